@@ -0,0 +1,231 @@
+/*
+ * Checks that the steady-state guiding loop allocates nothing: binning,
+ * the shift-and-add stack, the scheduler with FFTW and/or gpu_fft, tracing
+ * and logging run on synthetic frames as in mmalyuv, with malloc, calloc,
+ * realloc, memalign and free replaced by counting wrappers. After the
+ * warmup frames (the first frame of each backend makes its buffers and
+ * plans) every allocation is counted, with the address it was called from
+ * for addr2line. Exits with 1 if there was any.
+ *
+ * gpu_fft needs the mailbox, run as root on the Pi, or -cpu.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <malloc.h>
+
+#include "log.h"
+#include "mmalyuv.h"
+#include "image.h"
+#include "scheduler.h"
+#include "bin.h"
+#include "shiftadd.h"
+#include "trace.h"
+#include "synth.h"
+
+#define CHECK_CALLERS 16
+
+// glibc's allocator behind the wrappers
+extern void *__libc_malloc( size_t size );
+extern void *__libc_calloc( size_t n, size_t size );
+extern void *__libc_realloc( void *p, size_t size );
+extern void *__libc_memalign( size_t align, size_t size );
+extern void __libc_free( void *p );
+
+char Usage[] =
+	"Usage: alloc_check [-size <w>x<h>] [-frames n] [-warmup n] [-bin n] [-cpu|-gpu|-alternate|-weighted] [-lowmem]\n"
+	"-size   = frame size,                    default 1024x1024\n"
+	"-frames = frames checked,                default 50\n"
+	"-warmup = frames before the check,       default 4\n"
+	"-bin    = binning 1, 2 or 4,             default 1\n"
+	"-cpu ...= scheduler mode as in mmalyuv,  default -weighted\n"
+	"-lowmem = FFTW in place as in mmalyuv\n";
+
+static int counting;
+static unsigned long allocs, frees;
+static void *caller[CHECK_CALLERS];
+
+static void count( void *from )
+{
+	unsigned long n;
+
+	if( !__atomic_load_n( &counting, __ATOMIC_RELAXED ) )
+		return;
+	n = __atomic_fetch_add( &allocs, 1, __ATOMIC_RELAXED );
+	if( n < CHECK_CALLERS )
+		caller[n] = from;
+}
+
+void *malloc( size_t size )
+{
+	count( __builtin_return_address( 0 ) );
+	return __libc_malloc( size );
+}
+
+void *calloc( size_t n, size_t size )
+{
+	count( __builtin_return_address( 0 ) );
+	return __libc_calloc( n, size );
+}
+
+void *realloc( void *p, size_t size )
+{
+	count( __builtin_return_address( 0 ) );
+	return __libc_realloc( p, size );
+}
+
+void *memalign( size_t align, size_t size )
+{
+	count( __builtin_return_address( 0 ) );
+	return __libc_memalign( align, size );
+}
+
+void *aligned_alloc( size_t align, size_t size )
+{
+	count( __builtin_return_address( 0 ) );
+	return __libc_memalign( align, size );
+}
+
+int posix_memalign( void **p, size_t align, size_t size )
+{
+	count( __builtin_return_address( 0 ) );
+	*p = __libc_memalign( align, size );
+	return *p ? 0 : 12; // ENOMEM
+}
+
+void free( void *p )
+{
+	if( p && __atomic_load_n( &counting, __ATOMIC_RELAXED ) )
+		__atomic_fetch_add( &frees, 1, __ATOMIC_RELAXED );
+	__libc_free( p );
+}
+
+/* as handle_result of mmalyuv */
+static void handle_result( sched_result_t *res, int bin, shiftadd_t *sa )
+{
+	if( res->status )
+	{
+		ERROR( "cannot phase correlate frame %u", res->seq );
+		shiftadd_discard( sa, res->seq );
+		return;
+	}
+	shiftadd_shift( sa, res->seq, -res->x, -res->y );
+	MSG( "frame %u (%s, %ld us) peak: %.2f, x: %d, y:%d", res->seq,
+		 res->backend == SCHED_BACKEND_GPU ? "gpu" : "cpu", res->usecs, res->peak, res->x * bin, res->y * bin );
+}
+
+int main( int argc, char *argv[] )
+{
+	uint32_t width = 1024, height = 1024;
+	int frames = 50, warmup = 4, factor = 1, mode = SCHED_MODE_WEIGHTED, lowmem = 0;
+	pix_y_t ref, shifted[SYNTH_SHIFTS], *pix;
+	synth_params_t sp;
+	synth_t *field = NULL;
+	sched_t *sched = NULL;
+	bin_t *bin = NULL;
+	shiftadd_t *sa = NULL;
+	sched_result_t res;
+	uint64_t t;
+	int i, k, ret = -1;
+
+	for( i = 1; i < argc; i++ )
+	{
+		if( strcmp( argv[i], "-size" ) == 0 && i+1 < argc )
+		{
+			if( sscanf( argv[++i], "%ux%u", &width, &height ) != 2 || width < 16 || height < 16 )
+			{
+				printf( "%s", Usage );
+				return -1;
+			}
+		}
+		else if( strcmp( argv[i], "-frames" ) == 0 && i+1 < argc )
+			frames = atoi( argv[++i] );
+		else if( strcmp( argv[i], "-warmup" ) == 0 && i+1 < argc )
+			warmup = atoi( argv[++i] );
+		else if( strcmp( argv[i], "-bin" ) == 0 && i+1 < argc )
+			factor = atoi( argv[++i] );
+		else if( strcmp( argv[i], "-cpu" ) == 0 )
+			mode = SCHED_MODE_CPU;
+		else if( strcmp( argv[i], "-gpu" ) == 0 )
+			mode = SCHED_MODE_GPU;
+		else if( strcmp( argv[i], "-alternate" ) == 0 )
+			mode = SCHED_MODE_ALTERNATE;
+		else if( strcmp( argv[i], "-weighted" ) == 0 )
+			mode = SCHED_MODE_WEIGHTED;
+		else if( strcmp( argv[i], "-lowmem" ) == 0 )
+			lowmem = 1;
+		else
+		{
+			printf( "%s", Usage );
+			return -1;
+		}
+	}
+	if( frames < 1 || warmup < 1 || (factor != 1 && factor != 2 && factor != 4) )
+	{
+		printf( "%s", Usage );
+		return -1;
+	}
+
+	// the reference and frames shifted against it, taken in turns
+	memset( &ref, 0, sizeof(ref) );
+	memset( shifted, 0, sizeof(shifted) );
+	synth_defaults( &sp );
+	field = synth_create( &sp, width, height, 16 );
+	if( !field || synth_frames( field, &ref, shifted, synth_shifts, SYNTH_SHIFTS ) )
+		goto out;
+
+	if( factor > 1 )
+		bin = bin_create( width, height, factor, 0 );
+	sched = sched_create( mode );
+	if( sched )
+		sched_set_lowmem( sched, lowmem );
+	pix = bin ? bin_frame( bin, &ref ) : &ref;
+	if( (factor > 1 && !bin) || !sched || !pix || sched_set_reference( sched, pix ) )
+		goto out;
+	sa = shiftadd_create( pix->width, pix->height, "/dev/null" );
+	if( !sa )
+		goto out;
+
+	for( k = 0; k < warmup + frames; k++ )
+	{
+		if( k == warmup )
+		{
+			while( sched_get_result( sched, &res, 1 ) == 0 )
+				handle_result( &res, factor, sa );
+			MSG( "warmup done, counting allocations" );
+			__atomic_store_n( &counting, 1, __ATOMIC_SEQ_CST );
+		}
+
+		t = trace_begin();
+		pix = bin ? bin_frame( bin, &shifted[k % SYNTH_SHIFTS] ) : &shifted[k % SYNTH_SHIFTS];
+		if( bin )
+			trace_end( TRACE_BIN, t );
+		if( !pix )
+			goto out;
+		shiftadd_push( sa, pix, k );
+		if( sched_submit( sched, pix, k, NULL ) )
+			goto out;
+		while( sched_get_result( sched, &res, 0 ) == 0 )
+			handle_result( &res, factor, sa );
+		DEBUG( "frame %d submitted", k );
+	}
+	while( sched_get_result( sched, &res, 1 ) == 0 )
+		handle_result( &res, factor, sa );
+	__atomic_store_n( &counting, 0, __ATOMIC_SEQ_CST );
+
+	MSG( "%lu allocations, %lu frees in %d frames after %d warmup frames", allocs, frees, frames, warmup );
+	for( i = 0; i < CHECK_CALLERS && i < (int)allocs; i++ )
+		MSG( "allocation %d from %p", i, caller[i] );
+	ret = allocs ? 1 : 0;
+
+out:
+	synth_destroy( field );
+	shiftadd_destroy( sa );
+	sched_log_stats( sched );
+	sched_destroy( sched );
+	bin_destroy( bin );
+	synth_frames_free( &ref, shifted, SYNTH_SHIFTS );
+	return ret;
+}
@@ -0,0 +1,88 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // MAP_HUGETLB, MAP_POPULATE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "log.h"
+#include "arena.h"
+
+/*
+ * Map an arena of size bytes, populated
+ * returns NULL on error
+ */
+arena_t *arena_create( size_t size )
+{
+	arena_t *a;
+	void *p = MAP_FAILED;
+
+	a = calloc( 1, sizeof(*a) );
+	if( !a )
+	{
+		ERROR( "out of memory" );
+		return NULL;
+	}
+	size = ARENA_SIZE( size ? size : 1 );
+
+#ifdef MAP_HUGETLB
+	if( size >= ARENA_HUGE )
+	{
+		a->size = (size + ARENA_HUGE - 1) & ~(size_t)(ARENA_HUGE - 1);
+		p = mmap( NULL, a->size, PROT_READ | PROT_WRITE,
+				  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0 );
+		a->huge = p != MAP_FAILED;
+	}
+#endif
+	if( p == MAP_FAILED )
+	{
+		a->size = size;
+		p = mmap( NULL, a->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0 );
+	}
+	if( p == MAP_FAILED )
+	{
+		ERROR( "cannot map %lu KB", (unsigned long)(size >> 10) );
+		free( a );
+		return NULL;
+	}
+	a->base = p;
+	DEBUG( "arena of %lu KB%s", (unsigned long)(a->size >> 10), a->huge ? " in huge pages" : "" );
+	return a;
+}
+
+void arena_destroy( arena_t *a )
+{
+	if( !a )
+		return;
+	munmap( a->base, a->size );
+	free( a );
+}
+
+/*
+ * Block of size bytes, ARENA_ALIGN aligned, not cleared
+ * returns NULL if the arena is full
+ */
+void *arena_alloc( arena_t *a, size_t size )
+{
+	void *p;
+
+	size = ARENA_SIZE( size );
+	if( size > a->size - a->used )
+	{
+		ERROR( "arena full: %lu of %lu bytes used, %lu more", (unsigned long)a->used,
+			   (unsigned long)a->size, (unsigned long)size );
+		return NULL;
+	}
+	p = a->base + a->used;
+	a->used += size;
+	return p;
+}
+
+/*
+ * Give back all blocks, the memory stays mapped
+ */
+void arena_reset( arena_t *a )
+{
+	a->used = 0;
+}
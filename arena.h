@@ -0,0 +1,39 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Memory for the buffers of the steady-state loop, allocated once.
+ *
+ * An arena is one mapping, sized when it is created and touched right
+ * away, so neither malloc nor a page fault is left for the loop. Blocks
+ * are cut from it in order, each aligned to ARENA_ALIGN (a cache line,
+ * enough for NEON, SSE2 and FFTW's SIMD), and are given back all at once
+ * with arena_reset() or arena_destroy(). Arenas of ARENA_HUGE bytes or more
+ * try huge pages first.
+ */
+
+#define ARENA_ALIGN 64
+
+// from this size on huge pages are tried, they fall back to normal ones
+#define ARENA_HUGE (2 << 20)
+
+typedef struct {
+	uint8_t *base;
+	size_t size;
+	size_t used;
+	int huge;         // mapped with huge pages
+} arena_t;
+
+// bytes an arena needs for a block of n bytes
+#define ARENA_SIZE(n) (((size_t)(n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+arena_t *arena_create( size_t size );
+void arena_destroy( arena_t *a );
+
+void *arena_alloc( arena_t *a, size_t size );
+void arena_reset( arena_t *a );
+
+#endif /* ARENA_H */
@@ -0,0 +1,329 @@
+/*
+ * Stage by stage timing of the phase correlation of two frames, FFTW
+ * (fft.c) and gpu_fft (fft_gpu.c), at sizes from 256 x 256 to 4096 x 4096.
+ * Frames are a synthetic star field and a shifted copy with new noise,
+ * lines padded like the camera's, the shift found is checked.
+ *
+ * After warmup runs each size is correlated reps times. Per stage (see
+ * PC_STAGE_*) and in total the median, the 99th percentile and the mean
+ * are printed, as CSV or JSON, with the program version so results of
+ * releases can be compared. The stages of gpu_fft overlap (ARM and QPUs
+ * work at the same time), their sum can exceed the total.
+ *
+ * -perf adds the hardware counters of each stage (perf.h) over the
+ * measured runs, logged to stderr per size.
+ *
+ * fftw_lowmem is FFTW in place (pixPhaseCorrelationInPlace), for boards
+ * with 512 MB. The peak resident memory each backend and size adds to
+ * the frames is logged to stderr, with its ratio to the float frame: the
+ * peak is reset per configuration through /proc/self/clear_refs and the
+ * buffers of the previous one are given back first.
+ *
+ * gpu_fft needs the mailbox, run as root on the Pi.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <malloc.h>
+
+#include "log.h"
+#include "mmalyuv.h"
+#include "image.h"
+#include "fft.h"
+#include "fft_gpu.h"
+#include "perf.h"
+#include "synth.h"
+#include "trace.h"
+
+#define BENCH_MAX_SIZES 16
+
+#define BACKEND_FFTW   1
+#define BACKEND_GPU    2
+#define BACKEND_LOWMEM 4
+
+char Usage[] =
+	"Usage: bench_phasecorr [-sizes n,n,...] [-warmup n] [-reps n] [-fftw|-gpu|-lowmem] [-csv|-json] [-perf]\n"
+	"-sizes  = frame sizes n x n,         default 256,512,1024,2048,4096\n"
+	"-warmup = runs not measured,         default 3\n"
+	"-reps   = runs measured per size,    default 20\n"
+	"-fftw   = FFTW only, -gpu gpu_fft only, -lowmem FFTW in place only, default all\n"
+	"-csv    = CSV output (default), -json JSON\n"
+	"-perf   = log IPC and misses per pixel of each stage to stderr\n";
+
+static const char *stage_name[PC_STAGES + 1] = {
+	"convert", "forward", "transpose", "cross", "inverse", "peak", "total"
+};
+
+static const char *backend_name[BACKEND_LOWMEM + 1] = {
+	[BACKEND_FFTW] = "fftw", [BACKEND_GPU] = "gpu_fft", [BACKEND_LOWMEM] = "fftw_lowmem"
+};
+
+static int json;
+static int records;
+static int peak_reset = 1;
+
+/* KB of a line of /proc/self/status, VmRSS or VmHWM, -1 if not there */
+static long status_kb( const char *key )
+{
+	char line[128];
+	long kb = -1;
+	FILE *f = fopen( "/proc/self/status", "r" );
+
+	if( !f )
+		return -1;
+	while( fgets( line, sizeof(line), f ) )
+		if( strncmp( line, key, strlen( key ) ) == 0 && line[strlen( key )] == ':' )
+		{
+			kb = atol( line + strlen( key ) + 1 );
+			break;
+		}
+	fclose( f );
+	return kb;
+}
+
+/* VmHWM down to the resident memory now, Linux 4.0 and later */
+static void reset_peak( void )
+{
+	FILE *f;
+
+	if( !peak_reset )
+		return;
+	f = fopen( "/proc/self/clear_refs", "w" );
+	if( !f || fputs( "5", f ) < 0 || fclose( f ) )
+	{
+		WARN( "cannot reset the peak resident memory, peaks are over the runs so far" );
+		peak_reset = 0;
+	}
+}
+
+static int cmp_long( const void *a, const void *b )
+{
+	long x = *(const long *)a, y = *(const long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* sorts v, nearest rank percentiles */
+static void report( const char *backend, uint32_t n, const char *stage, long *v, int reps )
+{
+	double mean = 0;
+	long median, p99;
+	int k;
+
+	qsort( v, reps, sizeof(*v), cmp_long );
+	for( k = 0; k < reps; k++ )
+		mean += v[k];
+	mean /= reps;
+	median = reps & 1 ? v[reps/2] : (v[reps/2 - 1] + v[reps/2]) / 2;
+	p99 = v[(99*reps + 99) / 100 - 1];
+
+	if( json )
+		printf( "%s\n    {\"backend\": \"%s\", \"size\": %u, \"stage\": \"%s\", \"reps\": %d, "
+				"\"median_us\": %ld, \"p99_us\": %ld, \"mean_us\": %.1f}",
+				records ? "," : "", backend, n, stage, reps, median, p99, mean );
+	else
+		printf( "%s,%u,%s,%d,%ld,%ld,%.1f\n", backend, n, stage, reps, median, p99, mean );
+	records++;
+}
+
+/*
+ * One correlation of ref and frame, stage times into t
+ * returns -1 on error or a wrong shift
+ */
+static int correlate( int backend, pix_y_t *ref, pix_y_t *frame, pc_times_t *t )
+{
+	fpix_y_t *fr, *fs;
+	float peak;
+	int32_t x = 0, y = 0;
+	int ret;
+	long start = now_us();
+
+	memset( t, 0, sizeof(*t) );
+	if( backend == BACKEND_LOWMEM )
+	{
+		fft_set_times( t );
+		ret = pixPhaseCorrelationInPlace( ref, frame, &peak, &x, &y );
+		fft_set_times( NULL );
+	}
+	else if( backend == BACKEND_FFTW )
+	{
+		fft_set_times( t );
+		fr = pixConvertToFPix( ref );
+		fs = pixConvertToFPix( frame );
+		ret = fr && fs ? pixPhaseCorrelation( fr, fs, &peak, &x, &y ) : -1;
+		fpixDestroy( fr );
+		fpixDestroy( fs );
+		fft_set_times( NULL );
+	}
+	else
+	{
+		fft_gpu_set_times( t );
+		ret = pixPhaseCorrelate_GPU( ref, frame, &peak, &x, &y );
+		fft_gpu_set_times( NULL );
+	}
+	if( ret )
+		return -1;
+
+	// the backends differ in sign
+	if( abs( x ) != abs( (int)synth_shifts[0].dx ) || abs( y ) != abs( (int)synth_shifts[0].dy ) )
+	{
+		fprintf( stderr, "%s %u x %u: shift %d, %d found, %d, %d expected\n",
+				 backend_name[backend], ref->width, ref->height,
+				 x, y, (int)synth_shifts[0].dx, (int)synth_shifts[0].dy );
+		return -1;
+	}
+	return now_us() - start;
+}
+
+static int bench( int backend, uint32_t n, int warmup, int reps )
+{
+	const char *name = backend_name[backend];
+	pix_y_t ref, frame;
+	synth_params_t sp;
+	synth_t *field = NULL;
+	pc_times_t t;
+	long *v[PC_STAGES + 1], rss, peak;
+	int k, s, us, ret = -1;
+
+	memset( &ref, 0, sizeof(ref) );
+	memset( &frame, 0, sizeof(frame) );
+	for( s = 0; s <= PC_STAGES; s++ )
+		v[s] = malloc( reps * sizeof(long) );
+	for( s = 0; s <= PC_STAGES; s++ )
+		if( !v[s] )
+			break;
+	if( s <= PC_STAGES )
+	{
+		fprintf( stderr, "Out of memory.\n" );
+		goto out;
+	}
+	synth_defaults( &sp );
+	sp.seed = n;
+	field = synth_create( &sp, n, n, 16 );
+	if( !field || synth_frames( field, &ref, &frame, synth_shifts, 1 ) )
+		goto out;
+
+	// what the correlation adds to the frames
+	malloc_trim( 0 );
+	reset_peak();
+	rss = status_kb( "VmRSS" );
+
+	for( k = 0; k < warmup + reps; k++ )
+	{
+		// counters of the measured runs only
+		if( k == warmup )
+			perf_reset();
+		us = correlate( backend, &ref, &frame, &t );
+		if( us < 0 )
+		{
+			fprintf( stderr, "%s %u x %u failed, left out\n", name, n, n );
+			goto out;
+		}
+		if( k < warmup )
+			continue;
+		for( s = 0; s < PC_STAGES; s++ )
+			v[s][k - warmup] = t.us[s];
+		v[PC_STAGES][k - warmup] = us;
+	}
+
+	peak = status_kb( "VmHWM" );
+	for( s = 0; s <= PC_STAGES; s++ )
+		report( name, n, stage_name[s], v[s], reps );
+	if( rss >= 0 && peak >= 0 )
+	{
+		fflush( stdout );
+		MSG( "%s %u x %u: peak resident +%ld KB, %.2f x the float frame", name, n, n,
+			 peak - rss, (peak - rss) * 1024.0 / (sizeof(float) * n * n) );
+	}
+	if( perf_enabled )
+	{
+		fflush( stdout );
+		MSG( "%s %u x %u, %d runs:", name, n, n, reps );
+		perf_report();
+	}
+	ret = 0;
+out:
+	// buffers and plans of this size go, for the next peak
+	fft_release();
+	fft_gpu_release();
+	synth_destroy( field );
+	for( s = 0; s <= PC_STAGES; s++ )
+		free( v[s] );
+	synth_frames_free( &ref, &frame, 1 );
+	return ret;
+}
+
+int main( int argc, char *argv[] )
+{
+	uint32_t sizes[BENCH_MAX_SIZES] = { 256, 512, 1024, 2048, 4096 };
+	int nsizes = 5, warmup = 3, reps = 20;
+	int backends = BACKEND_FFTW | BACKEND_GPU | BACKEND_LOWMEM;
+	int i, b, failed = 0;
+	char *p;
+
+	for( i = 1; i < argc; i++ )
+	{
+		if( strcmp( argv[i], "-sizes" ) == 0 && i+1 < argc )
+		{
+			for( nsizes = 0, p = argv[++i]; *p && nsizes < BENCH_MAX_SIZES; nsizes++ )
+			{
+				sizes[nsizes] = strtoul( p, &p, 10 );
+				if( sizes[nsizes] < 16 || (*p && *p++ != ',') )
+					break;
+			}
+			if( *p || !nsizes || sizes[nsizes-1] < 16 )
+			{
+				printf( "%s", Usage );
+				return -1;
+			}
+		}
+		else if( strcmp( argv[i], "-warmup" ) == 0 && i+1 < argc )
+			warmup = atoi( argv[++i] );
+		else if( strcmp( argv[i], "-reps" ) == 0 && i+1 < argc )
+			reps = atoi( argv[++i] );
+		else if( strcmp( argv[i], "-fftw" ) == 0 )
+			backends = BACKEND_FFTW;
+		else if( strcmp( argv[i], "-gpu" ) == 0 )
+			backends = BACKEND_GPU;
+		else if( strcmp( argv[i], "-lowmem" ) == 0 )
+			backends = BACKEND_LOWMEM;
+		else if( strcmp( argv[i], "-csv" ) == 0 )
+			json = 0;
+		else if( strcmp( argv[i], "-json" ) == 0 )
+			json = 1;
+		else if( strcmp( argv[i], "-perf" ) == 0 )
+		{
+			if( perf_enable() )
+				return -1;
+		}
+		else
+		{
+			printf( "%s", Usage );
+			return -1;
+		}
+	}
+	if( warmup < 0 || reps < 1 )
+	{
+		printf( "%s", Usage );
+		return -1;
+	}
+
+	log_verbose( 0 );
+	if( json )
+		printf( "{\n  \"bench\": \"phasecorr\", \"version\": \"%s\", \"warmup\": %d,\n  \"results\": [",
+				PROGRAM_VERSION, warmup );
+	else
+		printf( "backend,size,stage,reps,median_us,p99_us,mean_us\n" );
+
+	for( b = BACKEND_FFTW; b <= BACKEND_LOWMEM; b <<= 1 )
+		for( i = 0; i < nsizes && (backends & b); i++ )
+			if( bench( b, sizes[i], warmup, reps ) )
+				failed++;
+
+	if( json )
+		printf( "\n  ]\n}\n" );
+	return failed ? -1 : 0;
+}
@@ -0,0 +1,305 @@
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define BIN_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define BIN_SSE2
+#endif
+
+#include "log.h"
+#include "bin.h"
+#include "image.h"
+
+#if defined(BIN_NEON)
+#define BIN_SIMD "neon"
+#elif defined(BIN_SSE2)
+#define BIN_SIMD "sse2"
+#else
+#define BIN_SIMD "scalar"
+#endif
+
+/*
+ * Mean of the f x f block at column i*f of the f lines from r, stride apart
+ */
+static inline uint8_t bin_px( const uint8_t *r, uint32_t stride, int f, uint32_t i )
+{
+	uint32_t sum = 0;
+	int x, y;
+
+	for( y = 0; y < f; y++ )
+		for( x = 0; x < f; x++ )
+			sum += r[y*stride + i*f + x];
+	return (sum + f*f/2) / (f*f);
+}
+
+/*
+ * dst[i] = mean of the 2x2 block at column 2i of lines r and r + stride, i < n
+ */
+static void bin2_row( uint8_t *dst, const uint8_t *r, uint32_t stride, uint32_t n )
+{
+	const uint8_t *r1 = r + stride;
+	uint32_t i = 0;
+
+#if defined(BIN_NEON)
+	for( ; i + 16 <= n; i += 16 )
+	{
+		// pairwise sums of the first line, the second added on top
+		uint16x8_t sa = vpadalq_u8( vpaddlq_u8( vld1q_u8( r + 2*i ) ),      vld1q_u8( r1 + 2*i ) );
+		uint16x8_t sb = vpadalq_u8( vpaddlq_u8( vld1q_u8( r + 2*i + 16 ) ), vld1q_u8( r1 + 2*i + 16 ) );
+
+		vst1q_u8( dst + i, vcombine_u8( vrshrn_n_u16( sa, 2 ), vrshrn_n_u16( sb, 2 ) ) );
+	}
+#elif defined(BIN_SSE2)
+	__m128i lo = _mm_set1_epi16( 0x00ff ), two = _mm_set1_epi16( 2 );
+
+	for( ; i + 16 <= n; i += 16 )
+	{
+		__m128i a0 = _mm_loadu_si128( (const __m128i *)(r + 2*i) );
+		__m128i b0 = _mm_loadu_si128( (const __m128i *)(r + 2*i + 16) );
+		__m128i a1 = _mm_loadu_si128( (const __m128i *)(r1 + 2*i) );
+		__m128i b1 = _mm_loadu_si128( (const __m128i *)(r1 + 2*i + 16) );
+		// even plus odd bytes of both lines, in 16 bit
+		__m128i sa = _mm_add_epi16( _mm_add_epi16( _mm_and_si128( a0, lo ), _mm_srli_epi16( a0, 8 ) ),
+									_mm_add_epi16( _mm_and_si128( a1, lo ), _mm_srli_epi16( a1, 8 ) ) );
+		__m128i sb = _mm_add_epi16( _mm_add_epi16( _mm_and_si128( b0, lo ), _mm_srli_epi16( b0, 8 ) ),
+									_mm_add_epi16( _mm_and_si128( b1, lo ), _mm_srli_epi16( b1, 8 ) ) );
+
+		sa = _mm_srli_epi16( _mm_add_epi16( sa, two ), 2 );
+		sb = _mm_srli_epi16( _mm_add_epi16( sb, two ), 2 );
+		_mm_storeu_si128( (__m128i *)(dst + i), _mm_packus_epi16( sa, sb ) );
+	}
+#endif
+	for( ; i < n; i++ )
+		dst[i] = bin_px( r, stride, 2, i );
+}
+
+/*
+ * dst[i] = mean of the 4x4 block at column 4i of the 4 lines from r, i < n
+ */
+static void bin4_row( uint8_t *dst, const uint8_t *r, uint32_t stride, uint32_t n )
+{
+	uint32_t i = 0;
+	int k, y;
+
+#if defined(BIN_NEON)
+	for( ; i + 16 <= n; i += 16 )
+	{
+		uint16x4_t q[4];
+
+		// 4 outputs from 16 bytes of each line
+		for( k = 0; k < 4; k++ )
+		{
+			uint16x8_t h = vpaddlq_u8( vld1q_u8( r + 4*i + 16*k ) );
+
+			for( y = 1; y < 4; y++ )
+				h = vpadalq_u8( h, vld1q_u8( r + y*stride + 4*i + 16*k ) );
+			q[k] = vrshrn_n_u32( vpaddlq_u16( h ), 4 );
+		}
+		vst1q_u8( dst + i, vcombine_u8( vmovn_u16( vcombine_u16( q[0], q[1] ) ),
+										vmovn_u16( vcombine_u16( q[2], q[3] ) ) ) );
+	}
+#elif defined(BIN_SSE2)
+	__m128i lo = _mm_set1_epi16( 0x00ff ), lo32 = _mm_set1_epi32( 0xffff ), eight = _mm_set1_epi32( 8 );
+
+	for( ; i + 16 <= n; i += 16 )
+	{
+		__m128i q[4];
+
+		for( k = 0; k < 4; k++ )
+		{
+			__m128i h = _mm_setzero_si128();
+
+			// pairs of each line in 16 bit, then pairs of pairs in 32 bit
+			for( y = 0; y < 4; y++ )
+			{
+				__m128i v = _mm_loadu_si128( (const __m128i *)(r + y*stride + 4*i + 16*k) );
+
+				h = _mm_add_epi16( h, _mm_add_epi16( _mm_and_si128( v, lo ), _mm_srli_epi16( v, 8 ) ) );
+			}
+			q[k] = _mm_add_epi32( _mm_and_si128( h, lo32 ), _mm_srli_epi32( h, 16 ) );
+			q[k] = _mm_srli_epi32( _mm_add_epi32( q[k], eight ), 4 );
+		}
+		_mm_storeu_si128( (__m128i *)(dst + i), _mm_packus_epi16( _mm_packs_epi32( q[0], q[1] ),
+																  _mm_packs_epi32( q[2], q[3] ) ) );
+	}
+#endif
+	for( ; i < n; i++ )
+		dst[i] = bin_px( r, stride, 4, i );
+}
+
+/*
+ * Bin the output lines of band from src
+ */
+static void bin_band( bin_t *b, bin_band_t *band, pix_y_t *src )
+{
+	uint32_t j;
+	const uint8_t *r;
+	uint8_t *d;
+
+	for( j = band->first; j < band->end; j++ )
+	{
+		r = pixAt( src, 0, j*b->factor );
+		d = pixAt( &b->out, 0, j );
+		if( b->factor == 2 )
+			bin2_row( d, r, src->stride, b->out.width );
+		else
+			bin4_row( d, r, src->stride, b->out.width );
+	}
+}
+
+/*
+ * Worker: bins its band of every new frame until bin_destroy
+ */
+static void *bin_worker( void *arg )
+{
+	bin_band_t *band = arg;
+	bin_t *b = band->bin;
+	unsigned seen = 0;
+	pix_y_t *src;
+
+	pthread_mutex_lock( &b->lock );
+	for( ;; )
+	{
+		while( !b->quit && b->generation == seen )
+			pthread_cond_wait( &b->start, &b->lock );
+		if( b->quit )
+			break;
+		seen = b->generation;
+		src = b->src;
+		pthread_mutex_unlock( &b->lock );
+
+		bin_band( b, band, src );
+
+		pthread_mutex_lock( &b->lock );
+		if( --b->pending == 0 )
+			pthread_cond_signal( &b->done );
+	}
+	pthread_mutex_unlock( &b->lock );
+	return NULL;
+}
+
+/*
+ * Binning of width x height frames by factor 2 or 4 in threads, 1 for none
+ * but the caller's. Lines and columns beyond a multiple of factor are left out
+ * returns NULL on error
+ */
+bin_t *bin_create( uint32_t width, uint32_t height, int factor, int threads )
+{
+	bin_t *b;
+	void *data;
+	uint32_t stride;
+	int k;
+
+	if( (factor != 2 && factor != 4) || width < (uint32_t)factor || height < (uint32_t)factor )
+	{
+		ERROR( "cannot bin %u x %u by %d", width, height, factor );
+		return NULL;
+	}
+	if( threads < 1 )
+		threads = 1;
+	if( threads > BIN_MAX_THREADS )
+		threads = BIN_MAX_THREADS;
+
+	b = calloc( 1, sizeof(*b) );
+	if( !b )
+	{
+		ERROR( "out of memory" );
+		return NULL;
+	}
+	b->width = width;
+	b->height = height;
+	b->factor = factor;
+	b->threads = 1;
+	stride = (width / factor + 15) & ~15;
+	if( posix_memalign( &data, PIX_ALIGN, stride * (height / factor) ) )
+	{
+		ERROR( "out of memory" );
+		free( b );
+		return NULL;
+	}
+	pixInit( &b->out, data, width / factor, height / factor, stride );
+	pthread_mutex_init( &b->lock, NULL );
+	pthread_cond_init( &b->start, NULL );
+	pthread_cond_init( &b->done, NULL );
+
+	// no frame before the bands are set, so the workers can start right away
+	for( k = 1; k < threads; k++ )
+	{
+		b->band[k].bin = b;
+		if( pthread_create( &b->band[k].tid, NULL, bin_worker, &b->band[k] ) )
+		{
+			ERROR( "cannot start binning thread %d", k );
+			bin_destroy( b );
+			return NULL;
+		}
+		b->threads++;
+	}
+	for( k = 0; k < b->threads; k++ )
+	{
+		b->band[k].first = b->out.height * k / b->threads;
+		b->band[k].end = b->out.height * (k+1) / b->threads;
+	}
+
+	DEBUG( "binning %u x %u by %d to %u x %u, %d threads (%s)", width, height, factor,
+		   b->out.width, b->out.height, b->threads, BIN_SIMD );
+	return b;
+}
+
+void bin_destroy( bin_t *b )
+{
+	int k;
+
+	if( !b )
+		return;
+	pthread_mutex_lock( &b->lock );
+	b->quit = 1;
+	pthread_cond_broadcast( &b->start );
+	pthread_mutex_unlock( &b->lock );
+	for( k = 1; k < b->threads; k++ )
+		pthread_join( b->band[k].tid, NULL );
+
+	pthread_cond_destroy( &b->start );
+	pthread_cond_destroy( &b->done );
+	pthread_mutex_destroy( &b->lock );
+	free( b->out.data );
+	free( b );
+}
+
+/*
+ * Bin src, any stride, of the size given to bin_create. src may be a view
+ * that does not step, subsampling and binning again makes no sense
+ * returns the binned frame, valid until the next call, NULL on error
+ */
+pix_y_t *bin_frame( bin_t *b, pix_y_t *src )
+{
+	if( src->width != b->width || src->height != b->height || src->step != 1 )
+	{
+		ERROR( "cannot bin %u x %u step %u, expected %u x %u", src->width, src->height, src->step,
+			   b->width, b->height );
+		return NULL;
+	}
+
+	if( b->threads > 1 )
+	{
+		pthread_mutex_lock( &b->lock );
+		b->src = src;
+		b->pending = b->threads - 1;
+		b->generation++;
+		pthread_cond_broadcast( &b->start );
+		pthread_mutex_unlock( &b->lock );
+	}
+
+	bin_band( b, &b->band[0], src );
+
+	if( b->threads > 1 )
+	{
+		pthread_mutex_lock( &b->lock );
+		while( b->pending )
+			pthread_cond_wait( &b->done, &b->lock );
+		pthread_mutex_unlock( &b->lock );
+	}
+	return &b->out;
+}
@@ -0,0 +1,52 @@
+#ifndef BIN_H
+#define BIN_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "mmalyuv.h"
+
+/*
+ * Box binning of a frame 2x2 or 4x4 before it is correlated: the mean of
+ * each block, rounded (NEON/SSE2, scalar otherwise). Reads the frame with
+ * its stride, in place in the camera buffer, and writes into a buffer of
+ * its own. Row bands of the output are binned in parallel by threads - 1
+ * workers and the calling thread.
+ */
+
+#define BIN_MAX_THREADS 8
+
+// threads binning one frame, main thread included
+#define BIN_THREADS 4
+
+struct bin_s;
+
+typedef struct {
+	struct bin_s *bin;
+	pthread_t tid;
+	uint32_t first;      // output lines first ... end-1
+	uint32_t end;
+} bin_band_t;
+
+typedef struct bin_s {
+	uint32_t width;      // of the frames binned
+	uint32_t height;
+	int factor;          // 2 or 4
+	pix_y_t out;         // width/factor x height/factor, stride multiple of 16
+	int threads;
+	bin_band_t band[BIN_MAX_THREADS];
+
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	pix_y_t *src;        // frame of the current generation
+	unsigned generation;
+	int pending;         // workers still binning the current frame
+	int quit;
+} bin_t;
+
+bin_t *bin_create( uint32_t width, uint32_t height, int factor, int threads );
+void bin_destroy( bin_t *b );
+
+pix_y_t *bin_frame( bin_t *b, pix_y_t *src );
+
+#endif /* BIN_H */
@@ -0,0 +1,459 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define CALIB_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define CALIB_SSE2
+#endif
+
+#include "log.h"
+#include "calib.h"
+
+#if defined(CALIB_NEON)
+#define CALIB_SIMD "neon"
+#elif defined(CALIB_SSE2)
+#define CALIB_SIMD "sse2"
+#else
+#define CALIB_SIMD "scalar"
+#endif
+
+// calibration used by the conversions for the FFT, set once at startup
+static calib_t *active = NULL;
+
+/*
+ * Write a master frame: header, then width * height floats
+ * A temporary file is renamed at the end, so an existing master is only
+ * replaced by a complete one
+ * returns -1 on error, 0 otherwise
+ */
+static int write_master( const char *file, uint32_t type, uint32_t width, uint32_t height,
+						 uint32_t frames, const float *data )
+{
+	calib_header_t hdr;
+	char tmp[1024];
+	FILE *f;
+	int ok;
+
+	memset( &hdr, 0, sizeof(hdr) );
+	memcpy( hdr.magic, CALIB_MAGIC, sizeof(hdr.magic) );
+	hdr.type = type;
+	hdr.width = width;
+	hdr.height = height;
+	hdr.frames = frames;
+
+	snprintf( tmp, sizeof(tmp), "%s.tmp", file );
+	f = fopen( tmp, "wb" );
+	if( !f )
+	{
+		ERROR( "cannot create %s", tmp );
+		return (-1);
+	}
+	ok = fwrite( &hdr, sizeof(hdr), 1, f ) == 1 &&
+		 fwrite( data, sizeof(float), (size_t)width * height, f ) == (size_t)width * height;
+	if( fclose( f ) || !ok || rename( tmp, file ) )
+	{
+		ERROR( "cannot write %s", file );
+		unlink( tmp );
+		return (-1);
+	}
+	MSG( "%s: master %s of %u frames, %u x %u", file, type == CALIB_DARK ? "dark" : "flat",
+		 frames, width, height );
+	return (0);
+}
+
+/*
+ * Mean of the stacked frames as float, width * height
+ * returns NULL on error
+ */
+static float *stack_to_float( pix_stack_t *st )
+{
+	uint16_t *sum = stack_sum( st );
+	float *mean, inv;
+	uint32_t i, j;
+
+	if( !st->frames )
+	{
+		ERROR( "no frames stacked" );
+		return NULL;
+	}
+	mean = malloc( (size_t)st->width * st->height * sizeof(float) );
+	if( !mean )
+	{
+		ERROR( "out of memory" );
+		return NULL;
+	}
+	inv = 1.0f / st->frames;
+	for( j = 0; j < st->height; j++ )
+		for( i = 0; i < st->width; i++ )
+			mean[j*st->width + i] = sum[j*st->stride + i] * inv;
+	return mean;
+}
+
+/*
+ * Master dark from the frames stacked in st
+ * returns -1 on error, 0 otherwise
+ */
+int calib_write_dark( const char *file, pix_stack_t *st )
+{
+	float *dark = stack_to_float( st );
+	int ret;
+
+	if( !dark )
+		return (-1);
+	ret = write_master( file, CALIB_DARK, st->width, st->height, st->frames, dark );
+	free( dark );
+	return ret;
+}
+
+/*
+ * Master flat from the frames stacked in st, less the master dark of dark
+ * if not NULL. Stored as gain, the mean of the flat over its value.
+ * returns -1 on error, 0 otherwise
+ */
+int calib_write_flat( const char *file, pix_stack_t *st, calib_t *dark )
+{
+	float *flat;
+	double mean = 0;
+	uint32_t i, n = st->width * st->height, used = 0;
+	int ret;
+
+	if( dark && dark->dark && (dark->width != st->width || dark->height != st->height) )
+	{
+		ERROR( "dark is %u x %u, flat %u x %u", dark->width, dark->height, st->width, st->height );
+		return (-1);
+	}
+	flat = stack_to_float( st );
+	if( !flat )
+		return (-1);
+
+	for( i = 0; i < n; i++ )
+	{
+		if( dark && dark->dark )
+			flat[i] -= dark->dark[i];
+		if( flat[i] >= CALIB_MIN_FLAT )
+		{
+			mean += flat[i];
+			used++;
+		}
+	}
+	if( !used )
+	{
+		ERROR( "flat is black" );
+		free( flat );
+		return (-1);
+	}
+	mean /= used;
+	for( i = 0; i < n; i++ )
+		flat[i] = flat[i] >= CALIB_MIN_FLAT ? mean / flat[i] : 0;
+	if( used < n )
+		WARN( "%u dead pixels in the flat", n - used );
+
+	ret = write_master( file, CALIB_FLAT, st->width, st->height, st->frames, flat );
+	free( flat );
+	return ret;
+}
+
+/*
+ * Map a master frame of the given type read-only
+ * returns the data behind the header, NULL on error
+ */
+static const float *map_master( const char *file, uint32_t type, calib_t *cal, void **map )
+{
+	calib_header_t *hdr;
+	struct stat sb;
+	size_t size;
+	int fd;
+
+	fd = open( file, O_RDONLY );
+	if( fd < 0 )
+	{
+		ERROR( "cannot open %s", file );
+		return NULL;
+	}
+	if( fstat( fd, &sb ) || sb.st_size < (off_t)sizeof(*hdr) )
+	{
+		ERROR( "%s is no master frame", file );
+		close( fd );
+		return NULL;
+	}
+	size = sb.st_size;
+	*map = mmap( NULL, size, PROT_READ, MAP_SHARED, fd, 0 );
+	close( fd );
+	if( *map == MAP_FAILED )
+	{
+		ERROR( "cannot map %s", file );
+		*map = NULL;
+		return NULL;
+	}
+
+	hdr = *map;
+	if( memcmp( hdr->magic, CALIB_MAGIC, sizeof(hdr->magic) ) || hdr->type != type ||
+		size != sizeof(*hdr) + (size_t)hdr->width * hdr->height * sizeof(float) )
+	{
+		ERROR( "%s is no master %s", file, type == CALIB_DARK ? "dark" : "flat" );
+		goto fail;
+	}
+	if( cal->width && (hdr->width != cal->width || hdr->height != cal->height) )
+	{
+		ERROR( "%s is %u x %u, not %u x %u", file, hdr->width, hdr->height, cal->width, cal->height );
+		goto fail;
+	}
+	cal->width = hdr->width;
+	cal->height = hdr->height;
+	cal->map_size = size;
+	DEBUG( "%s: %u x %u, %u frames", file, hdr->width, hdr->height, hdr->frames );
+	return (const float *)(hdr + 1);
+
+fail:
+	munmap( *map, size );
+	*map = NULL;
+	return NULL;
+}
+
+/*
+ * Map the master dark and/or flat, either file may be NULL
+ * returns NULL on error
+ */
+calib_t *calib_load( const char *dark_file, const char *flat_file )
+{
+	calib_t *cal = calloc( 1, sizeof(*cal) );
+
+	if( !cal )
+	{
+		ERROR( "out of memory" );
+		return NULL;
+	}
+	if( (dark_file && !(cal->dark = map_master( dark_file, CALIB_DARK, cal, &cal->dark_map ))) ||
+		(flat_file && !(cal->gain = map_master( flat_file, CALIB_FLAT, cal, &cal->gain_map ))) )
+	{
+		calib_free( cal );
+		return NULL;
+	}
+	MSG( "calibrating %u x %u:%s%s (%s)", cal->width, cal->height, cal->dark ? " dark" : "",
+		 cal->gain ? " flat" : "", CALIB_SIMD );
+	return cal;
+}
+
+void calib_free( calib_t *cal )
+{
+	if( !cal )
+		return;
+	if( active == cal )
+		active = NULL;
+	if( cal->dark_map )
+		munmap( cal->dark_map, cal->map_size );
+	if( cal->gain_map )
+		munmap( cal->gain_map, cal->map_size );
+	free( cal );
+}
+
+/*
+ * Calibrate the frames converted for the FFT with cal, NULL for none.
+ * Not thread safe, set it before the first frame.
+ */
+void calib_set( calib_t *cal )
+{
+	active = cal;
+}
+
+/*
+ * The calibration for frames of width x height, NULL if none matches
+ */
+const calib_t *calib_for( uint32_t width, uint32_t height )
+{
+	if( active && active->width == width && active->height == height )
+		return active;
+	return NULL;
+}
+
+/*
+ * Row pointers of the masters for line y, NULL where there is no master
+ */
+static void calib_rows( const calib_t *cal, uint32_t y, const float **dark, const float **gain )
+{
+	*dark = cal && cal->dark ? cal->dark + (size_t)y * cal->width : NULL;
+	*gain = cal && cal->gain ? cal->gain + (size_t)y * cal->width : NULL;
+}
+
+static inline float calib_px( uint8_t v, const float *dark, const float *gain, uint32_t i )
+{
+	float f = v;
+
+	if( dark )
+		f -= dark[i];
+	if( gain )
+		f *= gain[i];
+	return f;
+}
+
+#if defined(CALIB_NEON)
+/* 16 pixels from src to float, calibrated */
+static inline void calib16( const uint8_t *src, const float *dark, const float *gain, float32x4_t f[4] )
+{
+	uint8x16_t s = vld1q_u8( src );
+	uint16x8_t lo = vmovl_u8( vget_low_u8( s ) ), hi = vmovl_u8( vget_high_u8( s ) );
+	int k;
+
+	f[0] = vcvtq_f32_u32( vmovl_u16( vget_low_u16( lo ) ) );
+	f[1] = vcvtq_f32_u32( vmovl_u16( vget_high_u16( lo ) ) );
+	f[2] = vcvtq_f32_u32( vmovl_u16( vget_low_u16( hi ) ) );
+	f[3] = vcvtq_f32_u32( vmovl_u16( vget_high_u16( hi ) ) );
+	for( k = 0; k < 4; k++ )
+	{
+		if( dark )
+			f[k] = vsubq_f32( f[k], vld1q_f32( dark + 4*k ) );
+		if( gain )
+			f[k] = vmulq_f32( f[k], vld1q_f32( gain + 4*k ) );
+	}
+}
+#elif defined(CALIB_SSE2)
+static inline void calib16( const uint8_t *src, const float *dark, const float *gain, __m128 f[4] )
+{
+	__m128i z = _mm_setzero_si128();
+	__m128i s = _mm_loadu_si128( (const __m128i *)src );
+	__m128i lo = _mm_unpacklo_epi8( s, z ), hi = _mm_unpackhi_epi8( s, z );
+	int k;
+
+	f[0] = _mm_cvtepi32_ps( _mm_unpacklo_epi16( lo, z ) );
+	f[1] = _mm_cvtepi32_ps( _mm_unpackhi_epi16( lo, z ) );
+	f[2] = _mm_cvtepi32_ps( _mm_unpacklo_epi16( hi, z ) );
+	f[3] = _mm_cvtepi32_ps( _mm_unpackhi_epi16( hi, z ) );
+	for( k = 0; k < 4; k++ )
+	{
+		if( dark )
+			f[k] = _mm_sub_ps( f[k], _mm_loadu_ps( dark + 4*k ) );
+		if( gain )
+			f[k] = _mm_mul_ps( f[k], _mm_loadu_ps( gain + 4*k ) );
+	}
+}
+#endif
+
+/*
+ * dst[i] = (src[i] - dark) * gain of line y, i < n
+ * cal NULL: dst[i] = src[i]
+ */
+void calib_to_float( const calib_t *cal, uint32_t y, const uint8_t *src, float *dst, uint32_t n )
+{
+	const float *dark, *gain;
+	uint32_t i = 0;
+
+	calib_rows( cal, y, &dark, &gain );
+#if defined(CALIB_NEON)
+	float32x4_t f[4];
+
+	for( ; i + 16 <= n; i += 16 )
+	{
+		calib16( src + i, dark ? dark + i : NULL, gain ? gain + i : NULL, f );
+		vst1q_f32( dst + i,      f[0] );
+		vst1q_f32( dst + i + 4,  f[1] );
+		vst1q_f32( dst + i + 8,  f[2] );
+		vst1q_f32( dst + i + 12, f[3] );
+	}
+#elif defined(CALIB_SSE2)
+	__m128 f[4];
+
+	for( ; i + 16 <= n; i += 16 )
+	{
+		calib16( src + i, dark ? dark + i : NULL, gain ? gain + i : NULL, f );
+		_mm_storeu_ps( dst + i,      f[0] );
+		_mm_storeu_ps( dst + i + 4,  f[1] );
+		_mm_storeu_ps( dst + i + 8,  f[2] );
+		_mm_storeu_ps( dst + i + 12, f[3] );
+	}
+#endif
+	for( ; i < n; i++ )
+		dst[i] = calib_px( src[i], dark, gain, i );
+}
+
+/*
+ * As calib_to_float, into complex values (re, im), imaginary part 0
+ */
+void calib_to_complex( const calib_t *cal, uint32_t y, const uint8_t *src, float *dst, uint32_t n )
+{
+	const float *dark, *gain;
+	uint32_t i = 0;
+
+	calib_rows( cal, y, &dark, &gain );
+#if defined(CALIB_NEON)
+	float32x4x2_t c;
+	int k;
+
+	c.val[1] = vdupq_n_f32( 0 );
+	for( ; i + 16 <= n; i += 16 )
+	{
+		float32x4_t f[4];
+
+		calib16( src + i, dark ? dark + i : NULL, gain ? gain + i : NULL, f );
+		for( k = 0; k < 4; k++ )
+		{
+			c.val[0] = f[k];
+			vst2q_f32( dst + 2*(i + 4*k), c );
+		}
+	}
+#elif defined(CALIB_SSE2)
+	__m128 f[4], z = _mm_setzero_ps();
+	int k;
+
+	for( ; i + 16 <= n; i += 16 )
+	{
+		calib16( src + i, dark ? dark + i : NULL, gain ? gain + i : NULL, f );
+		for( k = 0; k < 4; k++ )
+		{
+			_mm_storeu_ps( dst + 2*(i + 4*k),     _mm_unpacklo_ps( f[k], z ) );
+			_mm_storeu_ps( dst + 2*(i + 4*k) + 4, _mm_unpackhi_ps( f[k], z ) );
+		}
+	}
+#endif
+	for( ; i < n; i++ )
+	{
+		dst[2*i] = calib_px( src[i], dark, gain, i );
+		dst[2*i+1] = 0;
+	}
+}
+
+/*
+ * As calib_to_float, src pixels step bytes apart (subsampled views)
+ */
+void calib_to_float_step( const calib_t *cal, uint32_t y, const uint8_t *src, uint32_t step, float *dst, uint32_t n )
+{
+	const float *dark, *gain;
+	uint32_t i;
+
+	if( step == 1 )
+	{
+		calib_to_float( cal, y, src, dst, n );
+		return;
+	}
+	calib_rows( cal, y, &dark, &gain );
+	for( i = 0; i < n; i++ )
+		dst[i] = calib_px( src[i * step], dark, gain, i );
+}
+
+/*
+ * As calib_to_complex, src pixels step bytes apart
+ */
+void calib_to_complex_step( const calib_t *cal, uint32_t y, const uint8_t *src, uint32_t step, float *dst, uint32_t n )
+{
+	const float *dark, *gain;
+	uint32_t i;
+
+	if( step == 1 )
+	{
+		calib_to_complex( cal, y, src, dst, n );
+		return;
+	}
+	calib_rows( cal, y, &dark, &gain );
+	for( i = 0; i < n; i++ )
+	{
+		dst[2*i] = calib_px( src[i * step], dark, gain, i );
+		dst[2*i+1] = 0;
+	}
+}
@@ -0,0 +1,63 @@
+#ifndef CALIB_H
+#define CALIB_H
+
+#include <stdint.h>
+#include "mmalyuv.h"
+#include "stack.h"
+
+/*
+ * Dark-frame and flat-field calibration. Master frames are the means of
+ * captured sequences, stored on disk as a header followed by one float per
+ * pixel: the dark as is, the flat as gain = mean(flat - dark) / (flat - dark)
+ * so that correcting a pixel is one subtraction and one multiplication.
+ *
+ * The masters are mapped with mmap, the correction is done while the
+ * frames are converted from 8 bit to float for the FFT (NEON/SSE2, scalar
+ * otherwise), so it costs no extra pass over the frame.
+ */
+
+#define CALIB_MAGIC  "MMALCAL1"
+#define CALIB_DARK   1
+#define CALIB_FLAT   2
+
+// frames stacked into a master
+#define CALIB_FRAMES 32
+
+// flat - dark below this is a dead pixel, gain 0
+#define CALIB_MIN_FLAT 1.0f
+
+// 64 bytes, so the data behind it stays 16 byte aligned in the mapping
+typedef struct {
+	char magic[8];
+	uint32_t type;       // CALIB_DARK or CALIB_FLAT
+	uint32_t width;
+	uint32_t height;
+	uint32_t frames;     // stacked into the master
+	uint32_t reserved[10];
+} calib_header_t;
+
+typedef struct {
+	uint32_t width;
+	uint32_t height;
+	const float *dark;   // width * height, NULL: no dark subtraction
+	const float *gain;   // width * height, NULL: no flat field
+	void *dark_map;
+	void *gain_map;
+	size_t map_size;
+} calib_t;
+
+int calib_write_dark( const char *file, pix_stack_t *st );
+int calib_write_flat( const char *file, pix_stack_t *st, calib_t *dark );
+
+calib_t *calib_load( const char *dark_file, const char *flat_file );
+void calib_free( calib_t *cal );
+
+void calib_set( calib_t *cal );
+const calib_t *calib_for( uint32_t width, uint32_t height );
+
+void calib_to_float( const calib_t *cal, uint32_t y, const uint8_t *src, float *dst, uint32_t n );
+void calib_to_complex( const calib_t *cal, uint32_t y, const uint8_t *src, float *dst, uint32_t n );
+void calib_to_float_step( const calib_t *cal, uint32_t y, const uint8_t *src, uint32_t step, float *dst, uint32_t n );
+void calib_to_complex_step( const calib_t *cal, uint32_t y, const uint8_t *src, uint32_t step, float *dst, uint32_t n );
+
+#endif /* CALIB_H */
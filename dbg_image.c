@@ -7,16 +7,17 @@
 #include <complex.h>
 #include "log.h"
 #include "dbg_image.h"
+#include "image.h"
 
 /*
- * Save 8-bit-luminance image to JPEG via gd
+ * Save 8-bit-luminance image or view to JPEG via gd
  * return -1 on error, 0 otherwise
  */
-uint32_t y_int_save( uint8_t *data, uint32_t w, uint32_t h, char *name )
+uint32_t y_pix_save( const pix_y_t *pix, char *name )
 {
 	FILE *f;
 	gdImage *image;
-	uint32_t i, j, color;
+	uint32_t i, j, color, w = pix->width, h = pix->height;
 	uint8_t *dat, d;
 	
 	if(!name)
@@ -39,11 +40,11 @@ uint32_t y_int_save( uint8_t *data, uint32_t w, uint32_t h, char *name )
 		return(-1);
 	}
 
-	dat = data;
 	for(j=0; j<h; j++){
+		dat = pixAt(pix, 0, j);
 		for(i=0; i<w; i++)
 		{
-			d = *(dat++);
+			d = dat[i * pix->step];
 			color = d + (d<<8) + (d<<16);
 			color &= 0xffffff; 
 			gdImageSetPixel(image,i,j,color);
@@ -57,14 +58,25 @@ uint32_t y_int_save( uint8_t *data, uint32_t w, uint32_t h, char *name )
 }
 
 /*
- * Save float luminance image to JPEG via gd
+ * Save 8-bit-luminance image w x h at data, lines not padded
+ */
+uint32_t y_int_save( uint8_t *data, uint32_t w, uint32_t h, char *name )
+{
+	pix_y_t pix;
+
+	pixInit(&pix, data, w, h, w);
+	return y_pix_save(&pix, name);
+}
+
+/*
+ * Save float luminance image or view to JPEG via gd
  * return -1 on error, 0 otherwise
  */
-uint32_t y_float_save( float *data, uint32_t w, uint32_t h, char *name )
+uint32_t y_fpix_save( const fpix_y_t *fpix, char *name )
 {
 	FILE *f;
 	gdImage *image;
-	uint32_t i, j, g, color;
+	uint32_t i, j, g, color, w = fpix->width, h = fpix->height;
 	float *dat, d, max;
 	
 	if(!name)
@@ -88,20 +100,22 @@ uint32_t y_float_save( float *data, uint32_t w, uint32_t h, char *name )
 	}
 
 	max=0;
-	dat=data;
 	for(j=0;j<h;j++)
+	{
+		dat = fpixAt(fpix, 0, j);
 		for(i=0;i<w;i++)
 		{
-			d = *(dat++);
+			d = dat[i * fpix->step];
 			if(d>max) max=d;
 		}		
+	}
 	
 	
-	dat = data;
 	for(j=0; j<h; j++){
+		dat = fpixAt(fpix, 0, j);
 		for(i=0; i<w; i++)
 		{
-			d = *(dat++);
+			d = dat[i * fpix->step];
 			g = 0xff * d/max;
 			color = g + (g<<8) + (g<<16);
 			color &= 0xffffff; 
@@ -115,6 +129,17 @@ uint32_t y_float_save( float *data, uint32_t w, uint32_t h, char *name )
 	return(0);
 }
 
+/*
+ * Save float luminance image w x h at data, lines not padded
+ */
+uint32_t y_float_save( float *data, uint32_t w, uint32_t h, char *name )
+{
+	fpix_y_t fpix;
+
+	fpixInit(&fpix, data, w, h, w);
+	return y_fpix_save(&fpix, name);
+}
+
 /*
  * Save complex matrix to JPEG via gd
  * if magnitude is set, brightness of output pixels is abs(complex), otherwise it's atan(re/im)  
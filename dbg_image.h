@@ -9,6 +9,10 @@
 #include "gpu_fft/gpu_fft.h"
 #endif // GPU_FFT_H
 
+#include "mmalyuv.h"
+
+uint32_t y_pix_save( const pix_y_t *pix, char *name );
+uint32_t y_fpix_save( const fpix_y_t *fpix, char *name );
 uint32_t y_int_save( uint8_t *data, uint32_t w, uint32_t h, char *name );
 uint32_t y_float_save( float *data, uint32_t w, uint32_t h, char *name );
 uint32_t y_complex_save( fftwf_complex *data, uint32_t real, uint32_t w, uint32_t h, char *name );
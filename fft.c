@@ -1,102 +1,359 @@
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
 #include <stdint.h>
 #include <time.h>
 #include <math.h>
 #include <complex.h>
+#include <pthread.h>
 #include <fftw3.h>
 #include "fft.h"
+#include "arena.h"
 #include "dbg_image.h"
 #include "log.h"
+#include "calib.h"
+#include "trace.h"
+#include "perf.h"
 
-static long millis()
+static pc_times_t *times;
+
+/*
+ * Buffers and plans of pixPhaseCorrelation for one size, per thread. Made
+ * by the first correlation of a size, the following ones allocate nothing.
+ * In place (pixPhaseCorrelationInPlace) there are only outr and outs, the
+ * frames are converted into them with rows padded to 2 * (w/2 + 1) floats
+ */
+typedef struct {
+	int32_t w, h;
+	int inplace;
+	unsigned gen;                // of the plan settings it was planned with
+	arena_t *arena;
+	float *in;                   // copy of an input not aligned like the plan's
+	fftwf_complex *outr, *outs, *outd;
+	fpix_y_t dpix;
+	fftwf_plan fwd, inv;
+} fft_ws_t;
+
+static __thread fft_ws_t *thread_ws;
+
+/*
+ * Buffers and plans of pixPhaseCorrelationBatch for one size and k, per
+ * thread, as fft_ws_t: real1/out1 the single image, realk/outk the k
+ * images one after the other
+ */
+typedef struct {
+	int32_t w, h, k;
+	unsigned gen;
+	arena_t *arena;
+	float *real1, *realk;
+	fftwf_complex *out1, *outk;
+	fftwf_plan fwd1, fwdk, invk;
+} fft_batch_t;
+
+static __thread fft_batch_t *thread_batch;
+
+// FFTW's planner is not thread safe, executing plans is
+static pthread_mutex_t plan_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// how workspaces plan, see fft_set_plan(). A new generation replans them
+static unsigned plan_flags = FFTW_ESTIMATE;
+static int plan_threads = 1;
+static unsigned plan_gen;
+static int threads_ready;
+
+
+/*
+ * Add the time of each stage of the following conversions and phase
+ * correlations to t, NULL to stop. Not for concurrent callers.
+ */
+void fft_set_times( pc_times_t *t )
 {
-	struct timespec tt;
-	clock_gettime(CLOCK_MONOTONIC,&tt);
-	return tt.tv_sec*1000l + tt.tv_nsec/1000000;
+	times = t;
 }
 
-
 /*
- * create float luminance image dimensions w x h
+ * How pixPhaseCorrelation and pixPhaseCorrelationInPlace plan their FFTs:
+ * flags FFTW_ESTIMATE (default), FFTW_MEASURE or FFTW_PATIENT, on threads
+ * threads each (needs fftw3f_threads). Workspaces made with other settings
+ * are planned again on their thread's next correlation
+ * returns -1 if FFTW cannot use threads
  */
-fpix_y_t *fpixCreate( uint32_t w, uint32_t h )
+int fft_set_plan( unsigned flags, int threads )
 {
-	fpix_y_t *fpix;
-	
-	fpix = calloc(sizeof(fpix_y_t), 1 );
-	if( fpix == NULL )
+	int ret = 0;
+
+	if( threads < 1 )
+		threads = 1;
+	pthread_mutex_lock( &plan_lock );
+	if( threads > 1 && !threads_ready )
+		threads_ready = fftwf_init_threads();
+	if( threads > 1 && !threads_ready )
 	{
-		ERROR("out of memory");
-		return NULL;
+		ERROR( "FFTW cannot plan on threads" );
+		ret = -1;
 	}
-	
-	fpix->width = w;
-	fpix->height = h;
-	fpix->data = calloc(sizeof(float), w*h );
-	if( !fpix->data )
+	else
 	{
-		free(fpix);
-		ERROR("out of memory");
-		return NULL;
+		plan_flags = flags;
+		plan_threads = threads;
+		__atomic_add_fetch( &plan_gen, 1, __ATOMIC_RELEASE );
 	}
-	return fpix;
+	pthread_mutex_unlock( &plan_lock );
+	return ret;
 }
 
 /*
- * destroy float luminance image
+ * FFTW wisdom: plans measured before, so FFTW_MEASURE costs the time of
+ * the measurement only once
+ * returns -1 if the file cannot be read or written
  */
-void fpixDestroy( fpix_y_t *fpix )
+int fft_wisdom_load( const char *file )
 {
-	if( !fpix )
+	int ok;
+
+	pthread_mutex_lock( &plan_lock );
+	ok = fftwf_import_wisdom_from_filename( file );
+	pthread_mutex_unlock( &plan_lock );
+	if( !ok )
+		return (-1);
+	DEBUG( "FFTW wisdom from %s", file );
+	return (0);
+}
+
+int fft_wisdom_save( const char *file )
+{
+	int ok;
+
+	pthread_mutex_lock( &plan_lock );
+	ok = fftwf_export_wisdom_to_filename( file );
+	pthread_mutex_unlock( &plan_lock );
+	if( !ok )
+	{
+		ERROR( "cannot write FFTW wisdom to %s", file );
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Begin a stage, with its counters if profiled
+ */
+static inline uint64_t stage_begin( void )
+{
+	perf_begin();
+	return trace_begin();
+}
+
+/*
+ * End stage s (PC_STAGE_*) begun at start: traced and added to the times
+ * if set. Returns its microseconds
+ */
+static long stage_end( int s, uint64_t start )
+{
+	long us = trace_end( TRACE_FFTW + s, start ) / 1000;
+
+	perf_end( TRACE_FFTW + s );
+	if( times )
+		times->us[s] += us;
+	return us;
+}
+
+
+/*
+ * Free the workspace of the calling thread
+ */
+static void release_ws( void )
+{
+	if( !thread_ws )
 		return;
-	
-	if( fpix->data )
-		free( fpix->data );
-	
-	free( fpix );
+	pthread_mutex_lock( &plan_lock );
+	if( thread_ws->fwd )
+		fftwf_destroy_plan( thread_ws->fwd );
+	if( thread_ws->inv )
+		fftwf_destroy_plan( thread_ws->inv );
+	pthread_mutex_unlock( &plan_lock );
+	arena_destroy( thread_ws->arena );
+	free( thread_ws );
+	thread_ws = NULL;
 }
 
 /*
- * create 8-bit luminance image dimensions w x h
+ * Free the batch workspace of the calling thread
  */
-pix_y_t *pixCreate( uint32_t w, uint32_t h )
+static void release_batch( void )
 {
-	pix_y_t *pix;
-	
-	pix = calloc(sizeof(pix_y_t), 1 );
-	if( pix == NULL )
+	fft_batch_t *b = thread_batch;
+
+	if( !b )
+		return;
+	pthread_mutex_lock( &plan_lock );
+	if( b->fwd1 )
+		fftwf_destroy_plan( b->fwd1 );
+	if( b->fwdk )
+		fftwf_destroy_plan( b->fwdk );
+	if( b->invk )
+		fftwf_destroy_plan( b->invk );
+	pthread_mutex_unlock( &plan_lock );
+	arena_destroy( b->arena );
+	free( b );
+	thread_batch = NULL;
+}
+
+/*
+ * Free the buffers and plans of the calling thread
+ */
+void fft_release( void )
+{
+	release_ws();
+	release_batch();
+}
+
+/*
+ * Buffers and plans of the calling thread for w x h, made if there are none
+ * of that size
+ * returns NULL on error
+ */
+static fft_ws_t *workspace( int32_t w, int32_t h, int inplace )
+{
+	size_t real = sizeof(float) * w * h;
+	size_t spectrum = sizeof(fftwf_complex) * h * (w / 2 + 1);
+
+	fft_ws_t *ws = thread_ws;
+	unsigned gen = __atomic_load_n( &plan_gen, __ATOMIC_ACQUIRE );
+
+	if( ws && ws->w == w && ws->h == h && ws->inplace == inplace && ws->gen == gen )
+		return ws;
+	release_ws();
+
+	ws = thread_ws = calloc( 1, sizeof(*ws) );
+	if( !ws )
 	{
 		ERROR("out of memory");
 		return NULL;
 	}
-	
-	pix->width = w;
-	pix->height = h;
-	pix->data = calloc(sizeof(uint8_t), w*h );
-	if( !pix->data )
+	ws->w = w;
+	ws->h = h;
+	ws->inplace = inplace;
+	ws->gen = gen;
+	if( inplace )
+		ws->arena = arena_create( 2*ARENA_SIZE(spectrum) );
+	else
+		ws->arena = arena_create( 2*ARENA_SIZE(real) + 3*ARENA_SIZE(spectrum) );
+	if( !ws->arena )
 	{
-		free(pix);
-		ERROR("out of memory");
+		release_ws();
 		return NULL;
 	}
-	return pix;
+	ws->outr = arena_alloc( ws->arena, spectrum );
+	ws->outs = arena_alloc( ws->arena, spectrum );
+	if( !inplace )
+	{
+		ws->in = arena_alloc( ws->arena, real );
+		ws->outd = arena_alloc( ws->arena, spectrum );
+		fpixInit( &ws->dpix, arena_alloc( ws->arena, real ), w, h, w );
+	}
+
+	// measuring planners overwrite the buffers, they hold nothing yet
+	pthread_mutex_lock( &plan_lock );
+	if( threads_ready )
+		fftwf_plan_with_nthreads( plan_threads );
+	if( inplace )
+	{
+		ws->fwd = fftwf_plan_dft_r2c_2d( h, w, (float *)ws->outr, ws->outr, plan_flags );
+		ws->inv = fftwf_plan_dft_c2r_2d( h, w, ws->outs, (float *)ws->outs, plan_flags );
+	}
+	else
+	{
+		ws->fwd = fftwf_plan_dft_r2c_2d( h, w, ws->in, ws->outr, plan_flags );
+		ws->inv = fftwf_plan_dft_c2r_2d( h, w, ws->outd, ws->dpix.data, plan_flags );
+	}
+	pthread_mutex_unlock( &plan_lock );
+	if( !ws->fwd || !ws->inv )
+	{
+		ERROR("cannot plan FFTs of %d x %d", w, h);
+		release_ws();
+		return NULL;
+	}
+	DEBUG( "phase correlation of %d x %d%s: %lu KB of buffers", w, h, inplace ? " in place" : "",
+		   (unsigned long)(ws->arena->size >> 10) );
+	return ws;
 }
 
 /*
- * destroy 8-bit luminance image
+ * Buffers and plans of the calling thread for k images of w x h and the
+ * single one, made if there are none of that size and k
+ * returns NULL on error
  */
-void pixDestroy( pix_y_t *pix )
+static fft_batch_t *batch_workspace( int32_t w, int32_t h, int32_t k )
 {
-	if( !pix )
-		return;
-	
-	if( pix->data )
-		free( pix->data );
-	
-	free( pix );
+	size_t real = sizeof(float) * w * h;
+	size_t spectrum = sizeof(fftwf_complex) * h * (w / 2 + 1);
+	int n[2] = { h, w };
+	fft_batch_t *b = thread_batch;
+	unsigned gen = __atomic_load_n( &plan_gen, __ATOMIC_ACQUIRE );
+
+	if( b && b->w == w && b->h == h && b->k == k && b->gen == gen )
+		return b;
+	release_batch();
+
+	b = thread_batch = calloc( 1, sizeof(*b) );
+	if( !b )
+	{
+		ERROR("out of memory");
+		return NULL;
+	}
+	b->w = w;
+	b->h = h;
+	b->k = k;
+	b->gen = gen;
+	b->arena = arena_create( ARENA_SIZE(real) + ARENA_SIZE(spectrum) +
+							 ARENA_SIZE(k * real) + ARENA_SIZE(k * spectrum) );
+	if( !b->arena )
+	{
+		release_batch();
+		return NULL;
+	}
+	b->real1 = arena_alloc( b->arena, real );
+	b->out1 = arena_alloc( b->arena, spectrum );
+	b->realk = arena_alloc( b->arena, k * real );
+	b->outk = arena_alloc( b->arena, k * spectrum );
+
+	pthread_mutex_lock( &plan_lock );
+	if( threads_ready )
+		fftwf_plan_with_nthreads( plan_threads );
+	b->fwd1 = fftwf_plan_dft_r2c_2d( h, w, b->real1, b->out1, plan_flags );
+	b->fwdk = fftwf_plan_many_dft_r2c( 2, n, k, b->realk, NULL, 1, w * h,
+									   b->outk, NULL, 1, h * (w / 2 + 1), plan_flags );
+	b->invk = fftwf_plan_many_dft_c2r( 2, n, k, b->outk, NULL, 1, h * (w / 2 + 1),
+									   b->realk, NULL, 1, w * h, plan_flags );
+	pthread_mutex_unlock( &plan_lock );
+	if( !b->fwd1 || !b->fwdk || !b->invk )
+	{
+		ERROR("cannot plan %d FFTs of %d x %d", k, w, h);
+		release_batch();
+		return NULL;
+	}
+	DEBUG( "batch phase correlation of 1 + %d x %d x %d: %lu KB of buffers", k, w, h,
+		   (unsigned long)(b->arena->size >> 10) );
+	return b;
 }
 
+/*
+ * DFT of fpix into out with the plan of the workspace. Data FFTW cannot
+ * take where it is, not aligned like the plan's or a view with lines
+ * apart, goes through the workspace's input
+ */
+static void forward_dft( fft_ws_t *ws, fpix_y_t *fpix, fftwf_complex *out )
+{
+	float *in = fpix->data;
+
+	if( !fpixIsContiguous( fpix ) || fftwf_alignment_of( in ) != fftwf_alignment_of( ws->in ) )
+	{
+		fpixPack( ws->in, fpix );
+		in = ws->in;
+	}
+	fftwf_execute_dft_r2c( ws->fwd, in, out );
+}
 
 /*--------------------------------------------------------------------*
  *                     FPix  <-->  Pix conversions                    *
@@ -107,15 +364,37 @@ void pixDestroy( pix_y_t *pix )
  *      Input:  pix 8 bit per pixel, luminance only
  *      Return: fpix, or null on error
  *
+ *  Notes:
+ *      (1) Dark subtracted and flat fielded on the way if a calibration
+ *          of the size of pix is set, see calib_set()
+ *
  */
 fpix_y_t *pixConvertToFPix(pix_y_t  *pixs )
+{
+	return pixConvertToFPixTo( NULL, pixs );
+}
+
+/*!
+ *  pixConvertToFPixTo()
+ *
+ *      Input:  fpixd (<optional> of the size of pixs, reused; null
+ *                     for a new one)
+ *              pixs 8 bit per pixel, luminance only
+ *      Return: fpixd, or null on error
+ *
+ *  Notes:
+ *      (1) As pixConvertToFPix(), without allocating when fpixd is
+ *          given, for the frames of a loop
+ *      (2) pixs may be any view, fpixd one that does not step
+ */
+fpix_y_t *pixConvertToFPixTo(fpix_y_t *fpixd, pix_y_t *pixs )
 {
 	int32_t     w, h;
-	int32_t     i, j;
+	int32_t     i;
 	uint8_t     *data;
 	float       *fdata;
-	fpix_y_t       *fpixd;
-	
+	const calib_t *cal;
+	uint64_t    before = stage_begin();
 	
     if (!pixs)
 	{
@@ -125,23 +404,26 @@ fpix_y_t *pixConvertToFPix(pix_y_t  *pixs )
 
 	w = pixs->width;
 	h = pixs->height;
+	perf_pixels( (uint64_t)w * h );
 
-    if ((fpixd = fpixCreate(w, h)) == NULL)
+	if (fpixd && (fpixd->width != w || fpixd->height != h || fpixd->step != 1))
+	{
+		ERROR("fpixd is %u x %u step %u, pixs %d x %d", fpixd->width, fpixd->height, fpixd->step, w, h);
+		return( NULL);
+	}
+    if (!fpixd && (fpixd = fpixCreate(w, h)) == NULL)
 	{
 		ERROR("out of memory");
 		return( NULL);
 	}
-    data = pixs->data;
-    fdata = fpixd->data;
+    cal = calib_for(w, h);
     for (i = 0; i < h; i++)
 	{
-		for (j = 0; j < w; j++)
-		{
-			*fdata = *data;
-			fdata++;
-			data++;
-        }
+		data = pixAt(pixs, 0, i);
+		fdata = fpixAt(fpixd, 0, i);
+		calib_to_float_step(cal, i, data, pixs->step, fdata, w);
     }
+	stage_end( PC_STAGE_CONVERT, before );
 	
     return fpixd;
 }
@@ -180,8 +462,6 @@ pix_y_t *fpixConvertToPix( fpix_y_t    *fpixs )
 	
 	w = fpixs->width;
 	h = fpixs->height;
-    datas = fpixs->data;
-	
 	
 	/* Make the pix and convert the data */
     if ( (pixd = pixCreate(w, h)) == NULL )
@@ -189,19 +469,18 @@ pix_y_t *fpixConvertToPix( fpix_y_t    *fpixs )
         ERROR("pixd not made");
 		return (NULL);
 	}
-    datad = pixd->data;
     for (i = 0; i < h; i++) {
+		datas = fpixAt(fpixs, 0, i);
+		datad = pixAt(pixd, 0, i);
         for (j = 0; j < w; j++) {
-			val = *datas;
+			val = datas[j * fpixs->step];
             if( val > 0.0 )
 				vald = (uint32_t)(val + 0.5);
             else /* val <= 0.0 */
                 vald = 0;
             if (vald > maxval)
                 vald = maxval;
-			*datad = (uint8_t)val;
-			datas++;
-			datad++;
+			datad[j] = (uint8_t)vald;
         }
     }
 	
@@ -248,18 +527,17 @@ fpixGetMax(fpix_y_t	*dpix,
     ymaxloc = 0;
     w = dpix->width;
 	h = dpix->height;
-    data = dpix->data;
     for (i = 0; i < h; i++)
 	{
+		data = fpixAt(dpix, 0, i);
         for (j = 0; j < w; j++)
 		{
-            if( (*data) > maxval )
+            if( data[j * dpix->step] > maxval )
 			{
-                maxval = (*data);
+                maxval = data[j * dpix->step];
                 xmaxloc = j;
                 ymaxloc = i;
             }
-			data++;
         }
     }
 	
@@ -309,14 +587,13 @@ fpixNormalize(fpix_y_t *dpixs)
 	
 	
 	n = dpixs->width * dpixs->height;
-	data = dpixs->data;
 	
 	for (i = 0; i < dpixs->height; i++)
+	{
+		data = fpixAt(dpixs, 0, i);
 		for (j = 0; j < dpixs->width; j++)
-		{
-			*data = (*data)/n;
-			data++;
-		}
+			data[j * dpixs->step] /= n;
+	}
 	
 	return 0;
 }
@@ -343,26 +620,17 @@ fpixInverseDFT(fftwf_complex *dft,
 		return NULL;
 	}
 	
-	if( NULL == (dpix=calloc(sizeof(fpix_y_t),1)) )
-	{
-		ERROR("out of memory");
-		return NULL;
-	}
-	
-	dpix->width  = w;
-	dpix->height = h;
-	
-	if( NULL == (dpix->data = malloc(sizeof(float) * w * h)) )
-	{
-		ERROR("out of memory");
-		free(dpix);
+	if( NULL == (dpix = fpixCreate(w, h)) )
 		return NULL;
-	}
 	
 	/* Compute the inverse DFT, storing the results into DPix */
+	pthread_mutex_lock( &plan_lock );
 	plan = fftwf_plan_dft_c2r_2d(h, w, dft, dpix->data, FFTW_ESTIMATE);
+	pthread_mutex_unlock( &plan_lock );
 	fftwf_execute( plan );
+	pthread_mutex_lock( &plan_lock );
 	fftwf_destroy_plan( plan );
+	pthread_mutex_unlock( &plan_lock );
 	
 	fpixNormalize( dpix );
 	
@@ -393,6 +661,7 @@ fftwf_complex *fpixDFT( fpix_y_t *fpix )
 {
 	fftwf_complex  *output;
 	fftwf_plan      plan;
+	float          *in, *packed = NULL;
 	
     if (!fpix)
 	{
@@ -400,12 +669,30 @@ fftwf_complex *fpixDFT( fpix_y_t *fpix )
 		return NULL;
 	}
 
+	/* FFTW takes the pixels in a row, views are packed first */
+	in = fpix->data;
+	if (!fpixIsContiguous(fpix))
+	{
+		if ((packed = fftwf_malloc(sizeof(float) * fpix->width * fpix->height)) == NULL)
+		{
+			ERROR("out of memory");
+			return NULL;
+		}
+		fpixPack(packed, fpix);
+		in = packed;
+	}
+
 /* Compute the DFT of the DPix */
 	output = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex) * fpix->height * (fpix->width / 2 + 1));
-	plan = fftwf_plan_dft_r2c_2d(fpix->height, fpix->width, fpix->data, output, FFTW_ESTIMATE);
+	pthread_mutex_lock( &plan_lock );
+	plan = fftwf_plan_dft_r2c_2d(fpix->height, fpix->width, in, output, FFTW_ESTIMATE);
+	pthread_mutex_unlock( &plan_lock );
 	fftwf_execute(plan);
 	
+	pthread_mutex_lock( &plan_lock );
 	fftwf_destroy_plan(plan);
+	pthread_mutex_unlock( &plan_lock );
+	fftwf_free(packed);
 	
 	return output;
 }
@@ -431,11 +718,15 @@ fftwf_complex *pixDFT(pix_y_t *pixs)
 
 	/* Compute the DFT of the DPix */
 	output = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex) * pixs->height * (pixs->width / 2 + 1));
+	pthread_mutex_lock( &plan_lock );
 	plan = fftwf_plan_dft_r2c_2d(fpix->height, fpix->width, fpix->data, output, FFTW_ESTIMATE);
+	pthread_mutex_unlock( &plan_lock );
 	fftwf_execute(plan);
 	
 	fpixDestroy( fpix );
+	pthread_mutex_lock( &plan_lock );
 	fftwf_destroy_plan(plan);
+	pthread_mutex_unlock( &plan_lock );
 	
 	return output;
 }
@@ -482,9 +773,11 @@ pixPhaseCorrelation(fpix_y_t       *pixr,
 	float      		cr, ci, r;
 	fftwf_complex  	*outputr, *outputs, *outputd;
 	fpix_y_t     	*dpix;
-	long			before, after;
+	fft_ws_t		*ws;
+	uint64_t		before;
+	long			us;
 	
-    if (!pixr && !pixs)
+    if (!pixr || !pixs)
 	{
     	ERROR("pixr or pixs not defined");
 		return(-1);
@@ -499,33 +792,27 @@ pixPhaseCorrelation(fpix_y_t       *pixr,
         ERROR("nothing to do");
 		return(-1);
 	}
+	perf_pixels( (uint64_t)pixr->width * pixr->height );
+
+	/* Buffers and plans of this size, made by the first call */
+	if ((ws = workspace(pixr->width, pixr->height, 0)) == NULL)
+		return(-1);
+	outputr = ws->outr;
+	outputs = ws->outs;
+	outputd = ws->outd;
+	dpix = &ws->dpix;
 	
 	/* Calculate the DFT of pixr and pixs */
-	before = millis();
-	if ((outputr = fpixDFT(pixr)) == NULL)
-	{
-		ERROR("outputr not made");
-		return(-1);
-	}
-	after = millis();
-	DEBUG( "fft pixr %ld milliseconds", after-before );
-	before = after;
-	if ((outputs = fpixDFT(pixs)) == NULL) {
-		fftwf_free(outputr);
-		ERROR("outputs not made");
-		return(-1);
-	}
-	after = millis();
-	DEBUG( "fft pixs %ld milliseconds", after-before );
-	outputd = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex) * pixr->height * (pixr->width / 2 + 1));
-	if (outputd == NULL) {
-		fftwf_free(outputr);
-		fftwf_free(outputs);
-		ERROR("outputd not made");
-		return(-1);
-	}
+	before = stage_begin();
+	forward_dft(ws, pixr, outputr);
+	us = stage_end( PC_STAGE_FORWARD, before );
+	DEBUG( "fft pixr %ld us", us );
+	before = stage_begin();
+	forward_dft(ws, pixs, outputs);
+	us = stage_end( PC_STAGE_FORWARD, before );
+	DEBUG( "fft pixs %ld us", us );
 	
-	before = millis();
+	before = stage_begin();
 	/* Calculate the cross-power spectrum */
 	for (i = 0, k = 0; i < pixr->height; i++) {
 		for (j = 0; j < pixr->width / 2 + 1; j++, k++) {
@@ -535,33 +822,277 @@ pixPhaseCorrelation(fpix_y_t       *pixr,
 			outputd[k] = (cr / r) + I * (ci / r);
 		}
 	}
-	after = millis();
-	DEBUG( "cross-power spectrum %ld milliseconds", after-before );
+	us = stage_end( PC_STAGE_CROSS, before );
+	DEBUG( "cross-power spectrum %ld us", us );
 	
 	/* Compute the inverse DFT of the cross-power spectrum
 	    and find its peak */
-	before = millis();
-	dpix = fpixInverseDFT(outputd, pixr->width, pixr->height);
-	after = millis();
-	DEBUG( "inverse DFT %ld milliseconds", after-before );
+	before = stage_begin();
+	fftwf_execute_dft_c2r(ws->inv, outputd, dpix->data);
+	fpixNormalize(dpix);
+	us = stage_end( PC_STAGE_INVERSE, before );
+	DEBUG( "inverse DFT %ld us", us );
 	
-	before = millis();
+	before = stage_begin();
 	fpixGetMax(dpix, ppeak, pxloc, pyloc);
-	after = millis();
-	DEBUG( "find max %ld milliseconds", after-before );
+	us = stage_end( PC_STAGE_PEAK, before );
+	DEBUG( "find max %ld us", us );
 	
 	if (*pxloc >= pixr->width / 2)
 		*pxloc -= pixr->width;
 	if (*pyloc >= pixr->height / 2)
 		*pyloc -= pixr->height;
-		
-	/* Release the allocated resources */
-	fftwf_free(outputr);
-	fftwf_free(outputs);
-	fftwf_free(outputd);
-	
-	free(dpix->data);
-	free(dpix);
 	
 	return(0);
 }
+
+
+/*!
+ *  pixPhaseCorrelationInPlace()
+ *
+ *      Input:  pixr (8 bit, luminance only), the reference
+ *              pixs (8 bit, luminance only), the input
+ *              &peak, &xloc, &yloc as pixPhaseCorrelation()
+ *      Return: 0 if OK; -1 on error
+ *
+ *  Notes:
+ *      (1) Same result as pixPhaseCorrelation() of the converted
+ *          images, in a fraction of the memory, for boards with 512 MB
+ *          or less.
+ *      (2) Each image is converted row by row straight into a spectrum
+ *          buffer of h * (w/2 + 1) complex values and transformed there
+ *          (FFTW in place r2c). The cross-power spectrum is written over
+ *          that of pixs and transformed back in place, the normalization
+ *          is left to the peak, which is searched row by row over the
+ *          padded rows. Two buffers of a little more than the float
+ *          image, no float images, no result image.
+ */
+int32_t
+pixPhaseCorrelationInPlace(pix_y_t        *pixr,
+						   pix_y_t        *pixs,
+						   float 			*ppeak,
+						   int32_t   		*pxloc,
+						   int32_t   		*pyloc)
+{
+	int32_t        	i, j, k, w, h, cw, xmaxloc, ymaxloc;
+	float      		cr, ci, r, maxval, *row;
+	fftwf_complex  	*outputr, *outputs;
+	const calib_t	*cal;
+	fft_ws_t		*ws;
+	uint64_t		before;
+	long			us;
+
+	if (!pixr || !pixs)
+	{
+		ERROR("pixr or pixs not defined");
+		return(-1);
+	}
+	if (pixr->width != pixs->width || pixr->height != pixs->height)
+	{
+		ERROR("pixr and pixs unequal size");
+		return(-1);
+	}
+	w = pixr->width;
+	h = pixr->height;
+	cw = w / 2 + 1;
+	perf_pixels( (uint64_t)w * h );
+
+	if ((ws = workspace(w, h, 1)) == NULL)
+		return(-1);
+	outputr = ws->outr;
+	outputs = ws->outs;
+
+	/* Convert into the padded rows of the spectra */
+	before = stage_begin();
+	cal = calib_for(w, h);
+	for (i = 0; i < h; i++)
+	{
+		calib_to_float_step(cal, i, pixAt(pixr, 0, i), pixr->step, (float *)outputr + 2 * cw * i, w);
+		calib_to_float_step(cal, i, pixAt(pixs, 0, i), pixs->step, (float *)outputs + 2 * cw * i, w);
+	}
+	stage_end( PC_STAGE_CONVERT, before );
+
+	/* DFT of pixr and pixs, in place */
+	before = stage_begin();
+	fftwf_execute_dft_r2c(ws->fwd, (float *)outputr, outputr);
+	us = stage_end( PC_STAGE_FORWARD, before );
+	DEBUG( "fft pixr %ld us", us );
+	before = stage_begin();
+	fftwf_execute_dft_r2c(ws->fwd, (float *)outputs, outputs);
+	us = stage_end( PC_STAGE_FORWARD, before );
+	DEBUG( "fft pixs %ld us", us );
+
+	/* Cross-power spectrum over that of pixs */
+	before = stage_begin();
+	for (k = 0; k < h * cw; k++) {
+		cr = creal(outputs[k]) * creal(outputr[k]) - cimag(outputs[k]) * (-cimag(outputr[k]));
+		ci = creal(outputs[k]) * (-cimag(outputr[k])) + cimag(outputs[k]) * creal(outputr[k]);
+		r = sqrtf(cr * cr + ci * ci);
+		outputs[k] = (cr / r) + I * (ci / r);
+	}
+	us = stage_end( PC_STAGE_CROSS, before );
+	DEBUG( "cross-power spectrum %ld us", us );
+
+	before = stage_begin();
+	fftwf_execute_dft_c2r(ws->inv, outputs, (float *)outputs);
+	us = stage_end( PC_STAGE_INVERSE, before );
+	DEBUG( "inverse DFT %ld us", us );
+
+	/* Peak of the unnormalized result, w of each 2 * cw floats */
+	before = stage_begin();
+	maxval = -1.0e38;
+	xmaxloc = ymaxloc = 0;
+	for (i = 0; i < h; i++)
+	{
+		row = (float *)outputs + 2 * cw * i;
+		for (j = 0; j < w; j++)
+		{
+			if (row[j] > maxval)
+			{
+				maxval = row[j];
+				xmaxloc = j;
+				ymaxloc = i;
+			}
+		}
+	}
+	us = stage_end( PC_STAGE_PEAK, before );
+	DEBUG( "find max %ld us", us );
+
+	if (ppeak) *ppeak = maxval / ((float)w * h);
+	if (xmaxloc >= w / 2)
+		xmaxloc -= w;
+	if (ymaxloc >= h / 2)
+		ymaxloc -= h;
+	if (pxloc) *pxloc = xmaxloc;
+	if (pyloc) *pyloc = ymaxloc;
+
+	return(0);
+}
+
+
+/*!
+ *  pixPhaseCorrelationBatch()
+ *
+ *      Input:  pix1 (float), the single image
+ *              pixk (float), array of k images
+ *              k
+ *              mode PHASECORR_BATCH_FRAMES: pix1 is the reference, pixk
+ *                       are k frames compared against it
+ *                   PHASECORR_BATCH_REFS: pixk are k references, pix1
+ *                       is compared against each of them
+ *              ppeak, pxloc, pyloc (arrays of k results)
+ *      Return: 0 if OK; -1 on error
+ *
+ *  Notes:
+ *      (1) Same result as k calls of pixPhaseCorrelation(), the
+ *          reference always being the first argument.
+ *      (2) The single image is transformed once, the k images in one
+ *          batch (fftwf_plan_many_dft_r2c), the cross-power spectra are
+ *          calculated in place over all k spectra and transformed back
+ *          in one batch as well. Set-up is paid once instead of k times.
+ *      (3) All images must have same width and height.
+ *      (4) Buffers and plans are kept per thread for the size and k, as
+ *          pixPhaseCorrelation() does, the following calls allocate and
+ *          plan nothing.
+ */
+int32_t
+pixPhaseCorrelationBatch(fpix_y_t       *pix1,
+						 fpix_y_t      **pixk,
+						 int32_t         k,
+						 int32_t         mode,
+						 float          *ppeak,
+						 int32_t        *pxloc,
+						 int32_t        *pyloc)
+{
+	int32_t        	i, j, f, w, h, cw;
+	float      		cr, ci, r, *data, maxval;
+	fftwf_complex  	*out1, *outk, *outf, *outr, *outs;
+	fft_batch_t		*b;
+	uint64_t		before;
+	long			us;
+
+	if (!pix1 || !pixk || k <= 0)
+	{
+		ERROR("pix1 or pixk not defined");
+		return(-1);
+	}
+	if (!ppeak || !pxloc || !pyloc)
+	{
+		ERROR("nothing to do");
+		return(-1);
+	}
+	w = pix1->width;
+	h = pix1->height;
+	cw = w / 2 + 1;
+	perf_pixels( (uint64_t)k * w * h );
+	for (f = 0; f < k; f++)
+	{
+		if (!pixk[f] || pixk[f]->width != w || pixk[f]->height != h)
+		{
+			ERROR("pixk[%d] missing or not %d x %d", f, w, h);
+			return(-1);
+		}
+	}
+
+	if ((b = batch_workspace(w, h, k)) == NULL)
+		return(-1);
+
+	/* Calculate the DFT of pix1 and, in one batch, of all of pixk */
+	before = stage_begin();
+	fpixPack(b->real1, pix1);
+	for (f = 0; f < k; f++)
+		fpixPack(b->realk + f * w * h, pixk[f]);
+	fftwf_execute(b->fwd1);
+	fftwf_execute(b->fwdk);
+	us = stage_end( PC_STAGE_FORWARD, before );
+	DEBUG( "fft 1 + %d images %ld us", k, us );
+
+	/* Calculate the cross-power spectra, in place over pixk's spectra */
+	before = stage_begin();
+	for (f = 0; f < k; f++) {
+		out1 = b->out1;
+		outk = b->outk + f * h * cw;
+		outr = mode == PHASECORR_BATCH_REFS ? outk : out1;
+		outs = mode == PHASECORR_BATCH_REFS ? out1 : outk;
+		outf = outk;
+		for (i = 0; i < h * cw; i++, outr++, outs++, outf++) {
+			cr = creal(*outs) * creal(*outr) - cimag(*outs) * (-cimag(*outr));
+			ci = creal(*outs) * (-cimag(*outr)) + cimag(*outs) * creal(*outr);
+			r = sqrtf(cr * cr + ci * ci);
+			*outf = (cr / r) + I * (ci / r);
+		}
+	}
+	us = stage_end( PC_STAGE_CROSS, before );
+	DEBUG( "%d cross-power spectra %ld us", k, us );
+
+	/* Inverse DFT of all cross-power spectra in one batch */
+	before = stage_begin();
+	fftwf_execute(b->invk);
+	us = stage_end( PC_STAGE_INVERSE, before );
+	DEBUG( "%d inverse DFTs %ld us", k, us );
+
+	/* Find the peaks, normalized like fpixInverseDFT() would */
+	before = stage_begin();
+	for (f = 0; f < k; f++) {
+		data = b->realk + f * w * h;
+		maxval = -1.0e38;
+		pxloc[f] = pyloc[f] = 0;
+		for (i = 0; i < h; i++) {
+			for (j = 0; j < w; j++, data++) {
+				if (*data > maxval) {
+					maxval = *data;
+					pxloc[f] = j;
+					pyloc[f] = i;
+				}
+			}
+		}
+		ppeak[f] = maxval / (w * h);
+		if (pxloc[f] >= w / 2)
+			pxloc[f] -= w;
+		if (pyloc[f] >= h / 2)
+			pyloc[f] -= h;
+	}
+	stage_end( PC_STAGE_PEAK, before );
+
+	return(0);
+}
@@ -6,6 +6,7 @@
 #endif // FFTW3_H
 
 #include "mmalyuv.h"
+#include "image.h"
 
 int32_t
 pixPhaseCorrelation(fpix_y_t       *pixr,
@@ -15,14 +16,35 @@ pixPhaseCorrelation(fpix_y_t       *pixr,
 					int32_t   		*pyloc);
 
 
+int32_t
+pixPhaseCorrelationInPlace(pix_y_t        *pixr,
+						   pix_y_t        *pixs,
+						   float 			*ppeak,
+						   int32_t   		*pxloc,
+						   int32_t   		*pyloc);
+
+
+int32_t
+pixPhaseCorrelationBatch(fpix_y_t       *pix1,
+						 fpix_y_t      **pixk,
+						 int32_t         k,
+						 int32_t         mode,
+						 float          *ppeak,
+						 int32_t        *pxloc,
+						 int32_t        *pyloc);
+
 fpix_y_t *fpixInverseDFT(fftwf_complex *dft, int32_t w, int32_t h);
 fftwf_complex *fpixDFT(fpix_y_t *dpix);
 fftwf_complex *pixDFT(pix_y_t *pixs);
 
 fpix_y_t *pixConvertToFPix(pix_y_t *pixs );
+fpix_y_t *pixConvertToFPixTo(fpix_y_t *fpixd, pix_y_t *pixs );
 pix_y_t *fpixConvertToPix( fpix_y_t *fpixs );
 
-void fpixDestroy( fpix_y_t *fpix );
-void pixDestroy( pix_y_t *fpix );
+void fft_set_times( pc_times_t *t );
+int fft_set_plan( unsigned flags, int threads );
+int fft_wisdom_load( const char *file );
+int fft_wisdom_save( const char *file );
+void fft_release( void );
 
 #endif
\ No newline at end of file
@@ -7,209 +7,552 @@
 #include <time.h>
 
 #include "mmalyuv.h"
+#include "image.h"
 #include "log.h"
 #include "fft_gpu.h"
+#include "calib.h"
 #include "dbg_image.h"
+#include "trace.h"
+#include "perf.h"
 
 #include "gpu_fft/mailbox.h"
 #include "gpu_fft/gpu_fft.h"
 
+// gpu_fft handles lengths 2^8 .. 2^17
+#define GPU_FFT_MIN_LOG2 8
+#define GPU_FFT_MAX_LOG2 17
+
+// batches alive at the same time in pixPhaseCorrelate_GPU, each gets
+// its share of VideoCore memory: 4 in use, 2 waiting in the cache
+#define GPU_FFT_BATCHES 6
+
+// prepared passes kept for the next correlation, see get_pass
+#define GPU_PASS_CACHE 8
+
+// tile size for the transpositions, 16 x 16 complex values = 2 KB
+#define TRANSPOSE_TILE 16
+
+/*
+ * One dimension of a 2D FFT: jobs lines of length 2^log2_N
+ */
+typedef struct {
+	struct GPU_FFT_COMPLEX *in, *out; // line j at in/out + j*step
+	int step;
+	unsigned usecs;                   // QPU time of the last run
+	int log2_N, jobs;
+	int direction;
+	int chunk;                        // jobs per gpu_fft batch, < jobs if chunked
+	int running;                      // submitted, not yet waited for
+	struct GPU_FFT *fft;
+	struct GPU_FFT_COMPLEX *data;     // lines in ARM memory if chunked, else NULL
+} gpu_pass_t;
+
 static int mb = -1;
+static int pad_mode = FFT_GPU_PAD_ZERO;
+static pc_times_t *times;
+
+
+/*
+ * Select how images are padded to the next power of 2:
+ * FFT_GPU_PAD_ZERO or FFT_GPU_PAD_MIRROR
+ */
+void fft_gpu_set_padding( int mode )
+{
+	pad_mode = mode;
+}
+
+/*
+ * Add the time of each stage of the following phase correlations to t,
+ * NULL to stop. ARM stages are wall clock, the FFTs QPU time, so with the
+ * interleaving the sum can exceed the correlation's time. Not for
+ * concurrent callers.
+ */
+void fft_gpu_set_times( pc_times_t *t )
+{
+	times = t;
+}
+
+/*
+ * Stage s (PC_STAGE_*) took us, on the QPUs: traced and added to the
+ * times if set. Returns us
+ */
+static long stage( int s, long us )
+{
+	trace_add( TRACE_GPU + s, us * 1000ULL );
+	if( times )
+		times->us[s] += us;
+	return us;
+}
+
+/*
+ * Begin a stage on the ARM, with its counters if profiled
+ */
+static inline uint64_t stage_begin( void )
+{
+	perf_begin();
+	return trace_begin();
+}
+
+/*
+ * End stage s begun at start, on the ARM, like stage()
+ */
+static long stage_end( int s, uint64_t start )
+{
+	long us = trace_end( TRACE_GPU + s, start ) / 1000;
+
+	perf_end( TRACE_GPU + s );
+	if( times )
+		times->us[s] += us;
+	return us;
+}
+
+/*
+ * log2 of the padded size for an image side of n pixels: the next power of 2,
+ * but not below what gpu_fft can do
+ * returns -1 if n is too large for gpu_fft
+ */
+static int padded_log2( uint32_t n )
+{
+	int log2_N = GPU_FFT_MIN_LOG2;
+
+	while( (1u << log2_N) < n )
+		log2_N++;
+
+	return log2_N > GPU_FFT_MAX_LOG2 ? -1 : log2_N;
+}
+
+/*
+ * Index into a line of n pixels for position i >= 0, reflected at the borders
+ * (without repeating the border pixel)
+ */
+static int mirror( int i, int n )
+{
+	int period = 2*n - 2;
+
+	if( n < 2 )
+		return 0;
+	i %= period;
+	return i < n ? i : period - i;
+}
+
+/*
+ *  Out-of-place transposition of a rectangular matrix of complex values:
+ *  the left w columns of the h lines in src become w lines of length h in dst.
+ *  Works in tiles, both matrices are far too large for the cache.
+ */
+static void transpose_rect( struct GPU_FFT_COMPLEX *dst, int dst_step, struct GPU_FFT_COMPLEX *src, int src_step, int w, int h )
+{
+	int i, j, ti, tj, imax, jmax;
+
+	for( tj = 0; tj < h; tj += TRANSPOSE_TILE )
+	{
+		jmax = tj + TRANSPOSE_TILE < h ? tj + TRANSPOSE_TILE : h;
+		for( ti = 0; ti < w; ti += TRANSPOSE_TILE )
+		{
+			imax = ti + TRANSPOSE_TILE < w ? ti + TRANSPOSE_TILE : w;
+			for( j = tj; j < jmax; j++ )
+				for( i = ti; i < imax; i++ )
+					dst[i*dst_step + j] = src[j*src_step + i];
+		}
+	}
+}
+
+/*
+ * Largest batch that was prepared successfully, per log2_N. Once VideoCore
+ * memory ran out for a size, later batches start from there instead of
+ * failing again.
+ */
+static int max_jobs[GPU_FFT_MAX_LOG2+1];
+
+/*
+ * Sizes for which the cached passes were released to make room. Only done
+ * once per size, or passes of one correlation would keep pushing each other
+ * out and be prepared again for every frame.
+ */
+static char dropped[GPU_FFT_MAX_LOG2+1];
 
-static long millis()
+/*
+ * Release VideoCore and ARM memory of a pass
+ */
+static void release_pass( gpu_pass_t *pass )
 {
-	struct timespec tt;
-	clock_gettime(CLOCK_MONOTONIC,&tt);
-	return tt.tv_sec*1000l + tt.tv_nsec/1000000;
+	gpu_fft_release( pass->fft );
+	free( pass->data );
+	free( pass );
 }
 
 /*
- *  In-place transposition of square matrix of complex values 
+ * Passes given back by put_pass, oldest first. Preparing a batch maps
+ * VideoCore memory and uploads shader and twiddles, releasing it disables
+ * the QPUs; in a steady stream of frames of one size every pass comes from
+ * here instead.
+ */
+static gpu_pass_t *pass_cache[GPU_PASS_CACHE];
+
+/*
+ * Passes submitted and not yet waited for. Releasing a batch disables the
+ * QPUs, so the cache is only dropped while this is 0.
+ */
+static int running_passes;
+
+/*
+ * Release the passes in the cache, their VideoCore memory is needed for a
+ * new batch. Only while nothing runs on the QPUs.
+ * returns the number of passes released
  */
-static void in_place_transpose_square( struct GPU_FFT_COMPLEX *data, int w, int step )
+static int drop_passes( void )
 {
-	struct GPU_FFT_COMPLEX temp;
-	struct GPU_FFT_COMPLEX *base, *trans;
-	int i, j;
-	
-	for( j = 0; j <= w-2; j++ )
-		for( i = j+1; i <= w-1; i++ )
+	int i, n = 0;
+
+	for( i = 0; i < GPU_PASS_CACHE; i++ )
+	{
+		if( pass_cache[i] )
 		{
-			base = data + j*step + i;
-			trans = data + i*step + j;
-			temp = *base;
-			*base = *trans;
-			*trans = temp;
+			release_pass( pass_cache[i] );
+			n++;
 		}
-	
+		pass_cache[i] = NULL;
+	}
+	return n;
 }
 
 /*
- *  Transpose in-place the left half of a square matrix to the upper half. 
- *  I.e. a w/2-by-w-Matrix becomes a w-x-w/2-matrix 
- *  The lower half of the result matrix is zeroed out.
+ * Prepare a batch of jobs GPU FFTs of length 2^log2_N
+ *
+ * This function assumes the mailbox is already created.
+ *
+ * If the batch does not fit into VideoCore memory, the cached passes are
+ * released first (once per size, and not while a pass runs). If it still
+ * does not fit, a smaller staging batch is prepared instead, and the lines
+ * are kept in ARM memory and streamed through it in chunks (see
+ * submit_pass). Slower, but does not fail.
+ * The size of the first try is limited to a share of the GPU memory split.
+ *
+ * pass->in, pass->out and pass->step address the lines either way.
+ *
+ * returns NULL on error
  */
-static void in_place_transpose_square_left_half( struct GPU_FFT_COMPLEX *data, int w, int step )
+static gpu_pass_t *prepare_fft_gpu( int log2_N, int direction, int jobs )
 {
-	struct GPU_FFT_COMPLEX temp;
-	struct GPU_FFT_COMPLEX *base, *trans;
-	int i, j;
-	
-	// transpose upper left quadrant of matrix
-	for( j = 0; j <= w/2-2; j++ )
-		for( i = j+1; i <= w/2-1; i++ )
+	gpu_pass_t *pass;
+	unsigned vc_mem, line_bytes;
+	int ret, chunk;
+
+	pass = calloc( sizeof(gpu_pass_t), 1 );
+	if( !pass )
+	{
+		ERROR("out of memory");
+		return NULL;
+	}
+	pass->log2_N = log2_N;
+	pass->jobs = jobs;
+	pass->direction = direction;
+
+	chunk = jobs;
+	if( max_jobs[log2_N] && chunk > max_jobs[log2_N] )
+		chunk = max_jobs[log2_N];
+
+	// ping-pong buffers take two lines per job
+	vc_mem = get_vc_memory( mb );
+	line_bytes = 2*(1+((sizeof(struct GPU_FFT_COMPLEX)<<log2_N)|4095));
+	if( vc_mem && chunk > vc_mem / (line_bytes*GPU_FFT_BATCHES) )
+		chunk = vc_mem / (line_bytes*GPU_FFT_BATCHES) > 0 ? vc_mem / (line_bytes*GPU_FFT_BATCHES) : 1;
+
+	for( ;; )
+	{
+		ret = gpu_fft_prepare(mb, log2_N, direction, chunk, &pass->fft);
+		if( ret == -3 )
+			qpu_enable( mb, 0 ); // enabled before it ran out of memory
+		if( ret == -3 && !running_passes && !dropped[log2_N] )
 		{
-			base = data + j*step + i;
-			trans = data + i*step + j;
-			temp = *base;
-			*base = *trans;
-			*trans = temp;
+			dropped[log2_N] = 1;
+			if( drop_passes() )
+				continue;        // the cache held the memory, same size again
 		}
-	
-	// move lover left quadrant transposed to upper right quadrant
-	// erase (fill with 0) lower half of matrix
-	for( j = w/2; j < w; j++ )
+		if( ret != -3 || chunk == 1 )
+			break;
+		chunk = (chunk+1)/2;
+	}
+
+	switch(ret) {
+		case -1: ERROR("Unable to enable V3D. Please check your firmware is up to date."); free(pass); return NULL;
+		case -2: ERROR("log2_N=%d not supported.  Try between 8 and 17.", log2_N);         free(pass); return NULL;
+		case -3: ERROR("Out of memory round1.  Try a smaller batch or increase GPU memory.");  free(pass); return NULL;
+		case -4: ERROR("Cannot open /dev/mem, must run as root.");  free(pass); return NULL;
+	}
+
+	pass->chunk = chunk;
+	if( chunk < jobs )
 	{
-		for( i = 0; i < w/2; i++ )
+		max_jobs[log2_N] = chunk;
+		pass->data = malloc( (sizeof(struct GPU_FFT_COMPLEX) << log2_N) * jobs );
+		if( !pass->data )
 		{
-			base = data+j*step+i;
-			trans= data+i*step+j;
-			*trans = *base;
+			ERROR("out of memory");
+			gpu_fft_release( pass->fft );
+			free( pass );
+			return NULL;
 		}
-		memset(data+j*step,0,sizeof(struct GPU_FFT_COMPLEX)*w);
+		pass->in = pass->out = pass->data;
+		pass->step = 1 << log2_N;
+		DEBUG( "%d FFTs of 2^%d in chunks of %d, VideoCore memory %u bytes", jobs, log2_N, chunk, vc_mem );
 	}
+	else
+	{
+		pass->in = pass->fft->in;
+		pass->out = pass->fft->out;
+		pass->step = pass->fft->step;
+	}
+	return pass;
 }
 
 /*
- *  Transpose in-place the top half of a square matrix to the left half. 
- *  I.e. a w-by-w/2-Matrix becomes a w/2-x-w-matrix 
- *  The right half of the result matrix is zeroed out.
+ * Start the FFTs of a pass on the QPUs. A pass that fits into one batch
+ * runs asynchronously until wait_pass, a chunked pass is done right here:
+ * each chunk is copied into the staging batch, transformed and copied back.
+ * returns -1 if the batch could not be queued or the QPUs timed out
  */
-static void in_place_transpose_square_upper_half( struct GPU_FFT_COMPLEX *data, int w, int step )
+static int submit_pass( gpu_pass_t *pass )
 {
-	struct GPU_FFT_COMPLEX temp;
-	struct GPU_FFT_COMPLEX *base, *trans;
-	int i, j;
-	
-	// transpose upper left quadrant of matrix
-	for( j = 0; j <= w/2-2; j++ )
-		for( i = j+1; i <= w/2-1; i++ )
+	struct GPU_FFT *fft = pass->fft;
+	size_t line = sizeof(struct GPU_FFT_COMPLEX) << pass->log2_N;
+	int j, k, n;
+
+	if( !pass->data )
+	{
+		if( gpu_fft_submit( fft ) )
 		{
-			base = data + j*step + i;
-			trans = data + i*step + j;
-			temp = *base;
-			*base = *trans;
-			*trans = temp;
+			ERROR( "cannot queue GPU FFT batch" );
+			return (-1);
 		}
-	
-	// move upper right quadrant of matrix transposed to lower left
-	// erase right half of all lines
-	for( j = 0; j < w/2; j++ )
+		pass->running = 1;
+		running_passes++;
+		return (0);
+	}
+
+	pass->usecs = 0;
+	for( j = 0; j < pass->jobs; j += pass->chunk )
 	{
-		for( i = w/2; i < w; i++ )
+		n = pass->jobs - j < pass->chunk ? pass->jobs - j : pass->chunk;
+		// a short last chunk leaves stale lines in the batch, their results are ignored
+		for( k = 0; k < n; k++ )
+			memcpy( fft->in + k*fft->step, pass->data + (j+k)*pass->step, line );
+
+		if( gpu_fft_submit( fft ) )
 		{
-			base = data+j*step+i;
-			trans= data+i*step+j;
-			*trans = *base;
+			ERROR( "cannot queue GPU FFT chunk" );
+			return (-1);
+		}
+		if( gpu_fft_wait( fft ) )
+		{
+			ERROR( "GPU FFT chunk timed out" );
+			return (-1);
 		}
-		// erase upper right quadrant after copy
-		memset( data +       j*step + w/2, 0, sizeof(struct GPU_FFT_COMPLEX)*w );
-		// erase lower right quadrant -- is this necessary at all?
-		memset( data + (w/2+j)*step + w/2,0, sizeof(struct GPU_FFT_COMPLEX)*w );
+		pass->usecs += fft->usecs;
+
+		for( k = 0; k < n; k++ )
+			memcpy( pass->data + (j+k)*pass->step, fft->out + k*fft->step, line );
 	}
+	return (0);
 }
 
+/*
+ * Wait for a pass started by submit_pass, also one submit_pass failed on
+ * returns -1 if the QPUs timed out
+ */
+static int wait_pass( gpu_pass_t *pass )
+{
+	if( pass->running )
+	{
+		pass->running = 0;
+		running_passes--;
+	}
+	if( !pass->data )
+	{
+		if( gpu_fft_wait( pass->fft ) )
+		{
+			ERROR( "GPU FFT batch timed out" );
+			return (-1);
+		}
+		pass->usecs = pass->fft->usecs;
+	}
+	return (0);
+}
 
-/* 
- * Do a GPU-based FFT on a square(!) image, but leave out the final transposition.
- * This is very useful for the phase correlation below
- *
- * This function assumes the mailbox is already created.
- * 
- * 1: horizontal fft for all lines
- * 2: transpose results from left half to top half 
- * 3: (vertical) fft for all lines (former columns) (see comment below on performance)
- * 
- * TODO This function does no error checking 
- *
- * returns pointer to struct GPU_FFT (basically, an array of complex numbers) with results
- * return value needs to be free'd with free_fft_gpu
+/*
+ * A pass of jobs FFTs of length 2^log2_N, from the cache or prepared
  * returns NULL on error
  */
-static struct GPU_FFT *pixDFT_GPU_no_final_transpose( pix_y_t *pic )
+static gpu_pass_t *get_pass( int log2_N, int direction, int jobs )
 {
-    int i, j, ret, log2_N;
-    struct GPU_FFT_COMPLEX *base;
-    struct GPU_FFT *fft;
-	uint8_t *picdata;
-	
-	log2_N = (int)round(log2(pic->width));
+	gpu_pass_t *pass;
+	int i;
 
-    ret = gpu_fft_prepare(mb, log2_N, GPU_FFT_FWD, pic->height, &fft); // call once
+	for( i = GPU_PASS_CACHE-1; i >= 0; i-- )
+	{
+		pass = pass_cache[i];
+		if( pass && pass->log2_N == log2_N && pass->direction == direction && pass->jobs == jobs )
+		{
+			pass_cache[i] = NULL;
+			return pass;
+		}
+	}
+	return prepare_fft_gpu( log2_N, direction, jobs );
+}
 
-    switch(ret) {
-        case -1: ERROR("Unable to enable V3D. Please check your firmware is up to date."); return NULL;
-        case -2: ERROR("log2_N=%d not supported.  Try between 8 and 17.", log2_N);         return NULL;
-        case -3: ERROR("Out of memory round1.  Try a smaller batch or increase GPU memory.");  return NULL;
-        case -4: ERROR("Cannot open /dev/mem, must run as root.");  return NULL;
-    }
+/*
+ * Give a pass back for reuse. When the cache is full the oldest pass is
+ * released, so only where release_pass would be safe
+ */
+static void put_pass( gpu_pass_t *pass )
+{
+	int i;
 
-	for( j=0; j < pic->height; j++ )
+	for( i = 0; i < GPU_PASS_CACHE && pass_cache[i]; i++ )
+		;
+	if( i == GPU_PASS_CACHE )
 	{
-		base = fft->in + j*fft->step; // input buffer
-		picdata = pic->data + j*pic->width;
-        for( i=0; i<pic->width ; i++,picdata++ )
+		release_pass( pass_cache[0] );
+		memmove( pass_cache, pass_cache + 1, (GPU_PASS_CACHE-1) * sizeof(*pass_cache) );
+		i = GPU_PASS_CACHE-1;
+	}
+	pass_cache[i] = pass;
+}
+
+/*
+ * Release the passes kept for reuse, while nothing runs on the QPUs. The
+ * batch sizes VideoCore memory was short for are forgotten with them
+ */
+void fft_gpu_release( void )
+{
+	drop_passes();
+	memset( max_jobs, 0, sizeof(max_jobs) );
+	memset( dropped, 0, sizeof(dropped) );
+}
+
+/*
+ * Copy luminance image into the input rows of fft, one line per job starting
+ * at line first, imaginary part 0. Lines are padded to 2^log2_w, the image to
+ * jobs lines, according to pad_mode. Calibrated if a calibration of the
+ * image's size is set.
+ */
+static void load_fft_gpu( gpu_pass_t *fft, pix_y_t *pic, int log2_w, int first, int jobs )
+{
+	struct GPU_FFT_COMPLEX *base;
+	uint8_t *picdata;
+	const calib_t *cal = calib_for( pic->width, pic->height );
+	int i, j, y, w = 1 << log2_w;
+
+	for( j=0; j < jobs; j++ )
+	{
+		base = fft->in + (first+j)*fft->step; // input buffer
+		if( j >= pic->height && pad_mode == FFT_GPU_PAD_ZERO )
+		{
+			memset( base, 0, w*sizeof(struct GPU_FFT_COMPLEX) );
+			continue;
+		}
+		y = mirror(j, pic->height);
+		picdata = pixAt( pic, 0, y );
+		calib_to_complex_step( cal, y, picdata, pic->step, &base[0].re, pic->width );
+		for( i=pic->width; i < w; i++ )
 		{
-			base[i].re = *(picdata);
-			base[i].im = 0;			
+			base[i].re = pad_mode == FFT_GPU_PAD_ZERO ? 0 : base[mirror(i, pic->width)].re;
+			base[i].im = 0;
 		}
-    }
+	}
+}
+
+/*
+ * Do a GPU-based FFT on an image, but leave out the final transposition.
+ * This is very useful for the phase correlation below
+ *
+ * This function assumes the mailbox is already created.
+ *
+ * 1: horizontal fft for all 2^log2_h lines, 2^log2_w long
+ * 2: transpose the left half of the results into 2^log2_w/2 lines of the column plan
+ * 3: (vertical) fft for all lines (former columns), 2^log2_h long
+ *
+ * Real input gives a hermitian spectrum, so the right half of the horizontal
+ * FFTs is not needed.
+ *
+ * returns pass (basically, an array of complex numbers) with transposed results
+ * in pass->out
+ * return value needs to be free'd with release_pass
+ * returns NULL on error
+ */
+static gpu_pass_t *pixDFT_GPU_no_final_transpose( pix_y_t *pic, int log2_w, int log2_h )
+{
+	gpu_pass_t *rows, *cols;
+
+	rows = prepare_fft_gpu( log2_w, GPU_FFT_FWD, 1 << log2_h );
+	if( !rows )
+		return NULL;
+
+	load_fft_gpu( rows, pic, log2_w, 0, 1 << log2_h );
 
 	usleep(1); // Yield to OS
 
-	gpu_fft_execute(fft); 
+	if( submit_pass(rows) || wait_pass(rows) )
+	{
+		release_pass( rows );
+		return NULL;
+	}
 
+	cols = prepare_fft_gpu( log2_h, GPU_FFT_FWD, 1 << (log2_w-1) );
+	if( !cols )
+	{
+		release_pass( rows );
+		return NULL;
+	}
+	transpose_rect( cols->in, cols->step, rows->out, rows->step, 1 << (log2_w-1), 1 << log2_h );
+	release_pass( rows );
 
-	// In-place transposition of the result
-	in_place_transpose_square_left_half( fft->out, pic->height, fft->step );	
-	
 	usleep(1); // Yield to OS
-	// this execution will work from fft->out back to fft->in
-	// If we just transpose the left half of the matrix to the upper half
-	// it's not necessary to perform the FFT on all rows. half of the rows
-	// would be sufficient. but since gpu_fft is so fast, it's not really an issue.
-	gpu_fft_execute(fft); // call one or many times
+	if( submit_pass(cols) || wait_pass(cols) )
+	{
+		release_pass( cols );
+		return NULL;
+	}
 
-	return fft;
+	return cols;
 
 }
 
-/* 
- * Do a GPU-based FFT on a square(!) image.
+/*
+ * Do a GPU-based FFT on an image of any size. The image is padded to the next
+ * power of 2 in each direction (see fft_gpu_set_padding), each at least 256.
  *
  * returns pointer to struct GPU_FFT (basically, an array of complex numbers) with results
+ * in fft->in, one line per job. Only the left half of each line is filled, the right half
+ * follows from symmetry and is set to 0.
  * return value needs to be free'd with free_fft_gpu
  * returns NULL on error
  *
+ * The result is one batch of 2^log2_h lines in VideoCore memory, it is not
+ * chunked like the passes of the phase correlation. If the GPU memory split
+ * is too small for it, this fails (after dropping the cached passes); only
+ * the phase correlation degrades gracefully.
  */
 struct GPU_FFT *pixDFT_GPU( pix_y_t *pic )
 {
 	struct GPU_FFT *fft;
-	
+	gpu_pass_t *cols;
+	int j, ret, log2_w, log2_h;
+
 	if( !pic )
 	{
 		ERROR("nothing to do");
 		return NULL;
 	}
 
-	if( (pic->width != pic->height) ||
-		(pic->width <= 0) ||
-		(pic->width & (pic->width-1)) != 0)
+	log2_w = padded_log2( pic->width );
+	log2_h = padded_log2( pic->height );
+	if( pic->width <= 0 || pic->height <= 0 || log2_w < 0 || log2_h < 0 )
 	{
-		ERROR( "as of now, this function only works on square images with a lenght greater 0 of a power of 2. %d x %d is not correct", pic->width, pic->height );
+		ERROR( "%d x %d cannot be padded to a size gpu_fft can handle", pic->width, pic->height );
 		return (NULL);
 	}
-	
+
 	if( mb < 0 )
 	{
 		mb = mbox_open();
@@ -218,63 +561,111 @@ struct GPU_FFT *pixDFT_GPU( pix_y_t *pic )
 			return (NULL);
 		}
 	}
-	
-	fft = pixDFT_GPU_no_final_transpose( pic );
-	if( !fft )
+
+	cols = pixDFT_GPU_no_final_transpose( pic, log2_w, log2_h );
+	if( !cols )
 	{
 		ERROR("pixDFT_GPU_no_final_transpose failed");
 		return NULL;
 	}
-	
-	// Transpose back
-	in_place_transpose_square_upper_half( fft->in, pic->height, fft->step );
+
+	// Transpose back, the result has to be one batch in VideoCore memory
+	ret = gpu_fft_prepare( mb, log2_w, GPU_FFT_FWD, 1 << log2_h, &fft );
+	if( ret == -3 )
+		qpu_enable( mb, 0 );
+	if( ret == -3 && drop_passes() )
+	{
+		ret = gpu_fft_prepare( mb, log2_w, GPU_FFT_FWD, 1 << log2_h, &fft );
+		if( ret == -3 )
+			qpu_enable( mb, 0 );
+	}
+	if( ret )
+	{
+		ERROR("cannot prepare GPU FFT for the result: %d", ret);
+		release_pass( cols );
+		return NULL;
+	}
+	transpose_rect( fft->in, fft->step, cols->out, cols->step, 1 << log2_h, 1 << (log2_w-1) );
+	for( j = 0; j < 1 << log2_h; j++ )
+		memset( fft->in + j*fft->step + (1 << (log2_w-1)), 0, sizeof(struct GPU_FFT_COMPLEX) << (log2_w-1) );
+	release_pass( cols );
 
 	return fft;
 }
 
 /*
- * free GPU FFT result 
- */ 
+ * free GPU FFT result
+ */
 void free_fft_gpu( struct GPU_FFT *fft )
 {
-    gpu_fft_release(fft); // Videocore memory lost if not freed !	
+    gpu_fft_release(fft); // Videocore memory lost if not freed !
 }
 
-/* 
- * Calculate phase correlation for 2 luminance images
+/*
+ * Phase correlation of one luminance image pix1 with k images pixk, all of equal,
+ * but otherwise any size. mode says which side the reference is on:
+ *   PHASECORR_BATCH_FRAMES  pix1 is the reference, pixk the shifted images
+ *   PHASECORR_BATCH_REFS    pixk are the references, pix1 the shifted image
+ *
+ * Sequence: FFT pix1, FFT all of pixk, calculate k cross-power spectra,
+ * inverse FFT on results, identify maxima+coordinates. See below for details
  *
- * Sequence: FFT reference image pixr, FFT shifted image pixs, calculate cross-power spectrum,
- * inverse FFT on result, identify maximum+coordinates. See below for details
- * 
- * ppeak, px and py are filled
- * returns -1 on error, 0 otherwise 
+ * All images are padded to W x H, the next powers of 2 (at least 256). Rows and
+ * columns get their own GPU FFT batches, the k images share one batch per
+ * direction, image f in lines f*H (rows) and f*W/2 (columns):
+ *   rows     H (pix1), k*H (pixk) jobs of length W
+ *   columns  W/2 (pix1), k*W/2 (pixk) jobs of length H (only the left half of
+ *            the row spectra is needed)
+ *
+ * ppeak[f], px[f] and py[f] are filled for each of the k images, shifts are
+ * relative to the padded size
+ * returns -1 on error, 0 otherwise
  */
-int pixPhaseCorrelate_GPU( pix_y_t *pixr, pix_y_t *pixs, float *ppeak, int *px, int *py )
+static int phase_correlate_gpu( pix_y_t *pix1, pix_y_t **pixk, int k, int mode, float *ppeak, int *px, int *py )
 {
-    int i, j, ret, log2_N;
-    struct GPU_FFT_COMPLEX *base_r, *base_s, *base_i;
-    struct GPU_FFT *fftr, *ffts, *ffti;
+	int i, j, f, log2_w, log2_h, w, h;
+	struct GPU_FFT_COMPLEX *base_r, *base_s, *base_i;
+	gpu_pass_t *row1, *rowk, *col1, *colk, *icol, *irow;
 	float maxval;
 	int xmaxloc, ymaxloc;
+	uint64_t t_start, t;
+	long arm_us = 0, qpu_us = 0, wall_us;
+	int err = 0;
 
 
-	if( (pixr->width != pixr->height) ||
-		(pixr->width != pixs->width)  ||
-		(pixr->height!= pixs->height) ||
-		(pixr->width <= 0) ||
-		(pixr->width & (pixr->width-1)) != 0)
+	if( !pix1 || !pixk || k <= 0 || (pix1->width <= 0) || (pix1->height <= 0) )
+	{
+		ERROR( "pix1 and pixk must be of equal size greater 0" );
+		return (-1);
+	}
+	for( f = 0; f < k; f++ )
+	{
+		if( !pixk[f] ||
+			(pixk[f]->width != pix1->width) ||
+			(pixk[f]->height!= pix1->height) )
+		{
+			ERROR( "pix1 and pixk[%d] must be of equal size greater 0", f );
+			return (-1);
+		}
+	}
+
+	log2_w = padded_log2( pix1->width );
+	log2_h = padded_log2( pix1->height );
+	if( log2_w < 0 || log2_h < 0 )
 	{
-		ERROR( "as of now, this function only works on square images with a lenght greater 0 of a power of 2.\n%d x %d (pixr) and %d x %d (pixs) is not correct", 
-			   pixr->width, pixr->height, pixr->width, pixr->height );
+		ERROR( "%d x %d cannot be padded to a size gpu_fft can handle", pix1->width, pix1->height );
 		return (-1);
 	}
-	
+	w = 1 << log2_w;
+	h = 1 << log2_h;
+	perf_pixels( (uint64_t)k * pix1->width * pix1->height );
+
 	if( !ppeak || !px || !py )
 	{
 		ERROR("missing parameter: ppeak:%ld px:%ld py:%ld", ppeak, px, py );
 		return (-1);
 	}
-	
+
 	if( mb < 0 )
 	{
 		mb = mbox_open();
@@ -285,128 +676,226 @@ int pixPhaseCorrelate_GPU( pix_y_t *pixr, pix_y_t *pixs, float *ppeak, int *px,
 	}
 
 
-	// FFT pixr
-	fftr = pixDFT_GPU_no_final_transpose( pixr );
-	if( !fftr )
+	// Forward FFTs of pix1 and pixk, interleaved: while the QPUs work on
+	// one batch the ARM loads or transposes the other one.
+	// Batches are only released while nothing runs on the QPUs, releasing
+	// a batch disables them.
+	t_start = trace_begin();
+
+	row1 = get_pass( log2_w, GPU_FFT_FWD, h );
+	rowk = get_pass( log2_w, GPU_FFT_FWD, k*h );
+	col1 = get_pass( log2_h, GPU_FFT_FWD, w/2 );
+	colk = get_pass( log2_h, GPU_FFT_FWD, k*w/2 );
+	if( !row1 || !rowk || !col1 || !colk )
 	{
-		ERROR("pixDFT_GPU_no_final_transpose failed");
+		ERROR("cannot prepare GPU FFT");
+		if( row1 ) put_pass( row1 );
+		if( rowk ) put_pass( rowk );
+		if( col1 ) put_pass( col1 );
+		if( colk ) put_pass( colk );
 		return (-1);
 	}
-	// RESULT IS NOW TRANSPOSED IN fftr->in 
 
-	
-	// FFT pixs
-	ffts = pixDFT_GPU_no_final_transpose( pixs );
-	if( !ffts )
+	t = stage_begin();
+	load_fft_gpu( row1, pix1, log2_w, 0, h );
+	arm_us += stage_end( PC_STAGE_CONVERT, t );
+	err |= submit_pass( row1 );                                          // rows pix1
+
+	t = stage_begin();
+	for( f = 0; f < k; f++ )                                             // ... meanwhile load pixk
+		load_fft_gpu( rowk, pixk[f], log2_w, f*h, h );
+	arm_us += stage_end( PC_STAGE_CONVERT, t );
+	err |= wait_pass( row1 );
+	qpu_us += stage( PC_STAGE_FORWARD, row1->usecs );
+	err |= submit_pass( rowk );                                          // rows pixk
+
+	t = stage_begin();
+	transpose_rect( col1->in, col1->step, row1->out, row1->step, w/2, h );  // ... meanwhile transpose pix1
+	arm_us += stage_end( PC_STAGE_TRANSPOSE, t );
+	err |= wait_pass( rowk );
+	qpu_us += stage( PC_STAGE_FORWARD, rowk->usecs );
+	put_pass( row1 );
+	err |= submit_pass( col1 );                                          // columns pix1
+
+	t = stage_begin();
+	for( f = 0; f < k; f++ )                                             // ... meanwhile transpose pixk
+		transpose_rect( colk->in + f*(w/2)*colk->step, colk->step,
+						rowk->out + f*h*rowk->step, rowk->step, w/2, h );
+	arm_us += stage_end( PC_STAGE_TRANSPOSE, t );
+	err |= wait_pass( col1 );
+	qpu_us += stage( PC_STAGE_FORWARD, col1->usecs );
+	put_pass( rowk );
+	err |= submit_pass( colk );                                          // columns pixk
+	err |= wait_pass( colk );
+	qpu_us += stage( PC_STAGE_FORWARD, colk->usecs );
+	// RESULTS ARE NOW TRANSPOSED IN col1->out AND colk->out
+
+	// every pass was waited for, also after an error, so none runs any more
+	// and the frame can be failed (the scheduler hands it to FFTW)
+	icol = err ? NULL : get_pass( log2_h, GPU_FFT_REV, k*w/2 );
+	if( !icol )
 	{
-		ERROR("pixDFT_GPU_no_final_transpose failed");
+		put_pass( col1 );
+		put_pass( colk );
 		return (-1);
 	}
-	// RESULT IS NOW TRANSPOSED IN ffts->in 
-
-
-	log2_N = (int)round(log2(pixr->width));
-
-    ret = gpu_fft_prepare(mb, log2_N, GPU_FFT_REV, pixr->height, &ffti); // call once
-
-    switch(ret) {
-        case -1: ERROR("Unable to enable V3D. Please check your firmware is up to date."); return (-1);
-        case -2: ERROR("log2_N=%d not supported.  Try between 8 and 17.", log2_N);         return (-1);
-        case -3: ERROR("Out of memory round1.  Try a smaller batch or increase GPU memory.");  return (-1);
-        case -4: ERROR("Cannot open /dev/mem, must run as root.");  return (-1);
-    }
 
-
-	// calculate cross-power spectrum
+	t = stage_begin();
+	// calculate cross-power spectra
 	// 	o_{i,j} = sqrt((re(s_{i,j})*re(r_{i,j}) - im(s_{i,j})*-im(r__{i,j}))^2 + (re(s_{i,j})*-im(r_{i,j}) - im(s_{i,j})*re(r__{i,j}))^2)
-	// 
+	//
 	// TODO Why is the cross power spectrum in fft.c 30% faster?
-	for( j = 0; j < pixr->width/2; j++ )
+	for( j = 0; j < k*w/2; j++ )
 	{
-		base_r = fftr->in + j*fftr->step;
-		base_s = ffts->in + j*ffts->step;
-		base_i = ffti->in + j*ffti->step;
-		for( i = 0; i < pixr->height; i++,base_r++,base_s++,base_i++ )
+		if( mode == PHASECORR_BATCH_REFS )
+		{
+			base_r = colk->out + j*colk->step;
+			base_s = col1->out + (j % (w/2))*col1->step;
+		}
+		else
+		{
+			base_r = col1->out + (j % (w/2))*col1->step;
+			base_s = colk->out + j*colk->step;
+		}
+		base_i = icol->in + j*icol->step;
+		for( i = 0; i < h; i++,base_r++,base_s++,base_i++ )
 		{
 			float ac, bd, bc, ad, r;
-			
+
 			// multiply element in reference matrix and element at same position complex-conjugated shifted matrix
 			// (a+bi)(c-di) = (ac+bd) + (bc-ad)i
-			// 
+			//
 			// normalize result by division by absolute value of product of both elements (non-congugated)
 			// |(a+bi)(c+di)| = |(ac-bd) + (bc+ad)i| = sqrt( (ac-bd)^2 + (bc+ad)^2 )
 			ac = base_r->re * base_s->re;
 			bd = base_r->im * base_s->im;
 			bc = base_r->im * base_s->re;
 			ad = base_r->re * base_s->im;
-			r = sqrtf(powf(ac-bd,2) + powf(bc+ad,2)); 
+			r = sqrtf(powf(ac-bd,2) + powf(bc+ad,2));
 			base_i->re = (ac+bd)/r;
 			base_i->im = (bc-ad)/r;
 		}
 	}
-	// set the lower half to zero
-	// This might be wrong. I may need to symmetrically fill it with the results of the calculation above and do the ffts on the full matrix.
-	// But in fact it works as it is, with just half of the matrix filled. So, I leave it as it is.
-	for( j = pixr->width/2; j < pixr->width; j++ )
-		memset(ffti->in + j*ffti->step, 0, pixr->height*sizeof(struct GPU_FFT_COMPLEX));
-	
-	
-	// Free fftr, ffts
-	free_fft_gpu( fftr );
-	free_fft_gpu( ffts );
-	
-
-	// 
+	arm_us += stage_end( PC_STAGE_CROSS, t );
+
+	// Free col1, colk
+	put_pass( col1 );
+	put_pass( colk );
+
+	//
 	// p = InverseDFT_GPU( o );
-	usleep(1); // Yield to OS
+	// columns first, they are still transposed
+	err |= submit_pass(icol);
+
+	// prepare the row batch meanwhile, QPUs are not touched by that
+	t = stage_begin();
+	irow = get_pass( log2_w, GPU_FFT_REV, k*h );
+	arm_us += (trace_now() - t) / 1000;
+
+	err |= wait_pass(icol);
+	qpu_us += stage( PC_STAGE_INVERSE, icol->usecs );
+	if( !irow || err )
+	{
+		if( irow ) put_pass( irow );
+		put_pass( icol );
+		return (-1);
+	}
 
-	gpu_fft_execute(ffti); // call one or many times
 
+	// Transposition of the results into the left half of the rows, right half set
+	// to zero. This may be incorrect for INVERSE FFT, but it works for now, see below
+	t = stage_begin();
+	for( f = 0; f < k; f++ )
+		transpose_rect( irow->in + f*h*irow->step, irow->step,
+						icol->out + f*(w/2)*icol->step, icol->step, h, w/2 );
+	for( j = 0; j < k*h; j++ )
+		memset( irow->in + j*irow->step + w/2, 0, sizeof(struct GPU_FFT_COMPLEX)*w/2 );
+	arm_us += stage_end( PC_STAGE_TRANSPOSE, t );
+	put_pass( icol );
 
-	// In-place transposition of the result
-	// this may be incorrect for INVERSE FFT
-	// but it works for now, see above and below
-	in_place_transpose_square_upper_half( ffti->out, pixr->height, ffti->step );	
-	
 
-	usleep(1); // Yield to OS
-	// this execution will work from out back to in
 	// This may fail. I've set the right half of the matrix to 0 but this still may not be correct
-	// 2014-02-06 It works for now, for synthesized and real pics, so I leave it as is is. 
-	gpu_fft_execute(ffti); // call one or many times
-	// RESULT IS NOW NOT-TRANSPOSED IN ffts->in 
-	
-	// 
-	// identify peak, x, y
-	maxval = -MAXFLOAT;
-	xmaxloc = 0;
-	ymaxloc = 0;
-	for( j = 0; j < pixr->height; j++ )
-	{
-		base_i = ffti->in + j*ffti->step;
-		for( i = 0; i < pixr->width; i++,base_i++ )
+	// 2014-02-06 It works for now, for synthesized and real pics, so I leave it as is is.
+	err |= submit_pass(irow);
+	err |= wait_pass(irow);
+	qpu_us += stage( PC_STAGE_INVERSE, irow->usecs );
+	if( err )
+	{
+		put_pass( irow );
+		return (-1);
+	}
+	// RESULTS ARE NOW NOT-TRANSPOSED IN irow->out, image f in lines f*h
+
+	//
+	// identify peak, x, y per image
+	t = stage_begin();
+	for( f = 0; f < k; f++ )
+	{
+		maxval = -MAXFLOAT;
+		xmaxloc = 0;
+		ymaxloc = 0;
+		for( j = 0; j < h; j++ )
 		{
-			if( base_i->re > maxval )
+			base_i = irow->out + (f*h+j)*irow->step;
+			for( i = 0; i < w; i++,base_i++ )
 			{
-				maxval = base_i->re;
-				xmaxloc = i;
-				ymaxloc = j;
+				if( base_i->re > maxval )
+				{
+					maxval = base_i->re;
+					xmaxloc = i;
+					ymaxloc = j;
+				}
 			}
 		}
-	}
 
-	if (xmaxloc >= pixr->width / 2)
-		xmaxloc -= pixr->width;
-	if (ymaxloc >= pixr->height / 2)
-		ymaxloc -= pixr->height;
+		if (xmaxloc >= w / 2)
+			xmaxloc -= w;
+		if (ymaxloc >= h / 2)
+			ymaxloc -= h;
+
+		ppeak[f] = maxval;
+		px[f] = xmaxloc;
+		py[f] = ymaxloc;
+	}
+	arm_us += stage_end( PC_STAGE_PEAK, t );
 
-	*ppeak = maxval;
-	*px = xmaxloc;
-	*py = ymaxloc;
+	// time spent on the ARM and the QPUs, the amount by which their sum exceeds
+	// the wall clock time is what the interleaving above saved
+	wall_us = (trace_now() - t_start) / 1000;
+	DEBUG( "phase correlation 1:%d %dx%d %ld us: arm %ld us, qpu %ld us, overlapped %ld us",
+		   k, w, h, wall_us, arm_us, qpu_us, arm_us + qpu_us > wall_us ? arm_us + qpu_us - wall_us : 0 );
 
-	// 
+	//
 	// clean up
-	free_fft_gpu( ffti );
-	
+	put_pass( irow );
+
 	return (0);
 }
+
+/*
+ * Calculate phase correlation for 2 luminance images of equal, but otherwise any size
+ *
+ * pixr is the reference image, pixs the shifted one
+ * ppeak, px and py are filled, shifts are relative to the padded size
+ * returns -1 on error, 0 otherwise
+ */
+int pixPhaseCorrelate_GPU( pix_y_t *pixr, pix_y_t *pixs, float *ppeak, int *px, int *py )
+{
+	return phase_correlate_gpu( pixr, &pixs, 1, PHASECORR_BATCH_FRAMES, ppeak, px, py );
+}
+
+/*
+ * Batched phase correlation: k frames pixk against the reference pix1
+ * (mode PHASECORR_BATCH_FRAMES), or the frame pix1 against k references pixk
+ * (mode PHASECORR_BATCH_REFS). All images of equal size.
+ *
+ * The FFT of pix1 is done once, those of pixk share GPU FFT batches, so the
+ * set-up cost per batch is paid once for all k images.
+ *
+ * ppeak, px and py are arrays of k results, in the order of pixk
+ * returns -1 on error, 0 otherwise
+ */
+int pixPhaseCorrelateBatch_GPU( pix_y_t *pix1, pix_y_t **pixk, int k, int mode, float *ppeak, int *px, int *py )
+{
+	return phase_correlate_gpu( pix1, pixk, k, mode, ppeak, px, py );
+}
@@ -4,8 +4,17 @@
 #include "gpu_fft/mailbox.h"
 #include "gpu_fft/gpu_fft.h"
 
+// padding of images to the next power of 2
+#define FFT_GPU_PAD_ZERO   0
+#define FFT_GPU_PAD_MIRROR 1
+
+void fft_gpu_set_padding( int mode );
+void fft_gpu_set_times( pc_times_t *t );
+void fft_gpu_release( void );
+
 struct GPU_FFT *pixDFT_GPU( pix_y_t *pic );
 int pixPhaseCorrelate_GPU( pix_y_t *pixr, pix_y_t *pixs, float *ppeak, int *px, int *py );
+int pixPhaseCorrelateBatch_GPU( pix_y_t *pix1, pix_y_t **pixk, int k, int mode, float *ppeak, int *px, int *py );
 
 void free_fft_gpu( struct GPU_FFT *fft_frame1_gpu );
 
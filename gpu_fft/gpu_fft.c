@@ -27,6 +27,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/mman.h>
 
 #include "gpu_fft.h"
@@ -35,8 +37,18 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define GPU_FFT_MEM_FLG 0xC // cached=0xC; direct=0x4
 #define GPU_FFT_MEM_MAP 0x0 // cached=0x0; direct=0x20000000
 
+#define GPU_FFT_QUEUE 16 // max. batches waiting for the QPUs
+
 typedef struct GPU_FFT_COMPLEX COMPLEX;
 
+// Asynchronous submission: execute_qpu() blocks in the mailbox ioctl, so a
+// single worker thread makes that call while the ARM carries on.  The QPUs
+// run one batch at a time anyway, so one worker and a FIFO are enough.
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  queue_cond = PTHREAD_COND_INITIALIZER;
+static struct GPU_FFT *queue[GPU_FFT_QUEUE];
+static int queue_head, queue_len, worker_running;
+
 struct GPU_FFT_PTR {
     unsigned vc;
     union { COMPLEX  *cptr;
@@ -142,6 +154,7 @@ int gpu_fft_prepare(
     info->size    = size;
     info->noflush = 1;
     info->timeout = 1000; // ms
+    info->pending = info->result = info->usecs = 0;
 
     *fft = info;
     return 0;
@@ -151,9 +164,68 @@ unsigned gpu_fft_execute(struct GPU_FFT *info) {
     return execute_qpu(info->mb, GPU_FFT_QPUS, info->vc_msg, info->noflush, info->timeout);
 }
 
+static void *worker(void *arg) {
+    struct GPU_FFT *info;
+    struct timespec t[2];
+    unsigned result;
+
+    pthread_mutex_lock(&queue_lock);
+    for (;;) {
+        while (!queue_len) pthread_cond_wait(&queue_cond, &queue_lock);
+        info = queue[queue_head];
+        queue_head = (queue_head+1) % GPU_FFT_QUEUE;
+        queue_len--;
+        pthread_mutex_unlock(&queue_lock);
+
+        clock_gettime(CLOCK_MONOTONIC, t+0);
+        result = gpu_fft_execute(info);
+        clock_gettime(CLOCK_MONOTONIC, t+1);
+
+        pthread_mutex_lock(&queue_lock);
+        info->result = result;
+        info->usecs = (t[1].tv_sec-t[0].tv_sec)*1000000 + (t[1].tv_nsec-t[0].tv_nsec)/1000;
+        info->pending = 0;
+        pthread_cond_broadcast(&queue_cond);
+    }
+    return NULL;
+}
+
+int gpu_fft_submit(struct GPU_FFT *info) {
+    pthread_t thread;
+    int ret = -1;
+
+    pthread_mutex_lock(&queue_lock);
+    if (!worker_running) {
+        if (pthread_create(&thread, NULL, worker, NULL)) goto out;
+        pthread_detach(thread);
+        worker_running = 1;
+    }
+    if (info->pending || queue_len == GPU_FFT_QUEUE) goto out;
+
+    info->pending = 1;
+    queue[(queue_head+queue_len) % GPU_FFT_QUEUE] = info;
+    queue_len++;
+    pthread_cond_broadcast(&queue_cond);
+    ret = 0;
+out:
+    pthread_mutex_unlock(&queue_lock);
+    return ret;
+}
+
+unsigned gpu_fft_wait(struct GPU_FFT *info) {
+    unsigned result;
+
+    pthread_mutex_lock(&queue_lock);
+    while (info->pending) pthread_cond_wait(&queue_cond, &queue_lock);
+    result = info->result;
+    pthread_mutex_unlock(&queue_lock);
+    return result;
+}
+
 void gpu_fft_release(struct GPU_FFT *info) {
     int mb = info->mb;
     unsigned handle = info->handle;
+    gpu_fft_wait(info); // never unmap under a running batch
     unmapmem(info->in, info->size);
     mem_unlock(mb, handle);
     mem_free(mb, handle);
@@ -42,6 +42,7 @@ struct GPU_FFT {
     struct GPU_FFT_COMPLEX *in, *out;
     int mb, step;
     unsigned timeout, noflush, handle, size, vc_msg;
+    unsigned pending, result, usecs; // gpu_fft_submit() state, usecs = last QPU run
 };
 
 int gpu_fft_prepare(
@@ -54,6 +55,12 @@ int gpu_fft_prepare(
 unsigned gpu_fft_execute(
     struct GPU_FFT *info);
 
+int gpu_fft_submit(         // queue batch for the QPUs and return at once
+    struct GPU_FFT *info);  // 0 = queued, -1 = already pending or queue full
+
+unsigned gpu_fft_wait(      // block until a submitted batch has finished,
+    struct GPU_FFT *info);  // returns what gpu_fft_execute() would have
+
 void gpu_fft_release(
     struct GPU_FFT *info);
 
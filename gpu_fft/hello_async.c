@@ -0,0 +1,172 @@
+/*
+ * 2D FFT of two N x N images, once strictly serial with gpu_fft_execute()
+ * and once pipelined with gpu_fft_submit()/gpu_fft_wait(), so the ARM
+ * fills and transposes one image while the QPUs work on the other.
+ *
+ * Prints a timing breakdown per variant: wall clock, time the QPUs were
+ * busy, time the ARM was busy and how much of both overlapped.
+ * Runs off-device when the library is built with STANDIN=1.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+
+#include "mailbox.h"
+#include "gpu_fft.h"
+
+char Usage[] =
+    "Usage: hello_async.bin log2_N [loops]\n"
+    "log2_N = log2(image side),       log2_N = 8...11\n"
+    "loops  = number of test repeats, loops>0,       default 1\n";
+
+unsigned Microseconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+struct TIMES {
+    unsigned wall, qpu, arm;
+};
+
+// test pattern, different per image
+void fill(struct GPU_FFT *fft, int N, int img) {
+    struct GPU_FFT_COMPLEX *base;
+    int i, j;
+
+    for (j=0; j<N; j++) {
+        base = fft->in + j*fft->step;
+        for (i=0; i<N; i++) {
+            base[i].re = ((i*7 + j*13 + img*31) & 0xff) / 255.0;
+            base[i].im = 0;
+        }
+    }
+}
+
+// transpose the result of a pass back into the input for the next pass
+void transpose(struct GPU_FFT *fft, int N) {
+    struct GPU_FFT_COMPLEX t, *a, *b;
+    int i, j;
+
+    for (j=0; j<N; j++)
+        for (i=(fft->in==fft->out? j+1 : 0); i<N; i++) {
+            a = fft->out + j*fft->step + i;
+            b = fft->in  + i*fft->step + j;
+            t = *b; *b = *a; *a = t;
+        }
+}
+
+unsigned arm(void (*f)(struct GPU_FFT *, int, int), struct GPU_FFT *fft, int N, int img) {
+    unsigned t = Microseconds();
+    f(fft, N, img);
+    return Microseconds() - t;
+}
+
+void transpose_img(struct GPU_FFT *fft, int N, int img) {
+    transpose(fft, N);
+}
+
+void serial(struct GPU_FFT **fft, int N, struct TIMES *t) {
+    unsigned t0 = Microseconds(), t1;
+    int k, pass;
+
+    t->qpu = t->arm = 0;
+    for (k=0; k<2; k++) {
+        t->arm += arm(fill, fft[k], N, k);
+        for (pass=0; pass<2; pass++) {
+            t1 = Microseconds();
+            gpu_fft_execute(fft[k]);
+            t->qpu += Microseconds() - t1;
+            t->arm += arm(transpose_img, fft[k], N, k);
+        }
+    }
+    t->wall = Microseconds() - t0;
+}
+
+void pipelined(struct GPU_FFT **fft, int N, struct TIMES *t) {
+    unsigned t0 = Microseconds();
+
+    t->qpu = t->arm = 0;
+    t->arm += arm(fill, fft[0], N, 0);
+    gpu_fft_submit(fft[0]);                     // rows A
+    t->arm += arm(fill, fft[1], N, 1);          // ... while filling B
+    gpu_fft_wait(fft[0]);   t->qpu += fft[0]->usecs;
+    gpu_fft_submit(fft[1]);                     // rows B
+    t->arm += arm(transpose_img, fft[0], N, 0); // ... while transposing A
+    gpu_fft_wait(fft[1]);   t->qpu += fft[1]->usecs;
+    gpu_fft_submit(fft[0]);                     // columns A
+    t->arm += arm(transpose_img, fft[1], N, 1); // ... while transposing B
+    gpu_fft_wait(fft[0]);   t->qpu += fft[0]->usecs;
+    gpu_fft_submit(fft[1]);                     // columns B
+    t->arm += arm(transpose_img, fft[0], N, 0); // ... while transposing A back
+    gpu_fft_wait(fft[1]);   t->qpu += fft[1]->usecs;
+    t->arm += arm(transpose_img, fft[1], N, 1);
+    t->wall = Microseconds() - t0;
+}
+
+void report(const char *name, struct TIMES *t) {
+    int overlap = (int)(t->qpu + t->arm) - (int)t->wall;
+    printf("%-9s wall = %7u us, qpu = %7u us, arm = %7u us, overlap = %7d us\n",
+        name, t->wall, t->qpu, t->arm, overlap>0? overlap : 0);
+}
+
+int main(int argc, char *argv[]) {
+    int i, j, k, ret, loops, log2_N, N, mb = mbox_open();
+    struct GPU_FFT *fft[2];
+    struct GPU_FFT_COMPLEX *ref, *base;
+    struct TIMES t;
+    double err;
+
+    log2_N = argc>1? atoi(argv[1]) : 10;
+    loops  = argc>2? atoi(argv[2]) : 1;
+
+    if (argc<2 || log2_N<8 || log2_N>11 || loops<1) {
+        printf(Usage);
+        return -1;
+    }
+
+    N = 1<<log2_N;
+    for (k=0; k<2; k++) {
+        ret = gpu_fft_prepare(mb, log2_N, GPU_FFT_FWD, N, fft+k);
+
+        switch(ret) {
+            case -1: printf("Unable to enable V3D. Please check your firmware is up to date.\n"); return -1;
+            case -2: printf("log2_N=%d not supported.  Try between 8 and 11.\n", log2_N);         return -1;
+            case -3: printf("Out of memory.  Try a smaller image or increase GPU memory.\n");     return -1;
+            case -4: printf("Cannot open /dev/mem, must run as root.\n");                          return -1;
+        }
+    }
+
+    ref = malloc(sizeof(*ref)*N*N);
+    if (!ref) {
+        printf("Out of memory.\n");
+        return -1;
+    }
+
+    for (k=0; k<loops; k++) {
+        serial(fft, N, &t);
+        report("serial", &t);
+        for (j=0; j<N; j++)
+            for (i=0; i<N; i++)
+                ref[j*N+i] = fft[1]->in[j*fft[1]->step+i];
+
+        pipelined(fft, N, &t);
+        report("pipelined", &t);
+
+        err = 0;
+        for (j=0; j<N; j++) {
+            base = fft[1]->in + j*fft[1]->step;
+            for (i=0; i<N; i++)
+                err = fmax(err, fabs(base[i].re-ref[j*N+i].re) + fabs(base[i].im-ref[j*N+i].im));
+        }
+        printf("max_abs_diff = %0.2g, k = %d\n", err, k);
+    }
+
+    free(ref);
+    gpu_fft_release(fft[0]); // Videocore memory lost if not freed !
+    gpu_fft_release(fft[1]);
+    return 0;
+}
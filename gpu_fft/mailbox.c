@@ -174,6 +174,26 @@ unsigned mem_unlock(int file_desc, unsigned handle)
    return p[5];
 }
 
+unsigned get_vc_memory(int file_desc)
+{
+   int i=0;
+   unsigned p[32];
+   p[i++] = 0; // size
+   p[i++] = 0x00000000; // process request
+
+   p[i++] = 0x00010006; // (the tag id)
+   p[i++] = 8; // (size of the buffer)
+   p[i++] = 0; // (size of the data)
+   p[i++] = 0; // base address
+   p[i++] = 0; // size in bytes
+
+   p[i++] = 0x00000000; // end tag
+   p[0] = i*sizeof *p; // actual size
+
+   mbox_property(file_desc, p);
+   return p[6];
+}
+
 unsigned execute_code(int file_desc, unsigned code, unsigned r0, unsigned r1, unsigned r2, unsigned r3, unsigned r4, unsigned r5)
 {
    int i=0;
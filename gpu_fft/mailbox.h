@@ -38,6 +38,7 @@ int mbox_open();
 void mbox_close(int file_desc);
 
 unsigned get_version(int file_desc);
+unsigned get_vc_memory(int file_desc); // size of the GPU memory split in bytes
 unsigned mem_alloc(int file_desc, unsigned size, unsigned align, unsigned flags);
 unsigned mem_free(int file_desc, unsigned handle);
 unsigned mem_lock(int file_desc, unsigned handle);
@@ -0,0 +1,261 @@
+/*
+ * Off-device stand-in for mailbox.c
+ *
+ * Implements the mailbox.h interface in process memory so gpu_fft and
+ * everything built on top of it can run (and be timed) on a machine without
+ * VideoCore.  Build with "make STANDIN=1".
+ *
+ * - mem_alloc() hands out malloc'ed blocks, the "bus address" of block n is
+ *   n<<28, mapmem() translates it back
+ * - the environment variable GPU_FFT_STANDIN_MEM sets the size of the GPU
+ *   memory split in MB (default 1024); mem_alloc() fails like the firmware
+ *   when the blocks in use would exceed it
+ * - GPU_FFT_STANDIN_TIMEOUT=n lets every n-th execute_qpu() time out, to
+ *   exercise the error paths and the failover to FFTW
+ * - execute_qpu() decodes the message gpu_fft_prepare() wrote (uniforms,
+ *   shader code, twiddles) and does the batch of FFTs on the ARM, leaving
+ *   the results in the same buffer the QPU shader would.  Calls are
+ *   serialized like the real QPUs.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "mailbox.h"
+#include "gpu_fft.h"
+
+#define STANDIN_BLOCKS 16          // handles 1..15, bus address = handle<<28
+#define STANDIN_BLOCK_SHIFT 28
+#define STANDIN_FD 0x6d62          // anything >= 0
+#define STANDIN_DEFAULT_MB 1024
+
+static struct {
+   void *mem;
+   unsigned size;
+} blocks[STANDIN_BLOCKS];
+
+static unsigned mem_used;
+static unsigned executed;
+static pthread_mutex_t qpu_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned mem_limit(void)
+{
+   char *env = getenv("GPU_FFT_STANDIN_MEM");
+   unsigned mb = env ? strtoul(env, NULL, 0) : STANDIN_DEFAULT_MB;
+
+   if (mb == 0 || mb > 4095)
+      mb = STANDIN_DEFAULT_MB;
+   return mb << 20;
+}
+
+static void *bus_to_arm(unsigned bus)
+{
+   unsigned handle = bus >> STANDIN_BLOCK_SHIFT;
+
+   if (handle == 0 || handle >= STANDIN_BLOCKS || !blocks[handle].mem)
+      return NULL;
+   return (char *)blocks[handle].mem + (bus & ((1u<<STANDIN_BLOCK_SHIFT)-1));
+}
+
+void *mapmem(unsigned base, unsigned size)
+{
+   void *mem = bus_to_arm(base);
+
+   if (!mem) {
+      printf("stand-in: no block at bus address 0x%08x\n", base);
+      return MAP_FAILED;
+   }
+   return mem;
+}
+
+void unmapmem(void *addr, unsigned size)
+{
+}
+
+unsigned mem_alloc(int file_desc, unsigned size, unsigned align, unsigned flags)
+{
+   unsigned handle;
+
+   if (size == 0 || size > (1u<<STANDIN_BLOCK_SHIFT) || mem_used + size > mem_limit())
+      return 0;
+
+   for (handle = 1; handle < STANDIN_BLOCKS; handle++)
+      if (!blocks[handle].mem)
+         break;
+   if (handle == STANDIN_BLOCKS)
+      return 0;
+
+   if (posix_memalign(&blocks[handle].mem, align < 64 ? 64 : align, size))
+      return 0;
+   memset(blocks[handle].mem, 0, size);
+   blocks[handle].size = size;
+   mem_used += size;
+   return handle;
+}
+
+unsigned mem_free(int file_desc, unsigned handle)
+{
+   if (handle == 0 || handle >= STANDIN_BLOCKS || !blocks[handle].mem)
+      return -1;
+
+   free(blocks[handle].mem);
+   mem_used -= blocks[handle].size;
+   blocks[handle].mem = NULL;
+   blocks[handle].size = 0;
+   return 0;
+}
+
+unsigned mem_lock(int file_desc, unsigned handle)
+{
+   return handle << STANDIN_BLOCK_SHIFT;
+}
+
+unsigned mem_unlock(int file_desc, unsigned handle)
+{
+   return 0;
+}
+
+unsigned get_version(int file_desc)
+{
+   return 0;
+}
+
+unsigned get_vc_memory(int file_desc)
+{
+   return mem_limit();
+}
+
+unsigned execute_code(int file_desc, unsigned code, unsigned r0, unsigned r1, unsigned r2, unsigned r3, unsigned r4, unsigned r5)
+{
+   return 0;
+}
+
+unsigned qpu_enable(int file_desc, unsigned enable)
+{
+   return 0;
+}
+
+/*
+ * In-place radix-2 FFT of length 1<<log2_N, sign -1 forward, +1 inverse.
+ * Unnormalized, like the shaders.
+ */
+static void standin_fft(struct GPU_FFT_COMPLEX *x, int log2_N, int sign)
+{
+   int n = 1 << log2_N, i, j, k, len;
+   struct GPU_FFT_COMPLEX t;
+
+   for (i = 1, j = 0; i < n; i++) {
+      int bit = n >> 1;
+      for (; j & bit; bit >>= 1)
+         j ^= bit;
+      j ^= bit;
+      if (i < j) {
+         t = x[i]; x[i] = x[j]; x[j] = t;
+      }
+   }
+
+   for (len = 2; len <= n; len <<= 1) {
+      double a = sign * 2 * GPU_FFT_PI / len;
+      float wr = cos(a), wi = sin(a);
+      for (i = 0; i < n; i += len) {
+         float cr = 1, ci = 0, tmp;
+         for (k = 0; k < len/2; k++) {
+            struct GPU_FFT_COMPLEX *u = x + i + k, *v = x + i + k + len/2;
+            float vr = v->re*cr - v->im*ci;
+            float vi = v->re*ci + v->im*cr;
+            v->re = u->re - vr; v->im = u->im - vi;
+            u->re += vr;        u->im += vi;
+            tmp = cr*wr - ci*wi;
+            ci  = cr*wi + ci*wr;
+            cr  = tmp;
+         }
+      }
+   }
+}
+
+// forward twiddles by log2_N, made on first use and kept, under qpu_lock
+static float *fwd_twiddles[18];
+
+/*
+ * Identify the transform from what gpu_fft_prepare() put into VC memory:
+ * log2_N from the shader code, direction from the twiddles.
+ */
+static int standin_identify(unsigned *code, float *twiddles, int *log2_N, int *direction, int *passes)
+{
+   int n, shared, unique;
+   unsigned bytes;
+
+   for (n = 8; n <= 17; n++)
+      if (!memcmp(code, gpu_fft_shader_code(n), gpu_fft_shader_size(n)))
+         break;
+   if (n > 17 || gpu_fft_twiddle_size(n, &shared, &unique, passes))
+      return -1;
+
+   bytes = sizeof(struct GPU_FFT_COMPLEX)*16*(shared+GPU_FFT_QPUS*unique);
+   if (!fwd_twiddles[n]) {
+      fwd_twiddles[n] = malloc(bytes);
+      if (!fwd_twiddles[n])
+         return -1;
+      gpu_fft_twiddle_data(n, GPU_FFT_FWD, fwd_twiddles[n]);
+   }
+   *direction = memcmp(fwd_twiddles[n], twiddles, bytes) ? GPU_FFT_REV : GPU_FFT_FWD;
+
+   *log2_N = n;
+   return 0;
+}
+
+unsigned execute_qpu(int file_desc, unsigned num_qpus, unsigned control, unsigned noflush, unsigned timeout)
+{
+   unsigned *msg, *unif, *code;
+   int log2_N, direction, passes, job;
+   char *env;
+
+   msg = bus_to_arm(control);
+   if (!msg)
+      return -1;
+   unif = bus_to_arm(msg[0]);   // QPU 0 carries the same job list as the others
+   code = bus_to_arm(msg[1]);
+   if (!unif || !code)
+      return -1;
+
+   pthread_mutex_lock(&qpu_lock);
+   env = getenv("GPU_FFT_STANDIN_TIMEOUT");
+   if (env && atoi(env) > 0 && ++executed % atoi(env) == 0) {
+      pthread_mutex_unlock(&qpu_lock);
+      return -1;
+   }
+   if (standin_identify(code, bus_to_arm(unif[0]), &log2_N, &direction, &passes)) {
+      pthread_mutex_unlock(&qpu_lock);
+      printf("stand-in: unknown shader\n");
+      return -1;
+   }
+
+   // uniforms: twiddles, unique twiddles, qpu, {in, out} per job, 0, irq
+   for (job = 0; unif[3+2*job]; job++) {
+      struct GPU_FFT_COMPLEX *in  = bus_to_arm(unif[3+2*job]);
+      struct GPU_FFT_COMPLEX *out = bus_to_arm(unif[4+2*job]);
+
+      // even number of passes ends in the input buffer, odd in the output
+      if (passes & 1)
+         memcpy(out, in, sizeof(struct GPU_FFT_COMPLEX) << log2_N);
+      else
+         out = in;
+      standin_fft(out, log2_N, direction == GPU_FFT_FWD ? -1 : 1);
+   }
+   pthread_mutex_unlock(&qpu_lock);
+
+   return 0;
+}
+
+int mbox_open()
+{
+   return STANDIN_FD;
+}
+
+void mbox_close(int file_desc)
+{
+}
@@ -0,0 +1,292 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "image.h"
+
+/*
+ * Alignment of data and of every line stride bytes apart, up to PIX_ALIGN,
+ * 1 if the pixels step
+ */
+static uint32_t align_of( const void *data, size_t stride, uint32_t step )
+{
+	uintptr_t a = (uintptr_t)data | stride | PIX_ALIGN;
+
+	if( step != 1 )
+		return 1;
+	return a & -a;
+}
+
+/*
+ * Describe w x h pixels at data, lines stride bytes apart, not owned
+ */
+void pixInit( pix_y_t *pix, uint8_t *data, uint32_t w, uint32_t h, uint32_t stride )
+{
+	pix->width = w;
+	pix->height = h;
+	pix->stride = stride;
+	pix->step = 1;
+	pix->owner = 0;
+	pix->data = data;
+	pix->align = align_of( data, stride, 1 );
+}
+
+/*
+ * As pixInit, lines stride floats apart
+ */
+void fpixInit( fpix_y_t *fpix, float *data, uint32_t w, uint32_t h, uint32_t stride )
+{
+	fpix->width = w;
+	fpix->height = h;
+	fpix->stride = stride;
+	fpix->step = 1;
+	fpix->owner = 0;
+	fpix->data = data;
+	fpix->align = align_of( data, sizeof(float) * stride, 1 );
+}
+
+/*
+ * create 8-bit luminance image dimensions w x h, lines padded to 16 bytes
+ * for SIMD, data PIX_ALIGN aligned
+ */
+pix_y_t *pixCreate( uint32_t w, uint32_t h )
+{
+	pix_y_t *pix;
+	void *data;
+	uint32_t stride = (w + 15) & ~15;
+
+	pix = calloc(sizeof(pix_y_t), 1 );
+	if( pix == NULL )
+	{
+		ERROR("out of memory");
+		return NULL;
+	}
+	if( posix_memalign( &data, PIX_ALIGN, (size_t)stride * h ) )
+	{
+		free(pix);
+		ERROR("out of memory");
+		return NULL;
+	}
+	memset( data, 0, (size_t)stride * h );
+	pixInit( pix, data, w, h, stride );
+	pix->owner = 1;
+	return pix;
+}
+
+/*
+ * create float luminance image dimensions w x h, lines not padded (FFTW
+ * takes it as it is), data PIX_ALIGN aligned
+ */
+fpix_y_t *fpixCreate( uint32_t w, uint32_t h )
+{
+	fpix_y_t *fpix;
+	void *data;
+
+	fpix = calloc(sizeof(fpix_y_t), 1 );
+	if( fpix == NULL )
+	{
+		ERROR("out of memory");
+		return NULL;
+	}
+	if( posix_memalign( &data, PIX_ALIGN, sizeof(float) * w * h ) )
+	{
+		free(fpix);
+		ERROR("out of memory");
+		return NULL;
+	}
+	memset( data, 0, sizeof(float) * w * h );
+	fpixInit( fpix, data, w, h, w );
+	fpix->owner = 1;
+	return fpix;
+}
+
+/*
+ * destroy 8-bit luminance image, its data if it owns it
+ */
+void pixDestroy( pix_y_t *pix )
+{
+	if( !pix )
+		return;
+	if( pix->owner )
+		free( pix->data );
+	free( pix );
+}
+
+/*
+ * destroy float luminance image, its data if it owns it
+ */
+void fpixDestroy( fpix_y_t *fpix )
+{
+	if( !fpix )
+		return;
+	if( fpix->owner )
+		free( fpix->data );
+	free( fpix );
+}
+
+/*
+ * View of the w x h region of pix at x, y. view may be pix
+ * returns -1 if the region is not inside pix
+ */
+int pixView( pix_y_t *view, const pix_y_t *pix, uint32_t x, uint32_t y, uint32_t w, uint32_t h )
+{
+	pix_y_t v = *pix;
+
+	if( !w || !h || x > pix->width - w || y > pix->height - h || w > pix->width || h > pix->height )
+	{
+		ERROR( "%u x %u at %u, %u is not inside %u x %u", w, h, x, y, pix->width, pix->height );
+		return (-1);
+	}
+	v.width = w;
+	v.height = h;
+	v.data = pixAt( pix, x, y );
+	v.owner = 0;
+	v.align = align_of( v.data, v.stride, v.step );
+	*view = v;
+	return (0);
+}
+
+/*
+ * View of pix without left and right columns and top and bottom lines
+ * returns -1 if nothing is left
+ */
+int pixCrop( pix_y_t *view, const pix_y_t *pix, uint32_t left, uint32_t top, uint32_t right, uint32_t bottom )
+{
+	if( left >= pix->width || right >= pix->width - left || top >= pix->height || bottom >= pix->height - top )
+	{
+		ERROR( "cannot crop %u, %u, %u, %u off %u x %u", left, top, right, bottom, pix->width, pix->height );
+		return (-1);
+	}
+	return pixView( view, pix, left, top, pix->width - left - right, pix->height - top - bottom );
+}
+
+/*
+ * View of every factor-th pixel of every factor-th line of pix, from the first
+ * returns -1 if that leaves nothing
+ */
+int pixSubsample( pix_y_t *view, const pix_y_t *pix, uint32_t factor )
+{
+	pix_y_t v = *pix;
+
+	if( !factor || pix->width < factor || pix->height < factor )
+	{
+		ERROR( "cannot subsample %u x %u by %u", pix->width, pix->height, factor );
+		return (-1);
+	}
+	v.width = pix->width / factor;
+	v.height = pix->height / factor;
+	v.stride = pix->stride * factor;
+	v.step = pix->step * factor;
+	v.owner = 0;
+	v.align = align_of( v.data, v.stride, v.step );
+	*view = v;
+	return (0);
+}
+
+/*
+ * As pixView, of a float image
+ */
+int fpixView( fpix_y_t *view, const fpix_y_t *fpix, uint32_t x, uint32_t y, uint32_t w, uint32_t h )
+{
+	fpix_y_t v = *fpix;
+
+	if( !w || !h || x > fpix->width - w || y > fpix->height - h || w > fpix->width || h > fpix->height )
+	{
+		ERROR( "%u x %u at %u, %u is not inside %u x %u", w, h, x, y, fpix->width, fpix->height );
+		return (-1);
+	}
+	v.width = w;
+	v.height = h;
+	v.data = fpixAt( fpix, x, y );
+	v.owner = 0;
+	v.align = align_of( v.data, sizeof(float) * v.stride, v.step );
+	*view = v;
+	return (0);
+}
+
+/*
+ * As pixCrop, of a float image
+ */
+int fpixCrop( fpix_y_t *view, const fpix_y_t *fpix, uint32_t left, uint32_t top, uint32_t right, uint32_t bottom )
+{
+	if( left >= fpix->width || right >= fpix->width - left || top >= fpix->height || bottom >= fpix->height - top )
+	{
+		ERROR( "cannot crop %u, %u, %u, %u off %u x %u", left, top, right, bottom, fpix->width, fpix->height );
+		return (-1);
+	}
+	return fpixView( view, fpix, left, top, fpix->width - left - right, fpix->height - top - bottom );
+}
+
+/*
+ * As pixSubsample, of a float image
+ */
+int fpixSubsample( fpix_y_t *view, const fpix_y_t *fpix, uint32_t factor )
+{
+	fpix_y_t v = *fpix;
+
+	if( !factor || fpix->width < factor || fpix->height < factor )
+	{
+		ERROR( "cannot subsample %u x %u by %u", fpix->width, fpix->height, factor );
+		return (-1);
+	}
+	v.width = fpix->width / factor;
+	v.height = fpix->height / factor;
+	v.stride = fpix->stride * factor;
+	v.step = fpix->step * factor;
+	v.owner = 0;
+	v.align = align_of( v.data, sizeof(float) * v.stride, v.step );
+	*view = v;
+	return (0);
+}
+
+/*
+ * Copy the pixels of src into dst of the same size, either may be a view
+ * returns -1 if the sizes differ
+ */
+int pixCopy( pix_y_t *dst, const pix_y_t *src )
+{
+	uint32_t i, j;
+	uint8_t *d;
+	const uint8_t *s;
+
+	if( dst->width != src->width || dst->height != src->height )
+	{
+		ERROR( "cannot copy %u x %u to %u x %u", src->width, src->height, dst->width, dst->height );
+		return (-1);
+	}
+	for( j = 0; j < src->height; j++ )
+	{
+		d = pixAt( dst, 0, j );
+		s = pixAt( src, 0, j );
+		if( src->step == 1 && dst->step == 1 )
+			memcpy( d, s, src->width );
+		else
+			for( i = 0; i < src->width; i++ )
+				d[i * dst->step] = s[i * src->step];
+	}
+	return (0);
+}
+
+/*
+ * The pixels of fpix into dst, width * height floats in a row
+ */
+void fpixPack( float *dst, const fpix_y_t *fpix )
+{
+	uint32_t i, j;
+	const float *s;
+
+	if( fpixIsContiguous( fpix ) )
+	{
+		memcpy( dst, fpix->data, sizeof(float) * fpix->width * fpix->height );
+		return;
+	}
+	for( j = 0; j < fpix->height; j++, dst += fpix->width )
+	{
+		s = fpixAt( fpix, 0, j );
+		if( fpix->step == 1 )
+			memcpy( dst, s, sizeof(float) * fpix->width );
+		else
+			for( i = 0; i < fpix->width; i++ )
+				dst[i] = s[i * fpix->step];
+	}
+}
@@ -0,0 +1,59 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "mmalyuv.h"
+
+/*
+ * Luminance images (pix_y_t, fpix_y_t in mmalyuv.h) and views of them.
+ *
+ * pixInit() and fpixInit() describe memory the caller has, the padded
+ * lines of a camera buffer for instance, pixCreate() and fpixCreate()
+ * allocate it, PIX_ALIGN aligned, and own it. A view is a region (pixView,
+ * or pixCrop by the margins left out) or every factor-th pixel and line
+ * (pixSubsample) of another image: it has the parent's data at an offset,
+ * its stride and a step, and is filled in by the caller, so making one
+ * allocates nothing and copies nothing. Views never own their data and
+ * must not outlive the parent. align tells what data and every line are
+ * aligned to, 1 for views that step.
+ */
+
+#define PIX_ALIGN 64   // of created images, a cache line as ARENA_ALIGN
+
+// pixel x of line y
+static inline uint8_t *pixAt( const pix_y_t *pix, uint32_t x, uint32_t y )
+{
+	return pix->data + (size_t)y * pix->stride + (size_t)x * pix->step;
+}
+
+static inline float *fpixAt( const fpix_y_t *fpix, uint32_t x, uint32_t y )
+{
+	return fpix->data + (size_t)y * fpix->stride + (size_t)x * fpix->step;
+}
+
+// 1 if the pixels are width * height values in a row, as FFTW takes them
+static inline int fpixIsContiguous( const fpix_y_t *fpix )
+{
+	return fpix->step == 1 && (fpix->stride == fpix->width || fpix->height == 1);
+}
+
+void pixInit( pix_y_t *pix, uint8_t *data, uint32_t w, uint32_t h, uint32_t stride );
+void fpixInit( fpix_y_t *fpix, float *data, uint32_t w, uint32_t h, uint32_t stride );
+
+pix_y_t *pixCreate( uint32_t w, uint32_t h );
+fpix_y_t *fpixCreate( uint32_t w, uint32_t h );
+void pixDestroy( pix_y_t *pix );
+void fpixDestroy( fpix_y_t *fpix );
+
+int pixView( pix_y_t *view, const pix_y_t *pix, uint32_t x, uint32_t y, uint32_t w, uint32_t h );
+int pixCrop( pix_y_t *view, const pix_y_t *pix, uint32_t left, uint32_t top, uint32_t right, uint32_t bottom );
+int pixSubsample( pix_y_t *view, const pix_y_t *pix, uint32_t factor );
+int fpixView( fpix_y_t *view, const fpix_y_t *fpix, uint32_t x, uint32_t y, uint32_t w, uint32_t h );
+int fpixCrop( fpix_y_t *view, const fpix_y_t *fpix, uint32_t left, uint32_t top, uint32_t right, uint32_t bottom );
+int fpixSubsample( fpix_y_t *view, const fpix_y_t *fpix, uint32_t factor );
+
+int pixCopy( pix_y_t *dst, const pix_y_t *src );
+void fpixPack( float *dst, const fpix_y_t *fpix );
+
+#endif /* IMAGE_H */
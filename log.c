@@ -33,6 +33,10 @@
 #define FG_CYAN   (36)
 #define FG_GREY   (37)
 
+/* Lines up to this long are formatted on the stack, longer ones in
+   allocated memory. Keeps malloc out of the hot path. */
+#define LOG_LINE  (512)
+
 char use_syslog = 0;
 int fd_log = STDERR_FILENO;
 
@@ -147,6 +151,8 @@ void log_msg(char *file, char *function, int line, char l, char *s, ... )
 {
 	va_list ap;
 	char *msg, *o;
+	char msg_buf[LOG_LINE], o_buf[LOG_LINE + 64];
+	int n;
 	
 	/* Is logging enabled? */
 	if(fd_log == -1) return;
@@ -160,20 +166,31 @@ void log_msg(char *file, char *function, int line, char l, char *s, ... )
 	
 	/* Format the message. */
 	va_start(ap, s);
-	msg = vmake_message(s, ap);
+	n = vsnprintf(msg_buf, sizeof(msg_buf), s, ap);
 	va_end(ap);
+	msg = msg_buf;
+	if(n < 0 || n >= sizeof(msg_buf))
+	{
+		va_start(ap, s);
+		msg = vmake_message(s, ap);
+		va_end(ap);
+	}
 	
 	if(!msg) return;
 	
 	/* Format the output. */
-	o = NULL;
-	
-	if(l == FLOG_DEBUG) o = make_message("%s,%i: %s\n", function, line, msg);
-	else o = make_message("%s\n", msg);
+	if(l == FLOG_DEBUG) n = snprintf(o_buf, sizeof(o_buf), "%s,%i: %s\n", function, line, msg);
+	else n = snprintf(o_buf, sizeof(o_buf), "%s\n", msg);
+	o = o_buf;
+	if(n < 0 || n >= sizeof(o_buf))
+	{
+		if(l == FLOG_DEBUG) o = make_message("%s,%i: %s\n", function, line, msg);
+		else o = make_message("%s\n", msg);
+	}
 	
 	if(!o)
 	{
-		free(msg);
+		if(msg != msg_buf) free(msg);
 		return;
 	}
 	
@@ -208,7 +225,7 @@ void log_msg(char *file, char *function, int line, char l, char *s, ... )
 	/* Reset console colour. */
 	if(fd_log == STDERR_FILENO && !use_syslog) fprintf(stderr, "\033[%im", RESET);
 	
-	free(msg);
-	free(o);
+	if(msg != msg_buf) free(msg);
+	if(o != o_buf) free(o);
 }
 
@@ -0,0 +1,363 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "log.h"
+#include "trace.h"
+#include "metrics.h"
+
+// the request of a client, if any, is waited for that long
+#define METRICS_REQUEST_MS 50
+
+uint64_t metrics[METRICS];
+
+static struct {
+	pthread_t tid;
+	int running;
+	int thread;             // tid is started
+	int listen_fd;
+	int wake[2];            // pipe, closed by metrics_stop
+	char *socket_path;
+	char *file;
+	char *tmp;              // file is renamed from it
+	long start_us;
+	int write_failed;
+} exporter = { .listen_fd = -1, .wake = { -1, -1 } };
+
+static const struct {
+	const char *name;
+	const char *labels;
+	const char *help;
+} counter[] = {
+	[METRIC_CAPTURED]       = { "frames_captured_total", "", "Frames taken from the camera or the replay" },
+	[METRIC_CAMERA_SKIPPED] = { "frames_skipped_total", "", "Camera buffers replaced by a newer one before they were taken" },
+	[METRIC_DROPPED]        = { "frames_dropped_total", "", "Frames replaced by a newer one before the loop got to them" },
+	[METRIC_PROCESSED]      = { "frames_processed_total", "", "Frames submitted for phase correlation" },
+	[METRIC_CORRELATED_CPU] = { "correlations_total", "{backend=\"cpu\"}", "Phase correlations done, per backend" },
+	[METRIC_CORRELATED_GPU] = { "correlations_total", "{backend=\"gpu\"}", NULL },
+	[METRIC_FAILED_CPU]     = { "correlation_failures_total", "{backend=\"cpu\"}", "Phase correlations failed, per backend" },
+	[METRIC_FAILED_GPU]     = { "correlation_failures_total", "{backend=\"gpu\"}", NULL },
+};
+
+static void gauge( FILE *f, const char *name, const char *help, double v )
+{
+	fprintf( f, "# HELP mmalyuv_%s %s\n# TYPE mmalyuv_%s gauge\nmmalyuv_%s %.9g\n", name, help, name, name, v );
+}
+
+/*
+ * Render all metrics in the Prometheus text format
+ * returns the text, to be freed, NULL on error
+ */
+static char *render( size_t *len )
+{
+	static const char *quantile[] = { "0.5", "0.9", "0.99" };
+	trace_stats_t st;
+	double q[3], shifts;
+	long pages, resident, page = sysconf( _SC_PAGESIZE );
+	char *buf = NULL;
+	FILE *f, *statm;
+	int m, s, k;
+
+	f = open_memstream( &buf, len );
+	if( !f )
+		return NULL;
+
+	for( m = METRIC_CAPTURED; m <= METRIC_FAILED_GPU; m++ )
+	{
+		if( counter[m].help )
+			fprintf( f, "# HELP mmalyuv_%s %s\n# TYPE mmalyuv_%s counter\n", counter[m].name, counter[m].help,
+					 counter[m].name );
+		fprintf( f, "mmalyuv_%s%s %llu\n", counter[m].name, counter[m].labels,
+				 (unsigned long long)__atomic_load_n( &metrics[m], __ATOMIC_RELAXED ) );
+	}
+	shifts = metrics_get_double( METRIC_SHIFT_SUM );
+	fprintf( f, "# HELP mmalyuv_shift_pixels_total Sum of the shift magnitudes found\n"
+			 "# TYPE mmalyuv_shift_pixels_total counter\nmmalyuv_shift_pixels_total %.9g\n", shifts );
+
+	m = __atomic_load_n( &metrics[METRIC_LOOP_US], __ATOMIC_RELAXED );
+	gauge( f, "loop_rate_hz", "Frames per second of the processing loop, last period", m > 0 ? 1e6 / m : 0 );
+	gauge( f, "peak", "Correlation peak of the last frame, scale is backend specific", metrics_get_double( METRIC_PEAK ) );
+	gauge( f, "shift_x_pixels", "Shift of the last frame", (int64_t)__atomic_load_n( &metrics[METRIC_SHIFT_X], __ATOMIC_RELAXED ) );
+	gauge( f, "shift_y_pixels", "Shift of the last frame", (int64_t)__atomic_load_n( &metrics[METRIC_SHIFT_Y], __ATOMIC_RELAXED ) );
+	gauge( f, "latency_seconds", "Arrival to output of the last frame",
+		   (int64_t)__atomic_load_n( &metrics[METRIC_LATENCY_US], __ATOMIC_RELAXED ) / 1e6 );
+
+	// the histograms of trace.c, p50, p90, p99
+	fprintf( f, "# HELP mmalyuv_stage_latency_seconds Latency per stage of the hot path\n"
+			 "# TYPE mmalyuv_stage_latency_seconds summary\n" );
+	for( s = 0; s < TRACE_STAGES; s++ )
+	{
+		if( !trace_get( s, &st ) )
+			continue;
+		q[0] = st.p50_us;
+		q[1] = st.p90_us;
+		q[2] = st.p99_us;
+		for( k = 0; k < 3; k++ )
+			fprintf( f, "mmalyuv_stage_latency_seconds{stage=\"%s\",quantile=\"%s\"} %.9g\n",
+					 trace_stage_name( s ), quantile[k], q[k] / 1e6 );
+		fprintf( f, "mmalyuv_stage_latency_seconds_sum{stage=\"%s\"} %.9g\n", trace_stage_name( s ), st.sum_us / 1e6 );
+		fprintf( f, "mmalyuv_stage_latency_seconds_count{stage=\"%s\"} %llu\n", trace_stage_name( s ),
+				 (unsigned long long)st.count );
+	}
+
+	statm = fopen( "/proc/self/statm", "r" );
+	if( statm )
+	{
+		if( fscanf( statm, "%ld %ld", &pages, &resident ) == 2 )
+		{
+			gauge( f, "memory_virtual_bytes", "Virtual memory size", (double)pages * page );
+			gauge( f, "memory_resident_bytes", "Resident memory size", (double)resident * page );
+		}
+		fclose( statm );
+	}
+	gauge( f, "uptime_seconds", "Time since the metrics were started", (now_us() - exporter.start_us) / 1e6 );
+
+	if( fclose( f ) )
+	{
+		free( buf );
+		return NULL;
+	}
+	return buf;
+}
+
+// a client gone away is no SIGPIPE
+static int write_all( int fd, const char *p, size_t len, int sock )
+{
+	ssize_t n;
+
+	while( len )
+	{
+		n = sock ? send( fd, p, len, MSG_NOSIGNAL ) : write( fd, p, len );
+		if( n <= 0 )
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Answer a client of the socket: the text as it is, or as HTTP response if
+ * it sent a GET
+ */
+static void serve( int listen_fd )
+{
+	struct pollfd pfd;
+	struct timeval tv = { .tv_sec = 1 };
+	char req[512], head[160];
+	size_t len;
+	char *text;
+	int fd, http = 0;
+	ssize_t n;
+
+	fd = accept( listen_fd, NULL, NULL );
+	if( fd < 0 )
+		return;
+	// a client that does not read does not hold up the exporter for long
+	setsockopt( fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv) );
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if( poll( &pfd, 1, METRICS_REQUEST_MS ) == 1 )
+	{
+		n = recv( fd, req, sizeof(req) - 1, 0 );
+		http = n >= 4 && strncmp( req, "GET ", 4 ) == 0;
+	}
+
+	text = render( &len );
+	if( text )
+	{
+		if( http )
+		{
+			n = snprintf( head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+						  "Content-Length: %lu\r\n\r\n", (unsigned long)len );
+			write_all( fd, head, n, 1 );
+		}
+		write_all( fd, text, len, 1 );
+		free( text );
+	}
+	close( fd );
+}
+
+/*
+ * Write the file as a whole: into the temporary one, renamed over it
+ */
+static void write_file( void )
+{
+	size_t len;
+	char *text;
+	int fd, ok = 0;
+
+	text = render( &len );
+	fd = text ? open( exporter.tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644 ) : -1;
+	if( fd >= 0 )
+	{
+		ok = write_all( fd, text, len, 0 ) == 0;
+		if( close( fd ) )
+			ok = 0;
+		if( ok && rename( exporter.tmp, exporter.file ) )
+			ok = 0;
+		if( !ok )
+			unlink( exporter.tmp );
+	}
+	free( text );
+
+	if( !ok && !exporter.write_failed++ )
+		WARN( "cannot write metrics to %s", exporter.file );
+	else if( ok )
+		exporter.write_failed = 0;
+}
+
+static void *metrics_thread( void *arg )
+{
+	struct pollfd pfd[2];
+	long next = now_us() + METRICS_INTERVAL * 1000000L, now;
+	int timeout;
+
+	pfd[0].fd = exporter.wake[0];
+	pfd[0].events = POLLIN;
+	pfd[1].fd = exporter.listen_fd;
+	pfd[1].events = POLLIN;
+
+	for( ;; )
+	{
+		now = now_us();
+		if( exporter.file && now >= next )
+		{
+			write_file();
+			next += METRICS_INTERVAL * 1000000L;
+			if( next < now )
+				next = now + METRICS_INTERVAL * 1000000L;
+			continue;
+		}
+		timeout = exporter.file ? (next - now + 999) / 1000 : -1;
+
+		if( poll( pfd, exporter.listen_fd >= 0 ? 2 : 1, timeout ) < 0 )
+			continue;
+		if( pfd[0].revents )
+			break;
+		if( exporter.listen_fd >= 0 && (pfd[1].revents & POLLIN) )
+			serve( exporter.listen_fd );
+	}
+
+	// the file holds the final counts
+	if( exporter.file )
+		write_file();
+	return NULL;
+}
+
+static int listen_on( const char *path )
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if( strlen( path ) >= sizeof(addr.sun_path) )
+	{
+		ERROR( "socket path too long: %s", path );
+		return -1;
+	}
+	memset( &addr, 0, sizeof(addr) );
+	addr.sun_family = AF_UNIX;
+	strcpy( addr.sun_path, path );
+
+	fd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+	if( fd < 0 )
+	{
+		ERROR( "cannot create metrics socket" );
+		return -1;
+	}
+	// left over from a previous run
+	unlink( path );
+	if( bind( fd, (struct sockaddr *)&addr, sizeof(addr) ) || listen( fd, 4 ) )
+	{
+		ERROR( "cannot listen on %s", path );
+		close( fd );
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Start serving the metrics on the Unix domain socket socket_path and/or
+ * writing them to file every METRICS_INTERVAL seconds, either may be NULL
+ * returns -1 on error
+ */
+int metrics_start( const char *socket_path, const char *file )
+{
+	if( exporter.running || (!socket_path && !file) )
+		return (-1);
+	exporter.start_us = now_us();
+
+	if( pipe( exporter.wake ) )
+	{
+		ERROR( "cannot create pipe" );
+		exporter.wake[0] = exporter.wake[1] = -1;
+		return (-1);
+	}
+	if( socket_path )
+	{
+		exporter.listen_fd = listen_on( socket_path );
+		exporter.socket_path = strdup( socket_path );
+		if( exporter.listen_fd < 0 || !exporter.socket_path )
+			goto fail;
+	}
+	if( file )
+	{
+		exporter.file = strdup( file );
+		exporter.tmp = malloc( strlen( file ) + 5 );
+		if( !exporter.file || !exporter.tmp )
+		{
+			ERROR( "out of memory" );
+			goto fail;
+		}
+		sprintf( exporter.tmp, "%s.tmp", file );
+	}
+
+	if( pthread_create( &exporter.tid, NULL, metrics_thread, NULL ) )
+	{
+		ERROR( "cannot start metrics thread" );
+		goto fail;
+	}
+	exporter.running = exporter.thread = 1;
+	MSG( "metrics%s%s%s%s", socket_path ? " on " : "", socket_path ? socket_path : "",
+		 file ? " to " : "", file ? file : "" );
+	return (0);
+
+fail:
+	exporter.running = 1;
+	metrics_stop();
+	return (-1);
+}
+
+void metrics_stop( void )
+{
+	if( !exporter.running )
+		return;
+	if( exporter.thread )
+	{
+		close( exporter.wake[1] );
+		exporter.wake[1] = -1;
+		pthread_join( exporter.tid, NULL );
+	}
+	if( exporter.wake[1] >= 0 )
+		close( exporter.wake[1] );
+	close( exporter.wake[0] );
+	if( exporter.listen_fd >= 0 )
+	{
+		close( exporter.listen_fd );
+		unlink( exporter.socket_path );
+	}
+	free( exporter.socket_path );
+	free( exporter.file );
+	free( exporter.tmp );
+	exporter.running = exporter.thread = 0;
+	exporter.listen_fd = exporter.wake[0] = exporter.wake[1] = -1;
+	exporter.socket_path = exporter.file = exporter.tmp = NULL;
+}
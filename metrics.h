@@ -0,0 +1,78 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Health of the guiding loop for monitoring: frame counters, loop rate,
+ * the last correlation, failures, the stage latencies of trace.c and the
+ * memory in use.
+ *
+ * The loop and the scheduler only add to or store into slots of a static
+ * array with relaxed atomics, no lock and no call. A thread of metrics.c
+ * reads them when asked and renders the Prometheus text format, on a Unix
+ * domain socket (plain or HTTP GET, e.g. curl --unix-socket) and/or into a
+ * file written every few seconds as a whole, by rename of a temporary one.
+ */
+
+// counters
+#define METRIC_CAPTURED       0   // frames taken from the camera or the replay
+#define METRIC_CAMERA_SKIPPED 1   // camera buffers replaced by a newer one before they were taken
+#define METRIC_DROPPED        2   // frames replaced by a newer one before the loop got to them
+#define METRIC_PROCESSED      3   // frames submitted for correlation
+#define METRIC_CORRELATED_CPU 4   // results, per backend
+#define METRIC_CORRELATED_GPU 5
+#define METRIC_FAILED_CPU     6   // correlations that failed, per backend
+#define METRIC_FAILED_GPU     7
+#define METRIC_SHIFT_SUM      8   // sum of the shift magnitudes, double
+// gauges
+#define METRIC_LOOP_US        9   // last loop period, frame to frame
+#define METRIC_PEAK          10   // of the last correlation, double
+#define METRIC_SHIFT_X       11   // last shift in pixels of the camera frame
+#define METRIC_SHIFT_Y       12
+#define METRIC_LATENCY_US    13   // last arrival to output
+#define METRICS              14
+
+// seconds between the writes of the file
+#define METRICS_INTERVAL 5
+
+extern uint64_t metrics[METRICS];
+
+static inline void metrics_add( int m, uint64_t n )
+{
+	__atomic_fetch_add( &metrics[m], n, __ATOMIC_RELAXED );
+}
+
+static inline void metrics_set( int m, int64_t v )
+{
+	__atomic_store_n( &metrics[m], (uint64_t)v, __ATOMIC_RELAXED );
+}
+
+// doubles are kept as their bits, adding is for one writer only
+static inline void metrics_set_double( int m, double v )
+{
+	uint64_t u;
+
+	memcpy( &u, &v, sizeof(u) );
+	__atomic_store_n( &metrics[m], u, __ATOMIC_RELAXED );
+}
+
+static inline double metrics_get_double( int m )
+{
+	uint64_t u = __atomic_load_n( &metrics[m], __ATOMIC_RELAXED );
+	double v;
+
+	memcpy( &v, &u, sizeof(v) );
+	return v;
+}
+
+static inline void metrics_add_double( int m, double v )
+{
+	metrics_set_double( m, metrics_get_double( m ) + v );
+}
+
+int metrics_start( const char *socket_path, const char *file );
+void metrics_stop( void );
+
+#endif /* METRICS_H */
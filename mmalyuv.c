@@ -3,7 +3,9 @@
 #include <time.h>
 #include <math.h>
 #include <unistd.h>
-#include <gd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <limits.h>
 
 #include <mcheck.h>
 
@@ -15,32 +17,126 @@
 #include <interface/mmal/util/mmal_connection.h>
 #include <bcm_host.h>
 #include "mmalyuv.h"
+#include "image.h"
 #include "log.h"
 #include "dbg_image.h"
 #include "fft.h"
 #include "fft_gpu.h"
-
+#include "scheduler.h"
+#include "spsc.h"
+#include "stack.h"
+#include "calib.h"
+#include "bin.h"
+#include "shiftadd.h"
+#include "record.h"
+#include "trace.h"
+#include "metrics.h"
+#include "perf.h"
+#include "tune.h"
+#include "synth.h"
+
+// synthetic stars (synth.c) over every frame and verbose logging,
+// make NO_HC_DEBUG=1 correlates the camera's frames
+#ifndef NO_HC_DEBUG
 #define HC_DEBUG
+#endif /* NO_HC_DEBUG */
+
+static volatile int keep_looping;
+static volatile int write_requested;
+static volatile int trace_requested;
+
+// sequence number of the reference frame in the shift-and-add stack
+#define REF_SEQ 0xffffffff
 
-static int keep_looping;
+/*
+ *  Capture thread state. Buffers come in through empty and go out through
+ *  full, both single producer single consumer. Frames come from replay
+ *  instead of the camera if set, and go to rec as well if set.
+ */
+typedef struct {
+	PORT_USERDATA *callback_data;
+	MMAL_PORT_T *camera_port;
+	MMAL_POOL_T *pool_out;
+	cam_config_t *cfg;
+	pix_stack_t *stack;
+	replay_t *replay;
+	recorder_t *rec;
+	spsc_t empty, full;
+	unsigned long captured;
+	volatile int failed;
+} capture_ctx_t;
 
 #ifdef HC_DEBUG
 static int shift_x;
 static int shift_y;
 #endif /* HC_DEBUG */
 
-#ifdef HC_DEBUG
-/* 
- *   Returns number of milliseconds since whenever
- *   Only useful to calculate time differences
+// sums over the frames handed on: [0] arrival to output, [i] point i-1 to i
+static long lat_us[LAT_POINTS];
+static unsigned long lat_frames;
+
+/*
+ *  Account the way of a frame from its arrival to the output, each step
+ *  and in total, into the trace histograms and the sums of the summary
  */
-static uint32_t millis()
+static void account_latency( frame_times_t *ft )
 {
-	struct timespec tt;
-	clock_gettime(CLOCK_MONOTONIC,&tt);
-	return tt.tv_sec*1000l + tt.tv_nsec/1000000;
+	long us;
+	int i;
+
+	if( !ft->t[LAT_ARRIVED] )
+		return;
+	for( i = LAT_POINTS-1; i >= 0; i-- )
+	{
+		us = i ? ft->t[i] - ft->t[i-1] : ft->t[LAT_OUTPUT] - ft->t[LAT_ARRIVED];
+		trace_add( TRACE_LAT + i, us * 1000ULL );
+		lat_us[i] += us;
+	}
+	lat_frames++;
 }
+
+/*
+ *  Log shift of a correlated frame, in sensor pixels for frames binned by bin,
+ *  and hand it to the shift-and-add stack sa if not NULL
+ *  TODO Motor control goes here
+ */
+static void handle_result( sched_result_t *res, int bin, shiftadd_t *sa )
+{
+	if( res->status )
+	{
+		ERROR( "cannot phase correlate frame %u", res->seq );
+		if( sa )
+			shiftadd_discard( sa, res->seq );
+		return;
+	}
+	// the content of the frame is displaced by minus the shift
+	if( sa )
+		shiftadd_shift( sa, res->seq, -res->x, -res->y );
+	res->times.t[LAT_OUTPUT] = now_us();
+	account_latency( &res->times );
+	metrics_add( res->backend == SCHED_BACKEND_GPU ? METRIC_CORRELATED_GPU : METRIC_CORRELATED_CPU, 1 );
+	metrics_set_double( METRIC_PEAK, res->peak );
+	metrics_set( METRIC_SHIFT_X, res->x * bin );
+	metrics_set( METRIC_SHIFT_Y, res->y * bin );
+	metrics_add_double( METRIC_SHIFT_SUM, hypot( res->x * bin, res->y * bin ) );
+	if( res->times.t[LAT_ARRIVED] )
+		metrics_set( METRIC_LATENCY_US, res->times.t[LAT_OUTPUT] - res->times.t[LAT_ARRIVED] );
+	MSG( "frame %u (%s, %ld us, %ld us since arrival) peak: %.2f, x: %d, y:%d", res->seq,
+		 res->backend == SCHED_BACKEND_GPU ? "gpu" : "cpu", res->usecs,
+		 res->times.t[LAT_ARRIVED] ? (long)(res->times.t[LAT_OUTPUT] - res->times.t[LAT_ARRIVED]) : -1,
+		 res->peak, res->x * bin, res->y * bin );
+	DEBUG( "frame %u pts %lld", res->seq, (long long)res->times.pts );
+
+#ifdef HC_DEBUG
+	shift_x -= res->x * bin;
+	shift_y -= res->y * bin;
+
+	if( abs(shift_x) > DBG_PAD_X - 15  )
+		shift_x = 0;
+	if( abs(shift_y) > DBG_PAD_Y - 15 )
+		shift_y = 0;
 #endif /* HC_DEBUG */
+}
 
 
 /*
@@ -54,147 +150,87 @@ static void signal_handler(int signal_number)
 	return;
 }
 
-
-#ifdef HC_DEBUG
 /*
- *  Load greyscale(!) pic from "sterne_pad.png", convert to array of bytes
- *  returns -1 if file cannot be opened or image not be created by gd.
- *  This is assuming a greyscale file. If RGB, it's only using the blue 
- *  component. 
+ *  Write the shift-and-add stack, from the main loop
  */
-static int dbg_load_stars( pix_y_t *pic )
+static void write_handler(int signal_number)
 {
-	int i, j, w, h;
-	uint8_t *dat;
-	FILE *f;
-	gdImage *image;
-	
-	f = fopen("sterne_pad.png","rb");
-
-	if( !f ) {
-		ERROR( "cannot open padded stars PNG" );
-		return (-1);
-	}
-	
-	image = gdImageCreateFromPng( f );
-	fclose( f );
-	
-	if( !image ) {
-		ERROR( "cannot create image from PNG file" );
-		return (-1);
-	}
-	
-	w = gdImageSX(image) < pic->width?gdImageSX(image):pic->width;
-	h = gdImageSY(image) < pic->height?gdImageSY(image):pic->height;
-
-	dat = pic->data;
-	for( j = 0; j < h; j++ )
-		for( i = 0; i < w; i++,dat++ )
-		{
-			// This is working fine for grayscale pics. For RGB it just takes the blue component into account.
-			*dat = 0xff & gdImageGetPixel( image, i, j );
-		}
-	gdImageDestroy( image );
-	return(0);
+	write_requested = 1;
 }
 
-
 /*
- * copy (luminance) data from src to dst, offset by sh_x and sh_y both >= 0
- * returns -1 if index out of bounds
+ *  Log the stage latencies, from the main loop
  */
-static int dbg_copy_stars( pix_y_t *dst, pix_y_t *src, unsigned sh_x, unsigned sh_y )
+static void trace_handler(int signal_number)
 {
-	unsigned j;
-	uint8_t *src_b, *dst_b;
-	
-	if( dst->width + sh_x > src->width )
-		return (-1);
-	if( dst->height + sh_y > src->height )
-		return (-1);
-	
-	
-	for( j = 0; j < dst->height; j++ )
-	{
-		src_b = src->data + (sh_y+j)*src->width + sh_x;
-		dst_b = dst->data + j*dst->width;
-		memcpy( dst_b, src_b, dst->width );
-	}
-	return (0);
+	trace_requested = 1;
 }
-#endif /* HC_DEBUG */
 
 
 /*
- *  Callback to get YUV frame data from camera, average multiple frames
- *  
- *	Only pData->max_bytes bytes are saved, this is calculated to be only the 
- *  Y (luminance) data at the beginning of the memory block. 
- *   
- *  First frame (pData->current_frame) is copied, other frames are 
- *  added in using floating average
+ *  Callback to get YUV frame data from camera
+ *
+ *  Runs on the MMAL thread, so it does nothing but queue the buffer header
+ *  of the Y (luminance) plane for capture_frames, which uses it in place.
+ *  The header goes back to the pool only when the frame has been processed.
+ *
+ *  Buffers are the size of the Y plane (prepare_camera), so with I420 the
+ *  first buffer of a frame holds all of Y and the frame is complete for us
+ *  right then. U and V follow in the next buffer(s), they are given back
+ *  without being looked at. With a grey format or full frame buffers the
+ *  Y plane simply comes in the frame's only buffer.
  */
 static void y_writer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
 {
-	int complete = 0;
+	int complete = 0, end, failed;
+	uint32_t length;
 	
     PORT_USERDATA *pData = (PORT_USERDATA *)port->userdata;	
 	
-	if( pData )
+	if( !pData )
 	{
-		// 									copy max_bytes at most, calculated to be width*height(*sizeof(byte))  
-		if( buffer->length && pData->image_buffer && pData->bytes_written < pData->max_bytes )
-		{
-			uint32_t to_write = 0;
-			
-			if( pData->bytes_written + buffer->length > pData->max_bytes )
-				to_write = pData->max_bytes - pData->bytes_written;
-			 else
-				to_write = buffer->length;
-			
-			mmal_buffer_header_mem_lock( buffer );
-			if( pData->current_frame )
-			{
-				uint8_t *dst = pData->image_buffer+pData->bytes_written;
-				uint8_t *src = buffer->data;
-				while( to_write > 0 ) {
-					*src = *src + (*dst-*src)/pData->current_frame;
-					src++;
-					dst++;
-					to_write--;
-				} 
-			} else // first frame, just memcpy
-				memcpy( pData->image_buffer+pData->bytes_written, buffer->data, to_write );
-			mmal_buffer_header_mem_unlock( buffer );
-
-			pData->bytes_written += to_write;
-		}
-		
-		// TODO: Could I set complete=1 already if the Y-data is finished? Or do I have to wait until 
-		// flags are set?  (MMAL_BUFFER_HEADER_FLAG_FRAME_END | MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED)
-		if( buffer->flags & (MMAL_BUFFER_HEADER_FLAG_FRAME_END | MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED) )
-			complete = 1;
+		ERROR("callback received encoder buffer with no user data");
+		mmal_buffer_header_release( buffer );
+		return;
+	}
+
+	length = buffer->length;
+	failed = buffer->flags & MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED;
+	end = buffer->flags & (MMAL_BUFFER_HEADER_FLAG_FRAME_END | MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED);
+
+	if( pData->frame_pos == 0 && length >= pData->y_bytes && !failed )
+	{
+		if( buffer->user_data )
+			*(int64_t *)buffer->user_data = now_us();
+		mmal_queue_put( pData->frame_queue, buffer );
+		pData->frame_queued = 1;
+		complete = 1;
 	}
 	else
+		mmal_buffer_header_release( buffer );
+
+	pData->frame_pos += length;
+	if( end )
 	{
-		ERROR("callback received encoder buffer with no user data");
+		// no Y plane came, capture_frames has to find out nonetheless
+		if( !pData->frame_queued )
+			complete = 1;
+		pData->frame_pos = 0;
+		pData->frame_queued = 0;
+		if( pData->stills )
+			vcos_semaphore_post( &pData->end_semaphore );
 	}
 
-	mmal_buffer_header_release(buffer);
-	
     // TODO I have no idea what this is doing, the "manual" in mmal.h doesn't mention it
 	// but the thing breaks without so let's do it
+	// The pool may well be empty, frames waiting for processing hold their buffers
     if( port->is_enabled )
     {
-       MMAL_STATUS_T status = MMAL_SUCCESS;
        MMAL_BUFFER_HEADER_T *new_buffer;
 
        new_buffer = mmal_queue_get( pData->camera_pool->queue );
 
-       if( new_buffer )
-          status = mmal_port_send_buffer(port, new_buffer);
-
-       if (!new_buffer || status != MMAL_SUCCESS)
+       if( new_buffer && mmal_port_send_buffer(port, new_buffer) != MMAL_SUCCESS )
           ERROR("Unable to return a buffer to the encoder port");
     }
 		
@@ -220,15 +256,16 @@ static void camera_control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
 
 
 /* 
- * Prepare the camera component and the still port, set the format for the still port, 
- * enable camera component, create buffer pool
+ * Prepare the camera component and the still or video port (cfg->mode), set the format
+ * for that port, enable camera component, create buffer pool
  * 
  * This is more or less a direct copy from RaspiStillYUV.c. This is made a function 
  * to be out of the way in main()
  *
- * return -1 on error
+ * return -1 on error, with the component destroyed and *camera_component
+ * and *camera_port NULL
  */
-static int prepare_camera( MMAL_COMPONENT_T **camera_component, MMAL_PORT_T **still_port, MMAL_POOL_T **pool_out, int night )
+static int prepare_camera( MMAL_COMPONENT_T **camera_component, MMAL_PORT_T **camera_port, MMAL_POOL_T **pool_out, cam_config_t *cfg )
 {
 	MMAL_STATUS_T status;
 	MMAL_ES_FORMAT_T *format_out;	
@@ -246,10 +283,14 @@ static int prepare_camera( MMAL_COMPONENT_T **camera_component, MMAL_PORT_T **st
 	{
 		ERROR("Camera doesn't have output ports - which ist really strange");
 		mmal_component_destroy( *camera_component );
+		*camera_component = NULL;
 		return(-1);
 	}
 	
-	*still_port = (*camera_component)->output[MMAL_CAMERA_CAPTURE_PORT];
+	if( cfg->mode == CAM_MODE_VIDEO )
+		*camera_port = (*camera_component)->output[MMAL_CAMERA_VIDEO_PORT];
+	else
+		*camera_port = (*camera_component)->output[MMAL_CAMERA_CAPTURE_PORT];
 
 
     status = mmal_port_enable((*camera_component)->control, camera_control_callback);
@@ -258,10 +299,31 @@ static int prepare_camera( MMAL_COMPONENT_T **camera_component, MMAL_PORT_T **st
 	{
 		ERROR("Unable to enable control port : error %d", status);
 		mmal_component_destroy( *camera_component );
+		*camera_component = NULL;
+		*camera_port = NULL;
 		return(-1);
     }
 
-	if( night )
+	{
+		// sensor set-up for the port we use, like raspistill/raspivid do
+		MMAL_PARAMETER_CAMERA_CONFIG_T cam_config = {
+			{ MMAL_PARAMETER_CAMERA_CONFIG, sizeof(cam_config) },
+			.max_stills_w = cfg->width,
+			.max_stills_h = cfg->height,
+			.stills_yuv422 = 0,
+			.one_shot_stills = cfg->mode == CAM_MODE_STILL,
+			.max_preview_video_w = cfg->width,
+			.max_preview_video_h = cfg->height,
+			.num_preview_video_frames = 3,
+			.stills_capture_circular_buffer_height = 0,
+			.fast_preview_resume = 0,
+			.use_stc_timestamp = MMAL_PARAM_TIMESTAMP_MODE_RESET_STC
+		};
+		if( mmal_port_parameter_set( (*camera_component)->control, &cam_config.hdr ) != MMAL_SUCCESS )
+			WARN( "cannot set camera config" );
+	}
+
+	if( cfg->night )
 	{
 		mmal_port_parameter_set_uint32( (*camera_component)->control, MMAL_PARAMETER_SHUTTER_SPEED, 500000);
 		mmal_port_parameter_set_int32(  (*camera_component)->control, MMAL_PARAMETER_EXPOSURE_COMP, 25);
@@ -273,63 +335,126 @@ static int prepare_camera( MMAL_COMPONENT_T **camera_component, MMAL_PORT_T **st
 
 
 
-	format_out = (*still_port)->format;
-	
-    format_out->encoding = MMAL_ENCODING_I420;
-    format_out->encoding_variant = MMAL_ENCODING_I420;
+	format_out = (*camera_port)->format;
 
-	format_out->es->video.width = MAX_CAM_WIDTH;
-	format_out->es->video.height = MAX_CAM_HEIGHT;
+	// lines of the I420 planes are padded, the image is the crop rectangle
+	format_out->es->video.width = VCOS_ALIGN_UP(cfg->width, 32);
+	format_out->es->video.height = VCOS_ALIGN_UP(cfg->height, 16);
 	format_out->es->video.crop.x = 0;
 	format_out->es->video.crop.y = 0;
-	format_out->es->video.crop.width = MAX_CAM_WIDTH;
-	format_out->es->video.crop.height = MAX_CAM_HEIGHT;
-	format_out->es->video.frame_rate.num = STILLS_FRAME_RATE_NUM;
-	format_out->es->video.frame_rate.den = STILLS_FRAME_RATE_DEN;
-	
-	if( (*still_port)->buffer_num < (*still_port)->buffer_num_min )
-		(*still_port)->buffer_num  = (*still_port)->buffer_num_min;
-
-	(*still_port)->buffer_size = (*still_port)->buffer_size_recommended;
-
-	status = mmal_port_format_commit( *still_port );
+	format_out->es->video.crop.width = cfg->width;
+	format_out->es->video.crop.height = cfg->height;
+	format_out->es->video.frame_rate.num = cfg->fps_num;
+	format_out->es->video.frame_rate.den = cfg->fps_den;
+
+	// only luminance is used: a grey image if the firmware can, else I420
+	status = MMAL_ENOSYS;
+#ifdef MMAL_ENCODING_GREY
+	format_out->encoding = MMAL_ENCODING_GREY;
+	format_out->encoding_variant = MMAL_ENCODING_GREY;
+	status = mmal_port_format_commit( *camera_port );
+	if( status != MMAL_SUCCESS )
+		DEBUG( "no grey format on %s, using the Y plane of I420", (*camera_port)->name );
+#endif
+	if( status != MMAL_SUCCESS )
+	{
+		format_out->encoding = MMAL_ENCODING_I420;
+		format_out->encoding_variant = MMAL_ENCODING_I420;
+		status = mmal_port_format_commit( *camera_port );
+	}
 	if( status != MMAL_SUCCESS )
 	{
 		ERROR( "cannot commit image format" );
 		mmal_component_destroy( *camera_component );
+		*camera_component = NULL;
+		*camera_port = NULL;
 		return(-1);
 	}
+
+	// buffers of the size of the Y plane, the chroma of I420 goes into the next
+	// one(s) and is dropped, see y_writer_callback. Frames are processed in place:
+	// every frame of the ring may hold one, plus the next sub-exposure being
+	// captured and one for the chroma
+	if( (*camera_port)->buffer_num < FRAME_RING + 2 )
+		(*camera_port)->buffer_num = FRAME_RING + 2;
+	if( (*camera_port)->buffer_num < (*camera_port)->buffer_num_min )
+		(*camera_port)->buffer_num  = (*camera_port)->buffer_num_min;
+
+	(*camera_port)->buffer_size = format_out->es->video.width * format_out->es->video.height;
+	if( (*camera_port)->buffer_size < (*camera_port)->buffer_size_min )
+		(*camera_port)->buffer_size = (*camera_port)->buffer_size_min;
+
+	// buffers in memory shared with VideoCore, so the frames are not copied
+	// from there to the ARM either
+	if( mmal_port_parameter_set_boolean( *camera_port, MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE ) != MMAL_SUCCESS )
+		WARN( "cannot set zero copy on %s", (*camera_port)->name );
 	
 	status = mmal_component_enable( *camera_component );
 	if( status != MMAL_SUCCESS )
 	{
 		ERROR( "Cannot enable camera component" );
 		mmal_component_destroy( *camera_component );
+		*camera_component = NULL;
+		*camera_port = NULL;
 		return(-1);
 	}
 	
-    *pool_out = mmal_port_pool_create(*still_port, (*still_port)->buffer_num, (*still_port)->buffer_size);
+    *pool_out = mmal_port_pool_create(*camera_port, (*camera_port)->buffer_num, (*camera_port)->buffer_size);
 	
     if (!(*pool_out))
     {
-       ERROR("Failed to create buffer header pool for encoder output port %s", (*still_port)->name);
+       ERROR("Failed to create buffer header pool for encoder output port %s", (*camera_port)->name);
+	   mmal_component_disable( *camera_component );
+	   mmal_component_destroy( *camera_component );
+	   *camera_component = NULL;
+	   *camera_port = NULL;
 	   return (-1);
     }
 	
 	return 0;
 }
 
+/*
+ *  Give the camera buffer of a frame back to the pool
+ */
+static void frame_release( frame_t *frame )
+{
+	if( frame->header )
+	{
+		mmal_buffer_header_mem_unlock( frame->header );
+		mmal_buffer_header_release( frame->header );
+		frame->header = NULL;
+	}
+	frame->pix.data = NULL;
+}
+
 /*
  * Capture frames: set buffer pool, set capture parameter, wait for semaphore
  *
+ * frame->pix.width and height must be set. The first sub-exposure stays in
+ * its camera buffer, frame->pix points to its Y plane and frame->header holds
+ * the buffer until frame_release. With more than one sub-exposure all go onto
+ * stack, the others are given back right away and the mean of the stack is
+ * written over the first one at the end.
+ *
+ * In CAM_MODE_VIDEO the port streams already (set_streaming), nothing is
+ * triggered: the next frame is waited for, older ones still queued are
+ * skipped.
+ *
  * return (-1) if error with buffer pool or capture  
  */
-static int capture_frames( PORT_USERDATA *callback_data, MMAL_PORT_T *still_port, MMAL_POOL_T *pool_out, int frames )
+static int capture_frames( PORT_USERDATA *callback_data, MMAL_PORT_T *camera_port, MMAL_POOL_T *pool_out, cam_config_t *cfg,
+						   pix_stack_t *stack, frame_t *frame )
 {
-	for( callback_data->current_frame = 0; callback_data->current_frame < frames; callback_data->current_frame++ )
+	MMAL_BUFFER_HEADER_T *header, *extra;
+	pix_y_t sub;
+	int n;
+
+	frame->header = NULL;
+	if( stack )
+		stack_reset( stack );
+	for( n = 0; n < cfg->frames; n++ )
 	{
-		callback_data->bytes_written = 0;
-
 		int q, num = mmal_queue_length(pool_out->queue);
 
 		for ( q=0; q<num; q++ )
@@ -337,47 +462,325 @@ static int capture_frames( PORT_USERDATA *callback_data, MMAL_PORT_T *still_port
 			MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get( pool_out->queue );
 
 			if (!buffer) { 
-				ERROR("Unable to get a required buffer %d from pool queue", q); return (-1); }
+				ERROR("Unable to get a required buffer %d from pool queue", q); frame_release( frame ); return (-1); }
 
-			if (mmal_port_send_buffer(still_port, buffer)!= MMAL_SUCCESS) {
-				ERROR("Unable to send a buffer to encoder output port (%d)", q); return (-1); }
+			if (mmal_port_send_buffer(camera_port, buffer)!= MMAL_SUCCESS) {
+				ERROR("Unable to send a buffer to encoder output port (%d)", q); frame_release( frame ); return (-1); }
 		}
 	
-		if ( mmal_port_parameter_set_boolean( still_port, MMAL_PARAMETER_CAPTURE, 1 ) != MMAL_SUCCESS)
+		// the previous still has to be through before the next is triggered,
+		// its chroma may still be coming
+		if( cfg->mode == CAM_MODE_STILL && callback_data->end_pending )
+		{
+			vcos_semaphore_wait( &callback_data->end_semaphore );
+			callback_data->end_pending = 0;
+		}
+
+		if ( cfg->mode == CAM_MODE_STILL &&
+			 mmal_port_parameter_set_boolean( camera_port, MMAL_PARAMETER_CAPTURE, 1 ) != MMAL_SUCCESS)
 		{
 			ERROR("Failed to start capture");
+			frame_release( frame );
 			return (-1);
 		}
 		else
 		{
-			// Wait for capture to complete
+			callback_data->end_pending = cfg->mode == CAM_MODE_STILL;
+
+			// Wait for the Y plane
 			// For some reason using vcos_semaphore_wait_timeout sometimes returns immediately with bad parameter error
 			// even though it appears to be all correct, so reverting to untimed one until figure out why its erratic
 			vcos_semaphore_wait( &callback_data->complete_semaphore );
 		}
+
+		// the queue holds whole Y planes only, see y_writer_callback. When streaming
+		// keep the newest. The semaphore has been posted for the skipped ones too,
+		// the next waits find the queue empty and wait again, as for frames that failed
+		header = mmal_queue_get( callback_data->frame_queue );
+		while( (extra = mmal_queue_get( callback_data->frame_queue )) )
+		{
+			if( cfg->mode == CAM_MODE_VIDEO )
+			{
+				mmal_buffer_header_release( header );
+				header = extra;
+				metrics_add( METRIC_CAMERA_SKIPPED, 1 );
+			}
+			else
+				mmal_buffer_header_release( extra );
+		}
+		if( !header && cfg->mode == CAM_MODE_VIDEO )
+		{
+			n--;
+			continue;
+		}
+		if( !header || header->length < callback_data->stride * frame->pix.height )
+		{
+			ERROR("incomplete frame: %u bytes", header ? header->length : 0);
+			if( header )
+				mmal_buffer_header_release( header );
+			frame_release( frame );
+			return (-1);
+		}
+
+		mmal_buffer_header_mem_lock( header );
+		pixInit( &sub, header->data + header->offset, frame->pix.width, frame->pix.height,
+				 callback_data->stride );
+		if( stack && stack_add( stack, &sub ) )
+		{
+			mmal_buffer_header_mem_unlock( header );
+			mmal_buffer_header_release( header );
+			frame_release( frame );
+			return (-1);
+		}
+
+		if( !frame->header )
+		{
+			frame->header = header;
+			frame->pix = sub;
+			frame->times.pts = header->pts == MMAL_TIME_UNKNOWN ? -1 : header->pts;
+			frame->times.t[LAT_ARRIVED] = header->user_data ? *(int64_t *)header->user_data : 0;
+		}
+		else
+		{
+			mmal_buffer_header_mem_unlock( header );
+			mmal_buffer_header_release( header );
+		}
+	}
+
+	if( stack && stack_mean( stack, &frame->pix ) )
+	{
+		frame_release( frame );
+		return (-1);
 	}
 	
 	return (0);
 }
 
+/*
+ *  Start or stop the stream of frames from the video port, nothing to do
+ *  for stills, they are triggered one by one
+ *
+ *  return -1 on error
+ */
+static int set_streaming( MMAL_PORT_T *camera_port, cam_config_t *cfg, int on )
+{
+	if( cfg->mode != CAM_MODE_VIDEO )
+		return 0;
+
+	if( mmal_port_parameter_set_boolean( camera_port, MMAL_PARAMETER_CAPTURE, on ? MMAL_TRUE : MMAL_FALSE ) != MMAL_SUCCESS )
+	{
+		ERROR( "cannot %s streaming on %s", on ? "start" : "stop", camera_port->name );
+		return (-1);
+	}
+	return 0;
+}
+
+/*
+ *  Next frame from the camera or, zero-copy, from the replay. Recorded as
+ *  frame seq if ctx->rec is set.
+ *
+ *  return -1 on error, 1 at the end of the replay
+ */
+static int next_frame( capture_ctx_t *ctx, frame_t *frame, uint32_t seq )
+{
+	TRACE_SCOPE( TRACE_CAPTURE );
+	int ret;
+
+	memset( &frame->times, 0, sizeof(frame->times) );
+	if( ctx->replay )
+	{
+		frame->header = NULL;
+		ret = replay_next( ctx->replay, &frame->pix );
+		if( !ret )
+			frame->times.pts = ctx->replay->index[ctx->replay->next-1].pts;
+	}
+	else
+		ret = capture_frames( ctx->callback_data, ctx->camera_port, ctx->pool_out, ctx->cfg, ctx->stack, frame );
+	if( ret )
+		return ret;
+
+	frame->seq = seq;
+	frame->times.t[LAT_CAPTURED] = now_us();
+	// replayed or not stamped by the callback: arrived when taken
+	if( !frame->times.t[LAT_ARRIVED] )
+		frame->times.t[LAT_ARRIVED] = frame->times.t[LAT_CAPTURED];
+	if( ctx->rec )
+		rec_append( ctx->rec, &frame->pix, seq, frame->times.t[LAT_ARRIVED], frame->times.pts );
+	return 0;
+}
 
+/*
+ *  Capture thread: captures into free frames of the ring and hands them
+ *  to the processing thread, until keep_looping is cleared or the capture
+ *  fails. Does not wait for the processing, which gives stale frames back
+ *  right away. Only while it copies the newest one no frame may be free
+ *  for a moment.
+ */
+static void *capture_thread( void *arg )
+{
+	capture_ctx_t *ctx = arg;
+	frame_t *frame;
+	int ret;
+
+	while( keep_looping )
+	{
+		frame = spsc_pop( &ctx->empty );
+		if( !frame )
+		{
+			usleep( 1000 );
+			continue;
+		}
+
+		ret = next_frame( ctx, frame, ctx->captured );
+		if( ret > 0 )
+		{
+			MSG( "end of the replay" );
+			spsc_push( &ctx->empty, frame );
+			keep_looping = 0;
+			break;
+		}
+		if( ret )
+		{
+			ERROR( "failed to capture shot x" );
+			ctx->failed = 1;
+			break;
+		}
+
+		ctx->captured++;
+		metrics_add( METRIC_CAPTURED, 1 );
+		spsc_push( &ctx->full, frame );
+	}
+
+	return NULL;
+}
+
+
+
+/*
+ *  Capture CALIB_FRAMES frames, stack them and write their mean to file as
+ *  master dark (CALIB_DARK) or flat. The flat is taken less the dark of cal
+ *  if there is one. Frames are binned by bin first if not NULL, like the
+ *  ones that are correlated.
+ *
+ *  return -1 on error
+ */
+static int make_master( capture_ctx_t *ctx, bin_t *bin, int type, const char *file, calib_t *cal )
+{
+	cam_config_t *cfg = ctx->cfg;
+	pix_stack_t *master;
+	frame_t frame;
+	pix_y_t *pix;
+	int n, ret = -1;
+
+	master = bin ? stack_create( bin->out.width, bin->out.height, CALIB_FRAMES, 0 )
+				 : stack_create( cfg->width, cfg->height, CALIB_FRAMES, 0 );
+	if( !master )
+		return (-1);
+
+	MSG( "capturing %d frames for the master %s", CALIB_FRAMES, type == CALIB_DARK ? "dark" : "flat" );
+	for( n = 0; n < CALIB_FRAMES && keep_looping; n++ )
+	{
+		pixInit( &frame.pix, NULL, cfg->width, cfg->height, cfg->width );
+		if( next_frame( ctx, &frame, n ) )
+			goto out;
+		pix = bin ? bin_frame( bin, &frame.pix ) : &frame.pix;
+		if( pix )
+			stack_add( master, pix );
+		frame_release( &frame );
+		if( !pix )
+			goto out;
+	}
+	if( n < CALIB_FRAMES )
+	{
+		ERROR( "interrupted after %d frames", n );
+		goto out;
+	}
+
+	ret = type == CALIB_DARK ? calib_write_dark( file, master ) : calib_write_flat( file, master, cal );
+out:
+	stack_destroy( master );
+	return ret;
+}
+
+/*
+ * Settings tuned for this board from file, measured and kept there first
+ * if it has none for it or retune is set. FFTW plans as tuned, with the
+ * wisdom of <file>.wisdom
+ * returns -1 if there are none and tuning failed
+ */
+static int load_tuning( const char *file, int retune, float target_fps, tune_t *t )
+{
+	char key[TUNE_KEY], wisdom[PATH_MAX];
+
+	if( tune_key( key, sizeof(key) ) )
+		WARN( "board model unknown, tuning for \"%s\"", key );
+	snprintf( wisdom, sizeof(wisdom), "%s.wisdom", file );
+	fft_wisdom_load( wisdom );
+
+	if( !retune && tune_load( file, key, t ) == 0 )
+	{
+		fft_set_plan( t->plan_flags, t->fft_threads );
+		tune_log( key, t );
+		return (0);
+	}
+	if( tune_run( MAX_CAM_WIDTH, MAX_CAM_HEIGHT, target_fps, t ) )
+		return (-1);
+	if( tune_save( file, key, t ) == 0 )
+		MSG( "tuning for %s kept in %s", key, file );
+	fft_wisdom_save( wisdom );
+	return (0);
+}
 
 int main(int argc, char *argv[])
 {
-	MMAL_COMPONENT_T *camera_component;
+	MMAL_COMPONENT_T *camera_component = NULL;
 	VCOS_STATUS_T vcos_status;
-	MMAL_POOL_T *pool_out;
-	MMAL_PORT_T *still_port = NULL;
-    PORT_USERDATA callback_data;
-	pix_y_t img1, img2;
+	MMAL_POOL_T *pool_out = NULL;     // not used when replaying
+	MMAL_PORT_T *camera_port = NULL;
+    PORT_USERDATA callback_data = { .frame_queue = NULL };
+	frame_t ref_frame = { .header = NULL };
 	// struct GPU_FFT *frame1_fft_gpu;
-	float peak;
-	int32_t xloc, yloc;
-	int night = 1;
+	sched_t *sched = NULL;
+	pix_stack_t *stack = NULL;
+	bin_t *bin = NULL;
+	shiftadd_t *sa = NULL;
+	char *stack_file = NULL;
+	char *record_file = NULL, *replay_file = NULL;
+	char *metrics_socket = NULL, *metrics_file = NULL;
+	char *tune_file = TUNE_FILE;
+	int autotune = 0, set_mode = 0, set_size = 0, set_bin = 0;
+	tune_t tuned;
+	uint32_t record_frames = REC_FRAMES;
+	int replay_realtime = 1;
+	pix_y_t *pix;
+	long bin_us = 0, t, loop_start = 0, loop_us;
+	uint64_t loop_t, bin_start;
+	sched_result_t res;
+	capture_ctx_t capture = { .failed = 0 };
+	pthread_t capture_tid;
+	int capture_running = 0;
+	int semaphores = 0;
+	frame_t frames[FRAME_RING] = { { .header = NULL } }, *frame = NULL, *f;
+	unsigned long dropped = 0, processed = 0;
+	int sched_mode = SCHED_MODE_WEIGHTED, lowmem = 0, streaming = 0, i, ret = -1;
+	char *dark_file = NULL, *flat_file = NULL, *master_file = NULL;
+	int master_type = 0;
+	calib_t *cal = NULL;
+	cam_config_t cfg = {
+		.mode = CAM_MODE_STILL,
+		.night = 1,
+		.width = MAX_CAM_WIDTH,
+		.height = MAX_CAM_HEIGHT,
+		.fps_num = STILLS_FRAME_RATE_NUM,
+		.fps_den = STILLS_FRAME_RATE_DEN,
+		.frames = MAX_FRAMES,
+		.kappa = 0,
+		.bin = 1
+	};
 
 #ifdef HC_DEBUG
-	pix_y_t star_base;
-	uint32_t bef, aft; 
+	synth_params_t star_params;
+	synth_t *stars = NULL;
 #endif /* HC_DEBUG */
 	
 #ifdef HC_DEBUG
@@ -389,87 +792,307 @@ int main(int argc, char *argv[])
 
 	bcm_host_init();
 	
+#ifndef STANDIN
 	if( geteuid() != 0 )
 	{
 		ERROR("This program needs r/w access to /dev/mem. It must be run as root (suid).\nExiting...");
 		exit(-1);
 	}
+#endif /* STANDIN */
 	
     signal(SIGINT, signal_handler);
+    signal(SIGUSR1, write_handler);
+    signal(SIGUSR2, trace_handler);
 	
 	
-	if( argc > 1 )
+	for( i = 1; i < argc; i++ )
 	{
-		if( strncmp( argv[1], "-day", 4 ) == 0 )
-			night = 0;
-		else if( strncmp( argv[1], "-night", 6 ) == 0 )
-			night = 1;
+		if( strncmp( argv[i], "-day", 4 ) == 0 )
+			cfg.night = 0;
+		else if( strncmp( argv[i], "-night", 6 ) == 0 )
+			cfg.night = 1;
+		else if( strncmp( argv[i], "-video", 6 ) == 0 )
+		{
+			cfg.mode = CAM_MODE_VIDEO;
+			cfg.fps_num = VIDEO_FRAME_RATE_NUM;
+			cfg.fps_den = VIDEO_FRAME_RATE_DEN;
+		}
+		else if( strncmp( argv[i], "-still", 6 ) == 0 )
+		{
+			cfg.mode = CAM_MODE_STILL;
+			cfg.fps_num = STILLS_FRAME_RATE_NUM;
+			cfg.fps_den = STILLS_FRAME_RATE_DEN;
+		}
+		else if( strncmp( argv[i], "-fps", 4 ) == 0 && i+1 < argc )
+		{
+			// n or n/d
+			cfg.fps_den = 1;
+			if( sscanf( argv[++i], "%u/%u", &cfg.fps_num, &cfg.fps_den ) < 1 || !cfg.fps_num || !cfg.fps_den )
+			{
+				ERROR( "bad frame rate %s", argv[i] );
+				exit(-1);
+			}
+		}
+		else if( strncmp( argv[i], "-size", 5 ) == 0 && i+1 < argc )
+		{
+			if( sscanf( argv[++i], "%ux%u", &cfg.width, &cfg.height ) != 2 || !cfg.width || !cfg.height )
+			{
+				ERROR( "bad image size %s, expected <width>x<height>", argv[i] );
+				exit(-1);
+			}
+			set_size = 1;
+		}
+		else if( strncmp( argv[i], "-frames", 7 ) == 0 && i+1 < argc )
+		{
+			cfg.frames = atoi( argv[++i] );
+			if( cfg.frames < 1 )
+			{
+				ERROR( "bad number of sub-exposures %s", argv[i] );
+				exit(-1);
+			}
+		}
+		else if( strncmp( argv[i], "-clip", 5 ) == 0 && i+1 < argc )
+		{
+			// sigma clipping of the sub-exposures, in standard deviations
+			cfg.kappa = atof( argv[++i] );
+			if( cfg.kappa <= 0 )
+			{
+				ERROR( "bad clipping factor %s", argv[i] );
+				exit(-1);
+			}
+		}
+		else if( strncmp( argv[i], "-bin", 4 ) == 0 && i+1 < argc )
+		{
+			cfg.bin = atoi( argv[++i] );
+			if( cfg.bin != 1 && cfg.bin != 2 && cfg.bin != 4 )
+			{
+				ERROR( "bad binning %s, 1, 2 or 4", argv[i] );
+				exit(-1);
+			}
+			set_bin = 1;
+		}
+		else if( strncmp( argv[i], "-stack", 6 ) == 0 && i+1 < argc )
+			stack_file = argv[++i];
+		else if( strncmp( argv[i], "-record", 7 ) == 0 && i+1 < argc )
+			record_file = argv[++i];
+		else if( strncmp( argv[i], "-recframes", 10 ) == 0 && i+1 < argc )
+			record_frames = atoi( argv[++i] );
+		else if( strncmp( argv[i], "-replayfast", 11 ) == 0 && i+1 < argc )
+		{
+			replay_file = argv[++i];
+			replay_realtime = 0;
+		}
+		else if( strncmp( argv[i], "-replay", 7 ) == 0 && i+1 < argc )
+			replay_file = argv[++i];
+		else if( strncmp( argv[i], "-metricsfile", 12 ) == 0 && i+1 < argc )
+			metrics_file = argv[++i];
+		else if( strncmp( argv[i], "-metrics", 8 ) == 0 && i+1 < argc )
+			metrics_socket = argv[++i];
+		else if( strncmp( argv[i], "-perf", 5 ) == 0 )
+		{
+			if( perf_enable() )
+				exit(-1);
+		}
+		else if( strncmp( argv[i], "-dark", 5 ) == 0 && i+1 < argc )
+			dark_file = argv[++i];
+		else if( strncmp( argv[i], "-flat", 5 ) == 0 && i+1 < argc )
+			flat_file = argv[++i];
+		else if( strncmp( argv[i], "-mkdark", 7 ) == 0 && i+1 < argc )
+		{
+			master_type = CALIB_DARK;
+			master_file = argv[++i];
+		}
+		else if( strncmp( argv[i], "-mkflat", 7 ) == 0 && i+1 < argc )
+		{
+			master_type = CALIB_FLAT;
+			master_file = argv[++i];
+		}
+		else if( strncmp( argv[i], "-gpu", 4 ) == 0 )
+			sched_mode = SCHED_MODE_GPU, set_mode = 1;
+		else if( strncmp( argv[i], "-cpu", 4 ) == 0 )
+			sched_mode = SCHED_MODE_CPU, set_mode = 1;
+		else if( strncmp( argv[i], "-alternate", 10 ) == 0 )
+			sched_mode = SCHED_MODE_ALTERNATE, set_mode = 1;
+		else if( strncmp( argv[i], "-weighted", 9 ) == 0 )
+			sched_mode = SCHED_MODE_WEIGHTED, set_mode = 1;
+		else if( strncmp( argv[i], "-lowmem", 7 ) == 0 )
+			lowmem = 1;
+		else if( strncmp( argv[i], "-autotune", 9 ) == 0 )
+			autotune = 1;
+		else if( strncmp( argv[i], "-retune", 7 ) == 0 )
+			autotune = 2;
+		else if( strncmp( argv[i], "-tunefile", 9 ) == 0 && i+1 < argc )
+			tune_file = argv[++i];
 	}
 
 
 #ifdef HC_DEBUG
-	srandom(millis());
+	srandom(now_us());
+#endif /* HC_DEBUG */	
 
+	// a replay stands in for the camera, with the recording's set-up. Its
+	// frames are stacked already
+	if( replay_file )
+	{
+		capture.replay = replay_open( replay_file, replay_realtime );
+		if( !capture.replay )
+			exit(-1);
+		cfg.width = capture.replay->hdr->width;
+		cfg.height = capture.replay->hdr->height;
+		cfg.mode = capture.replay->hdr->mode;
+		cfg.fps_num = capture.replay->hdr->fps_num;
+		cfg.fps_den = capture.replay->hdr->fps_den;
+		cfg.frames = 1;
+	}
 
-	star_base.width = MAX_CAM_WIDTH_PADDED + 2*DBG_PAD_X;
-	star_base.height = MAX_CAM_HEIGHT_PADDED + 2*DBG_PAD_Y;
-	star_base.data = calloc( (MAX_CAM_WIDTH_PADDED + 2*DBG_PAD_X) * (MAX_CAM_HEIGHT_PADDED + 2*DBG_PAD_Y), sizeof( uint8_t ) );
-	if( !star_base.data ) {
-		ERROR("out of memory data");
-		exit(-1);
+	// the board's tuned settings, where the command line leaves them open
+	if( autotune )
+	{
+		if( load_tuning( tune_file, autotune == 2, (float)cfg.fps_num / cfg.fps_den / cfg.frames, &tuned ) )
+			exit(-1);
+		if( !set_mode )
+			sched_mode = tuned.sched_mode;
+		if( !set_mode && !lowmem )
+			lowmem = tuned.lowmem;
+		if( !set_bin )
+			cfg.bin = tuned.bin;
+		if( !set_size && !capture.replay )
+		{
+			cfg.width = tuned.width;
+			cfg.height = tuned.height;
+		}
 	}
-	dbg_load_stars( &star_base );
-#endif /* HC_DEBUG */	
 
-	if( prepare_camera( &camera_component, &still_port, &pool_out, night ) )
+	MSG( "%s %ux%u at %u/%u fps, %d sub-exposures per frame, binned %dx%d", cfg.mode == CAM_MODE_VIDEO ? "video" : "stills",
+		 cfg.width, cfg.height, cfg.fps_num, cfg.fps_den, cfg.frames, cfg.bin, cfg.bin );
+
+	// masters are built from raw frames, a flat less the dark only
+	if( master_type == CALIB_DARK )
+		dark_file = flat_file = NULL;
+	else if( master_type == CALIB_FLAT )
+		flat_file = NULL;
+	if( dark_file || flat_file )
 	{
-		ERROR( "failed to prepare camera" );
-		goto error;
+		cal = calib_load( dark_file, flat_file );
+		if( !cal )
+			exit(-1);
+		// the binned frames are calibrated
+		if( cal->width != cfg.width / cfg.bin || cal->height != cfg.height / cfg.bin )
+		{
+			ERROR( "calibration is %u x %u, frames %u x %u", cal->width, cal->height,
+				   cfg.width / cfg.bin, cfg.height / cfg.bin );
+			exit(-1);
+		}
+		calib_set( cal );
 	}
+
+	// loop health for monitoring, see metrics.h
+	if( (metrics_socket || metrics_file) && metrics_start( metrics_socket, metrics_file ) )
+		goto error;
+
+	if( !capture.replay )
+	{
+		if( prepare_camera( &camera_component, &camera_port, &pool_out, &cfg ) )
+		{
+			ERROR( "failed to prepare camera" );
+			goto error;
+		}
 	
 
-	callback_data.camera_pool = pool_out;
-	callback_data.image_buffer = NULL;
+		callback_data.camera_pool = pool_out;
+		callback_data.arrived = calloc( pool_out->headers_num, sizeof(int64_t) );
+		if( !callback_data.arrived )
+		{
+			ERROR( "out of memory" );
+			goto error;
+		}
+		for( i = 0; i < (int)pool_out->headers_num; i++ )
+			pool_out->header[i]->user_data = &callback_data.arrived[i];
+		callback_data.stride = camera_port->format->es->video.width;
+		callback_data.y_bytes = camera_port->format->es->video.width * camera_port->format->es->video.height;
+		callback_data.stills = cfg.mode == CAM_MODE_STILL;
+		callback_data.frame_queue = mmal_queue_create();
+		if( !callback_data.frame_queue )
+		{
+			ERROR("cannot create frame queue");
+			goto error;
+		}
 
-	DEBUG("creating semaphore");
-    vcos_status = vcos_semaphore_create(&callback_data.complete_semaphore, "mmalcam-sem", 0);
-    vcos_assert(vcos_status == VCOS_SUCCESS);
+		DEBUG("creating semaphore");
+	    vcos_status = vcos_semaphore_create(&callback_data.complete_semaphore, "mmalcam-sem", 0);
+	    vcos_assert(vcos_status == VCOS_SUCCESS);
+	    vcos_status = vcos_semaphore_create(&callback_data.end_semaphore, "mmalcam-end", 0);
+	    vcos_assert(vcos_status == VCOS_SUCCESS);
+		semaphores = 1;
 	
 	
-	if( !night )
-	{
-		DEBUG("sleeping for some time have exposure adjust automatically");
-		// results show: sleeping time can be much shorter, tested down to 2ms
-		// although then exposure and awb seem to be somewhat off and image size huge 
-    	vcos_sleep(300);
-	} else {
-    	vcos_sleep(2);		
+		if( !cfg.night )
+		{
+			DEBUG("sleeping for some time have exposure adjust automatically");
+			// results show: sleeping time can be much shorter, tested down to 2ms
+			// although then exposure and awb seem to be somewhat off and image size huge 
+	    	vcos_sleep(300);
+		} else {
+	    	vcos_sleep(2);		
+		}
 	}
 
-	img1.width = MAX_CAM_WIDTH_PADDED;
-	img1.height = MAX_CAM_HEIGHT_PADDED;
-	img1.data = calloc( MAX_CAM_WIDTH_PADDED * MAX_CAM_HEIGHT_PADDED, sizeof( uint8_t ));
-	if( !img1.data )
+	pixInit( &ref_frame.pix, NULL, cfg.width, cfg.height, cfg.width );
+
+	if( cfg.frames > 1 )
 	{
-		ERROR("out of memory img1");
-		goto error;
+		stack = stack_create( cfg.width, cfg.height, cfg.frames, cfg.kappa );
+		if( !stack )
+			goto error;
+	}
+	if( cfg.bin > 1 )
+	{
+		bin = bin_create( cfg.width, cfg.height, cfg.bin, BIN_THREADS );
+		if( !bin )
+			goto error;
 	}
 	
-	callback_data.image_buffer = img1.data;
-	callback_data.max_bytes = MAX_CAM_WIDTH_PADDED * MAX_CAM_HEIGHT_PADDED;
-	callback_data.current_frame = 0;
-	
-    still_port->userdata = (struct MMAL_PORT_USERDATA_T *)&callback_data;
+	if( !capture.replay )
+	{
+	    camera_port->userdata = (struct MMAL_PORT_USERDATA_T *)&callback_data;
 	
 	
-	if( mmal_port_enable( still_port, y_writer_callback ) != MMAL_SUCCESS )
+		if( mmal_port_enable( camera_port, y_writer_callback ) != MMAL_SUCCESS )
+		{
+			ERROR("failed to enable camera output port");
+			goto error;
+		}
+
+		if( set_streaming( camera_port, &cfg, 1 ) )
+			goto error;
+		streaming = 1;
+	}
+
+	// frames come through next_frame from here on
+	capture.callback_data = &callback_data;
+	capture.camera_port = camera_port;
+	capture.pool_out = pool_out;
+	capture.cfg = &cfg;
+	capture.stack = stack;
+
+	// raw frames, as they come from the camera or the replay
+	if( record_file )
 	{
-		ERROR("failed to enable camera still output port");
-		goto error;
+		capture.rec = rec_create( record_file, cfg.width, cfg.height, record_frames, &cfg );
+		if( !capture.rec )
+			goto error;
 	}
 
+	// only the master frame, cleaned up as on error
+	if( master_type )
+	{
+		keep_looping = 1;
+		if( make_master( &capture, bin, master_type, master_file, cal ) == 0 )
+			ret = 0;
+		goto error;
+	}
 
-	if( capture_frames( &callback_data, still_port, pool_out, MAX_FRAMES ) ) {
+	if( next_frame( &capture, &ref_frame, REF_SEQ ) ) {
 		ERROR( "failed to capture first shot" );
 		goto error;
 	}
@@ -477,8 +1100,13 @@ int main(int argc, char *argv[])
 	
 #ifdef HC_DEBUG
 	// DEBUG
-	// overwrite first frame with stars 
-	dbg_copy_stars( &img1, &star_base, DBG_PAD_X, DBG_PAD_Y );
+	// overwrite first frame with synthetic stars, the field reaches DBG_PAD_X / Y
+	// past the frame for the shifted ones
+	synth_defaults( &star_params );
+	stars = synth_create( &star_params, ref_frame.pix.width, ref_frame.pix.height,
+						  DBG_PAD_X > DBG_PAD_Y ? DBG_PAD_X : DBG_PAD_Y );
+	if( !stars || synth_frame( stars, &ref_frame.pix, 0, 0, REF_SEQ ) )
+		goto error;
 #endif /* HC_DEBUG */	
 	
 	// GPU FFT
@@ -495,34 +1123,95 @@ int main(int argc, char *argv[])
 	*/
 
 
-	img2.width = MAX_CAM_WIDTH_PADDED;
-	img2.height = MAX_CAM_HEIGHT_PADDED;
-	img2.data = calloc( MAX_CAM_WIDTH_PADDED * MAX_CAM_HEIGHT_PADDED, sizeof( uint8_t ));
-	if( !img2.data )
+	// ring of frames, all free to start with. Their data stays in the camera buffers
+	if( spsc_init( &capture.empty, FRAME_RING ) || spsc_init( &capture.full, FRAME_RING ) )
+		goto error;
+	for( i = 0; i < FRAME_RING; i++ )
+	{
+		pixInit( &frames[i].pix, NULL, cfg.width, cfg.height, cfg.width );
+		frames[i].header = NULL;
+		spsc_push( &capture.empty, &frames[i] );
+	}
+
+	// frames are correlated by FFTW and/or gpu_fft in the background while
+	// the next one is captured
+	sched = sched_create( sched_mode );
+	if( sched )
+		sched_set_lowmem( sched, lowmem );
+	pix = bin ? bin_frame( bin, &ref_frame.pix ) : &ref_frame.pix;
+	if( !sched || !pix || sched_set_reference( sched, pix ) )
 	{
-		ERROR("out of memory img2");
+		ERROR("cannot start phase correlation");
 		goto error;
 	}
-	
-	callback_data.image_buffer = img2.data;
-	callback_data.max_bytes = MAX_CAM_WIDTH_PADDED * MAX_CAM_HEIGHT_PADDED;
+
+	// frames shifted back onto the reference are added up in the background,
+	// written on SIGUSR1 and at the end
+	if( stack_file )
+	{
+		sa = shiftadd_create( pix->width, pix->height, stack_file );
+		if( !sa || shiftadd_push( sa, pix, REF_SEQ ) )
+			goto error;
+		shiftadd_shift( sa, REF_SEQ, 0, 0 );
+	}
+	frame_release( &ref_frame );
 
 
 	keep_looping = 1;
+	loop_start = now_us();
 
-#ifdef HC_DEBUG
-	bef = millis();
-#endif /* HC_DEBUG */
+	// capture runs in its own thread, this one processes the newest frame
+	// whenever a backend is free. The loop period is max(capture, correlation)
+	if( pthread_create( &capture_tid, NULL, capture_thread, &capture ) )
+	{
+		ERROR("cannot start capture thread");
+		goto error;
+	}
+	capture_running = 1;
+
+	loop_t = trace_begin();
 
 	do {
-		callback_data.bytes_written = 0;
-		callback_data.current_frame = 0;
+		// newest complete frame, stale ones go back to the capture thread
+		while( (f = spsc_pop( &capture.full )) )
+		{
+			if( frame )
+			{
+				frame_release( frame );
+				spsc_push( &capture.empty, frame );
+				dropped++;
+				metrics_add( METRIC_DROPPED, 1 );
+			}
+			frame = f;
+		}
 
-		if( capture_frames( &callback_data, still_port, pool_out, MAX_FRAMES ) ) {
-			ERROR( "failed to capture shot x" );
+		while( sched_get_result( sched, &res, 0 ) == 0 )
+			handle_result( &res, cfg.bin, sa );
+
+		if( capture.failed )
 			goto error;
+
+		if( write_requested )
+		{
+			write_requested = 0;
+			if( sa )
+				shiftadd_request_write( sa );
+		}
+		if( trace_requested )
+		{
+			trace_requested = 0;
+			trace_dump();
+			perf_report();
 		}
 
+		if( !frame )
+		{
+			usleep( 1000 );
+			continue;
+		}
+		if( !sched_wait_ready( sched, 5 ) )
+			continue;
+
 #ifdef HC_DEBUG
 		// DEBUG overwrite frame with stars
 		shift_x += (random()&0x1f) - 16;
@@ -534,70 +1223,149 @@ int main(int argc, char *argv[])
 			shift_y = 0;
 		DEBUG( "shiftx: %d, shift_y: %d", shift_x, shift_y );
 
-		dbg_copy_stars( &img2, &star_base, DBG_PAD_X + shift_x, DBG_PAD_Y + shift_y );
+		// stars displaced by minus the shift, as handle_result takes it back
+		synth_frame( stars, &frame->pix, -shift_x, -shift_y, frame->seq );
 #endif /* HC_DEBUG */
 		
 	
+		// binned in parallel bands, the binned frame is copied by sched_submit
+		bin_start = trace_begin();
+		pix = bin ? bin_frame( bin, &frame->pix ) : &frame->pix;
+		t = bin ? trace_end( TRACE_BIN, bin_start ) / 1000 : 0;
+		bin_us += t;
+
+		// copied for the stack before the correlation, a frame without a free
+		// slot is only left out of the stack
+		if( pix && sa )
+			shiftadd_push( sa, pix, frame->seq );
+
 		// TODO we could save a lot of time when calculating the FFT of the first pic in advance
-		if( pixPhaseCorrelate_GPU( &img1, &img2, &peak, &xloc, &yloc ) )
+		frame->times.t[LAT_SUBMITTED] = now_us();
+		if( !pix || sched_submit( sched, pix, frame->seq, &frame->times ) )
 		{
 			ERROR("cannot phase correlate");
 			goto error;		
 		}
-		else
-	    	MSG("peak: %.2f, x: %d, y:%d", peak, xloc, yloc );
-
-		
-		// TODO Motor control goes here
-
-#ifdef HC_DEBUG
-		shift_x -= xloc;
-		shift_y -= yloc;
-		
-		if( abs(shift_x) > DBG_PAD_X - 15  )
-			shift_x = 0;
-		if( abs(shift_y) > DBG_PAD_Y - 15 )
-			shift_y = 0;
-		
-		aft = millis();
-		DEBUG("loop in %5d millis", aft-bef );
-		bef = aft;
-#endif /* HC_DEBUG */
+		processed++;
+		metrics_add( METRIC_PROCESSED, 1 );
+		frame_release( frame );
+		spsc_push( &capture.empty, frame );
+		frame = NULL;
+
+		// frame to frame, waits for a frame and a free backend included
+		loop_us = trace_end( TRACE_LOOP, loop_t ) / 1000;
+		loop_t = trace_begin();
+		metrics_set( METRIC_LOOP_US, loop_us );
+		DEBUG("loop in %5ld us, binning %ld us", loop_us, t );
 	} while( keep_looping );
 
+	pthread_join( capture_tid, NULL );
+	loop_us = now_us() - loop_start;
+	MSG( "%lu frames captured, %lu dropped, %lu processed in %.1f s: %.2f fps captured, %.2f fps processed",
+		 capture.captured, dropped, processed, loop_us / 1e6, capture.captured * 1e6 / loop_us,
+		 processed * 1e6 / loop_us );
+	if( bin && processed )
+		MSG( "binning %dx%d to %ux%u: avg %ld us per frame", cfg.bin, cfg.bin, bin->out.width, bin->out.height,
+			 bin_us / (long)processed );
+	for( i = 0; i < FRAME_RING; i++ )
+		frame_release( &frames[i] );
+	if( camera_port )
+	{
+		set_streaming( camera_port, &cfg, 0 );
+		mmal_port_disable( camera_port );
+	}
+	rec_close( capture.rec );
+	replay_close( capture.replay );
+
+	while( sched_get_result( sched, &res, 1 ) == 0 )
+		handle_result( &res, cfg.bin, sa );
+	if( lat_frames && lat_us[LAT_ARRIVED] > 0 )
+		MSG( "arrival to output: avg %ld us per frame, capture %.0f%%, handover %.0f%%, sched queue %.0f%%, "
+			 "correlation %.0f%%, result %.0f%%", lat_us[LAT_ARRIVED] / (long)lat_frames,
+			 100.0 * lat_us[LAT_CAPTURED] / lat_us[LAT_ARRIVED], 100.0 * lat_us[LAT_SUBMITTED] / lat_us[LAT_ARRIVED],
+			 100.0 * lat_us[LAT_STARTED] / lat_us[LAT_ARRIVED], 100.0 * lat_us[LAT_DONE] / lat_us[LAT_ARRIVED],
+			 100.0 * lat_us[LAT_OUTPUT] / lat_us[LAT_ARRIVED] );
+	sched_log_stats( sched );
+	sched_destroy( sched );
+	trace_dump();
+	perf_report();
+	metrics_stop();
+	if( sa )
+		shiftadd_request_write( sa );
+	shiftadd_destroy( sa );
+	stack_destroy( stack );
+	bin_destroy( bin );
+	calib_free( cal );
 	
-	
-	vcos_semaphore_delete(&callback_data.complete_semaphore);
+	if( semaphores )
+	{
+		vcos_semaphore_delete(&callback_data.complete_semaphore);
+		vcos_semaphore_delete(&callback_data.end_semaphore);
+	}
 	
 #ifdef HC_DEBUG
-	free( star_base.data );
+	synth_destroy( stars );
 #endif /* HC_DEBUG */
 
 	
 	// free_fft_gpu( frame1_fft_gpu );
 
-	free( img1.data );
-	free( img2.data );
-
-		
-    mmal_component_destroy( camera_component );
+	spsc_free( &capture.empty );
+	spsc_free( &capture.full );
+	if( camera_component )
+	{
+		mmal_queue_destroy( callback_data.frame_queue );
+	    mmal_component_destroy( camera_component );
+	}
+	free( callback_data.arrived );
 
 	return 0;
 
 error:
-	vcos_semaphore_delete(&callback_data.complete_semaphore);
+	if( capture_running )
+	{
+		keep_looping = 0;
+		pthread_join( capture_tid, NULL );
+	}
+	metrics_stop();
+	sched_destroy( sched );
+	shiftadd_destroy( sa );
+	stack_destroy( stack );
+	bin_destroy( bin );
+	calib_free( cal );
+#ifdef HC_DEBUG
+	synth_destroy( stars );
+#endif /* HC_DEBUG */
+	rec_close( capture.rec );
+	replay_close( capture.replay );
+	// the camera buffers the frames still hold go back before the port is disabled
+	frame_release( &ref_frame );
+	for( i = 0; i < FRAME_RING; i++ )
+		frame_release( &frames[i] );
+	if( streaming )
+		set_streaming( camera_port, &cfg, 0 );
+	if( semaphores )
+	{
+		vcos_semaphore_delete(&callback_data.complete_semaphore);
+		vcos_semaphore_delete(&callback_data.end_semaphore);
+	}
 
 
-	if( still_port ) {
-		mmal_port_disable( still_port );
+	if( camera_port ) {
+		mmal_port_disable( camera_port );
 	}
+	spsc_free( &capture.empty );
+	spsc_free( &capture.full );
+	if( callback_data.frame_queue )
+		mmal_queue_destroy( callback_data.frame_queue );
 	if( camera_component )
 	{
 		mmal_component_disable( camera_component );
 		mmal_component_destroy( camera_component );
 	}
+	free( callback_data.arrived );
 	
-	return (-1);
+	return (ret);
 
 }
 
@@ -5,6 +5,7 @@
 #include <interface/mmal/mmal.h>
 
 
+#define MMAL_CAMERA_VIDEO_PORT 1
 #define MMAL_CAMERA_CAPTURE_PORT 2
 
 // #define MAX_CAM_WIDTH 2592
@@ -12,6 +13,8 @@
 // #define MAX_CAM_HEIGHT 1944
 // #define MAX_CAM_HEIGHT_PADDED 1952
 
+// The GPU correlator takes any size, w != h and non powers of 2 are padded
+// (e.g. 2048 x 1024 at native aspect ratio)
 #define MAX_CAM_WIDTH 1024
 #define MAX_CAM_WIDTH_PADDED 1024
 #define MAX_CAM_HEIGHT 1024
@@ -29,28 +32,106 @@
 #define STILLS_FRAME_RATE_NUM 3
 #define STILLS_FRAME_RATE_DEN 1
 
+// frame rate of the video port in streaming mode, -fps
+#define VIDEO_FRAME_RATE_NUM 15
+#define VIDEO_FRAME_RATE_DEN 1
+
+// camera set-up, from the command line
+#define CAM_MODE_STILL 0   // one still capture per sub-exposure
+#define CAM_MODE_VIDEO 1   // continuous frames from the video port
+
+typedef struct {
+	int mode;              // CAM_MODE_STILL or CAM_MODE_VIDEO
+	int night;
+	uint32_t width;        // image size, lines are padded by the camera
+	uint32_t height;
+	uint32_t fps_num;      // frame rate of the port
+	uint32_t fps_den;
+	int frames;            // sub-exposures stacked into one frame
+	float kappa;           // sigma clipping of the stack, 0 off
+	int bin;               // box binning before correlation, 2 or 4, 1 off
+} cam_config_t;
+
 typedef struct
 {
-   void *image_buffer;			/// File handle to write buffer data to
-   uint32_t max_bytes;
-   uint32_t bytes_written;
-   uint32_t current_frame;
-   VCOS_SEMAPHORE_T complete_semaphore; /// semaphore which is posted when we reach end of frame (indicates end of capture or fault)
+   MMAL_QUEUE_T *frame_queue;   /// buffer headers of complete Y planes, in place until processed
+   uint32_t stride;             /// bytes per line of the Y plane
+   uint32_t y_bytes;            /// size of the Y plane, a buffer with less does not start a frame
+   uint32_t frame_pos;          /// bytes of the current frame received so far
+   int frame_queued;            /// Y plane of the current frame is in frame_queue
+   int stills;                  /// post end_semaphore at the end of every frame
+   int end_pending;             /// capture_frames: a still capture has not ended yet
+   VCOS_SEMAPHORE_T complete_semaphore; /// semaphore which is posted when the Y plane is complete (or the capture failed)
+   VCOS_SEMAPHORE_T end_semaphore;      /// posted when the rest of a still has arrived as well
    MMAL_POOL_T *camera_pool;
+   int64_t *arrived;            /// per buffer of camera_pool, its user_data: stamped when its Y plane is queued
 } PORT_USERDATA;
 
+// batched phase correlation: one reference against k frames,
+// or one frame against k references
+#define PHASECORR_BATCH_FRAMES 0
+#define PHASECORR_BATCH_REFS   1
+
+// stages of a phase correlation, their time is added up in pc_times_t
+// by fft.c and fft_gpu.c if set with fft_set_times() / fft_gpu_set_times()
+#define PC_STAGE_CONVERT   0   // 8 bit to float or complex, calibration
+#define PC_STAGE_FORWARD   1   // forward FFTs, on the GPU QPU time
+#define PC_STAGE_TRANSPOSE 2   // between row and column FFTs, GPU only
+#define PC_STAGE_CROSS     3   // cross-power spectra
+#define PC_STAGE_INVERSE   4   // inverse FFTs, on the GPU QPU time
+#define PC_STAGE_PEAK      5   // peak search
+#define PC_STAGES          6
+
+typedef struct {
+	long us[PC_STAGES];
+} pc_times_t;
+
+// luminance images, pixel x of line y at data[y*stride + x*step]. Set up
+// with pixInit() or pixCreate(), views with pixView() etc., see image.h
 typedef struct {
 	uint32_t width;
 	uint32_t height;
+	uint32_t stride; // floats from one line to the next, >= width * step
+	uint32_t step;   // floats from one pixel to the next, 1 but in subsampled views
+	uint32_t align;  // bytes data and every line are aligned to
+	int owner;       // data was allocated with the image, freed with it
 	float *data;
 } fpix_y_t;
 
 typedef struct {
 	uint32_t width;
 	uint32_t height;
+	uint32_t stride; // bytes from one line to the next, >= width * step
+	uint32_t step;   // bytes from one pixel to the next, 1 but in subsampled views
+	uint32_t align;  // bytes data and every line are aligned to
+	int owner;       // data was allocated with the image, freed with it
 	uint8_t *data;
 } pix_y_t;
 
+// points a frame passes from the camera to the correction, in frame_times_t
+#define LAT_ARRIVED   0   // Y plane of its first sub-exposure in y_writer_callback
+#define LAT_CAPTURED  1   // all sub-exposures in and averaged
+#define LAT_SUBMITTED 2   // taken by the processing loop, binned, to the scheduler
+#define LAT_STARTED   3   // correlation started on a backend
+#define LAT_DONE      4   // correlation done
+#define LAT_OUTPUT    5   // shift handed on
+#define LAT_POINTS    6
+
+typedef struct {
+	int64_t pts;              // camera's, of the first sub-exposure, -1 if unknown
+	int64_t t[LAT_POINTS];    // us, CLOCK_MONOTONIC, 0 where not passed
+} frame_times_t;
+
+// frame buffers circulating between capture and processing thread
+#define FRAME_RING 4
+
+typedef struct {
+	pix_y_t pix;                  // Y plane inside header's buffer
+	uint32_t seq;
+	MMAL_BUFFER_HEADER_T *header; // goes back to the pool when processed, NULL if replayed
+	frame_times_t times;
+} frame_t;
+
 
 
 #endif // MMALYUV
\ No newline at end of file
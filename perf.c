@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "log.h"
+#include "perf.h"
+
+typedef struct {
+	uint64_t calls;
+	uint64_t pixels;
+	uint64_t count[PERF_EVENTS];
+} perf_stage_t;
+
+/*
+ * Counters of one thread, written by it alone, like the histograms of
+ * trace.c. Threads stay on the list for the report at exit
+ */
+typedef struct perf_thread {
+	struct perf_thread *next;
+	int leader;                   // fd of the group, -1 if nothing opened
+	int nr;                       // events in the group
+	int event[PERF_EVENTS];       // PERF_* in the order of the group read
+	uint64_t pixels;
+	uint64_t start[PERF_EVENTS];
+	perf_stage_t stage[TRACE_STAGES];
+} perf_thread_t;
+
+int perf_enabled;
+
+static perf_thread_t *threads;
+static __thread perf_thread_t *self;
+static int available;             // 1 << PERF_*, opened by any thread
+static int no_memory;
+
+static const struct {
+	uint32_t type;
+	uint64_t config;
+	const char *name;
+} events[PERF_EVENTS] = {
+	[PERF_CYCLES]        = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles" },
+	[PERF_INSTRUCTIONS]  = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions" },
+	[PERF_CACHE_MISSES]  = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache misses" },
+	[PERF_BRANCH_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch misses" },
+	[PERF_TASK_CLOCK]    = { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task clock" },
+	[PERF_PAGE_FAULTS]   = { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "page faults" },
+};
+
+static int open_event( int e, int group )
+{
+	struct perf_event_attr attr;
+
+	memset( &attr, 0, sizeof(attr) );
+	attr.size = sizeof(attr);
+	attr.type = events[e].type;
+	attr.config = events[e].config;
+	attr.read_format = PERF_FORMAT_GROUP;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall( __NR_perf_event_open, &attr, 0, -1, group, 0 );
+}
+
+/*
+ * Group of the counters of the calling thread: led by the first event that
+ * opens, the others that do not open are left out
+ */
+static perf_thread_t *perf_register( void )
+{
+	perf_thread_t *t;
+	int e, fd;
+
+	if( no_memory )
+		return NULL;
+	t = calloc( 1, sizeof(*t) );
+	if( !t )
+	{
+		no_memory = 1;
+		ERROR( "out of memory, no counters for this thread" );
+		return NULL;
+	}
+	t->leader = -1;
+	for( e = 0; e < PERF_EVENTS; e++ )
+	{
+		fd = open_event( e, t->leader );
+		if( fd < 0 )
+		{
+			DEBUG( "no %s counter", events[e].name );
+			continue;
+		}
+		if( t->leader < 0 )
+			t->leader = fd;
+		t->event[t->nr++] = e;
+		__atomic_or_fetch( &available, 1 << e, __ATOMIC_RELAXED );
+	}
+	if( t->leader < 0 )
+		WARN( "no performance counters, see /proc/sys/kernel/perf_event_paranoid" );
+
+	t->next = __atomic_load_n( &threads, __ATOMIC_ACQUIRE );
+	while( !__atomic_compare_exchange_n( &threads, &t->next, t, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE ) )
+		;
+	self = t;
+	return t;
+}
+
+/*
+ * Current counts of the group into v, by PERF_*
+ * returns -1 if the group cannot be read
+ */
+static int read_group( perf_thread_t *t, uint64_t *v )
+{
+	uint64_t buf[1 + PERF_EVENTS];
+	int i;
+
+	if( t->leader < 0 || read( t->leader, buf, sizeof(buf) ) < (ssize_t)((1 + t->nr) * sizeof(uint64_t)) )
+		return (-1);
+	for( i = 0; i < t->nr && i < (int)buf[0]; i++ )
+		v[t->event[i]] = buf[1 + i];
+	return (0);
+}
+
+/*
+ * Profile the stages from now on. The counters of a thread are opened on
+ * its first perf_begin()
+ * returns -1 if perf_event_open() is not there or not permitted
+ */
+int perf_enable( void )
+{
+	int fd = open_event( PERF_TASK_CLOCK, -1 );
+
+	if( fd < 0 )
+	{
+		ERROR( "cannot open performance counters, see /proc/sys/kernel/perf_event_paranoid" );
+		return (-1);
+	}
+	close( fd );
+	perf_enabled = 1;
+	MSG( "performance counters per stage enabled" );
+	return (0);
+}
+
+void perf_pixels_( uint64_t n )
+{
+	perf_thread_t *t = self ? self : perf_register();
+
+	if( t )
+		t->pixels = n;
+}
+
+void perf_begin_( void )
+{
+	perf_thread_t *t = self ? self : perf_register();
+
+	if( t )
+		read_group( t, t->start );
+}
+
+void perf_end_( int stage )
+{
+	perf_thread_t *t = self;
+	uint64_t v[PERF_EVENTS];
+	perf_stage_t *s;
+	int i, e;
+
+	if( !t || stage < 0 || stage >= TRACE_STAGES || read_group( t, v ) )
+		return;
+	s = &t->stage[stage];
+	// one writer, the stores are atomic only for perf_report to read them whole
+	for( i = 0; i < t->nr; i++ )
+	{
+		e = t->event[i];
+		__atomic_store_n( &s->count[e], s->count[e] + (v[e] - t->start[e]), __ATOMIC_RELAXED );
+	}
+	__atomic_store_n( &s->pixels, s->pixels + t->pixels, __ATOMIC_RELAXED );
+	__atomic_store_n( &s->calls, s->calls + 1, __ATOMIC_RELEASE );
+}
+
+/*
+ * Forget the counts so far, while no thread profiles
+ */
+void perf_reset( void )
+{
+	perf_thread_t *t;
+
+	for( t = __atomic_load_n( &threads, __ATOMIC_ACQUIRE ); t; t = t->next )
+		memset( t->stage, 0, sizeof(t->stage) );
+}
+
+/*
+ * Log per stage, over all threads: calls, IPC, and per pixel cache misses,
+ * branch misses, task clock ns and page faults. - where not counted
+ */
+void perf_report( void )
+{
+	perf_thread_t *t;
+	perf_stage_t sum;
+	char col[PERF_EVENTS][16];
+	double px;
+	int s, e;
+
+	if( !perf_enabled )
+		return;
+	MSG( "counters per stage: calls, IPC, per pixel: cache misses, branch misses, task clock ns, page faults" );
+	for( s = 0; s < TRACE_STAGES; s++ )
+	{
+		memset( &sum, 0, sizeof(sum) );
+		for( t = __atomic_load_n( &threads, __ATOMIC_ACQUIRE ); t; t = t->next )
+		{
+			if( !__atomic_load_n( &t->stage[s].calls, __ATOMIC_ACQUIRE ) )
+				continue;
+			sum.calls += t->stage[s].calls;
+			sum.pixels += __atomic_load_n( &t->stage[s].pixels, __ATOMIC_RELAXED );
+			for( e = 0; e < PERF_EVENTS; e++ )
+				sum.count[e] += __atomic_load_n( &t->stage[s].count[e], __ATOMIC_RELAXED );
+		}
+		if( !sum.calls )
+			continue;
+
+		px = sum.pixels ? sum.pixels : 1;
+		for( e = 0; e < PERF_EVENTS; e++ )
+		{
+			if( !(available & (1 << e)) )
+				strcpy( col[e], "-" );
+			else if( e == PERF_INSTRUCTIONS )
+				snprintf( col[e], sizeof(col[e]), "%.2f",
+						  sum.count[PERF_CYCLES] ? (double)sum.count[e] / sum.count[PERF_CYCLES] : 0.0 );
+			else
+				snprintf( col[e], sizeof(col[e]), "%.4f", sum.count[e] / px );
+		}
+		if( !(available & (1 << PERF_CYCLES)) )
+			strcpy( col[PERF_INSTRUCTIONS], "-" );
+		MSG( "%-16s %8llu %8s %10s %10s %10s %10s", trace_stage_name( s ), (unsigned long long)sum.calls,
+			 col[PERF_INSTRUCTIONS], col[PERF_CACHE_MISSES], col[PERF_BRANCH_MISSES], col[PERF_TASK_CLOCK],
+			 col[PERF_PAGE_FAULTS] );
+	}
+}
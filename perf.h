@@ -0,0 +1,62 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdint.h>
+#include "trace.h"
+
+/*
+ * Hardware counters per stage of the phase correlation, opt-in with
+ * perf_enable(): whether a stage is bound by memory or by compute shows in
+ * its instructions per cycle and its cache misses per pixel, which the
+ * wall clock of trace.c does not tell.
+ *
+ * Each thread that profiles opens its own group of perf_event_open()
+ * counters, user space only: cycles, instructions, cache misses, branch
+ * misses, and the task clock and page faults in software, which are there
+ * where the PMU is not (VMs, perf_event_paranoid). What cannot be opened is
+ * left out of the report. A stage reads the group on perf_begin() and on
+ * perf_end(), one read() each.
+ *
+ * Stages are those of trace.h (TRACE_FFTW + PC_STAGE_*, ...). Counts are
+ * per pixel of the frames the thread has set with perf_pixels().
+ */
+
+#define PERF_CYCLES        0
+#define PERF_INSTRUCTIONS  1
+#define PERF_CACHE_MISSES  2
+#define PERF_BRANCH_MISSES 3
+#define PERF_TASK_CLOCK    4   // ns
+#define PERF_PAGE_FAULTS   5
+#define PERF_EVENTS        6
+
+extern int perf_enabled;
+
+int perf_enable( void );
+void perf_report( void );
+void perf_reset( void );
+
+void perf_pixels_( uint64_t n );
+void perf_begin_( void );
+void perf_end_( int stage );
+
+// pixels of the frames processed next by this thread
+static inline void perf_pixels( uint64_t n )
+{
+	if( perf_enabled )
+		perf_pixels_( n );
+}
+
+static inline void perf_begin( void )
+{
+	if( perf_enabled )
+		perf_begin_();
+}
+
+// counts since perf_begin() to stage
+static inline void perf_end( int stage )
+{
+	if( perf_enabled )
+		perf_end_( stage );
+}
+
+#endif /* PERF_H */
@@ -0,0 +1,344 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // sync_file_range
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "record.h"
+#include "image.h"
+#include "trace.h"
+
+#define PAGE_UP(x) (((x) + REC_PAGE - 1) & ~(size_t)(REC_PAGE - 1))
+
+static uint8_t *frame_data( uint8_t *map, const rec_header_t *hdr, uint32_t k )
+{
+	return map + hdr->data_offset + (size_t)k * hdr->frame_size;
+}
+
+/*
+ * Fault in the pages of a frame without storing to them: writable where
+ * the kernel has MADV_POPULATE_WRITE (5.14), else a read per page, which
+ * leaves rec_append a minor fault per page
+ */
+static void prefault( uint8_t *data, size_t size )
+{
+	volatile const uint8_t *p = data;
+	size_t i;
+
+#ifdef MADV_POPULATE_WRITE
+	if( madvise( data, size, MADV_POPULATE_WRITE ) == 0 )
+		return;
+#endif
+	for( i = 0; i < size; i += REC_PAGE )
+		(void)p[i];
+}
+
+/*
+ * Recorder thread: faults in the frames ahead of the next append and
+ * starts the write-back of the ones appended, until rec_close
+ */
+static void *rec_thread( void *arg )
+{
+	recorder_t *rec = arg;
+	uint32_t k, ahead;
+
+	pthread_mutex_lock( &rec->lock );
+	for( ;; )
+	{
+		ahead = rec->hdr->frames + REC_AHEAD;
+		if( ahead > rec->hdr->max_frames )
+			ahead = rec->hdr->max_frames;
+		// frame hdr->frames may be being copied by rec_append, the ones
+		// before are done: not touched
+		if( rec->faulted <= rec->hdr->frames )
+			rec->faulted = rec->hdr->frames + 1;
+
+		if( rec->faulted < ahead && !rec->quit )
+		{
+			k = rec->faulted;
+			pthread_mutex_unlock( &rec->lock );
+			prefault( frame_data( rec->map, rec->hdr, k ), rec->hdr->frame_size );
+			pthread_mutex_lock( &rec->lock );
+			rec->faulted = k + 1;
+		}
+		else if( rec->written < rec->hdr->frames )
+		{
+			k = rec->written;
+			pthread_mutex_unlock( &rec->lock );
+			sync_file_range( rec->fd, rec->hdr->data_offset + (off_t)k * rec->hdr->frame_size,
+							 rec->hdr->frame_size, SYNC_FILE_RANGE_WRITE );
+			pthread_mutex_lock( &rec->lock );
+			rec->written++;
+		}
+		else if( rec->quit )
+			break;
+		else
+			pthread_cond_wait( &rec->wake, &rec->lock );
+	}
+	pthread_mutex_unlock( &rec->lock );
+	return NULL;
+}
+
+/*
+ * Create file for up to max_frames frames of width x height, captured as
+ * set up in cfg. The file is allocated in full right away
+ * returns NULL on error
+ */
+recorder_t *rec_create( const char *file, uint32_t width, uint32_t height, uint32_t max_frames, cam_config_t *cfg )
+{
+	recorder_t *rec;
+	size_t index_size, frame_size;
+	int err;
+
+	if( !width || !height || !max_frames )
+	{
+		ERROR( "cannot record %u frames of %u x %u", max_frames, width, height );
+		return NULL;
+	}
+	rec = calloc( 1, sizeof(*rec) );
+	if( !rec || !(rec->file = strdup( file )) )
+	{
+		ERROR( "out of memory" );
+		free( rec );
+		return NULL;
+	}
+
+	index_size = PAGE_UP( (size_t)max_frames * sizeof(rec_index_t) );
+	frame_size = PAGE_UP( (size_t)width * height );
+	rec->map_size = REC_PAGE + index_size + max_frames * frame_size;
+
+	rec->fd = open( file, O_RDWR | O_CREAT | O_TRUNC, 0644 );
+	if( rec->fd < 0 )
+	{
+		ERROR( "cannot create %s", file );
+		goto fail;
+	}
+	err = posix_fallocate( rec->fd, 0, rec->map_size );
+	if( err )
+	{
+		ERROR( "cannot allocate %lu MB for %s: %s", (unsigned long)(rec->map_size >> 20), file, strerror( err ) );
+		goto fail;
+	}
+	rec->map = mmap( NULL, rec->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, rec->fd, 0 );
+	if( rec->map == MAP_FAILED )
+	{
+		rec->map = NULL;
+		ERROR( "cannot map %s", file );
+		goto fail;
+	}
+
+	rec->hdr = (rec_header_t *)rec->map;
+	memcpy( rec->hdr->magic, REC_MAGIC, sizeof(rec->hdr->magic) );
+	rec->hdr->width = width;
+	rec->hdr->height = height;
+	rec->hdr->frame_size = frame_size;
+	rec->hdr->max_frames = max_frames;
+	rec->hdr->frames = 0;
+	rec->hdr->mode = cfg->mode;
+	rec->hdr->fps_num = cfg->fps_num;
+	rec->hdr->fps_den = cfg->fps_den;
+	rec->hdr->sub_exposures = cfg->frames;
+	rec->hdr->bin = cfg->bin;
+	rec->hdr->index_offset = REC_PAGE;
+	rec->hdr->data_offset = REC_PAGE + index_size;
+	rec->index = (rec_index_t *)(rec->map + REC_PAGE);
+
+	pthread_mutex_init( &rec->lock, NULL );
+	pthread_cond_init( &rec->wake, NULL );
+	if( pthread_create( &rec->tid, NULL, rec_thread, rec ) )
+	{
+		ERROR( "cannot start recorder thread" );
+		pthread_cond_destroy( &rec->wake );
+		pthread_mutex_destroy( &rec->lock );
+		goto fail;
+	}
+
+	MSG( "recording up to %u frames of %u x %u to %s, %lu MB", max_frames, width, height, file,
+		 (unsigned long)(rec->map_size >> 20) );
+	return rec;
+
+fail:
+	if( rec->map )
+		munmap( rec->map, rec->map_size );
+	if( rec->fd >= 0 )
+	{
+		close( rec->fd );
+		unlink( file );
+	}
+	free( rec->file );
+	free( rec );
+	return NULL;
+}
+
+/*
+ * Append pix (any stride or view, of the recorder's size) as frame seq, captured at
+ * usecs, with the camera's pts or -1
+ * returns -1 if the file is full or pix has another size, 0 otherwise
+ */
+int rec_append( recorder_t *rec, pix_y_t *pix, uint32_t seq, int64_t usecs_captured, int64_t pts )
+{
+	rec_header_t *hdr = rec->hdr;
+	uint32_t k = hdr->frames;
+	pix_y_t dst;
+	long t = now_us();
+
+	if( pix->width != hdr->width || pix->height != hdr->height )
+	{
+		ERROR( "cannot record %u x %u into %u x %u", pix->width, pix->height, hdr->width, hdr->height );
+		return (-1);
+	}
+	if( k >= hdr->max_frames )
+	{
+		if( !rec->full++ )
+			WARN( "%s is full, %u frames", rec->file, k );
+		return (-1);
+	}
+
+	pixInit( &dst, frame_data( rec->map, hdr, k ), hdr->width, hdr->height, hdr->width );
+	pixCopy( &dst, pix );
+	rec->index[k].usecs = usecs_captured;
+	rec->index[k].pts = pts;
+	rec->index[k].seq = seq;
+
+	// the index entry before the count that makes it valid
+	__sync_synchronize();
+	pthread_mutex_lock( &rec->lock );
+	hdr->frames = k + 1;
+	pthread_cond_signal( &rec->wake );
+	pthread_mutex_unlock( &rec->lock );
+
+	t = now_us() - t;
+	rec->copy_us += t;
+	if( t > rec->max_us )
+		rec->max_us = t;
+	return (0);
+}
+
+/*
+ * Finish the recording, the file is cut down to the frames recorded
+ */
+void rec_close( recorder_t *rec )
+{
+	uint32_t frames;
+
+	if( !rec )
+		return;
+	pthread_mutex_lock( &rec->lock );
+	rec->quit = 1;
+	pthread_cond_signal( &rec->wake );
+	pthread_mutex_unlock( &rec->lock );
+	pthread_join( rec->tid, NULL );
+	pthread_cond_destroy( &rec->wake );
+	pthread_mutex_destroy( &rec->lock );
+
+	frames = rec->hdr->frames;
+	msync( rec->map, rec->map_size, MS_SYNC );
+	if( ftruncate( rec->fd, rec->hdr->data_offset + (off_t)frames * rec->hdr->frame_size ) )
+		WARN( "cannot truncate %s", rec->file );
+	munmap( rec->map, rec->map_size );
+	close( rec->fd );
+
+	MSG( "%s: %u frames recorded, %lu left out, append avg %ld us, max %ld us", rec->file, frames,
+		 rec->full, frames ? rec->copy_us / (long)frames : 0, rec->max_us );
+	free( rec->file );
+	free( rec );
+}
+
+/*
+ * Map a recording for replay, at the recorded pace if realtime
+ * returns NULL on error
+ */
+replay_t *replay_open( const char *file, int realtime )
+{
+	replay_t *rp;
+	const rec_header_t *hdr;
+	struct stat sb;
+	int fd;
+
+	fd = open( file, O_RDONLY );
+	if( fd < 0 || fstat( fd, &sb ) || sb.st_size < REC_PAGE )
+	{
+		ERROR( "cannot open recording %s", file );
+		if( fd >= 0 )
+			close( fd );
+		return NULL;
+	}
+	rp = calloc( 1, sizeof(*rp) );
+	if( !rp )
+	{
+		ERROR( "out of memory" );
+		close( fd );
+		return NULL;
+	}
+	// private: frames are handed out where they are, writes go to copies
+	rp->map_size = sb.st_size;
+	rp->map = mmap( NULL, rp->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+	close( fd );
+	if( rp->map == MAP_FAILED )
+	{
+		ERROR( "cannot map %s", file );
+		free( rp );
+		return NULL;
+	}
+
+	rp->hdr = hdr = (const rec_header_t *)rp->map;
+	if( memcmp( hdr->magic, REC_MAGIC, sizeof(hdr->magic) ) || !hdr->frames ||
+		hdr->frame_size < (size_t)hdr->width * hdr->height ||
+		hdr->index_offset + (size_t)hdr->frames * sizeof(rec_index_t) > rp->map_size ||
+		hdr->data_offset + (size_t)hdr->frames * hdr->frame_size > rp->map_size )
+	{
+		ERROR( "%s is no recording or empty", file );
+		replay_close( rp );
+		return NULL;
+	}
+	rp->index = (const rec_index_t *)(rp->map + hdr->index_offset);
+	rp->realtime = realtime;
+	madvise( rp->map, rp->map_size, MADV_SEQUENTIAL );
+
+	MSG( "replaying %u frames of %u x %u from %s, %s", hdr->frames, hdr->width, hdr->height, file,
+		 realtime ? "at the recorded pace" : "as fast as taken" );
+	return rp;
+}
+
+/*
+ * The next frame into pix, in place in the mapping, stride = width
+ * returns 1 after the last frame, 0 otherwise
+ */
+int replay_next( replay_t *rp, pix_y_t *pix )
+{
+	struct timespec ts;
+	long due;
+
+	if( rp->next >= rp->hdr->frames )
+		return 1;
+
+	if( rp->realtime )
+	{
+		if( !rp->next )
+			rp->start = now_us();
+		due = rp->start + (rp->index[rp->next].usecs - rp->index[0].usecs);
+		ts.tv_sec = due / 1000000;
+		ts.tv_nsec = (due % 1000000) * 1000;
+		clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL );
+	}
+
+	pixInit( pix, frame_data( rp->map, rp->hdr, rp->next ), rp->hdr->width, rp->hdr->height, rp->hdr->width );
+	rp->next++;
+	return 0;
+}
+
+void replay_close( replay_t *rp )
+{
+	if( !rp )
+		return;
+	munmap( rp->map, rp->map_size );
+	free( rp );
+}
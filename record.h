@@ -0,0 +1,93 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "mmalyuv.h"
+
+/*
+ * Recording of the captured frames and their replay in place of the camera.
+ *
+ * A recording is one preallocated segment file, mapped with mmap: a header
+ * page with the capture set-up, the index with one entry per frame
+ * (timestamp, sequence number, camera pts), then the Y planes without
+ * padding, each starting on a page. Appending is a copy into the mapping;
+ * a thread of the recorder faults in the pages ahead of it and starts the
+ * write-back behind it, so the copy neither waits for the disk nor
+ * piles up dirty memory.
+ *
+ * The replay maps the file read-only and hands out the frames where they
+ * are, at the recorded pace or as fast as they are taken.
+ */
+
+#define REC_MAGIC "MMALREC1"
+#define REC_PAGE  4096
+
+// frames preallocated, -recframes
+#define REC_FRAMES 600
+
+// frames faulted in ahead of the next one appended
+#define REC_AHEAD 4
+
+typedef struct {
+	char magic[8];
+	uint32_t width;          // of the frames, lines are not padded
+	uint32_t height;
+	uint32_t frame_size;     // bytes per frame in the file, multiple of REC_PAGE
+	uint32_t max_frames;     // preallocated
+	uint32_t frames;         // recorded, entries of the index that are valid
+	uint32_t mode;           // cam_config_t of the recording
+	uint32_t fps_num;
+	uint32_t fps_den;
+	uint32_t sub_exposures;
+	uint32_t bin;
+	uint64_t index_offset;
+	uint64_t data_offset;
+} rec_header_t;
+
+typedef struct {
+	int64_t usecs;           // captured, CLOCK_MONOTONIC
+	int64_t pts;             // of the camera buffer, -1 if none
+	uint32_t seq;
+	uint32_t reserved;
+} rec_index_t;
+
+typedef struct {
+	int fd;
+	uint8_t *map;
+	size_t map_size;
+	rec_header_t *hdr;
+	rec_index_t *index;
+	char *file;
+
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	uint32_t faulted;        // frames faulted in, by the thread
+	uint32_t written;        // frames whose write-back has been started
+	int quit;
+
+	unsigned long full;      // frames not recorded, file full
+	long copy_us;            // total time in rec_append
+	long max_us;
+} recorder_t;
+
+typedef struct {
+	uint8_t *map;
+	size_t map_size;
+	const rec_header_t *hdr;
+	const rec_index_t *index;
+	int realtime;            // at the recorded pace
+	uint32_t next;
+	long start;              // replay of frame 0, CLOCK_MONOTONIC
+} replay_t;
+
+recorder_t *rec_create( const char *file, uint32_t width, uint32_t height, uint32_t max_frames, cam_config_t *cfg );
+int rec_append( recorder_t *rec, pix_y_t *pix, uint32_t seq, int64_t usecs, int64_t pts );
+void rec_close( recorder_t *rec );
+
+replay_t *replay_open( const char *file, int realtime );
+int replay_next( replay_t *rp, pix_y_t *pix );
+void replay_close( replay_t *rp );
+
+#endif /* RECORD_H */
@@ -0,0 +1,487 @@
+/*
+ * Regression check of the phase correlation: accuracy and time per stage
+ * of each backend, FFTW (fft.c), FFTW in place and gpu_fft (fft_gpu.c),
+ * at each frame size, on synthetic star fields (synth.c).
+ *
+ * Frames are the field shifted by known amounts, integer ones and ones by
+ * fractions of a pixel, each with noise of its own, against the unshifted
+ * field. Integer shifts must be found exactly. The backends find whole
+ * pixels, a fractional shift must come out as one of the two next to it.
+ *
+ * The median time of each stage (PC_STAGE_*) and in total is held against
+ * a budget file, lines of "<backend> <w>x<h> <stage> <us>" as -save writes
+ * them from a run of a known good build on the same board. A median more
+ * than -tolerance percent and REGRESS_SLACK_US over its budget fails,
+ * stages without a budget are not held. Exits with 1 on any wrong shift or
+ * slow stage.
+ *
+ * The batched correlations of fftw and gpu_fft, all frames against the
+ * reference (PHASECORR_BATCH_FRAMES) and the reference against all frames
+ * as references (PHASECORR_BATCH_REFS, the opposite shifts), must find the
+ * shifts of the single correlations.
+ *
+ * -chunked MB correlates every frame on gpu_fft once more with the memory
+ * split of the mailbox stand-in (GPU_FFT_STANDIN_MEM, make STANDIN=1) set
+ * that small, so the batches do not fit and are streamed in chunks, and
+ * fails on a shift that differs from the one found in whole batches.
+ *
+ * gpu_fft needs the mailbox, run as root on the Pi, or -cpu.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "log.h"
+#include "mmalyuv.h"
+#include "image.h"
+#include "fft.h"
+#include "fft_gpu.h"
+#include "synth.h"
+#include "trace.h"
+
+#define REGRESS_MAX_SIZES 16
+#define REGRESS_MAX_BUDGETS 512
+#define REGRESS_MARGIN 64          // of the star field around the frame
+#define REGRESS_SLACK_US 20        // over the budget, for the short stages
+
+#define BACKEND_FFTW   0
+#define BACKEND_LOWMEM 1
+#define BACKEND_GPU    2
+#define BACKENDS       3
+
+char Usage[] =
+	"Usage: regress_phasecorr [-sizes n|wxh,...] [-warmup n] [-reps n] [-fftw|-lowmem|-gpu|-cpu]\n"
+	"                         [-budget file] [-save file] [-tolerance pct] [-chunked MB]\n"
+	"-sizes     = frame sizes,                     default 256,512,1024,2048,1024x512\n"
+	"-warmup    = runs not timed,                  default 2\n"
+	"-reps      = runs timed per size,             default 16, the shifts in turns,\n"
+	"             warmup + reps at least 8\n"
+	"-fftw ...  = that backend only, -cpu both FFTW ones, default all\n"
+	"-budget    = medians of a good run to hold the stages to\n"
+	"-save      = write the medians of this run as budgets\n"
+	"-tolerance = percent over budget allowed,     default 20\n"
+	"-chunked   = gpu_fft again with the stand-in's GPU memory at MB, same shifts\n";
+
+static const char *stage_name[PC_STAGES + 1] = {
+	"convert", "forward", "transpose", "cross", "inverse", "peak", "total"
+};
+
+static const char *backend_name[BACKENDS] = { "fftw", "fftw_lowmem", "gpu_fft" };
+
+// shifts of the frames against the reference, integer ones first
+static const synth_shift_t shifts[] = {
+	{ 0, 0 }, { 7, -5 }, { -23, 16 }, { 40, 33 },
+	{ 3.5f, -2.5f }, { -10.25f, 4.75f }, { 0.4f, -0.3f }, { 17.6f, -31.2f },
+};
+#define SHIFTS ((int)(sizeof(shifts) / sizeof(shifts[0])))
+
+typedef struct {
+	int backend;
+	uint32_t width, height;
+	int stage;
+	long us;
+} budget_t;
+
+static budget_t budgets[REGRESS_MAX_BUDGETS];
+static int nbudgets;
+static FILE *save;
+static int tolerance = 20;
+static int chunked_mb;
+
+static int cmp_long( const void *a, const void *b )
+{
+	long x = *(const long *)a, y = *(const long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Budgets from file, lines of "<backend> <w>x<h> <stage> <us>", # comments
+ * returns -1 if it cannot be read or a line is bad
+ */
+static int load_budgets( const char *file )
+{
+	char line[128], backend[32], stage[32];
+	budget_t b;
+	int n = 0;
+	FILE *f = fopen( file, "r" );
+
+	if( !f )
+	{
+		ERROR( "cannot open budget file %s", file );
+		return (-1);
+	}
+	while( fgets( line, sizeof(line), f ) )
+	{
+		n++;
+		if( line[0] == '#' || line[0] == '\n' )
+			continue;
+		if( sscanf( line, "%31s %ux%u %31s %ld", backend, &b.width, &b.height, stage, &b.us ) != 5 )
+			break;
+		for( b.backend = 0; b.backend < BACKENDS && strcmp( backend, backend_name[b.backend] ); b.backend++ )
+			;
+		for( b.stage = 0; b.stage <= PC_STAGES && strcmp( stage, stage_name[b.stage] ); b.stage++ )
+			;
+		if( b.backend == BACKENDS || b.stage > PC_STAGES || nbudgets == REGRESS_MAX_BUDGETS )
+			break;
+		budgets[nbudgets++] = b;
+	}
+	if( !feof( f ) )
+	{
+		ERROR( "%s:%d: bad budget", file, n );
+		fclose( f );
+		return (-1);
+	}
+	fclose( f );
+	MSG( "%d budgets from %s", nbudgets, file );
+	return (0);
+}
+
+static const budget_t *find_budget( int backend, uint32_t w, uint32_t h, int stage )
+{
+	int k;
+
+	for( k = 0; k < nbudgets; k++ )
+		if( budgets[k].backend == backend && budgets[k].width == w &&
+			budgets[k].height == h && budgets[k].stage == stage )
+			return &budgets[k];
+	return NULL;
+}
+
+/*
+ * One correlation of ref and frame, stage times into t, shift found into x, y
+ * as the content of frame moved against ref
+ * returns its microseconds, -1 on error
+ */
+static long correlate( int backend, pix_y_t *ref, pix_y_t *frame, pc_times_t *t, int *x, int *y )
+{
+	fpix_y_t *fr, *fs;
+	float peak;
+	int32_t px = 0, py = 0;
+	int ret;
+	long start = now_us();
+
+	memset( t, 0, sizeof(*t) );
+	if( backend == BACKEND_LOWMEM )
+	{
+		fft_set_times( t );
+		ret = pixPhaseCorrelationInPlace( ref, frame, &peak, &px, &py );
+		fft_set_times( NULL );
+	}
+	else if( backend == BACKEND_FFTW )
+	{
+		fft_set_times( t );
+		fr = pixConvertToFPix( ref );
+		fs = pixConvertToFPix( frame );
+		ret = fr && fs ? pixPhaseCorrelation( fr, fs, &peak, &px, &py ) : -1;
+		fpixDestroy( fr );
+		fpixDestroy( fs );
+		fft_set_times( NULL );
+	}
+	else
+	{
+		fft_gpu_set_times( t );
+		ret = pixPhaseCorrelate_GPU( ref, frame, &peak, &px, &py );
+		fft_gpu_set_times( NULL );
+		// the opposite direction, see scheduler.c
+		px = -px;
+		py = -py;
+	}
+	if( ret )
+		return (-1);
+	*x = px;
+	*y = py;
+	return now_us() - start;
+}
+
+/* 1 if x, y is not shift k, to a pixel next to it for fractional ones */
+static int wrong( int k, int x, int y )
+{
+	float ex = fabsf( x - shifts[k].dx ), ey = fabsf( y - shifts[k].dy );
+
+	if( shifts[k].dx == floorf( shifts[k].dx ) && shifts[k].dy == floorf( shifts[k].dy ) )
+		return ex != 0 || ey != 0;
+	return ex >= 1 || ey >= 1;
+}
+
+/*
+ * Correlate all frames in one batch with the reference on backend, in both
+ * modes, and compare with the single correlations' shifts x, y
+ * returns the number of shifts that differ, -1 on error
+ */
+static int check_batch( int backend, pix_y_t *ref, pix_y_t *frames, const int *x, const int *y )
+{
+	fpix_y_t *fr, *fk[SHIFTS];
+	pix_y_t *pk[SHIFTS];
+	float peak[SHIFTS];
+	int32_t bx[SHIFTS], by[SHIFTS];
+	int k, mode, sign, ret = 0, differ = 0;
+
+	memset( fk, 0, sizeof(fk) );
+	fr = backend == BACKEND_FFTW ? pixConvertToFPix( ref ) : NULL;
+	for( k = 0; k < SHIFTS; k++ )
+	{
+		pk[k] = &frames[k];
+		if( backend == BACKEND_FFTW && !(fk[k] = pixConvertToFPix( &frames[k] )) )
+			ret = -1;
+	}
+	if( backend == BACKEND_FFTW && !fr )
+		ret = -1;
+
+	for( mode = PHASECORR_BATCH_FRAMES; mode <= PHASECORR_BATCH_REFS && !ret; mode++ )
+	{
+		if( backend == BACKEND_FFTW )
+			ret = pixPhaseCorrelationBatch( fr, fk, SHIFTS, mode, peak, bx, by );
+		else
+			ret = pixPhaseCorrelateBatch_GPU( ref, pk, SHIFTS, mode, peak, bx, by );
+		// frames as references see the opposite shifts, gpu_fft as in correlate()
+		sign = (mode == PHASECORR_BATCH_REFS ? -1 : 1) * (backend == BACKEND_GPU ? -1 : 1);
+		for( k = 0; k < SHIFTS && !ret; k++ )
+			if( sign * bx[k] != x[k] || sign * by[k] != y[k] )
+			{
+				MSG( "%s %u x %u batch %s: shift %d, %d, single %d, %d", backend_name[backend],
+					 ref->width, ref->height, mode == PHASECORR_BATCH_REFS ? "refs" : "frames",
+					 sign * bx[k], sign * by[k], x[k], y[k] );
+				differ++;
+			}
+	}
+
+	fpixDestroy( fr );
+	for( k = 0; k < SHIFTS; k++ )
+		fpixDestroy( fk[k] );
+	return ret ? -1 : differ;
+}
+
+/*
+ * Correlate the frames on gpu_fft with the stand-in's memory split at
+ * chunked_mb and compare with the shifts x, y found before
+ * returns the number of shifts that differ, -1 on error
+ */
+static int check_chunked( pix_y_t *ref, pix_y_t *frames, const int *x, const int *y )
+{
+	char mb[16], *prev = getenv( "GPU_FFT_STANDIN_MEM" );
+	pc_times_t t;
+	int k, cx, cy, differ = 0;
+
+	if( prev )
+		prev = strdup( prev );
+	snprintf( mb, sizeof(mb), "%d", chunked_mb );
+	setenv( "GPU_FFT_STANDIN_MEM", mb, 1 );
+	fft_gpu_release();
+	for( k = 0; k < SHIFTS; k++ )
+	{
+		if( correlate( BACKEND_GPU, ref, &frames[k], &t, &cx, &cy ) < 0 )
+		{
+			differ = -1;
+			break;
+		}
+		if( cx != x[k] || cy != y[k] )
+		{
+			MSG( "gpu_fft %u x %u chunked: shift %d, %d, in whole batches %d, %d",
+				 ref->width, ref->height, cx, cy, x[k], y[k] );
+			differ++;
+		}
+	}
+	fft_gpu_release();
+	if( prev )
+		setenv( "GPU_FFT_STANDIN_MEM", prev, 1 );
+	else
+		unsetenv( "GPU_FFT_STANDIN_MEM" );
+	free( prev );
+	return differ;
+}
+
+/*
+ * Check backend at w x h
+ * returns the number of wrong shifts and slow stages, -1 on error
+ */
+static int check( int backend, uint32_t w, uint32_t h, int warmup, int reps )
+{
+	const char *name = backend_name[backend];
+	pix_y_t ref, frames[SHIFTS];
+	synth_params_t sp;
+	synth_t *field = NULL;
+	const budget_t *b;
+	pc_times_t t;
+	long *v[PC_STAGES + 1], us, median, limit;
+	int k, s, x[SHIFTS], y[SHIFTS], wrongs = 0, slow = 0, ret = -1;
+
+	memset( &ref, 0, sizeof(ref) );
+	memset( frames, 0, sizeof(frames) );
+	memset( v, 0, sizeof(v) );
+	for( s = 0; s <= PC_STAGES; s++ )
+		if( !(v[s] = malloc( reps * sizeof(long) )) )
+			break;
+	if( s <= PC_STAGES )
+	{
+		ERROR( "out of memory" );
+		goto out;
+	}
+
+	// the same stars for every backend
+	synth_defaults( &sp );
+	sp.seed = w * 7919 + h;
+	field = synth_create( &sp, w, h, REGRESS_MARGIN );
+	if( !field || synth_frames( field, &ref, frames, shifts, SHIFTS ) )
+		goto out;
+
+	// every run checks its shift, warmup runs included
+	for( k = 0; k < warmup + reps; k++ )
+	{
+		s = k % SHIFTS;
+		us = correlate( backend, &ref, &frames[s], &t, &x[s], &y[s] );
+		if( us < 0 )
+		{
+			ERROR( "%s %u x %u: correlation failed", name, w, h );
+			goto out;
+		}
+		if( wrong( s, x[s], y[s] ) )
+		{
+			MSG( "%s %u x %u: WRONG shift %d, %d for %.2f, %.2f", name, w, h,
+				 x[s], y[s], shifts[s].dx, shifts[s].dy );
+			wrongs++;
+		}
+		if( k < warmup )
+			continue;
+		for( s = 0; s < PC_STAGES; s++ )
+			v[s][k - warmup] = t.us[s];
+		v[PC_STAGES][k - warmup] = us;
+	}
+
+	for( s = 0; s <= PC_STAGES; s++ )
+	{
+		qsort( v[s], reps, sizeof(long), cmp_long );
+		median = reps & 1 ? v[s][reps/2] : (v[s][reps/2 - 1] + v[s][reps/2]) / 2;
+		if( save )
+			fprintf( save, "%s %ux%u %s %ld\n", name, w, h, stage_name[s], median );
+
+		b = find_budget( backend, w, h, s );
+		limit = b ? b->us + b->us * tolerance / 100 + REGRESS_SLACK_US : -1;
+		printf( "%s,%ux%u,%s,%ld,%ld,%s\n", name, w, h, stage_name[s], median,
+				b ? b->us : -1L, !b ? "-" : median > limit ? "SLOW" : "ok" );
+		if( b && median > limit )
+		{
+			MSG( "%s %u x %u: %s SLOW, median %ld us, budget %ld us", name, w, h, stage_name[s], median, b->us );
+			slow++;
+		}
+	}
+	if( backend != BACKEND_LOWMEM )
+	{
+		if( (k = check_batch( backend, &ref, frames, x, y )) < 0 )
+		{
+			ERROR( "%s %u x %u: batch correlation failed", name, w, h );
+			goto out;
+		}
+		wrongs += k;
+	}
+	if( backend == BACKEND_GPU && chunked_mb )
+	{
+		if( (k = check_chunked( &ref, frames, x, y )) < 0 )
+		{
+			ERROR( "%s %u x %u: chunked correlation failed", name, w, h );
+			goto out;
+		}
+		wrongs += k;
+	}
+	ret = wrongs + slow;
+out:
+	// buffers and plans of this size go
+	fft_release();
+	fft_gpu_release();
+	synth_destroy( field );
+	for( s = 0; s <= PC_STAGES; s++ )
+		free( v[s] );
+	synth_frames_free( &ref, frames, SHIFTS );
+	return ret;
+}
+
+int main( int argc, char *argv[] )
+{
+	uint32_t width[REGRESS_MAX_SIZES] = { 256, 512, 1024, 2048, 1024 };
+	uint32_t height[REGRESS_MAX_SIZES] = { 256, 512, 1024, 2048, 512 };
+	int nsizes = 5, warmup = 2, reps = 16;
+	int backends = 1 << BACKEND_FFTW | 1 << BACKEND_LOWMEM | 1 << BACKEND_GPU;
+	const char *budget_file = NULL, *save_file = NULL;
+	int i, b, n, failed = 0;
+	char *p;
+
+	for( i = 1; i < argc; i++ )
+	{
+		if( strcmp( argv[i], "-sizes" ) == 0 && i+1 < argc )
+		{
+			for( nsizes = 0, p = argv[++i]; *p && nsizes < REGRESS_MAX_SIZES; nsizes++ )
+			{
+				width[nsizes] = height[nsizes] = strtoul( p, &p, 10 );
+				if( *p == 'x' )
+					height[nsizes] = strtoul( p + 1, &p, 10 );
+				if( width[nsizes] < 64 || height[nsizes] < 64 || (*p && *p++ != ',') )
+					break;
+			}
+			if( *p || !nsizes || width[nsizes-1] < 64 || height[nsizes-1] < 64 )
+			{
+				printf( "%s", Usage );
+				return -1;
+			}
+		}
+		else if( strcmp( argv[i], "-warmup" ) == 0 && i+1 < argc )
+			warmup = atoi( argv[++i] );
+		else if( strcmp( argv[i], "-reps" ) == 0 && i+1 < argc )
+			reps = atoi( argv[++i] );
+		else if( strcmp( argv[i], "-fftw" ) == 0 )
+			backends = 1 << BACKEND_FFTW;
+		else if( strcmp( argv[i], "-lowmem" ) == 0 )
+			backends = 1 << BACKEND_LOWMEM;
+		else if( strcmp( argv[i], "-gpu" ) == 0 )
+			backends = 1 << BACKEND_GPU;
+		else if( strcmp( argv[i], "-cpu" ) == 0 )
+			backends = 1 << BACKEND_FFTW | 1 << BACKEND_LOWMEM;
+		else if( strcmp( argv[i], "-budget" ) == 0 && i+1 < argc )
+			budget_file = argv[++i];
+		else if( strcmp( argv[i], "-save" ) == 0 && i+1 < argc )
+			save_file = argv[++i];
+		else if( strcmp( argv[i], "-tolerance" ) == 0 && i+1 < argc )
+			tolerance = atoi( argv[++i] );
+		else if( strcmp( argv[i], "-chunked" ) == 0 && i+1 < argc )
+			chunked_mb = atoi( argv[++i] );
+		else
+		{
+			printf( "%s", Usage );
+			return -1;
+		}
+	}
+	// the batches and -chunked compare the shift of every frame, each must have run
+	if( warmup < 0 || reps < 1 || tolerance < 0 || chunked_mb < 0 || warmup + reps < SHIFTS )
+	{
+		printf( "%s", Usage );
+		return -1;
+	}
+
+	log_verbose( 0 );
+	if( budget_file && load_budgets( budget_file ) )
+		return -1;
+	if( save_file && !(save = fopen( save_file, "w" )) )
+	{
+		ERROR( "cannot write %s", save_file );
+		return -1;
+	}
+	if( save )
+		fprintf( save, "# phasecorr budgets, %s %s, median us per stage\n", PROGRAM_NAME, PROGRAM_VERSION );
+
+	printf( "backend,size,stage,median_us,budget_us,result\n" );
+	for( b = 0; b < BACKENDS; b++ )
+		for( i = 0; i < nsizes && (backends & 1 << b); i++ )
+		{
+			n = check( b, width[i], height[i], warmup, reps );
+			if( n < 0 )
+				MSG( "%s %u x %u: FAILED", backend_name[b], width[i], height[i] );
+			failed += n < 0 ? 1 : n;
+		}
+
+	if( save && fclose( save ) )
+		ERROR( "cannot write %s", save_file );
+	MSG( "%d regressions", failed );
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,606 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <limits.h>
+
+#include "mmalyuv.h"
+#include "log.h"
+#include "fft.h"
+#include "image.h"
+#include "fft_gpu.h"
+#include "trace.h"
+#include "metrics.h"
+#include "scheduler.h"
+
+/*
+ * Phase correlation scheduler: distributes frames over the FFTW (ARM) and
+ * the gpu_fft (QPU) backend. Each backend has a worker thread and a queue,
+ * so both correlate at the same time while the main loop captures the next
+ * frame. A frame the GPU fails on is handed to the CPU, and the GPU is left
+ * out for SCHED_GPU_RETRY frames.
+ *
+ * Frames are copied into one of SCHED_JOBS slots on submit, sched_submit
+ * blocks while all of them are queued or running. Results wait for
+ * sched_get_result in a ring of SCHED_RESULTS, if nobody collects them the
+ * oldest are dropped: for tracking only the latest shifts matter.
+ */
+
+#define SCHED_AVG_WEIGHT 4 // moving average over ~4 frames
+#define SCHED_RESULTS    16
+
+typedef struct {
+	pix_y_t frame;
+	uint32_t seq;
+	sched_result_t res;
+	int free;
+} sched_job_t;
+
+typedef struct {
+	struct sched *owner;
+	pthread_t thread;
+	int running;                // thread was started
+	int queue[SCHED_JOBS];      // job slots, FIFO
+	int head, count;
+	int busy;                   // job slot being correlated or -1
+	long started;               // when the current job started
+	uint32_t retry_at;          // submits after which a failed GPU is tried again
+	sched_counters_t c;
+} sched_backend_t;
+
+struct sched {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;        // broadcast on every change of state
+	int mode, quit;
+	int lowmem;                 // CPU correlates the frames in place, no fref or fs
+	int next;                   // round robin
+	uint32_t submitted;
+	long t_start;
+
+	pix_y_t ref;                // GPU reference, CPU in lowmem
+	fpix_y_t *fref;             // CPU reference
+	fpix_y_t *fs;               // CPU frame, converted into for each one
+
+	sched_job_t jobs[SCHED_JOBS];
+	sched_result_t results[SCHED_RESULTS]; // FIFO
+	int res_head, res_count;
+	unsigned long dropped;      // results overwritten before collected
+
+	sched_backend_t be[SCHED_BACKENDS];
+};
+
+static const char *backend_name( int backend )
+{
+	return backend == SCHED_BACKEND_GPU ? "gpu" : "cpu";
+}
+
+/*
+ * Queue job slot j for backend b, lock held
+ */
+static void enqueue( sched_t *s, int b, int j )
+{
+	sched_backend_t *be = &s->be[b];
+
+	be->queue[(be->head + be->count) % SCHED_JOBS] = j;
+	be->count++;
+	pthread_cond_broadcast( &s->cond );
+}
+
+/*
+ * Store the result of job slot j and give the slot back, lock held
+ */
+static void finish( sched_t *s, int j )
+{
+	if( s->res_count == SCHED_RESULTS )
+	{
+		s->res_head = (s->res_head + 1) % SCHED_RESULTS;
+		s->res_count--;
+		s->dropped++;
+	}
+	s->results[(s->res_head + s->res_count) % SCHED_RESULTS] = s->jobs[j].res;
+	s->res_count++;
+	s->jobs[j].free = 1;
+	pthread_cond_broadcast( &s->cond );
+}
+
+/*
+ * Number of frames queued or running, lock held
+ */
+static int in_flight( sched_t *s )
+{
+	int b, n = 0;
+
+	for( b = 0; b < SCHED_BACKENDS; b++ )
+		n += s->be[b].count + (s->be[b].busy >= 0);
+	return n;
+}
+
+/*
+ * Correlate frame of job slot j against the reference on backend b,
+ * lock not held. x and y are returned with the sign of pixPhaseCorrelate_GPU,
+ * pixPhaseCorrelation reports the opposite direction.
+ */
+static int correlate( sched_t *s, int b, sched_job_t *job )
+{
+	fpix_y_t *fs;
+	int x, y, ret;
+
+	if( b == SCHED_BACKEND_GPU )
+	{
+		ret = pixPhaseCorrelate_GPU( &s->ref, &job->frame, &job->res.peak, &x, &y );
+		job->res.x = x;
+		job->res.y = y;
+		return ret;
+	}
+
+	// no float reference in lowmem
+	if( !s->fref )
+		ret = pixPhaseCorrelationInPlace( &s->ref, &job->frame, &job->res.peak, &job->res.x, &job->res.y );
+	else
+	{
+		fs = pixConvertToFPixTo( s->fs, &job->frame );
+		if( !fs )
+			return (-1);
+		ret = pixPhaseCorrelation( s->fref, fs, &job->res.peak, &job->res.x, &job->res.y );
+	}
+	job->res.x = -job->res.x;
+	job->res.y = -job->res.y;
+	return ret;
+}
+
+/*
+ * Worker thread of one backend
+ */
+static void *worker( void *arg )
+{
+	sched_backend_t *be = arg;
+	sched_t *s = be->owner;
+	int b = be - s->be;
+	sched_job_t *job;
+	uint64_t start;
+	long t;
+	int j, ret;
+
+	pthread_mutex_lock( &s->lock );
+	for( ;; )
+	{
+		while( !be->count && !s->quit )
+			pthread_cond_wait( &s->cond, &s->lock );
+		if( !be->count )
+			break;
+
+		j = be->queue[be->head];
+		be->head = (be->head + 1) % SCHED_JOBS;
+		be->count--;
+		be->busy = j;
+		be->started = now_us();
+		pthread_mutex_unlock( &s->lock );
+
+		job = &s->jobs[j];
+		start = trace_begin();
+		ret = correlate( s, b, job );
+		trace_end( b == SCHED_BACKEND_GPU ? TRACE_JOB_GPU : TRACE_JOB_CPU, start );
+		t = now_us();
+
+		pthread_mutex_lock( &s->lock );
+		job->res.usecs = t - be->started;
+		job->res.times.t[LAT_STARTED] = be->started;
+		job->res.times.t[LAT_DONE] = t;
+		be->busy = -1;
+		if( ret )
+		{
+			be->c.errors++;
+			metrics_add( b == SCHED_BACKEND_GPU ? METRIC_FAILED_GPU : METRIC_FAILED_CPU, 1 );
+			if( b == SCHED_BACKEND_GPU )
+			{
+				// fail over: CPU does this frame, GPU sits out for a while
+				ERROR( "GPU phase correlation failed, frame %u goes to the CPU", job->seq );
+				be->c.enabled = 0;
+				be->retry_at = s->submitted + SCHED_GPU_RETRY;
+				enqueue( s, SCHED_BACKEND_CPU, j );
+				continue;
+			}
+			ERROR( "%s phase correlation failed, frame %u", backend_name(b), job->seq );
+			job->res.status = -1;
+		}
+		else
+		{
+			job->res.status = 0;
+			be->c.frames++;
+			be->c.busy_us += job->res.usecs;
+			be->c.avg_us = be->c.avg_us ?
+				be->c.avg_us + (job->res.usecs - be->c.avg_us) / SCHED_AVG_WEIGHT : job->res.usecs;
+		}
+		job->res.backend = b;
+		job->res.seq = job->seq;
+		finish( s, j );
+	}
+	pthread_mutex_unlock( &s->lock );
+
+	// buffers and plans the backend kept for the next frame
+	if( b == SCHED_BACKEND_GPU )
+		fft_gpu_release();
+	else
+		fft_release();
+	return NULL;
+}
+
+/*
+ * Backend for the next frame, lock held
+ *
+ * SCHED_MODE_WEIGHTED estimates when each backend would be done with the
+ * frame from its moving average time per frame, the frames queued and what
+ * is left of the running one, and takes the earliest. A backend without
+ * measurements yet is taken when idle, so each one gets tried.
+ */
+static int pick_backend( sched_t *s )
+{
+	sched_backend_t *gpu = &s->be[SCHED_BACKEND_GPU];
+	long now, est, best_est = 0;
+	int b, best = SCHED_BACKEND_CPU;
+
+	if( !gpu->c.enabled && s->mode != SCHED_MODE_CPU && s->submitted >= gpu->retry_at )
+	{
+		DEBUG( "trying GPU again" );
+		gpu->c.enabled = 1;
+	}
+
+	switch( s->mode )
+	{
+		case SCHED_MODE_CPU:
+			return SCHED_BACKEND_CPU;
+		case SCHED_MODE_GPU:
+			return gpu->c.enabled ? SCHED_BACKEND_GPU : SCHED_BACKEND_CPU;
+		case SCHED_MODE_ALTERNATE:
+			s->next = (s->next + 1) % SCHED_BACKENDS;
+			return s->be[s->next].c.enabled ? s->next : SCHED_BACKEND_CPU;
+	}
+
+	now = now_us();
+	for( b = 0; b < SCHED_BACKENDS; b++ )
+	{
+		sched_backend_t *be = &s->be[b];
+
+		if( !be->c.enabled )
+			continue;
+		if( !be->c.avg_us )
+			est = be->busy < 0 && !be->count ? 0 : LONG_MAX;
+		else
+		{
+			est = (be->count + 1) * be->c.avg_us;
+			if( be->busy >= 0 && be->c.avg_us > now - be->started )
+				est += be->c.avg_us - (now - be->started);
+		}
+		if( b == SCHED_BACKEND_CPU || est < best_est )
+		{
+			best = b;
+			best_est = est;
+		}
+	}
+	return best;
+}
+
+/*
+ * Whether a backend the next frame could go to is idle, lock held
+ */
+static int ready( sched_t *s )
+{
+	int b;
+
+	for( b = 0; b < SCHED_BACKENDS; b++ )
+	{
+		if( !s->be[b].c.enabled || s->be[b].busy >= 0 || s->be[b].count )
+			continue;
+		if( s->mode == SCHED_MODE_CPU && b != SCHED_BACKEND_CPU )
+			continue;
+		if( s->mode == SCHED_MODE_GPU && b != SCHED_BACKEND_GPU && s->be[SCHED_BACKEND_GPU].c.enabled )
+			continue;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Create scheduler with worker threads for the backends mode uses.
+ * The CPU worker is always started, it takes over when the GPU fails.
+ *
+ * returns NULL on error
+ */
+sched_t *sched_create( int mode )
+{
+	sched_t *s;
+	int b, j;
+
+	s = calloc( sizeof(sched_t), 1 );
+	if( !s )
+	{
+		ERROR("out of memory");
+		return NULL;
+	}
+	pthread_mutex_init( &s->lock, NULL );
+	pthread_cond_init( &s->cond, NULL );
+	s->mode = mode;
+	s->next = SCHED_BACKENDS - 1;
+	s->t_start = now_us();
+	for( j = 0; j < SCHED_JOBS; j++ )
+		s->jobs[j].free = 1;
+
+	for( b = 0; b < SCHED_BACKENDS; b++ )
+	{
+		s->be[b].owner = s;
+		s->be[b].busy = -1;
+		s->be[b].c.enabled = b == SCHED_BACKEND_CPU || mode != SCHED_MODE_CPU;
+		if( !s->be[b].c.enabled )
+			continue;
+		if( pthread_create( &s->be[b].thread, NULL, worker, &s->be[b] ) )
+		{
+			ERROR( "cannot start %s worker", backend_name(b) );
+			sched_destroy( s );
+			return NULL;
+		}
+		s->be[b].running = 1;
+	}
+
+	return s;
+}
+
+/*
+ * Finish the frames still queued, stop the workers and free everything.
+ * Results not collected by then are lost.
+ */
+void sched_destroy( sched_t *s )
+{
+	int b, j;
+
+	if( !s )
+		return;
+
+	pthread_mutex_lock( &s->lock );
+	s->quit = 1;
+	pthread_cond_broadcast( &s->cond );
+	pthread_mutex_unlock( &s->lock );
+
+	for( b = 0; b < SCHED_BACKENDS; b++ )
+		if( s->be[b].running )
+			pthread_join( s->be[b].thread, NULL );
+
+	for( j = 0; j < SCHED_JOBS; j++ )
+		free( s->jobs[j].frame.data );
+	free( s->ref.data );
+	if( s->fref )
+		fpixDestroy( s->fref );
+	if( s->fs )
+		fpixDestroy( s->fs );
+	pthread_cond_destroy( &s->cond );
+	pthread_mutex_destroy( &s->lock );
+	free( s );
+}
+
+/*
+ * Low memory footprint of the CPU backend (pixPhaseCorrelationInPlace):
+ * no float copies of the reference and the frame, the correlation in two
+ * spectrum buffers. Takes effect with the next sched_set_reference
+ */
+void sched_set_lowmem( sched_t *s, int on )
+{
+	s->lowmem = on;
+}
+
+/*
+ * Set the reference image frames are correlated against, a copy is kept,
+ * so ref may be any view.
+ * Waits until the frames in flight are done with the old one.
+ *
+ * returns -1 on error, 0 otherwise
+ */
+int sched_set_reference( sched_t *s, pix_y_t *ref )
+{
+	fpix_y_t *fref, *fs;
+	sched_job_t *job;
+	pix_y_t copy;
+	uint8_t *data;
+	int j;
+
+	if( !s || !ref || !ref->data )
+	{
+		ERROR("nothing to do");
+		return (-1);
+	}
+
+	fref = fs = NULL;
+	if( !s->lowmem )
+	{
+		fref = pixConvertToFPix( ref );
+		fs = fpixCreate( ref->width, ref->height );
+	}
+	data = malloc( ref->width * ref->height );
+	if( (!s->lowmem && (!fref || !fs)) || !data )
+	{
+		ERROR("out of memory");
+		if( fref ) fpixDestroy( fref );
+		if( fs ) fpixDestroy( fs );
+		free( data );
+		return (-1);
+	}
+	pixInit( &copy, data, ref->width, ref->height, ref->width );
+	pixCopy( &copy, ref );
+
+	pthread_mutex_lock( &s->lock );
+	while( in_flight( s ) )
+		pthread_cond_wait( &s->cond, &s->lock );
+	free( s->ref.data );
+	if( s->fref )
+		fpixDestroy( s->fref );
+	if( s->fs )
+		fpixDestroy( s->fs );
+	s->ref = copy;
+	s->fref = fref;
+	s->fs = fs;
+	// the job slots of the new size now, not on their first submit
+	for( j = 0; j < SCHED_JOBS; j++ )
+	{
+		job = &s->jobs[j];
+		if( job->frame.width * job->frame.height == ref->width * ref->height )
+			continue;
+		data = realloc( job->frame.data, ref->width * ref->height );
+		if( !data )
+			break; // sched_submit tries again
+		pixInit( &job->frame, data, ref->width, ref->height, ref->width );
+	}
+	pthread_mutex_unlock( &s->lock );
+
+	return (0);
+}
+
+/*
+ * Hand a frame to one of the backends. The frame is copied, it can be
+ * overwritten or its camera buffer given back as soon as this returns. Blocks while SCHED_JOBS frames are
+ * in flight. times, if not NULL, come back with the result.
+ *
+ * returns -1 on error, 0 otherwise
+ */
+int sched_submit( sched_t *s, pix_y_t *frame, uint32_t seq, const frame_times_t *times )
+{
+	sched_job_t *job;
+	uint8_t *data;
+	int j;
+
+	if( !s || !frame || !frame->data || !s->ref.data ||
+		frame->width != s->ref.width || frame->height != s->ref.height )
+	{
+		ERROR( "no reference or frame not of its size" );
+		return (-1);
+	}
+
+	pthread_mutex_lock( &s->lock );
+	for( ;; )
+	{
+		for( j = 0; j < SCHED_JOBS && !s->jobs[j].free; j++ )
+			;
+		if( j < SCHED_JOBS )
+			break;
+		pthread_cond_wait( &s->cond, &s->lock );
+	}
+	s->jobs[j].free = 0;
+	pthread_mutex_unlock( &s->lock );
+
+	// the slot is ours until it is queued
+	job = &s->jobs[j];
+	if( job->frame.width * job->frame.height != frame->width * frame->height )
+	{
+		data = realloc( job->frame.data, frame->width * frame->height );
+		if( !data )
+		{
+			ERROR("out of memory");
+			pthread_mutex_lock( &s->lock );
+			s->jobs[j].free = 1;
+			pthread_mutex_unlock( &s->lock );
+			return (-1);
+		}
+		job->frame.data = data;
+	}
+	pixInit( &job->frame, job->frame.data, frame->width, frame->height, frame->width );
+	pixCopy( &job->frame, frame );
+	job->seq = seq;
+	if( times )
+		job->res.times = *times;
+	else
+		memset( &job->res.times, 0, sizeof(job->res.times) );
+
+	pthread_mutex_lock( &s->lock );
+	s->submitted++;
+	enqueue( s, pick_backend( s ), j );
+	pthread_mutex_unlock( &s->lock );
+
+	return (0);
+}
+
+/*
+ * Wait up to timeout_ms until a backend is idle, so a frame submitted
+ * now starts right away instead of queueing. Lets the caller pick the
+ * newest frame at the last moment.
+ *
+ * returns 1 if a backend is idle, 0 on timeout
+ */
+int sched_wait_ready( sched_t *s, int timeout_ms )
+{
+	struct timespec until;
+	int ret;
+
+	clock_gettime( CLOCK_REALTIME, &until );
+	until.tv_sec += timeout_ms / 1000;
+	until.tv_nsec += (timeout_ms % 1000) * 1000000l;
+	if( until.tv_nsec >= 1000000000l )
+	{
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000l;
+	}
+
+	pthread_mutex_lock( &s->lock );
+	while( !(ret = ready( s )) )
+		if( pthread_cond_timedwait( &s->cond, &s->lock, &until ) )
+			break;
+	ret = ready( s );
+	pthread_mutex_unlock( &s->lock );
+
+	return ret;
+}
+
+/*
+ * Collect the next finished frame, in order of completion. With wait set,
+ * blocks until one is finished.
+ *
+ * returns 0 if res was filled, -1 if nothing was finished (or, with wait,
+ * nothing is in flight)
+ */
+int sched_get_result( sched_t *s, sched_result_t *res, int wait )
+{
+	pthread_mutex_lock( &s->lock );
+	while( !s->res_count && wait && in_flight( s ) )
+		pthread_cond_wait( &s->cond, &s->lock );
+	if( !s->res_count )
+	{
+		pthread_mutex_unlock( &s->lock );
+		return (-1);
+	}
+	*res = s->results[s->res_head];
+	s->res_head = (s->res_head + 1) % SCHED_RESULTS;
+	s->res_count--;
+	pthread_mutex_unlock( &s->lock );
+
+	return (0);
+}
+
+/*
+ * Copy of the throughput counters of a backend
+ */
+void sched_get_counters( sched_t *s, int backend, sched_counters_t *c )
+{
+	pthread_mutex_lock( &s->lock );
+	*c = s->be[backend].c;
+	pthread_mutex_unlock( &s->lock );
+}
+
+/*
+ * Log frames, errors and throughput per backend: frames per second while
+ * busy, and frames per second of wall clock time since sched_create
+ */
+void sched_log_stats( sched_t *s )
+{
+	sched_counters_t c;
+	long wall_us = now_us() - s->t_start;
+	int b;
+
+	for( b = 0; b < SCHED_BACKENDS; b++ )
+	{
+		sched_get_counters( s, b, &c );
+		MSG( "%s: %lu frames, %lu errors, %.2f fps busy, %.2f fps overall, avg %ld us%s",
+			 backend_name(b), c.frames, c.errors,
+			 c.busy_us ? c.frames * 1e6 / c.busy_us : 0.0,
+			 wall_us ? c.frames * 1e6 / wall_us : 0.0,
+			 c.avg_us, c.enabled ? "" : " (disabled)" );
+	}
+	if( s->dropped )
+		MSG( "%lu results dropped, not collected in time", s->dropped );
+}
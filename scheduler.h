@@ -0,0 +1,56 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+#include "mmalyuv.h"
+
+// correlation backends
+#define SCHED_BACKEND_CPU 0 // FFTW, fft.c
+#define SCHED_BACKEND_GPU 1 // gpu_fft, fft_gpu.c
+#define SCHED_BACKENDS    2
+
+// how frames are distributed
+#define SCHED_MODE_GPU       0 // GPU only, CPU takes over while the GPU fails
+#define SCHED_MODE_CPU       1 // CPU only
+#define SCHED_MODE_ALTERNATE 2 // round robin over both
+#define SCHED_MODE_WEIGHTED  3 // to the backend expected to finish first
+
+// frames in flight (queued or running)
+#define SCHED_JOBS 4
+
+// frames submitted before a failed GPU is tried again
+#define SCHED_GPU_RETRY 50
+
+typedef struct sched sched_t;
+
+typedef struct {
+	uint32_t seq;     // as passed to sched_submit
+	int backend;      // that did the correlation
+	int status;       // 0 ok, -1 failed on every backend tried
+	float peak;       // scale is backend specific
+	int32_t x, y;     // shift, same sign convention for both backends
+	long usecs;       // time the backend took
+	frame_times_t times; // as passed to sched_submit, LAT_STARTED and LAT_DONE stamped
+} sched_result_t;
+
+typedef struct {
+	unsigned long frames;  // correlated successfully
+	unsigned long errors;  // failed, GPU errors are handed on to the CPU
+	long busy_us;          // total time spent correlating
+	long avg_us;           // moving average per frame
+	int enabled;           // 0 while the GPU is failed over
+} sched_counters_t;
+
+sched_t *sched_create( int mode );
+void sched_destroy( sched_t *s );
+
+void sched_set_lowmem( sched_t *s, int on );
+int sched_set_reference( sched_t *s, pix_y_t *ref );
+int sched_submit( sched_t *s, pix_y_t *frame, uint32_t seq, const frame_times_t *times );
+int sched_wait_ready( sched_t *s, int timeout_ms );
+int sched_get_result( sched_t *s, sched_result_t *res, int wait );
+
+void sched_get_counters( sched_t *s, int backend, sched_counters_t *c );
+void sched_log_stats( sched_t *s );
+
+#endif /* SCHEDULER_H */
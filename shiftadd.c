@@ -0,0 +1,487 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SHIFTADD_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SHIFTADD_SSE2
+#endif
+
+#include "log.h"
+#include "shiftadd.h"
+#include "image.h"
+
+#if defined(SHIFTADD_NEON)
+#define SHIFTADD_SIMD "neon"
+#elif defined(SHIFTADD_SSE2)
+#define SHIFTADD_SIMD "sse2"
+#else
+#define SHIFTADD_SIMD "scalar"
+#endif
+
+#if defined(SHIFTADD_NEON)
+/* 16 pixels from src to float */
+static inline void widen16( const uint8_t *src, float32x4_t f[4] )
+{
+	uint8x16_t s = vld1q_u8( src );
+	uint16x8_t lo = vmovl_u8( vget_low_u8( s ) ), hi = vmovl_u8( vget_high_u8( s ) );
+
+	f[0] = vcvtq_f32_u32( vmovl_u16( vget_low_u16( lo ) ) );
+	f[1] = vcvtq_f32_u32( vmovl_u16( vget_high_u16( lo ) ) );
+	f[2] = vcvtq_f32_u32( vmovl_u16( vget_low_u16( hi ) ) );
+	f[3] = vcvtq_f32_u32( vmovl_u16( vget_high_u16( hi ) ) );
+}
+#elif defined(SHIFTADD_SSE2)
+static inline void widen16( const uint8_t *src, __m128 f[4] )
+{
+	__m128i z = _mm_setzero_si128();
+	__m128i s = _mm_loadu_si128( (const __m128i *)src );
+	__m128i lo = _mm_unpacklo_epi8( s, z ), hi = _mm_unpackhi_epi8( s, z );
+
+	f[0] = _mm_cvtepi32_ps( _mm_unpacklo_epi16( lo, z ) );
+	f[1] = _mm_cvtepi32_ps( _mm_unpackhi_epi16( lo, z ) );
+	f[2] = _mm_cvtepi32_ps( _mm_unpacklo_epi16( hi, z ) );
+	f[3] = _mm_cvtepi32_ps( _mm_unpackhi_epi16( hi, z ) );
+}
+#endif
+
+/*
+ * sum[i] += src[i], cov[i]++, i < n
+ */
+static void add_row( float *sum, uint32_t *cov, const uint8_t *src, uint32_t n )
+{
+	uint32_t i = 0;
+	int k;
+
+#if defined(SHIFTADD_NEON)
+	float32x4_t f[4];
+	uint32x4_t one = vdupq_n_u32( 1 );
+
+	for( ; i + 16 <= n; i += 16 )
+	{
+		widen16( src + i, f );
+		for( k = 0; k < 4; k++ )
+		{
+			vst1q_f32( sum + i + 4*k, vaddq_f32( vld1q_f32( sum + i + 4*k ), f[k] ) );
+			vst1q_u32( cov + i + 4*k, vaddq_u32( vld1q_u32( cov + i + 4*k ), one ) );
+		}
+	}
+#elif defined(SHIFTADD_SSE2)
+	__m128 f[4];
+	__m128i one = _mm_set1_epi32( 1 );
+
+	for( ; i + 16 <= n; i += 16 )
+	{
+		widen16( src + i, f );
+		for( k = 0; k < 4; k++ )
+		{
+			__m128i *c = (__m128i *)(cov + i + 4*k);
+
+			_mm_storeu_ps( sum + i + 4*k, _mm_add_ps( _mm_loadu_ps( sum + i + 4*k ), f[k] ) );
+			_mm_storeu_si128( c, _mm_add_epi32( _mm_loadu_si128( c ), one ) );
+		}
+	}
+#endif
+	for( ; i < n; i++ )
+	{
+		sum[i] += src[i];
+		cov[i]++;
+	}
+}
+
+/*
+ * sum[i] += w[0] a[i] + w[1] a[i+1] + w[2] b[i] + w[3] b[i+1], cov[i]++, i < n
+ * a[n] and b[n] are read even if their weight is 0
+ */
+static void add_bilinear_row( float *sum, uint32_t *cov, const uint8_t *a, const uint8_t *b, uint32_t n,
+							  const float w[4] )
+{
+	uint32_t i = 0;
+	int k;
+
+#if defined(SHIFTADD_NEON)
+	float32x4_t a0[4], a1[4], b0[4], b1[4], v;
+	uint32x4_t one = vdupq_n_u32( 1 );
+
+	for( ; i + 16 <= n; i += 16 )
+	{
+		widen16( a + i, a0 );
+		widen16( a + i + 1, a1 );
+		widen16( b + i, b0 );
+		widen16( b + i + 1, b1 );
+		for( k = 0; k < 4; k++ )
+		{
+			v = vmulq_n_f32( a0[k], w[0] );
+			v = vmlaq_n_f32( v, a1[k], w[1] );
+			v = vmlaq_n_f32( v, b0[k], w[2] );
+			v = vmlaq_n_f32( v, b1[k], w[3] );
+			vst1q_f32( sum + i + 4*k, vaddq_f32( vld1q_f32( sum + i + 4*k ), v ) );
+			vst1q_u32( cov + i + 4*k, vaddq_u32( vld1q_u32( cov + i + 4*k ), one ) );
+		}
+	}
+#elif defined(SHIFTADD_SSE2)
+	__m128 a0[4], a1[4], b0[4], b1[4], v;
+	__m128 w0 = _mm_set1_ps( w[0] ), w1 = _mm_set1_ps( w[1] ), w2 = _mm_set1_ps( w[2] ), w3 = _mm_set1_ps( w[3] );
+	__m128i one = _mm_set1_epi32( 1 );
+
+	for( ; i + 16 <= n; i += 16 )
+	{
+		widen16( a + i, a0 );
+		widen16( a + i + 1, a1 );
+		widen16( b + i, b0 );
+		widen16( b + i + 1, b1 );
+		for( k = 0; k < 4; k++ )
+		{
+			__m128i *c = (__m128i *)(cov + i + 4*k);
+
+			v = _mm_add_ps( _mm_add_ps( _mm_mul_ps( a0[k], w0 ), _mm_mul_ps( a1[k], w1 ) ),
+							_mm_add_ps( _mm_mul_ps( b0[k], w2 ), _mm_mul_ps( b1[k], w3 ) ) );
+			_mm_storeu_ps( sum + i + 4*k, _mm_add_ps( _mm_loadu_ps( sum + i + 4*k ), v ) );
+			_mm_storeu_si128( c, _mm_add_epi32( _mm_loadu_si128( c ), one ) );
+		}
+	}
+#endif
+	for( ; i < n; i++ )
+	{
+		sum[i] += w[0]*a[i] + w[1]*a[i+1] + w[2]*b[i] + w[3]*b[i+1];
+		cov[i]++;
+	}
+}
+
+/*
+ * Add a frame whose content is at the reference's + (dx, dy): the master
+ * pixel (x, y) gets the frame's (x + dx, y + dy) where that is inside
+ */
+static void add_frame( shiftadd_t *sa, shiftadd_slot_t *slot )
+{
+	int32_t ix = floorf( slot->dx ), iy = floorf( slot->dy );
+	float fx = slot->dx - ix, fy = slot->dy - iy, w[4];
+	int32_t ex = fx > 0, ey = fy > 0;
+	int32_t x0, x1, y0, y1, y, width = sa->width, height = sa->height;
+	const uint8_t *a;
+
+	// master columns x0 ... x1-1 and lines y0 ... y1-1 have all their sources
+	x0 = ix < 0 ? -ix : 0;
+	x1 = width - ix - ex < width ? width - ix - ex : width;
+	y0 = iy < 0 ? -iy : 0;
+	y1 = height - iy - ey < height ? height - iy - ey : height;
+	if( x0 >= x1 || y0 >= y1 )
+		return;
+
+	w[0] = (1 - fx) * (1 - fy);
+	w[1] = fx * (1 - fy);
+	w[2] = (1 - fx) * fy;
+	w[3] = fx * fy;
+
+	for( y = y0; y < y1; y++ )
+	{
+		a = slot->data + (y + iy)*width + x0 + ix;
+		if( ex || ey )
+			add_bilinear_row( sa->sum + y*width + x0, sa->coverage + y*width + x0, a,
+							  ey ? a + width : a, x1 - x0, w );
+		else
+			add_row( sa->sum + y*width + x0, sa->coverage + y*width + x0, a, x1 - x0 );
+	}
+}
+
+/*
+ * Write a 16 bit PGM, big endian as the format wants it, via a temporary
+ * file so a reader never sees half of it
+ * returns -1 on error, 0 otherwise
+ */
+static int write_pgm16( const char *file, const uint16_t *data, uint32_t width, uint32_t height )
+{
+	char tmp[1024];
+	FILE *f;
+	int ok;
+
+	snprintf( tmp, sizeof(tmp), "%s.tmp", file );
+	f = fopen( tmp, "wb" );
+	if( !f )
+	{
+		ERROR( "cannot create %s", tmp );
+		return (-1);
+	}
+	ok = fprintf( f, "P5\n%u %u\n65535\n", width, height ) > 0 &&
+		 fwrite( data, sizeof(uint16_t), (size_t)width * height, f ) == (size_t)width * height;
+	if( fclose( f ) || !ok || rename( tmp, file ) )
+	{
+		ERROR( "cannot write %s", file );
+		unlink( tmp );
+		return (-1);
+	}
+	return (0);
+}
+
+static inline uint16_t be16( uint32_t v )
+{
+	v = v > 65535 ? 65535 : v;
+	return (uint16_t)((v >> 8) | (v << 8));
+}
+
+/*
+ * Write the mean of the master, 8 bit scaled to 16, to sa->file and the
+ * coverage to <file without .pgm>_coverage.pgm
+ * returns -1 on error, 0 otherwise
+ */
+static int write_stack( shiftadd_t *sa )
+{
+	uint32_t i, n = sa->width * sa->height;
+	uint16_t *out;
+	char cov_file[1024];
+	size_t len = strlen( sa->file );
+	int ret;
+
+	out = calloc( n, sizeof(uint16_t) );
+	if( !out )
+	{
+		ERROR( "out of memory" );
+		return (-1);
+	}
+	for( i = 0; i < n; i++ )
+		out[i] = be16( sa->coverage[i] ? sa->sum[i] * 256.0f / sa->coverage[i] + 0.5f : 0 );
+	ret = write_pgm16( sa->file, out, sa->width, sa->height );
+
+	if( len > 4 && strcmp( sa->file + len - 4, ".pgm" ) == 0 )
+		len -= 4;
+	snprintf( cov_file, sizeof(cov_file), "%.*s_coverage.pgm", (int)len, sa->file );
+	for( i = 0; i < n; i++ )
+		out[i] = be16( sa->coverage[i] );
+	if( !ret )
+		ret = write_pgm16( cov_file, out, sa->width, sa->height );
+
+	free( out );
+	if( !ret )
+		MSG( "%s: %lu frames stacked", sa->file, sa->stacked );
+	return ret;
+}
+
+/*
+ * Stacking thread: adds the frames whose shifts are in, writes on request,
+ * ends on quit once there is nothing left to add
+ */
+static void *shiftadd_thread( void *arg )
+{
+	shiftadd_t *sa = arg;
+	shiftadd_slot_t *slot;
+	int k;
+
+	pthread_mutex_lock( &sa->lock );
+	for( ;; )
+	{
+		for( slot = NULL, k = 0; k < SHIFTADD_SLOTS && !slot; k++ )
+			if( sa->slot[k].state == SHIFTADD_READY )
+				slot = &sa->slot[k];
+
+		if( slot )
+		{
+			slot->state = SHIFTADD_BUSY;
+			pthread_mutex_unlock( &sa->lock );
+			add_frame( sa, slot );
+			pthread_mutex_lock( &sa->lock );
+			slot->state = SHIFTADD_FREE;
+			sa->stacked++;
+		}
+		else if( sa->write_pending )
+		{
+			sa->write_pending = 0;
+			pthread_mutex_unlock( &sa->lock );
+			write_stack( sa );
+			pthread_mutex_lock( &sa->lock );
+		}
+		else if( sa->quit )
+			break;
+		else
+			pthread_cond_wait( &sa->wake, &sa->lock );
+	}
+	pthread_mutex_unlock( &sa->lock );
+	return NULL;
+}
+
+/*
+ * Shift-and-add stack of width x height frames, written to file, a 16 bit PGM
+ * returns NULL on error
+ */
+shiftadd_t *shiftadd_create( uint32_t width, uint32_t height, const char *file )
+{
+	shiftadd_t *sa;
+	size_t n = (size_t)width * height;
+	int k;
+
+	if( !width || !height || !file )
+	{
+		ERROR( "bad stack %u x %u", width, height );
+		return NULL;
+	}
+	sa = calloc( 1, sizeof(*sa) );
+	if( !sa )
+	{
+		ERROR( "out of memory" );
+		return NULL;
+	}
+	sa->width = width;
+	sa->height = height;
+	sa->sum = calloc( n, sizeof(float) );
+	sa->coverage = calloc( n, sizeof(uint32_t) );
+	sa->file = strdup( file );
+	for( k = 0; k < SHIFTADD_SLOTS; k++ )
+		sa->slot[k].data = malloc( n + 1 ); // a[n] of add_bilinear_row on the last line
+	for( k = 0; k < SHIFTADD_SLOTS && sa->slot[k].data; k++ )
+		;
+	if( !sa->sum || !sa->coverage || !sa->file || k < SHIFTADD_SLOTS )
+	{
+		ERROR( "out of memory" );
+		goto fail;
+	}
+
+	pthread_mutex_init( &sa->lock, NULL );
+	pthread_cond_init( &sa->wake, NULL );
+	if( pthread_create( &sa->tid, NULL, shiftadd_thread, sa ) )
+	{
+		ERROR( "cannot start stacking thread" );
+		pthread_cond_destroy( &sa->wake );
+		pthread_mutex_destroy( &sa->lock );
+		goto fail;
+	}
+
+	DEBUG( "shift-and-add of %u x %u into %s (%s)", width, height, file, SHIFTADD_SIMD );
+	return sa;
+
+fail:
+	for( k = 0; k < SHIFTADD_SLOTS; k++ )
+		free( sa->slot[k].data );
+	free( sa->sum );
+	free( sa->coverage );
+	free( sa->file );
+	free( sa );
+	return NULL;
+}
+
+/*
+ * Add what is ready, then stop. Frames still waiting for their shift are
+ * left out. Does not write the stack, see shiftadd_request_write
+ */
+void shiftadd_destroy( shiftadd_t *sa )
+{
+	int k;
+
+	if( !sa )
+		return;
+	pthread_mutex_lock( &sa->lock );
+	sa->quit = 1;
+	pthread_cond_signal( &sa->wake );
+	pthread_mutex_unlock( &sa->lock );
+	pthread_join( sa->tid, NULL );
+
+	MSG( "shift-and-add: %lu frames stacked, %lu skipped, %lu failed", sa->stacked, sa->skipped, sa->discarded );
+	pthread_cond_destroy( &sa->wake );
+	pthread_mutex_destroy( &sa->lock );
+	for( k = 0; k < SHIFTADD_SLOTS; k++ )
+		free( sa->slot[k].data );
+	free( sa->sum );
+	free( sa->coverage );
+	free( sa->file );
+	free( sa );
+}
+
+/*
+ * Copy frame seq (any stride or view) to be added once its shift is known.
+ * The copy is taken by the caller's thread, outside the lock
+ * returns -1 if the size is wrong or no slot is free, the frame is left out
+ */
+int shiftadd_push( shiftadd_t *sa, pix_y_t *pix, uint32_t seq )
+{
+	shiftadd_slot_t *slot = NULL;
+	pix_y_t dst;
+	int k;
+
+	if( pix->width != sa->width || pix->height != sa->height )
+	{
+		ERROR( "cannot stack %u x %u onto %u x %u", pix->width, pix->height, sa->width, sa->height );
+		return (-1);
+	}
+
+	pthread_mutex_lock( &sa->lock );
+	for( k = 0; k < SHIFTADD_SLOTS && !slot; k++ )
+		if( sa->slot[k].state == SHIFTADD_FREE )
+			slot = &sa->slot[k];
+	if( slot )
+		slot->state = SHIFTADD_BUSY;
+	else
+		sa->skipped++;
+	pthread_mutex_unlock( &sa->lock );
+	if( !slot )
+		return (-1);
+
+	pixInit( &dst, slot->data, sa->width, sa->height, sa->width );
+	pixCopy( &dst, pix );
+
+	pthread_mutex_lock( &sa->lock );
+	slot->seq = seq;
+	slot->state = SHIFTADD_PENDING;
+	pthread_mutex_unlock( &sa->lock );
+	return (0);
+}
+
+static shiftadd_slot_t *pending( shiftadd_t *sa, uint32_t seq )
+{
+	int k;
+
+	for( k = 0; k < SHIFTADD_SLOTS; k++ )
+		if( sa->slot[k].state == SHIFTADD_PENDING && sa->slot[k].seq == seq )
+			return &sa->slot[k];
+	return NULL;
+}
+
+/*
+ * Shift of frame seq is known, its content is at the reference's + (dx, dy).
+ * Nothing happens if seq was not pushed.
+ */
+void shiftadd_shift( shiftadd_t *sa, uint32_t seq, float dx, float dy )
+{
+	shiftadd_slot_t *slot;
+
+	pthread_mutex_lock( &sa->lock );
+	slot = pending( sa, seq );
+	if( slot )
+	{
+		slot->dx = dx;
+		slot->dy = dy;
+		slot->state = SHIFTADD_READY;
+		pthread_cond_signal( &sa->wake );
+	}
+	pthread_mutex_unlock( &sa->lock );
+}
+
+/*
+ * Frame seq could not be correlated, leave it out
+ */
+void shiftadd_discard( shiftadd_t *sa, uint32_t seq )
+{
+	shiftadd_slot_t *slot;
+
+	pthread_mutex_lock( &sa->lock );
+	slot = pending( sa, seq );
+	if( slot )
+	{
+		slot->state = SHIFTADD_FREE;
+		sa->discarded++;
+	}
+	pthread_mutex_unlock( &sa->lock );
+}
+
+/*
+ * Write the stack from the stacking thread, after the frames ready so far
+ */
+void shiftadd_request_write( shiftadd_t *sa )
+{
+	pthread_mutex_lock( &sa->lock );
+	sa->write_pending = 1;
+	pthread_cond_signal( &sa->wake );
+	pthread_mutex_unlock( &sa->lock );
+}
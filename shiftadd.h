@@ -0,0 +1,60 @@
+#ifndef SHIFTADD_H
+#define SHIFTADD_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "mmalyuv.h"
+
+/*
+ * Shift-and-add stacking of the guided frames: each frame is copied when
+ * it is submitted for correlation and added into a float master at its
+ * measured shift once the result is in, by a thread of its own so the
+ * guiding loop never waits for it. Whole pixel shifts are added as they
+ * are, fractional ones bilinearly (NEON/SSE2, scalar otherwise). The
+ * coverage, frames that contributed, is counted per pixel and the mean is
+ * written as 16 bit PGM on demand.
+ */
+
+// frames copied but not added yet: in correlation or waiting for the thread
+#define SHIFTADD_SLOTS 8
+
+#define SHIFTADD_FREE    0
+#define SHIFTADD_PENDING 1  // waiting for its shift
+#define SHIFTADD_READY   2  // shift known, waiting for the thread
+#define SHIFTADD_BUSY    3  // being added
+
+typedef struct {
+	int state;
+	uint32_t seq;
+	float dx, dy;        // content of the frame is at the reference's + (dx, dy)
+	uint8_t *data;       // width * height
+} shiftadd_slot_t;
+
+typedef struct {
+	uint32_t width;
+	uint32_t height;
+	float *sum;          // width * height
+	uint32_t *coverage;  // width * height
+	shiftadd_slot_t slot[SHIFTADD_SLOTS];
+	char *file;          // written on demand
+
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	int write_pending;
+	int quit;
+
+	unsigned long stacked;   // frames added
+	unsigned long skipped;   // no free slot
+	unsigned long discarded; // correlation failed
+} shiftadd_t;
+
+shiftadd_t *shiftadd_create( uint32_t width, uint32_t height, const char *file );
+void shiftadd_destroy( shiftadd_t *sa );
+
+int shiftadd_push( shiftadd_t *sa, pix_y_t *pix, uint32_t seq );
+void shiftadd_shift( shiftadd_t *sa, uint32_t seq, float dx, float dy );
+void shiftadd_discard( shiftadd_t *sa, uint32_t seq );
+void shiftadd_request_write( shiftadd_t *sa );
+
+#endif /* SHIFTADD_H */
@@ -0,0 +1,63 @@
+#include <stdlib.h>
+
+#include "log.h"
+#include "spsc.h"
+
+/*
+ * Create queue for at least size pointers
+ * returns -1 on error, 0 otherwise
+ */
+int spsc_init( spsc_t *q, unsigned size )
+{
+	q->size = 1;
+	while( q->size < size )
+		q->size <<= 1;
+	q->head = q->tail = 0;
+	q->slot = calloc( q->size, sizeof(void *) );
+	if( !q->slot )
+	{
+		ERROR("out of memory");
+		return (-1);
+	}
+	return (0);
+}
+
+void spsc_free( spsc_t *q )
+{
+	free( q->slot );
+	q->slot = NULL;
+}
+
+/*
+ * Producer side: append p
+ * returns -1 if the queue is full, 0 otherwise
+ */
+int spsc_push( spsc_t *q, void *p )
+{
+	unsigned tail = q->tail;
+
+	if( tail - q->head == q->size )
+		return (-1);
+	q->slot[tail & (q->size-1)] = p;
+	__sync_synchronize(); // slot is written before the consumer can see it
+	q->tail = tail + 1;
+	return (0);
+}
+
+/*
+ * Consumer side: remove the oldest pointer
+ * returns NULL if the queue is empty
+ */
+void *spsc_pop( spsc_t *q )
+{
+	unsigned head = q->head;
+	void *p;
+
+	if( head == q->tail )
+		return NULL;
+	__sync_synchronize(); // tail is read before the slot
+	p = q->slot[head & (q->size-1)];
+	__sync_synchronize(); // slot is read before the producer may reuse it
+	q->head = head + 1;
+	return p;
+}
@@ -0,0 +1,23 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+/*
+ * Lock-free queue of pointers for exactly one producer and one consumer
+ * thread, e.g. frame buffers from the capture to the processing thread.
+ * Neither side ever blocks, a full queue makes spsc_push fail, an empty one
+ * makes spsc_pop return NULL.
+ */
+typedef struct {
+	void **slot;
+	unsigned size;          // power of 2
+	volatile unsigned head; // next to pop, written by the consumer only
+	volatile unsigned tail; // next to push, written by the producer only
+} spsc_t;
+
+int spsc_init( spsc_t *q, unsigned size );
+void spsc_free( spsc_t *q );
+
+int spsc_push( spsc_t *q, void *p );
+void *spsc_pop( spsc_t *q );
+
+#endif /* SPSC_H */
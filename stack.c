@@ -0,0 +1,310 @@
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define STACK_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define STACK_SSE2
+#endif
+
+#include "log.h"
+#include "stack.h"
+#include "image.h"
+
+#if defined(STACK_NEON)
+#define STACK_SIMD "neon"
+#elif defined(STACK_SSE2)
+#define STACK_SIMD "sse2"
+#else
+#define STACK_SIMD "scalar"
+#endif
+
+/*
+ * acc[i] += src[i], i < n. acc 16 byte aligned
+ */
+static void add_row( uint16_t *acc, const uint8_t *src, uint32_t n )
+{
+	uint32_t i = 0;
+
+#if defined(STACK_NEON)
+	for( ; i + 16 <= n; i += 16 )
+	{
+		uint8x16_t s = vld1q_u8( src + i );
+
+		vst1q_u16( acc + i,     vaddw_u8( vld1q_u16( acc + i ),     vget_low_u8( s ) ) );
+		vst1q_u16( acc + i + 8, vaddw_u8( vld1q_u16( acc + i + 8 ), vget_high_u8( s ) ) );
+	}
+#elif defined(STACK_SSE2)
+	__m128i z = _mm_setzero_si128();
+
+	for( ; i + 16 <= n; i += 16 )
+	{
+		__m128i s = _mm_loadu_si128( (const __m128i *)(src + i) );
+		__m128i *a = (__m128i *)(acc + i);
+
+		_mm_store_si128( a,     _mm_add_epi16( _mm_load_si128( a ),     _mm_unpacklo_epi8( s, z ) ) );
+		_mm_store_si128( a + 1, _mm_add_epi16( _mm_load_si128( a + 1 ), _mm_unpackhi_epi8( s, z ) ) );
+	}
+#endif
+	for( ; i < n; i++ )
+		acc[i] += src[i];
+}
+
+/*
+ * acc[i] += src[i]^2, i < n. acc 16 byte aligned
+ */
+static void add_sq_row( uint32_t *acc, const uint8_t *src, uint32_t n )
+{
+	uint32_t i = 0;
+
+#if defined(STACK_NEON)
+	for( ; i + 16 <= n; i += 16 )
+	{
+		uint8x16_t s = vld1q_u8( src + i );
+		uint16x8_t lo = vmull_u8( vget_low_u8( s ), vget_low_u8( s ) );
+		uint16x8_t hi = vmull_u8( vget_high_u8( s ), vget_high_u8( s ) );
+
+		vst1q_u32( acc + i,      vaddw_u16( vld1q_u32( acc + i ),      vget_low_u16( lo ) ) );
+		vst1q_u32( acc + i + 4,  vaddw_u16( vld1q_u32( acc + i + 4 ),  vget_high_u16( lo ) ) );
+		vst1q_u32( acc + i + 8,  vaddw_u16( vld1q_u32( acc + i + 8 ),  vget_low_u16( hi ) ) );
+		vst1q_u32( acc + i + 12, vaddw_u16( vld1q_u32( acc + i + 12 ), vget_high_u16( hi ) ) );
+	}
+#elif defined(STACK_SSE2)
+	__m128i z = _mm_setzero_si128();
+
+	for( ; i + 16 <= n; i += 16 )
+	{
+		__m128i s = _mm_loadu_si128( (const __m128i *)(src + i) );
+		__m128i lo = _mm_unpacklo_epi8( s, z ), hi = _mm_unpackhi_epi8( s, z );
+		__m128i *a = (__m128i *)(acc + i);
+
+		// squares of 8 bit values fit into 16 bit
+		lo = _mm_mullo_epi16( lo, lo );
+		hi = _mm_mullo_epi16( hi, hi );
+		_mm_store_si128( a,     _mm_add_epi32( _mm_load_si128( a ),     _mm_unpacklo_epi16( lo, z ) ) );
+		_mm_store_si128( a + 1, _mm_add_epi32( _mm_load_si128( a + 1 ), _mm_unpackhi_epi16( lo, z ) ) );
+		_mm_store_si128( a + 2, _mm_add_epi32( _mm_load_si128( a + 2 ), _mm_unpacklo_epi16( hi, z ) ) );
+		_mm_store_si128( a + 3, _mm_add_epi32( _mm_load_si128( a + 3 ), _mm_unpackhi_epi16( hi, z ) ) );
+	}
+#endif
+	for( ; i < n; i++ )
+		acc[i] += src[i] * src[i];
+}
+
+/*
+ * dst[i] = sum[i] * inv rounded, i < n. sum 16 byte aligned
+ * The same float arithmetic on every path, so they give the same result
+ */
+static void mean_row( uint8_t *dst, const uint16_t *sum, uint32_t n, float inv )
+{
+	uint32_t i = 0;
+
+#if defined(STACK_NEON)
+	float32x4_t vinv = vdupq_n_f32( inv ), half = vdupq_n_f32( 0.5f );
+
+	for( ; i + 8 <= n; i += 8 )
+	{
+		uint16x8_t s = vld1q_u16( sum + i );
+		float32x4_t lo = vcvtq_f32_u32( vmovl_u16( vget_low_u16( s ) ) );
+		float32x4_t hi = vcvtq_f32_u32( vmovl_u16( vget_high_u16( s ) ) );
+		uint32x4_t mlo = vcvtq_u32_f32( vaddq_f32( vmulq_f32( lo, vinv ), half ) );
+		uint32x4_t mhi = vcvtq_u32_f32( vaddq_f32( vmulq_f32( hi, vinv ), half ) );
+
+		vst1_u8( dst + i, vmovn_u16( vcombine_u16( vmovn_u32( mlo ), vmovn_u32( mhi ) ) ) );
+	}
+#elif defined(STACK_SSE2)
+	__m128i z = _mm_setzero_si128();
+	__m128 vinv = _mm_set1_ps( inv ), half = _mm_set1_ps( 0.5f );
+
+	for( ; i + 8 <= n; i += 8 )
+	{
+		__m128i s = _mm_load_si128( (const __m128i *)(sum + i) );
+		__m128 lo = _mm_cvtepi32_ps( _mm_unpacklo_epi16( s, z ) );
+		__m128 hi = _mm_cvtepi32_ps( _mm_unpackhi_epi16( s, z ) );
+		__m128i m = _mm_packs_epi32( _mm_cvttps_epi32( _mm_add_ps( _mm_mul_ps( lo, vinv ), half ) ),
+									 _mm_cvttps_epi32( _mm_add_ps( _mm_mul_ps( hi, vinv ), half ) ) );
+
+		_mm_storel_epi64( (__m128i *)(dst + i), _mm_packus_epi16( m, m ) );
+	}
+#endif
+	for( ; i < n; i++ )
+		dst[i] = (uint8_t)(sum[i] * inv + 0.5f);
+}
+
+/*
+ * Sigma-clipped mean of row j, from the copies of the sub-exposures
+ */
+static void clipped_row( pix_stack_t *st, uint8_t *dst, uint32_t j, float inv )
+{
+	uint32_t i, plane = st->width * st->height;
+	uint16_t *sum = st->sum + j*st->stride;
+	uint32_t *sumsq = st->sumsq + j*st->stride;
+	uint8_t *v;
+	float mean, var, lim, d, acc;
+	int k, cnt;
+
+	for( i = 0; i < st->width; i++ )
+	{
+		mean = sum[i] * inv;
+		var = sumsq[i] * inv - mean*mean;
+		lim = var > 0 ? st->kappa * st->kappa * var : 0;
+
+		acc = 0;
+		cnt = 0;
+		v = st->copies + j*st->width + i;
+		for( k = 0; k < st->frames; k++, v += plane )
+		{
+			d = *v - mean;
+			if( d*d <= lim )
+			{
+				acc += *v;
+				cnt++;
+			}
+		}
+		dst[i] = (uint8_t)((cnt ? acc / cnt : mean) + 0.5f);
+	}
+}
+
+
+/*
+ * Create a stack for up to max_frames sub-exposures of width x height,
+ * sigma-clipped with kappa > 0
+ * returns NULL on error
+ */
+pix_stack_t *stack_create( uint32_t width, uint32_t height, int max_frames, float kappa )
+{
+	pix_stack_t *st;
+
+	if( !width || !height || max_frames < 1 || max_frames > STACK_MAX_FRAMES || kappa < 0 )
+	{
+		ERROR( "cannot stack %d frames of %u x %u", max_frames, width, height );
+		return NULL;
+	}
+
+	st = calloc( 1, sizeof(*st) );
+	if( !st )
+	{
+		ERROR( "out of memory" );
+		return NULL;
+	}
+	st->width = width;
+	st->height = height;
+	st->stride = (width + 15) & ~15;
+	st->max_frames = max_frames;
+	st->kappa = kappa;
+
+	if( posix_memalign( (void **)&st->sum, 16, st->stride * height * sizeof(uint16_t) ) )
+		st->sum = NULL;
+	if( kappa > 0 )
+	{
+		if( posix_memalign( (void **)&st->sumsq, 16, st->stride * height * sizeof(uint32_t) ) )
+			st->sumsq = NULL;
+		st->copies = malloc( (size_t)max_frames * width * height );
+	}
+	if( !st->sum || (kappa > 0 && (!st->sumsq || !st->copies)) )
+	{
+		ERROR( "out of memory" );
+		stack_destroy( st );
+		return NULL;
+	}
+
+	stack_reset( st );
+	DEBUG( "stacking up to %d frames of %u x %u (%s)%s", max_frames, width, height, STACK_SIMD,
+		   kappa > 0 ? ", sigma clipped" : "" );
+	return st;
+}
+
+void stack_destroy( pix_stack_t *st )
+{
+	if( !st )
+		return;
+	free( st->sum );
+	free( st->sumsq );
+	free( st->copies );
+	free( st );
+}
+
+/*
+ * Start the next stack
+ */
+void stack_reset( pix_stack_t *st )
+{
+	memset( st->sum, 0, st->stride * st->height * sizeof(uint16_t) );
+	if( st->sumsq )
+		memset( st->sumsq, 0, st->stride * st->height * sizeof(uint32_t) );
+	st->frames = 0;
+}
+
+/*
+ * Add a sub-exposure, any stride or a view that does not step. The stack
+ * does not keep pix
+ * returns -1 if the stack is full or pix has another size, 0 otherwise
+ */
+int stack_add( pix_stack_t *st, pix_y_t *pix )
+{
+	uint32_t j;
+	uint8_t *src;
+
+	if( pix->width != st->width || pix->height != st->height || pix->step != 1 )
+	{
+		ERROR( "cannot stack %u x %u step %u onto %u x %u", pix->width, pix->height, pix->step,
+			   st->width, st->height );
+		return (-1);
+	}
+	if( st->frames >= st->max_frames )
+	{
+		ERROR( "stack is full, %d frames", st->frames );
+		return (-1);
+	}
+
+	for( j = 0; j < st->height; j++ )
+	{
+		src = pixAt( pix, 0, j );
+		add_row( st->sum + j*st->stride, src, st->width );
+		if( st->kappa > 0 )
+		{
+			add_sq_row( st->sumsq + j*st->stride, src, st->width );
+			memcpy( st->copies + ((size_t)st->frames * st->height + j) * st->width, src, st->width );
+		}
+	}
+	st->frames++;
+	return (0);
+}
+
+/*
+ * Mean of the stack into dst (any stride, may be one of the stacked
+ * frames), sigma-clipped if the stack was created with kappa > 0
+ * returns -1 if the stack is empty or dst has another size, 0 otherwise
+ */
+int stack_mean( pix_stack_t *st, pix_y_t *dst )
+{
+	uint32_t j;
+	float inv;
+
+	if( !st->frames || dst->width != st->width || dst->height != st->height || dst->step != 1 )
+	{
+		ERROR( "cannot take mean of %d frames of %u x %u into %u x %u", st->frames,
+			   st->width, st->height, dst->width, dst->height );
+		return (-1);
+	}
+
+	inv = 1.0f / st->frames;
+	for( j = 0; j < st->height; j++ )
+	{
+		if( st->kappa > 0 )
+			clipped_row( st, pixAt( dst, 0, j ), j, inv );
+		else
+			mean_row( pixAt( dst, 0, j ), st->sum + j*st->stride, st->width, inv );
+	}
+	return (0);
+}
+
+/*
+ * Sum of the stack, st->stride values per line
+ */
+uint16_t *stack_sum( pix_stack_t *st )
+{
+	return st->sum;
+}
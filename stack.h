@@ -0,0 +1,38 @@
+#ifndef STACK_H
+#define STACK_H
+
+#include <stdint.h>
+#include "mmalyuv.h"
+
+/*
+ * Stacking of the sub-exposures of one frame: each is added into a uint16
+ * accumulator (NEON/SSE2, scalar otherwise), the mean or the sum is taken
+ * once at the end. With kappa > 0 the mean is sigma-clipped per pixel,
+ * values further than kappa standard deviations from the pixel's mean are
+ * left out. That needs a copy of every sub-exposure.
+ */
+
+// sums of 8 bit values in 16 bit
+#define STACK_MAX_FRAMES 256
+
+typedef struct {
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;     // of sum and sumsq, multiple of 16 pixels
+	int max_frames;
+	int frames;          // added since stack_reset
+	float kappa;         // sigma clipping, 0 off
+	uint16_t *sum;
+	uint32_t *sumsq;     // kappa > 0 only
+	uint8_t *copies;     // kappa > 0 only, max_frames * width * height
+} pix_stack_t;
+
+pix_stack_t *stack_create( uint32_t width, uint32_t height, int max_frames, float kappa );
+void stack_destroy( pix_stack_t *st );
+
+void stack_reset( pix_stack_t *st );
+int stack_add( pix_stack_t *st, pix_y_t *pix );
+int stack_mean( pix_stack_t *st, pix_y_t *dst );
+uint16_t *stack_sum( pix_stack_t *st );
+
+#endif /* STACK_H */
@@ -0,0 +1,155 @@
+/*
+ * Throughput of the sub-exposure stacking (stack.c) at 1024 x 1024 and at
+ * the full sensor size, 2592 x 1944: add all frames and take the mean,
+ * the same with sigma clipping, and the running 8 bit average mmalyuv
+ * used before for comparison. Frames have padded lines like the camera's.
+ *
+ * Prints MB of sub-exposures stacked per second and the largest difference
+ * of each mean from the exact one. The clipped mean differs where it left
+ * out the hot pixels.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "stack.h"
+#include "image.h"
+#include "trace.h"
+
+char Usage[] =
+	"Usage: stack_bench [frames [loops]]\n"
+	"frames = sub-exposures per stack, 1...256, default 3\n"
+	"loops  = stacks per measurement,            default 10\n";
+
+/* running average of n sub-exposures, as y_writer_callback did it */
+static void running_average( pix_y_t *dst, pix_y_t *sub, int n )
+{
+	uint32_t i, j;
+	uint8_t *d, *s;
+
+	for( j = 0; j < dst->height; j++ )
+	{
+		d = dst->data + j*dst->stride;
+		s = sub->data + j*sub->stride;
+		for( i = 0; i < dst->width; i++ )
+			d[i] = d[i] + ((int)s[i] - d[i]) / n;
+	}
+}
+
+/* largest difference of dst from the mean of the frames, rounded half up */
+static int max_diff( pix_y_t *dst, pix_y_t *sub, int frames )
+{
+	uint32_t i, j, sum;
+	int k, d, max = 0;
+
+	for( j = 0; j < dst->height; j++ )
+		for( i = 0; i < dst->width; i++ )
+		{
+			for( sum = 0, k = 0; k < frames; k++ )
+				sum += sub[k].data[j*sub[k].stride + i];
+			d = abs( (int)dst->data[j*dst->stride + i] - (int)((2*sum + frames) / (2*frames)) );
+			if( d > max )
+				max = d;
+		}
+	return max;
+}
+
+static void report( const char *name, long us, int loops, int frames, pix_y_t *dst, pix_y_t *sub )
+{
+	double mb = (double)loops * frames * dst->width * dst->height / (1 << 20);
+
+	printf( "  %-16s %8.2f ms/stack %8.1f MB/s  max_abs_diff = %d\n", name,
+			us / 1000.0 / loops, mb / (us / 1e6), max_diff( dst, sub, frames ) );
+}
+
+static int bench( uint32_t w, uint32_t h, int frames, int loops )
+{
+	pix_y_t *sub, dst;
+	pix_stack_t *plain, *clipped;
+	uint32_t i;
+	int k, l;
+	long t;
+
+	sub = calloc( frames, sizeof(*sub) );
+	pixInit( &dst, malloc( ((w + 31) & ~31) * h ), w, h, (w + 31) & ~31 );
+	plain = stack_create( w, h, frames, 0 );
+	clipped = stack_create( w, h, frames, 2.5 );
+	if( !sub || !dst.data || !plain || !clipped )
+	{
+		printf( "Out of memory.\n" );
+		return -1;
+	}
+
+	// sky with noise and a few hot pixels, different per frame
+	for( k = 0; k < frames; k++ )
+	{
+		pixInit( &sub[k], malloc( dst.stride * h ), w, h, dst.stride );
+		if( !sub[k].data )
+		{
+			printf( "Out of memory.\n" );
+			return -1;
+		}
+		for( i = 0; i < dst.stride * h; i++ )
+			sub[k].data[i] = 20 + random() % 32 + (random() % 4096 == 0 ? 200 : 0);
+	}
+
+	printf( "%u x %u, %d frames:\n", w, h, frames );
+
+	t = now_us();
+	for( l = 0; l < loops; l++ )
+	{
+		stack_reset( plain );
+		for( k = 0; k < frames; k++ )
+			stack_add( plain, &sub[k] );
+		stack_mean( plain, &dst );
+	}
+	report( "mean", now_us() - t, loops, frames, &dst, sub );
+
+	t = now_us();
+	for( l = 0; l < loops; l++ )
+	{
+		stack_reset( clipped );
+		for( k = 0; k < frames; k++ )
+			stack_add( clipped, &sub[k] );
+		stack_mean( clipped, &dst );
+	}
+	report( "clipped mean", now_us() - t, loops, frames, &dst, sub );
+
+	t = now_us();
+	for( l = 0; l < loops; l++ )
+	{
+		for( i = 0; i < h; i++ )
+			memcpy( dst.data + i*dst.stride, sub[0].data + i*sub[0].stride, w );
+		for( k = 1; k < frames; k++ )
+			running_average( &dst, &sub[k], k+1 );
+	}
+	report( "running average", now_us() - t, loops, frames, &dst, sub );
+
+	stack_destroy( plain );
+	stack_destroy( clipped );
+	for( k = 0; k < frames; k++ )
+		free( sub[k].data );
+	free( sub );
+	free( dst.data );
+	return 0;
+}
+
+int main( int argc, char *argv[] )
+{
+	int frames = argc > 1 ? atoi( argv[1] ) : 3;
+	int loops  = argc > 2 ? atoi( argv[2] ) : 10;
+
+	if( frames < 1 || frames > STACK_MAX_FRAMES || loops < 1 )
+	{
+		printf( "%s", Usage );
+		return -1;
+	}
+
+	log_verbose( 0 );
+	if( bench( 1024, 1024, frames, loops ) || bench( 2592, 1944, frames, loops ) )
+		return -1;
+	return 0;
+}
@@ -0,0 +1,10 @@
+/*
+ * Off-device stand-in for bcm_host.h, see mmal_standin.c
+ */
+#ifndef BCM_HOST_H
+#define BCM_HOST_H
+
+void bcm_host_init( void );
+void bcm_host_deinit( void );
+
+#endif /* BCM_HOST_H */
@@ -0,0 +1,13 @@
+/*
+ * Off-device stand-in for mmal_encodings.h, see mmal_standin.c
+ */
+#ifndef MMAL_ENCODINGS_H
+#define MMAL_ENCODINGS_H
+
+#include "mmal.h"
+
+#define MMAL_ENCODING_I420 MMAL_FOURCC('I','4','2','0')
+#define MMAL_ENCODING_YV12 MMAL_FOURCC('Y','V','1','2')
+#define MMAL_ENCODING_GREY MMAL_FOURCC('G','R','E','Y')
+
+#endif /* MMAL_ENCODINGS_H */
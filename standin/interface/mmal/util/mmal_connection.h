@@ -0,0 +1,9 @@
+/*
+ * Off-device stand-in for mmal_connection.h, nothing of it is used by mmalyuv
+ */
+#ifndef MMAL_CONNECTION_H
+#define MMAL_CONNECTION_H
+
+#include "interface/mmal/mmal.h"
+
+#endif /* MMAL_CONNECTION_H */
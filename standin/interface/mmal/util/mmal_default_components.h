@@ -0,0 +1,9 @@
+/*
+ * Off-device stand-in for mmal_default_components.h, see mmal_standin.c
+ */
+#ifndef MMAL_DEFAULT_COMPONENTS_H
+#define MMAL_DEFAULT_COMPONENTS_H
+
+#define MMAL_COMPONENT_DEFAULT_CAMERA "vc.ril.camera"
+
+#endif /* MMAL_DEFAULT_COMPONENTS_H */
@@ -0,0 +1,9 @@
+/*
+ * Off-device stand-in for mmal_util.h, nothing of it is used by mmalyuv
+ */
+#ifndef MMAL_UTIL_H
+#define MMAL_UTIL_H
+
+#include "interface/mmal/mmal.h"
+
+#endif /* MMAL_UTIL_H */
@@ -0,0 +1,13 @@
+/*
+ * Off-device stand-in for mmal_util_params.h, see mmal_standin.c
+ */
+#ifndef MMAL_UTIL_PARAMS_H
+#define MMAL_UTIL_PARAMS_H
+
+#include "interface/mmal/mmal.h"
+
+MMAL_STATUS_T mmal_port_parameter_set_boolean( MMAL_PORT_T *port, uint32_t id, MMAL_BOOL_T value );
+MMAL_STATUS_T mmal_port_parameter_set_uint32( MMAL_PORT_T *port, uint32_t id, uint32_t value );
+MMAL_STATUS_T mmal_port_parameter_set_int32( MMAL_PORT_T *port, uint32_t id, int32_t value );
+
+#endif /* MMAL_UTIL_PARAMS_H */
@@ -0,0 +1,59 @@
+/*
+ * Off-device stand-in for the VCOS subset used by mmalyuv, see mmal_standin.c
+ */
+#ifndef VCOS_H
+#define VCOS_H
+
+#include <stdint.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <semaphore.h>
+
+typedef enum {
+	VCOS_SUCCESS,
+	VCOS_EAGAIN,
+	VCOS_ENOENT,
+	VCOS_ENOSPC,
+	VCOS_EINVAL
+} VCOS_STATUS_T;
+
+typedef sem_t VCOS_SEMAPHORE_T;
+
+#define VCOS_ALIGN_UP(p,n) (((p) + (n) - 1) & ~((n) - 1))
+#define vcos_assert(cond) assert(cond)
+
+static inline VCOS_STATUS_T vcos_semaphore_create( VCOS_SEMAPHORE_T *sem, const char *name, unsigned initial_count )
+{
+	return sem_init( sem, 0, initial_count ) ? VCOS_ENOSPC : VCOS_SUCCESS;
+}
+
+static inline void vcos_semaphore_delete( VCOS_SEMAPHORE_T *sem )
+{
+	sem_destroy( sem );
+}
+
+static inline VCOS_STATUS_T vcos_semaphore_wait( VCOS_SEMAPHORE_T *sem )
+{
+	while( sem_wait( sem ) )
+		if( errno != EINTR )
+			return VCOS_EINVAL;
+	return VCOS_SUCCESS;
+}
+
+static inline VCOS_STATUS_T vcos_semaphore_trywait( VCOS_SEMAPHORE_T *sem )
+{
+	return sem_trywait( sem ) ? VCOS_EAGAIN : VCOS_SUCCESS;
+}
+
+static inline void vcos_semaphore_post( VCOS_SEMAPHORE_T *sem )
+{
+	sem_post( sem );
+}
+
+static inline void vcos_sleep( uint32_t ms )
+{
+	usleep( ms * 1000 );
+}
+
+#endif /* VCOS_H */
@@ -0,0 +1,944 @@
+/*
+ * Off-device stand-in for the MMAL/VCOS subset used by mmalyuv
+ *
+ * Build with "make STANDIN=1", the headers in standin/ take the place of
+ * the userland ones.
+ *
+ * - "vc.ril.camera" has a control port and the outputs preview (0),
+ *   video (1) and capture (2). The output formats take I420 up to the
+ *   sensor size, MMAL_ENCODING_GREY only if the environment variable
+ *   MMAL_STANDIN_GREY is set, like firmware that has it
+ * - a sensor thread per camera stands in for the VideoCore side: while
+ *   MMAL_PARAMETER_CAPTURE is set on the video port it fills one buffer
+ *   per frame period, a capture on the still port delivers one frame a
+ *   frame period after it was triggered. The period is that of the port's
+ *   frame rate, or MMAL_PARAMETER_SHUTTER_SPEED if longer. When the port
+ *   has no buffer, the frame is dropped like on the Pi. Frames larger
+ *   than a buffer continue in the next ones, the last carries FRAME_END
+ * - frames are a synthetic star field (synth.c) of the port's crop size,
+ *   drifting by a random walk of whole pixels, chroma is grey. With MMAL_STANDIN_FRAMES=<file> they are read from a file of raw
+ *   I420 frames of the port's crop size instead (e.g. ffmpeg -pix_fmt
+ *   yuv420p -f rawvideo), over and over. Buffers go to the port callback
+ *   from the sensor thread, like from the MMAL callback thread
+ * - MMAL_STANDIN_JITTER_US=<n> delays each frame by up to n us at random
+ *   past the frame clock, like the ISP and the callback thread do
+ * - queues, pools and buffer headers behave like MMAL's: released headers go
+ *   back to the queue of their pool
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "interface/mmal/mmal.h"
+#include "interface/mmal/mmal_encodings.h"
+#include "interface/mmal/util/mmal_default_components.h"
+#include "interface/mmal/util/mmal_util_params.h"
+#include "bcm_host.h"
+#include "../synth.h"
+#include "../image.h"
+
+#define STANDIN_SENSOR_WIDTH  2592
+#define STANDIN_SENSOR_HEIGHT 1944
+#define STANDIN_OUTPUTS 3          // preview, video, capture
+#define STANDIN_VIDEO_PORT 1
+#define STANDIN_CAPTURE_PORT 2
+#define STANDIN_SKY 16             // level outside the crop
+#define STANDIN_DRIFT 64           // pixels the field may drift, stars placed that far around
+
+struct MMAL_QUEUE_T {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	MMAL_BUFFER_HEADER_T *first, **last;
+	unsigned int length;
+};
+
+struct MMAL_BUFFER_HEADER_PRIVATE_T {
+	MMAL_QUEUE_T *home;       // queue of the pool the header belongs to
+	int refcount;             // references on top of the owner's
+};
+
+struct MMAL_PORT_PRIVATE_T {
+	MMAL_PORT_BH_CB_T cb;
+	MMAL_QUEUE_T *sent;       // buffers waiting to be filled
+	MMAL_BOOL_T capture;      // MMAL_PARAMETER_CAPTURE
+	MMAL_ES_FORMAT_T format;
+	MMAL_ES_SPECIFIC_FORMAT_T es;
+	char name[32];
+};
+
+struct MMAL_COMPONENT_PRIVATE_T {
+	MMAL_PORT_T *ports[1+STANDIN_OUTPUTS];
+	pthread_t sensor;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int running;
+	int delivering;           // sensor thread is in a port callback
+	uint32_t shutter_us;      // 0: frame rate of the port
+	uint8_t *image;           // frame being read out
+	uint32_t image_size;
+	synth_t *field;           // of the crop size, NULL before the first frame
+	uint32_t field_seed;
+	int drift_x, drift_y;
+	const uint8_t *file;      // MMAL_STANDIN_FRAMES mapped, NULL: synthetic
+	size_t file_size;
+	uint32_t file_frame;      // next frame of the file
+	long jitter_us;           // MMAL_STANDIN_JITTER_US
+	unsigned long frames, dropped;
+};
+
+static long standin_usecs( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec*1000000L + ts.tv_nsec/1000;
+}
+
+
+/*
+ *  Queues
+ */
+
+MMAL_QUEUE_T *mmal_queue_create( void )
+{
+	MMAL_QUEUE_T *queue = calloc( 1, sizeof(*queue) );
+
+	if( !queue )
+		return NULL;
+	pthread_mutex_init( &queue->lock, NULL );
+	pthread_cond_init( &queue->cond, NULL );
+	queue->last = &queue->first;
+	return queue;
+}
+
+void mmal_queue_put( MMAL_QUEUE_T *queue, MMAL_BUFFER_HEADER_T *buffer )
+{
+	pthread_mutex_lock( &queue->lock );
+	buffer->next = NULL;
+	*queue->last = buffer;
+	queue->last = &buffer->next;
+	queue->length++;
+	pthread_cond_signal( &queue->cond );
+	pthread_mutex_unlock( &queue->lock );
+}
+
+void mmal_queue_put_back( MMAL_QUEUE_T *queue, MMAL_BUFFER_HEADER_T *buffer )
+{
+	pthread_mutex_lock( &queue->lock );
+	buffer->next = queue->first;
+	queue->first = buffer;
+	if( queue->last == &queue->first )
+		queue->last = &buffer->next;
+	queue->length++;
+	pthread_cond_signal( &queue->cond );
+	pthread_mutex_unlock( &queue->lock );
+}
+
+static MMAL_BUFFER_HEADER_T *queue_get_locked( MMAL_QUEUE_T *queue )
+{
+	MMAL_BUFFER_HEADER_T *buffer = queue->first;
+
+	if( !buffer )
+		return NULL;
+	queue->first = buffer->next;
+	if( !queue->first )
+		queue->last = &queue->first;
+	queue->length--;
+	buffer->next = NULL;
+	return buffer;
+}
+
+MMAL_BUFFER_HEADER_T *mmal_queue_get( MMAL_QUEUE_T *queue )
+{
+	MMAL_BUFFER_HEADER_T *buffer;
+
+	pthread_mutex_lock( &queue->lock );
+	buffer = queue_get_locked( queue );
+	pthread_mutex_unlock( &queue->lock );
+	return buffer;
+}
+
+MMAL_BUFFER_HEADER_T *mmal_queue_wait( MMAL_QUEUE_T *queue )
+{
+	MMAL_BUFFER_HEADER_T *buffer;
+
+	pthread_mutex_lock( &queue->lock );
+	while( !queue->first )
+		pthread_cond_wait( &queue->cond, &queue->lock );
+	buffer = queue_get_locked( queue );
+	pthread_mutex_unlock( &queue->lock );
+	return buffer;
+}
+
+unsigned int mmal_queue_length( MMAL_QUEUE_T *queue )
+{
+	unsigned int length;
+
+	pthread_mutex_lock( &queue->lock );
+	length = queue->length;
+	pthread_mutex_unlock( &queue->lock );
+	return length;
+}
+
+void mmal_queue_destroy( MMAL_QUEUE_T *queue )
+{
+	if( !queue )
+		return;
+	pthread_mutex_destroy( &queue->lock );
+	pthread_cond_destroy( &queue->cond );
+	free( queue );
+}
+
+
+/*
+ *  Buffer headers
+ */
+
+void mmal_buffer_header_reset( MMAL_BUFFER_HEADER_T *header )
+{
+	header->length = 0;
+	header->offset = 0;
+	header->flags = 0;
+	header->pts = MMAL_TIME_UNKNOWN;
+	header->dts = MMAL_TIME_UNKNOWN;
+}
+
+void mmal_buffer_header_acquire( MMAL_BUFFER_HEADER_T *header )
+{
+	__sync_fetch_and_add( &header->priv->refcount, 1 );
+}
+
+void mmal_buffer_header_release( MMAL_BUFFER_HEADER_T *header )
+{
+	if( __sync_fetch_and_sub( &header->priv->refcount, 1 ) > 0 )
+		return;
+	header->priv->refcount = 0;
+	mmal_buffer_header_reset( header );
+	if( header->priv->home )
+		mmal_queue_put( header->priv->home, header );
+}
+
+MMAL_STATUS_T mmal_buffer_header_mem_lock( MMAL_BUFFER_HEADER_T *header )
+{
+	return MMAL_SUCCESS;
+}
+
+void mmal_buffer_header_mem_unlock( MMAL_BUFFER_HEADER_T *header )
+{
+}
+
+
+/*
+ *  Pools
+ */
+
+void mmal_port_pool_destroy( MMAL_PORT_T *port, MMAL_POOL_T *pool )
+{
+	uint32_t i;
+
+	if( !pool )
+		return;
+	for( i = 0; i < pool->headers_num; i++ )
+	{
+		free( pool->header[i]->data );
+		free( pool->header[i] );
+	}
+	free( pool->header );
+	mmal_queue_destroy( pool->queue );
+	free( pool );
+}
+
+MMAL_POOL_T *mmal_port_pool_create( MMAL_PORT_T *port, unsigned int headers, uint32_t payload_size )
+{
+	MMAL_POOL_T *pool;
+	MMAL_BUFFER_HEADER_T *header;
+	struct MMAL_BUFFER_HEADER_PRIVATE_T *priv;
+	unsigned int align = port->buffer_alignment_min > 32 ? port->buffer_alignment_min : 32;
+
+	pool = calloc( 1, sizeof(*pool) );
+	if( !pool )
+		return NULL;
+	pool->queue = mmal_queue_create();
+	pool->header = calloc( headers, sizeof(*pool->header) );
+	if( !pool->queue || !pool->header )
+	{
+		mmal_port_pool_destroy( port, pool );
+		return NULL;
+	}
+
+	for( pool->headers_num = 0; pool->headers_num < headers; pool->headers_num++ )
+	{
+		// header and its private part in one block, like MMAL
+		header = calloc( 1, sizeof(*header) + sizeof(*priv) );
+		if( !header )
+		{
+			mmal_port_pool_destroy( port, pool );
+			return NULL;
+		}
+		header->priv = priv = (struct MMAL_BUFFER_HEADER_PRIVATE_T *)(header + 1);
+		priv->home = pool->queue;
+		if( payload_size && posix_memalign( (void **)&header->data, align, payload_size ) )
+		{
+			free( header );
+			mmal_port_pool_destroy( port, pool );
+			return NULL;
+		}
+		header->alloc_size = payload_size;
+		mmal_buffer_header_reset( header );
+		pool->header[pool->headers_num] = header;
+		mmal_queue_put( pool->queue, header );
+	}
+
+	return pool;
+}
+
+
+/*
+ *  Sensor: synthetic frames at the frame rate of the active port
+ */
+
+/*
+ *  Map the frames of MMAL_STANDIN_FRAMES, if set
+ */
+static void sensor_open_file( struct MMAL_COMPONENT_PRIVATE_T *cam )
+{
+	const char *name = getenv( "MMAL_STANDIN_FRAMES" );
+	struct stat sb;
+	void *map;
+	int fd;
+
+	if( !name )
+		return;
+	fd = open( name, O_RDONLY );
+	if( fd < 0 || fstat( fd, &sb ) || !sb.st_size ||
+		(map = mmap( NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0 )) == MAP_FAILED )
+	{
+		printf( "stand-in: cannot map %s, frames are synthetic\n", name );
+		if( fd >= 0 )
+			close( fd );
+		return;
+	}
+	close( fd );
+	cam->file = map;
+	cam->file_size = sb.st_size;
+}
+
+static void sensor_close_file( struct MMAL_COMPONENT_PRIVATE_T *cam )
+{
+	if( cam->file )
+		munmap( (void *)cam->file, cam->file_size );
+	cam->file = NULL;
+}
+
+/*
+ *  Copy the next frame of the file into the crop of y, the padded I420 or
+ *  grey image of w x h. Returns 0, or -1 if the file holds no whole frames
+ *  of the crop size
+ */
+static int sensor_read_file( struct MMAL_COMPONENT_PRIVATE_T *cam, MMAL_PORT_T *port, uint8_t *y, uint32_t w, uint32_t h )
+{
+	MMAL_VIDEO_FORMAT_T *video = &port->format->es->video;
+	uint32_t cw = video->crop.width, ch = video->crop.height, j;
+	size_t frame = (size_t)cw * ch * 3 / 2;
+	const uint8_t *src;
+
+	if( frame > cam->file_size || cam->file_size % frame )
+	{
+		printf( "stand-in: %lu bytes are no I420 frames of %u x %u, frames are synthetic\n",
+				(unsigned long)cam->file_size, cw, ch );
+		sensor_close_file( cam );
+		return -1;
+	}
+	src = cam->file + cam->file_frame * frame;
+	cam->file_frame = (cam->file_frame + 1) % (cam->file_size / frame);
+
+	for( j = 0; j < ch; j++ )
+		memcpy( y + j*w, src + j*cw, cw );
+	if( port->format->encoding == MMAL_ENCODING_I420 )
+	{
+		// U then V, half the size of the Y plane each way
+		src += cw * ch;
+		y += w * h;
+		for( j = 0; j < ch/2; j++ )
+			memcpy( y + j*(w/2), src + j*(cw/2), cw/2 );
+		src += (cw/2) * (ch/2);
+		y += (w/2) * (h/2);
+		for( j = 0; j < ch/2; j++ )
+			memcpy( y + j*(w/2), src + j*(cw/2), cw/2 );
+	}
+	return 0;
+}
+
+/*
+ *  Render the next frame into cam->image, returns its size or 0
+ */
+static uint32_t sensor_draw( struct MMAL_COMPONENT_PRIVATE_T *cam, MMAL_PORT_T *port )
+{
+	MMAL_VIDEO_FORMAT_T *video = &port->format->es->video;
+	uint32_t w = video->width, h = video->height;
+	uint32_t size = port->format->encoding == MMAL_ENCODING_GREY ? w * h : w * h * 3 / 2;
+	pix_y_t pix;
+	synth_params_t sp;
+	uint8_t *y;
+
+	if( cam->image_size < size )
+	{
+		free( cam->image );
+		cam->image = malloc( size );
+		cam->image_size = cam->image ? size : 0;
+		if( !cam->image )
+			return 0;
+	}
+	y = cam->image;
+
+	memset( y, STANDIN_SKY, w * h );
+	if( size > w * h )
+		memset( y + w * h, 128, size - w * h );
+	if( cam->file && sensor_read_file( cam, port, y, w, h ) == 0 )
+		return size;
+
+	// the same stars while the crop stays
+	if( !cam->field || cam->field->width != (uint32_t)video->crop.width ||
+		cam->field->height != (uint32_t)video->crop.height )
+	{
+		synth_destroy( cam->field );
+		synth_defaults( &sp );
+		sp.seed = cam->field_seed;
+		cam->field = synth_create( &sp, video->crop.width, video->crop.height, STANDIN_DRIFT );
+		if( !cam->field )
+			return 0;
+	}
+
+	// tracking error of the mount, within the stars placed
+	cam->drift_x += (random() % 5) - 2;
+	cam->drift_y += (random() % 5) - 2;
+	if( abs( cam->drift_x ) > STANDIN_DRIFT )
+		cam->drift_x = cam->drift_x < 0 ? -STANDIN_DRIFT : STANDIN_DRIFT;
+	if( abs( cam->drift_y ) > STANDIN_DRIFT )
+		cam->drift_y = cam->drift_y < 0 ? -STANDIN_DRIFT : STANDIN_DRIFT;
+
+	pixInit( &pix, y, video->crop.width, video->crop.height, w );
+	if( synth_frame( cam->field, &pix, cam->drift_x, cam->drift_y, cam->frames ) )
+		return 0;
+	return size;
+}
+
+/*
+ *  Buffer for the rest of a frame, the readout waits for one. NULL when
+ *  the port is disabled meanwhile
+ */
+static MMAL_BUFFER_HEADER_T *sensor_next_buffer( struct MMAL_COMPONENT_PRIVATE_T *cam, MMAL_PORT_T *port )
+{
+	MMAL_BUFFER_HEADER_T *buffer;
+
+	while( !(buffer = mmal_queue_get( port->priv->sent )) )
+	{
+		if( !port->is_enabled || !cam->running )
+			return NULL;
+		usleep( 500 );
+	}
+	return buffer;
+}
+
+/*
+ *  Read a frame out into buffer and, if it does not fit, the next ones.
+ *  Runs with cam->delivering set, without the lock
+ */
+static void sensor_deliver( struct MMAL_COMPONENT_PRIVATE_T *cam, MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer )
+{
+	uint32_t size = sensor_draw( cam, port ), pos = 0, n;
+	int64_t pts = standin_usecs();
+
+	if( !size )
+	{
+		buffer->length = 0;
+		buffer->flags = MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED;
+		port->priv->cb( port, buffer );
+		return;
+	}
+
+	while( buffer )
+	{
+		n = size - pos < buffer->alloc_size ? size - pos : buffer->alloc_size;
+		memcpy( buffer->data, cam->image + pos, n );
+		buffer->offset = 0;
+		buffer->length = n;
+		buffer->flags = (pos == 0 ? MMAL_BUFFER_HEADER_FLAG_FRAME_START : 0) |
+						(pos + n == size ? MMAL_BUFFER_HEADER_FLAG_FRAME_END : 0);
+		buffer->pts = buffer->dts = pts;
+		pos += n;
+		port->priv->cb( port, buffer );
+
+		buffer = pos < size ? sensor_next_buffer( cam, port ) : NULL;
+	}
+}
+
+static long sensor_period( struct MMAL_COMPONENT_PRIVATE_T *cam, MMAL_PORT_T *port )
+{
+	MMAL_RATIONAL_T *rate = &port->format->es->video.frame_rate;
+	long period = 1000000L / 30;
+
+	if( rate->num > 0 && rate->den > 0 )
+		period = 1000000L * rate->den / rate->num;
+	if( cam->shutter_us > period )
+		period = cam->shutter_us;
+	return period;
+}
+
+/*
+ *  Port the sensor works for: the video port while it captures, else the
+ *  capture port while a still is requested. Called with cam->lock held.
+ */
+static MMAL_PORT_T *sensor_port( struct MMAL_COMPONENT_PRIVATE_T *cam )
+{
+	MMAL_PORT_T *port;
+	int i;
+
+	for( i = STANDIN_VIDEO_PORT; i <= STANDIN_CAPTURE_PORT; i++ )
+	{
+		port = cam->ports[1+i];
+		if( port->is_enabled && port->priv->capture )
+			return port;
+	}
+	return NULL;
+}
+
+static void *sensor_thread( void *arg )
+{
+	struct MMAL_COMPONENT_PRIVATE_T *cam = arg;
+	MMAL_PORT_T *port, *last = NULL;
+	MMAL_BUFFER_HEADER_T *buffer;
+	struct timespec ts;
+	long next = 0, now;
+
+	pthread_mutex_lock( &cam->lock );
+	while( cam->running )
+	{
+		port = sensor_port( cam );
+		if( !port )
+		{
+			last = NULL;
+			pthread_cond_wait( &cam->cond, &cam->lock );
+			continue;
+		}
+
+		// a frame period after capturing started, then on the frame clock
+		now = standin_usecs();
+		if( port != last || next < now - sensor_period( cam, port ) )
+			next = now + sensor_period( cam, port );
+		last = port;
+
+		now = next + (cam->jitter_us ? random() % cam->jitter_us : 0);
+		ts.tv_sec = now / 1000000;
+		ts.tv_nsec = (now % 1000000) * 1000;
+		pthread_mutex_unlock( &cam->lock );
+		clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL );
+		pthread_mutex_lock( &cam->lock );
+
+		if( !cam->running || sensor_port( cam ) != port )
+			continue;
+		next += sensor_period( cam, port );
+
+		// the still is taken, the next needs another capture request
+		if( port == cam->ports[1+STANDIN_CAPTURE_PORT] )
+			port->priv->capture = MMAL_FALSE;
+
+		buffer = mmal_queue_get( port->priv->sent );
+		if( !buffer )
+		{
+			cam->dropped++;
+			continue;
+		}
+		cam->frames++;
+
+		cam->delivering = 1;
+		pthread_mutex_unlock( &cam->lock );
+		sensor_deliver( cam, port, buffer );
+		pthread_mutex_lock( &cam->lock );
+		cam->delivering = 0;
+		pthread_cond_broadcast( &cam->cond );
+	}
+	pthread_mutex_unlock( &cam->lock );
+
+	return NULL;
+}
+
+
+/*
+ *  Ports
+ */
+
+MMAL_STATUS_T mmal_port_format_commit( MMAL_PORT_T *port )
+{
+	MMAL_VIDEO_FORMAT_T *video = &port->format->es->video;
+
+	if( port->type != MMAL_PORT_TYPE_OUTPUT )
+		return MMAL_EINVAL;
+	if( port->format->encoding != MMAL_ENCODING_I420 &&
+		(port->format->encoding != MMAL_ENCODING_GREY || !getenv( "MMAL_STANDIN_GREY" )) )
+	{
+		printf( "stand-in: %s: encoding 0x%08x not supported\n", port->name, port->format->encoding );
+		return MMAL_EINVAL;
+	}
+	if( !video->width || !video->height ||
+		video->width > VCOS_ALIGN_UP(STANDIN_SENSOR_WIDTH, 32) ||
+		video->height > VCOS_ALIGN_UP(STANDIN_SENSOR_HEIGHT, 16) ||
+		video->width % 32 || video->height % 16 )
+	{
+		printf( "stand-in: %s: %u x %u not supported\n", port->name, video->width, video->height );
+		return MMAL_EINVAL;
+	}
+
+	if( !video->crop.width || !video->crop.height )
+	{
+		video->crop.width = video->width;
+		video->crop.height = video->height;
+	}
+	// a buffer takes at least a strip of 16 lines, recommended is a whole frame
+	port->buffer_size_min = video->width * 16;
+	port->buffer_size_recommended = video->width * video->height;
+	if( port->format->encoding == MMAL_ENCODING_I420 )
+		port->buffer_size_recommended += video->width * video->height / 2;
+	return MMAL_SUCCESS;
+}
+
+MMAL_STATUS_T mmal_port_enable( MMAL_PORT_T *port, MMAL_PORT_BH_CB_T cb )
+{
+	struct MMAL_COMPONENT_PRIVATE_T *cam = port->component->priv;
+
+	if( !cb )
+		return MMAL_EINVAL;
+
+	pthread_mutex_lock( &cam->lock );
+	if( port->is_enabled )
+	{
+		pthread_mutex_unlock( &cam->lock );
+		return MMAL_EISCONN;
+	}
+	port->priv->cb = cb;
+	port->is_enabled = 1;
+	pthread_cond_broadcast( &cam->cond );
+	pthread_mutex_unlock( &cam->lock );
+	return MMAL_SUCCESS;
+}
+
+/*
+ *  Buffers not filled yet come back through the callback, empty
+ */
+MMAL_STATUS_T mmal_port_disable( MMAL_PORT_T *port )
+{
+	struct MMAL_COMPONENT_PRIVATE_T *cam = port->component->priv;
+	MMAL_BUFFER_HEADER_T *buffer;
+
+	pthread_mutex_lock( &cam->lock );
+	if( !port->is_enabled )
+	{
+		pthread_mutex_unlock( &cam->lock );
+		return MMAL_EINVAL;
+	}
+	port->is_enabled = 0;
+	port->priv->capture = MMAL_FALSE;
+	while( cam->delivering )
+		pthread_cond_wait( &cam->cond, &cam->lock );
+	pthread_mutex_unlock( &cam->lock );
+
+	while( port->priv->sent && (buffer = mmal_queue_get( port->priv->sent )) )
+	{
+		mmal_buffer_header_reset( buffer );
+		port->priv->cb( port, buffer );
+	}
+	return MMAL_SUCCESS;
+}
+
+MMAL_STATUS_T mmal_port_flush( MMAL_PORT_T *port )
+{
+	MMAL_BUFFER_HEADER_T *buffer;
+
+	while( port->priv->sent && (buffer = mmal_queue_get( port->priv->sent )) )
+	{
+		mmal_buffer_header_reset( buffer );
+		port->priv->cb( port, buffer );
+	}
+	return MMAL_SUCCESS;
+}
+
+MMAL_STATUS_T mmal_port_send_buffer( MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer )
+{
+	if( !port->is_enabled || !port->priv->sent )
+		return MMAL_EINVAL;
+	if( buffer->alloc_size < port->buffer_size_min )
+		return MMAL_EINVAL;
+
+	mmal_queue_put( port->priv->sent, buffer );
+	return MMAL_SUCCESS;
+}
+
+
+/*
+ *  Parameters, the ones mmalyuv sets. Everything else is accepted
+ *  and ignored like an unused camera setting.
+ */
+
+MMAL_STATUS_T mmal_port_parameter_set( MMAL_PORT_T *port, const MMAL_PARAMETER_HEADER_T *param )
+{
+	struct MMAL_COMPONENT_PRIVATE_T *cam = port->component->priv;
+	MMAL_STATUS_T status = MMAL_SUCCESS;
+
+	pthread_mutex_lock( &cam->lock );
+	switch( param->id )
+	{
+		case MMAL_PARAMETER_CAPTURE:
+			if( port->type != MMAL_PORT_TYPE_OUTPUT || param->size < sizeof(MMAL_PARAMETER_BOOLEAN_T) )
+				status = MMAL_EINVAL;
+			else if( !port->is_enabled )
+				status = MMAL_ENOTREADY;
+			else
+				port->priv->capture = ((MMAL_PARAMETER_BOOLEAN_T *)param)->enable;
+			break;
+
+		case MMAL_PARAMETER_SHUTTER_SPEED:
+			if( port != cam->ports[0] || param->size < sizeof(MMAL_PARAMETER_UINT32_T) )
+				status = MMAL_EINVAL;
+			else
+				cam->shutter_us = ((MMAL_PARAMETER_UINT32_T *)param)->value;
+			break;
+
+		case MMAL_PARAMETER_CAMERA_CONFIG:
+			if( port != cam->ports[0] || param->size < sizeof(MMAL_PARAMETER_CAMERA_CONFIG_T) )
+				status = MMAL_EINVAL;
+			break;
+
+		default:
+			break;
+	}
+	pthread_cond_broadcast( &cam->cond );
+	pthread_mutex_unlock( &cam->lock );
+
+	return status;
+}
+
+MMAL_STATUS_T mmal_port_parameter_get( MMAL_PORT_T *port, MMAL_PARAMETER_HEADER_T *param )
+{
+	struct MMAL_COMPONENT_PRIVATE_T *cam = port->component->priv;
+	MMAL_STATUS_T status = MMAL_SUCCESS;
+
+	pthread_mutex_lock( &cam->lock );
+	switch( param->id )
+	{
+		case MMAL_PARAMETER_CAPTURE:
+			if( param->size < sizeof(MMAL_PARAMETER_BOOLEAN_T) )
+				status = MMAL_EINVAL;
+			else
+				((MMAL_PARAMETER_BOOLEAN_T *)param)->enable = port->priv->capture;
+			break;
+
+		case MMAL_PARAMETER_SHUTTER_SPEED:
+			if( param->size < sizeof(MMAL_PARAMETER_UINT32_T) )
+				status = MMAL_EINVAL;
+			else
+				((MMAL_PARAMETER_UINT32_T *)param)->value = cam->shutter_us;
+			break;
+
+		default:
+			status = MMAL_ENOSYS;
+			break;
+	}
+	pthread_mutex_unlock( &cam->lock );
+
+	return status;
+}
+
+MMAL_STATUS_T mmal_port_parameter_set_boolean( MMAL_PORT_T *port, uint32_t id, MMAL_BOOL_T value )
+{
+	MMAL_PARAMETER_BOOLEAN_T param = {{id, sizeof(param)}, value};
+
+	return mmal_port_parameter_set( port, &param.hdr );
+}
+
+MMAL_STATUS_T mmal_port_parameter_set_uint32( MMAL_PORT_T *port, uint32_t id, uint32_t value )
+{
+	MMAL_PARAMETER_UINT32_T param = {{id, sizeof(param)}, value};
+
+	return mmal_port_parameter_set( port, &param.hdr );
+}
+
+MMAL_STATUS_T mmal_port_parameter_set_int32( MMAL_PORT_T *port, uint32_t id, int32_t value )
+{
+	MMAL_PARAMETER_INT32_T param = {{id, sizeof(param)}, value};
+
+	return mmal_port_parameter_set( port, &param.hdr );
+}
+
+
+/*
+ *  Components, only the camera
+ */
+
+static MMAL_PORT_T *port_create( MMAL_COMPONENT_T *component, MMAL_PORT_TYPE_T type, int index )
+{
+	MMAL_PORT_T *port;
+	struct MMAL_PORT_PRIVATE_T *priv;
+
+	port = calloc( 1, sizeof(*port) + sizeof(*priv) );
+	if( !port )
+		return NULL;
+	port->priv = priv = (struct MMAL_PORT_PRIVATE_T *)(port + 1);
+	if( type == MMAL_PORT_TYPE_CONTROL )
+		snprintf( priv->name, sizeof(priv->name), "%s:ctr:0", component->name );
+	else
+		snprintf( priv->name, sizeof(priv->name), "%s:out:%d", component->name, index );
+	port->name = priv->name;
+	port->type = type;
+	port->index = index;
+	port->component = component;
+	port->format = &priv->format;
+	priv->format.es = &priv->es;
+
+	if( type == MMAL_PORT_TYPE_OUTPUT )
+	{
+		priv->sent = mmal_queue_create();
+		if( !priv->sent )
+		{
+			free( port );
+			return NULL;
+		}
+		priv->format.type = MMAL_ES_TYPE_VIDEO;
+		priv->format.encoding = MMAL_ENCODING_I420;
+		priv->format.encoding_variant = MMAL_ENCODING_I420;
+		priv->es.video.width = 1920;
+		priv->es.video.height = 1088;
+		priv->es.video.crop.width = 1920;
+		priv->es.video.crop.height = 1080;
+		priv->es.video.frame_rate.num = index == STANDIN_CAPTURE_PORT ? 15 : 30;
+		priv->es.video.frame_rate.den = 1;
+		port->buffer_num_min = 1;
+		port->buffer_num_recommended = index == STANDIN_CAPTURE_PORT ? 1 : 3;
+		port->buffer_alignment_min = 16;
+		port->buffer_size_min = 1920 * 16;
+		port->buffer_size_recommended = 1920 * 1088 * 3 / 2;
+	}
+	return port;
+}
+
+MMAL_STATUS_T mmal_component_destroy( MMAL_COMPONENT_T *component )
+{
+	struct MMAL_COMPONENT_PRIVATE_T *cam;
+	int i;
+
+	if( !component )
+		return MMAL_EINVAL;
+	cam = component->priv;
+
+	mmal_component_disable( component );
+	for( i = 0; i <= STANDIN_OUTPUTS; i++ )
+	{
+		if( !cam->ports[i] )
+			continue;
+		if( cam->ports[i]->is_enabled )
+			mmal_port_disable( cam->ports[i] );
+		mmal_queue_destroy( cam->ports[i]->priv->sent );
+		free( cam->ports[i] );
+	}
+	if( cam->frames || cam->dropped )
+		printf( "stand-in: %s delivered %lu frames, dropped %lu for lack of buffers\n",
+				component->name, cam->frames, cam->dropped );
+	pthread_mutex_destroy( &cam->lock );
+	pthread_cond_destroy( &cam->cond );
+	sensor_close_file( cam );
+	free( cam->image );
+	synth_destroy( cam->field );
+	free( component );
+	return MMAL_SUCCESS;
+}
+
+MMAL_STATUS_T mmal_component_create( const char *name, MMAL_COMPONENT_T **component )
+{
+	MMAL_COMPONENT_T *c;
+	struct MMAL_COMPONENT_PRIVATE_T *cam;
+	int i;
+
+	*component = NULL;
+	if( strcmp( name, MMAL_COMPONENT_DEFAULT_CAMERA ) )
+		return MMAL_ENOSYS;
+
+	c = calloc( 1, sizeof(*c) + sizeof(*cam) );
+	if( !c )
+		return MMAL_ENOMEM;
+	c->priv = cam = (struct MMAL_COMPONENT_PRIVATE_T *)(c + 1);
+	c->name = MMAL_COMPONENT_DEFAULT_CAMERA;
+	pthread_mutex_init( &cam->lock, NULL );
+	pthread_cond_init( &cam->cond, NULL );
+
+	cam->ports[0] = port_create( c, MMAL_PORT_TYPE_CONTROL, 0 );
+	for( i = 0; i < STANDIN_OUTPUTS; i++ )
+		cam->ports[1+i] = port_create( c, MMAL_PORT_TYPE_OUTPUT, i );
+	for( i = 0; i <= STANDIN_OUTPUTS; i++ )
+		if( !cam->ports[i] )
+		{
+			mmal_component_destroy( c );
+			return MMAL_ENOMEM;
+		}
+
+	c->control = cam->ports[0];
+	c->output = cam->ports + 1;
+	c->output_num = STANDIN_OUTPUTS;
+	c->port = cam->ports;
+	c->port_num = 1 + STANDIN_OUTPUTS;
+
+	cam->field_seed = random();
+	sensor_open_file( cam );
+	if( getenv( "MMAL_STANDIN_JITTER_US" ) )
+		cam->jitter_us = labs( atol( getenv( "MMAL_STANDIN_JITTER_US" ) ) );
+
+	*component = c;
+	return MMAL_SUCCESS;
+}
+
+MMAL_STATUS_T mmal_component_enable( MMAL_COMPONENT_T *component )
+{
+	struct MMAL_COMPONENT_PRIVATE_T *cam = component->priv;
+
+	if( component->is_enabled )
+		return MMAL_SUCCESS;
+
+	cam->running = 1;
+	if( pthread_create( &cam->sensor, NULL, sensor_thread, cam ) )
+	{
+		cam->running = 0;
+		return MMAL_ENOSPC;
+	}
+	component->is_enabled = 1;
+	return MMAL_SUCCESS;
+}
+
+MMAL_STATUS_T mmal_component_disable( MMAL_COMPONENT_T *component )
+{
+	struct MMAL_COMPONENT_PRIVATE_T *cam = component->priv;
+
+	if( !component->is_enabled )
+		return MMAL_SUCCESS;
+
+	pthread_mutex_lock( &cam->lock );
+	cam->running = 0;
+	pthread_cond_broadcast( &cam->cond );
+	pthread_mutex_unlock( &cam->lock );
+	pthread_join( cam->sensor, NULL );
+	component->is_enabled = 0;
+	return MMAL_SUCCESS;
+}
+
+
+void bcm_host_init( void )
+{
+}
+
+void bcm_host_deinit( void )
+{
+}
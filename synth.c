@@ -0,0 +1,426 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SYNTH_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SYNTH_SSE2
+#endif
+
+#include "log.h"
+#include "synth.h"
+#include "image.h"
+
+#define SYNTH_MIN_STARS 32
+
+// sum of four 16 bit uniforms: mean and 1 / standard deviation
+#define SYNTH_G_MEAN  131070.0f
+#define SYNTH_G_SCALE (1.7320508f / 65536.0f)
+
+static inline uint32_t xorshift( uint32_t x )
+{
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return x;
+}
+
+static inline uint32_t mix( uint32_t x )
+{
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x ? x : 1;
+}
+
+// uniform in [0, 1)
+static inline float uniform( uint32_t *x )
+{
+	*x = xorshift( *x );
+	return (*x >> 8) * (1.0f / 16777216.0f);
+}
+
+// unit Gaussian from lane state x, as the NEON/SSE2 lanes do
+static inline float gauss1( uint32_t *x )
+{
+	uint32_t a = xorshift( *x ), b = xorshift( a );
+
+	*x = b;
+	return ((float)((a & 0xffff) + (a >> 16) + (b & 0xffff) + (b >> 16)) - SYNTH_G_MEAN) * SYNTH_G_SCALE;
+}
+
+static inline uint8_t px1( float v, float read2, float inv_gain, uint32_t *x )
+{
+	v = v > 0 ? v : 0;
+	v += sqrtf( read2 + v * inv_gain ) * gauss1( x ) + 0.5f;
+	return v <= 0 ? 0 : v >= 255 ? 255 : (uint8_t)v;
+}
+
+#if defined(SYNTH_NEON)
+static inline uint32x4_t xorshift4( uint32x4_t x )
+{
+	x = veorq_u32( x, vshlq_n_u32( x, 13 ) );
+	x = veorq_u32( x, vshrq_n_u32( x, 17 ) );
+	return veorq_u32( x, vshlq_n_u32( x, 5 ) );
+}
+
+static inline float32x4_t gauss4( uint32x4_t *st )
+{
+	const uint32x4_t m = vdupq_n_u32( 0xffff );
+	uint32x4_t a = xorshift4( *st ), b = xorshift4( a );
+	uint32x4_t s = vaddq_u32( vaddq_u32( vandq_u32( a, m ), vshrq_n_u32( a, 16 ) ),
+							  vaddq_u32( vandq_u32( b, m ), vshrq_n_u32( b, 16 ) ) );
+
+	*st = b;
+	return vmulq_n_f32( vsubq_f32( vcvtq_f32_u32( s ), vdupq_n_f32( SYNTH_G_MEAN ) ), SYNTH_G_SCALE );
+}
+
+static inline uint16x4_t px4( const float *row, float32x4_t read2, float inv_gain, uint32x4_t *st )
+{
+	float32x4_t zero = vdupq_n_f32( 0 );
+	float32x4_t v = vmaxq_f32( vld1q_f32( row ), zero );
+	float32x4_t var = vmlaq_n_f32( read2, v, inv_gain );
+	// no vsqrtq on ARMv7: var / sqrt(var), one Newton step
+	float32x4_t r = vrsqrteq_f32( var );
+
+	r = vmulq_f32( r, vrsqrtsq_f32( vmulq_f32( var, r ), r ) );
+	v = vmlaq_f32( vaddq_f32( v, vdupq_n_f32( 0.5f ) ), vmulq_f32( var, r ), gauss4( st ) );
+	v = vminq_f32( vmaxq_f32( v, zero ), vdupq_n_f32( 255.0f ) );
+	return vmovn_u32( vcvtq_u32_f32( v ) );
+}
+#elif defined(SYNTH_SSE2)
+static inline __m128i xorshift4( __m128i x )
+{
+	x = _mm_xor_si128( x, _mm_slli_epi32( x, 13 ) );
+	x = _mm_xor_si128( x, _mm_srli_epi32( x, 17 ) );
+	return _mm_xor_si128( x, _mm_slli_epi32( x, 5 ) );
+}
+
+static inline __m128 gauss4( __m128i *st )
+{
+	const __m128i m = _mm_set1_epi32( 0xffff );
+	__m128i a = xorshift4( *st ), b = xorshift4( a );
+	__m128i s = _mm_add_epi32( _mm_add_epi32( _mm_and_si128( a, m ), _mm_srli_epi32( a, 16 ) ),
+							   _mm_add_epi32( _mm_and_si128( b, m ), _mm_srli_epi32( b, 16 ) ) );
+
+	*st = b;
+	return _mm_mul_ps( _mm_sub_ps( _mm_cvtepi32_ps( s ), _mm_set1_ps( SYNTH_G_MEAN ) ), _mm_set1_ps( SYNTH_G_SCALE ) );
+}
+
+static inline __m128i px4( const float *row, __m128 read2, __m128 inv_gain, __m128i *st )
+{
+	__m128 zero = _mm_setzero_ps();
+	__m128 v = _mm_max_ps( _mm_loadu_ps( row ), zero );
+	__m128 sd = _mm_sqrt_ps( _mm_add_ps( read2, _mm_mul_ps( v, inv_gain ) ) );
+
+	v = _mm_add_ps( _mm_add_ps( v, _mm_set1_ps( 0.5f ) ), _mm_mul_ps( sd, gauss4( st ) ) );
+	v = _mm_min_ps( _mm_max_ps( v, zero ), _mm_set1_ps( 255.0f ) );
+	return _mm_cvttps_epi32( v );
+}
+#endif
+
+/*
+ * dst[i] = row[i] with noise, rounded and clamped to 8 bit, i < n. Lane l of
+ * the generator, seeded from seed and line, takes the pixels i % 4 == l
+ */
+static void finish_row( uint8_t *dst, const float *row, uint32_t n, float read2, float inv_gain,
+						uint32_t seed, uint32_t line )
+{
+	uint32_t st[4], i = 0;
+	int l;
+
+	for( l = 0; l < 4; l++ )
+		st[l] = mix( seed * 0x9e3779b9 + line * 4 + l );
+
+#if defined(SYNTH_NEON)
+	{
+		uint32x4_t s4 = vld1q_u32( st );
+		float32x4_t r2 = vdupq_n_f32( read2 );
+
+		for( ; i + 16 <= n; i += 16 )
+		{
+			uint16x4_t a = px4( row + i, r2, inv_gain, &s4 );
+			uint16x4_t b = px4( row + i + 4, r2, inv_gain, &s4 );
+			uint16x4_t c = px4( row + i + 8, r2, inv_gain, &s4 );
+			uint16x4_t d = px4( row + i + 12, r2, inv_gain, &s4 );
+
+			vst1q_u8( dst + i, vcombine_u8( vmovn_u16( vcombine_u16( a, b ) ), vmovn_u16( vcombine_u16( c, d ) ) ) );
+		}
+		vst1q_u32( st, s4 );
+	}
+#elif defined(SYNTH_SSE2)
+	{
+		__m128i s4 = _mm_loadu_si128( (const __m128i *)st );
+		__m128 r2 = _mm_set1_ps( read2 ), g = _mm_set1_ps( inv_gain );
+
+		for( ; i + 16 <= n; i += 16 )
+		{
+			__m128i a = px4( row + i, r2, g, &s4 );
+			__m128i b = px4( row + i + 4, r2, g, &s4 );
+			__m128i c = px4( row + i + 8, r2, g, &s4 );
+			__m128i d = px4( row + i + 12, r2, g, &s4 );
+
+			_mm_storeu_si128( (__m128i *)(dst + i), _mm_packus_epi16( _mm_packs_epi32( a, b ), _mm_packs_epi32( c, d ) ) );
+		}
+		_mm_storeu_si128( (__m128i *)st, s4 );
+	}
+#endif
+	for( ; i < n; i++ )
+		dst[i] = px1( row[i], read2, inv_gain, &st[i & 3] );
+}
+
+const synth_shift_t synth_shifts[SYNTH_SHIFTS] = { { 7, -5 }, { -3, 4 } };
+
+void synth_defaults( synth_params_t *p )
+{
+	p->density = 2000;
+	p->fwhm = 3.0f;
+	p->mag_range = 5.0f;
+	p->peak = 220;
+	p->sky = 24;
+	p->gradient_x = 0.010f;
+	p->gradient_y = -0.006f;
+	p->gain = 2.0f;
+	p->read_noise = 2.0f;
+	p->hot = 2e-5f;
+	p->seed = 1;
+}
+
+static int cmp_star( const void *a, const void *b )
+{
+	float ya = ((const synth_star_t *)a)->y, yb = ((const synth_star_t *)b)->y;
+
+	return ya < yb ? -1 : ya > yb;
+}
+
+/*
+ * Field of width x height, stars placed margin pixels around it too
+ * returns NULL on error
+ */
+synth_t *synth_create( const synth_params_t *p, uint32_t width, uint32_t height, uint32_t margin )
+{
+	synth_t *s;
+	uint32_t x = mix( p->seed ), hot;
+	float sigma, span, area;
+	int k, n;
+
+	if( !width || !height || p->fwhm <= 0 || p->mag_range < 0 )
+	{
+		ERROR( "bad star field %u x %u, fwhm %.2f", width, height, p->fwhm );
+		return NULL;
+	}
+	s = calloc( 1, sizeof(*s) );
+	if( !s )
+	{
+		ERROR( "out of memory" );
+		return NULL;
+	}
+	s->p = *p;
+	s->width = width;
+	s->height = height;
+
+	sigma = p->fwhm / 2.35482f;
+	s->radius = (int)ceilf( 4 * sigma ) + 1;
+	if( s->radius > SYNTH_MAX_RADIUS )
+		s->radius = SYNTH_MAX_RADIUS;
+	n = 2 * s->radius + 1;
+
+	area = (float)(width + 2*margin) * (height + 2*margin);
+	s->nstars = p->density * area / 1e6f;
+	if( s->nstars < SYNTH_MIN_STARS )
+		s->nstars = SYNTH_MIN_STARS;
+	hot = p->hot * width * height;
+
+	s->stars = malloc( s->nstars * sizeof(*s->stars) );
+	s->psf = malloc( s->nstars * 2 * n * sizeof(float) );
+	s->x0 = malloc( s->nstars * sizeof(int) );
+	s->y0 = malloc( s->nstars * sizeof(int) );
+	s->hot = malloc( (hot + 1) * sizeof(uint32_t) );
+	s->hot_val = malloc( hot + 1 );
+	s->row = malloc( width * sizeof(float) );
+	if( !s->stars || !s->psf || !s->x0 || !s->y0 || !s->hot || !s->hot_val || !s->row )
+	{
+		ERROR( "out of memory" );
+		synth_destroy( s );
+		return NULL;
+	}
+
+	// inverse of the cumulative counts up to the faintest
+	span = powf( 10, SYNTH_MAG_SLOPE * p->mag_range ) - 1;
+	for( k = 0; k < s->nstars; k++ )
+	{
+		float m = log10f( 1 + uniform( &x ) * span ) / SYNTH_MAG_SLOPE;
+
+		s->stars[k].x = uniform( &x ) * (width + 2*margin) - margin;
+		s->stars[k].y = uniform( &x ) * (height + 2*margin) - margin;
+		s->stars[k].flux = p->peak * 2 * (float)M_PI * sigma * sigma * powf( 10, -0.4f * m );
+	}
+	qsort( s->stars, s->nstars, sizeof(*s->stars), cmp_star );
+
+	for( s->nhot = 0; s->nhot < (int)hot; s->nhot++ )
+	{
+		s->hot[s->nhot] = (uint32_t)(uniform( &x ) * height) * width + (uint32_t)(uniform( &x ) * width);
+		s->hot_val[s->nhot] = 200 + uniform( &x ) * 56;
+	}
+
+	DEBUG( "star field %u x %u, %d stars, fwhm %.1f, %d hot pixels", width, height, s->nstars, p->fwhm, s->nhot );
+	return s;
+}
+
+void synth_destroy( synth_t *s )
+{
+	if( !s )
+		return;
+	free( s->stars );
+	free( s->psf );
+	free( s->x0 );
+	free( s->y0 );
+	free( s->hot );
+	free( s->hot_val );
+	free( s->row );
+	free( s );
+}
+
+/*
+ * Light of a unit PSF centred at c in pixels first ... first + n - 1,
+ * pixel i covering i - 0.5 ... i + 0.5, times f
+ */
+static void psf_table( float *t, int first, int n, float c, float sigma, float f )
+{
+	float k = 1 / (sqrtf( 2 ) * sigma), e0, e1;
+	int i;
+
+	e0 = erff( (first - 0.5f - c) * k );
+	for( i = 0; i < n; i++, e0 = e1 )
+	{
+		e1 = erff( (first + i + 0.5f - c) * k );
+		t[i] = 0.5f * f * (e1 - e0);
+	}
+}
+
+/*
+ * Render the field shifted by dx, dy into pix, of the size of the field,
+ * with the noise of noise_seed
+ * returns -1 if pix is not of the field's size
+ */
+int synth_frame( synth_t *s, pix_y_t *pix, float dx, float dy, uint32_t noise_seed )
+{
+	const synth_params_t *p = &s->p;
+	float sigma = p->fwhm / 2.35482f;
+	float read2 = p->read_noise * p->read_noise + 1e-6f;
+	float inv_gain = p->gain > 0 ? 1 / p->gain : 0;
+	float *row = s->row, *px, a, sky;
+	int r = s->radius, n = 2 * r + 1;
+	int k, first, t, t0, t1;
+	uint32_t i, j;
+
+	if( pix->width != s->width || pix->height != s->height || pix->step != 1 )
+	{
+		ERROR( "frame %u x %u step %u, star field %u x %u", pix->width, pix->height, pix->step,
+			   s->width, s->height );
+		return (-1);
+	}
+
+	// tables of this shift, the x table times the flux
+	for( k = 0; k < s->nstars; k++ )
+	{
+		float cx = s->stars[k].x + dx, cy = s->stars[k].y + dy;
+
+		s->x0[k] = (int)floorf( cx ) - r;
+		s->y0[k] = (int)floorf( cy ) - r;
+		psf_table( s->psf + 2*k*n, s->x0[k], n, cx, sigma, s->stars[k].flux );
+		psf_table( s->psf + 2*k*n + n, s->y0[k], n, cy, sigma, 1 );
+	}
+
+	for( j = 0, first = 0; j < s->height; j++ )
+	{
+		sky = p->sky + p->gradient_y * ((float)j - s->height / 2);
+		for( i = 0; i < s->width; i++ )
+			row[i] = sky + p->gradient_x * ((float)i - s->width / 2);
+
+		// stars sorted by y, their tables cover y0 ... y0 + n - 1
+		while( first < s->nstars && s->y0[first] + n <= (int)j )
+			first++;
+		for( k = first; k < s->nstars && s->y0[k] <= (int)j; k++ )
+		{
+			px = s->psf + 2*k*n;
+			a = px[n + j - s->y0[k]];
+			t0 = s->x0[k] < 0 ? -s->x0[k] : 0;
+			t1 = s->x0[k] + n > (int)s->width ? (int)s->width - s->x0[k] : n;
+			for( t = t0; t < t1; t++ )
+				row[s->x0[k] + t] += a * px[t];
+		}
+		finish_row( pixAt( pix, 0, j ), row, s->width, read2, inv_gain, noise_seed, j );
+	}
+
+	for( k = 0; k < s->nhot; k++ )
+	{
+		uint8_t *d = pixAt( pix, s->hot[k] % s->width, s->hot[k] / s->width );
+
+		if( *d < s->hot_val[k] )
+			*d = s->hot_val[k];
+	}
+	return 0;
+}
+
+/*
+ * Allocate pix of the field's size, lines padded to 32 bytes, owned by pix
+ */
+static int frame_alloc( synth_t *s, pix_y_t *pix )
+{
+	uint32_t stride = (s->width + 31) & ~31;
+	void *data;
+
+	if( posix_memalign( &data, PIX_ALIGN, (size_t)stride * s->height ) )
+	{
+		ERROR( "out of memory" );
+		return (-1);
+	}
+	pixInit( pix, data, s->width, s->height, stride );
+	pix->owner = 1;
+	return 0;
+}
+
+/*
+ * Allocate ref (if not NULL) and pix[0 ... n-1] and render the unshifted
+ * field into ref with noise seed 0, into pix[k] shifted by shifts[k] with
+ * noise seed k + 1. ref and pix should be zeroed
+ * returns -1 on error, synth_frames_free() frees what was allocated anyway
+ */
+int synth_frames( synth_t *s, pix_y_t *ref, pix_y_t pix[], const synth_shift_t shifts[], int n )
+{
+	int k;
+
+	if( ref && (frame_alloc( s, ref ) || synth_frame( s, ref, 0, 0, 0 )) )
+		return (-1);
+	for( k = 0; k < n; k++ )
+		if( frame_alloc( s, &pix[k] ) || synth_frame( s, &pix[k], shifts[k].dx, shifts[k].dy, k + 1 ) )
+			return (-1);
+	return 0;
+}
+
+/*
+ * Free what synth_frames() allocated for ref and pix[0 ... n-1], data the
+ * images do not own stays
+ */
+void synth_frames_free( pix_y_t *ref, pix_y_t pix[], int n )
+{
+	int k;
+
+	for( k = -1; k < n; k++ )
+	{
+		pix_y_t *p = k < 0 ? ref : &pix[k];
+
+		if( p && p->owner )
+		{
+			free( p->data );
+			p->data = NULL;
+			p->owner = 0;
+		}
+	}
+}
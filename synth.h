@@ -0,0 +1,82 @@
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include <stdint.h>
+#include "mmalyuv.h"
+
+/*
+ * Synthetic star fields with exactly known shifts, in memory, for the
+ * checks, the benches, the tuning, HC_DEBUG and the stand-in camera.
+ *
+ * Stars are placed once by synth_create(), over the frame and a margin
+ * around it so a shifted frame brings new stars in. Their magnitudes follow
+ * the counts of the sky, N(m) ~ 10^(SYNTH_MAG_SLOPE m), up to mag_range
+ * below the brightest. Each is a Gaussian PSF integrated over the pixels,
+ * so a shift by a fraction of a pixel moves the light by exactly that.
+ *
+ * synth_frame() renders the stars shifted by dx, dy on a sky with a
+ * gradient, adds shot and read noise of its own for each noise seed,
+ * quantizes to 8 bit and sets the hot pixels. Sky, gradient and hot pixels
+ * belong to the sensor and do not move with the stars. Rows are rendered
+ * in a float row and finished with NEON/SSE2 (scalar otherwise): a
+ * xorshift generator per lane, the sum of four uniforms as Gaussian.
+ * Nothing is allocated per frame, one thread renders at a time.
+ *
+ * synth_frames() allocates and renders a reference and n frames shifted
+ * against it, synth_frames_free() frees them again.
+ */
+
+#define SYNTH_MAG_SLOPE 0.3f   // log10 of the star counts per magnitude
+#define SYNTH_MAX_RADIUS 16    // of the PSF tables, pixels
+
+typedef struct {
+	float density;         // stars per megapixel
+	float fwhm;            // of the PSF, pixels
+	float mag_range;       // faintest star, magnitudes below the brightest
+	float peak;            // ADU at the centre of the brightest star
+	float sky;             // ADU at the centre of the frame
+	float gradient_x;      // ADU per pixel, left to right
+	float gradient_y;      // top to bottom
+	float gain;            // electrons per ADU of the shot noise, 0 none
+	float read_noise;      // ADU rms
+	float hot;             // fraction of the pixels hot
+	uint32_t seed;         // of the stars and hot pixels
+} synth_params_t;
+
+typedef struct {
+	float x, y;            // on the unshifted frame
+	float flux;            // ADU over the whole PSF
+} synth_star_t;
+
+typedef struct {
+	synth_params_t p;
+	uint32_t width;
+	uint32_t height;
+	int radius;            // of the PSF tables
+	int nstars;            // sorted by y
+	synth_star_t *stars;
+	float *psf;            // 2 * (2 radius + 1) per star, x then y
+	int *x0, *y0;          // first column and row of each star's table
+	int nhot;
+	uint32_t *hot;         // offsets y * width + x of the hot pixels
+	uint8_t *hot_val;
+	float *row;            // signal of the row rendered
+} synth_t;
+
+void synth_defaults( synth_params_t *p );
+synth_t *synth_create( const synth_params_t *p, uint32_t width, uint32_t height, uint32_t margin );
+void synth_destroy( synth_t *s );
+
+typedef struct {
+	float dx, dy;          // of the stars, pixels
+} synth_shift_t;
+
+// frames shifted against the reference, as the checks, benches and tuning take them
+#define SYNTH_SHIFTS 2
+extern const synth_shift_t synth_shifts[SYNTH_SHIFTS];
+
+int synth_frame( synth_t *s, pix_y_t *pix, float dx, float dy, uint32_t noise_seed );
+int synth_frames( synth_t *s, pix_y_t *ref, pix_y_t pix[], const synth_shift_t shifts[], int n );
+void synth_frames_free( pix_y_t *ref, pix_y_t pix[], int n );
+
+#endif /* SYNTH_H */
@@ -0,0 +1,187 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "trace.h"
+
+typedef struct {
+	uint32_t bucket[TRACE_BUCKETS];
+	uint64_t count;
+	uint64_t sum;        // ns
+	uint64_t max;
+} trace_hist_t;
+
+/*
+ * Histograms of one thread, written by it alone. Threads are pushed onto
+ * the list when they first record and stay there, so their counts are
+ * still in the dump at exit
+ */
+typedef struct trace_thread {
+	struct trace_thread *next;
+	trace_hist_t stage[TRACE_STAGES];
+} trace_thread_t;
+
+static trace_thread_t *threads;
+static __thread trace_thread_t *self;
+static int no_memory;
+
+static const char *stage_name[TRACE_STAGES] = {
+	"capture", "bin", "loop", "job cpu", "job gpu",
+	"fftw convert", "fftw forward", "fftw transpose", "fftw cross", "fftw inverse", "fftw peak",
+	"gpu convert", "gpu forward qpu", "gpu transpose", "gpu cross", "gpu inverse qpu", "gpu peak",
+	"lat end to end", "lat capture", "lat handover", "lat sched queue", "lat correlation", "lat result",
+};
+
+/*
+ * Bucket of ns: 0..7 as they are, then 8 per power of two
+ */
+static inline int bucket( uint64_t ns )
+{
+	int msb;
+
+	if( ns < 8 )
+		return ns;
+	msb = 63 - __builtin_clzll( ns );
+	return 8*(msb-2) + ((ns >> (msb-3)) & 7);
+}
+
+/*
+ * Middle of bucket b in ns
+ */
+static double bucket_ns( int b )
+{
+	int shift;
+
+	if( b < 8 )
+		return b;
+	shift = b/8 - 1;
+	return (double)((uint64_t)(8 + b%8) << shift) + ((1ULL << shift) - 1) / 2.0;
+}
+
+static trace_thread_t *trace_register( void )
+{
+	trace_thread_t *t;
+
+	if( no_memory )
+		return NULL;
+	t = calloc( 1, sizeof(*t) );
+	if( !t )
+	{
+		no_memory = 1;
+		ERROR( "out of memory, no tracing of this thread" );
+		return NULL;
+	}
+	t->next = __atomic_load_n( &threads, __ATOMIC_ACQUIRE );
+	while( !__atomic_compare_exchange_n( &threads, &t->next, t, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE ) )
+		;
+	self = t;
+	return t;
+}
+
+/*
+ * Count ns for stage in the calling thread's histogram
+ */
+void trace_add( int stage, uint64_t ns )
+{
+	trace_thread_t *t = self ? self : trace_register();
+	trace_hist_t *h;
+	int b;
+
+	if( !t || stage < 0 || stage >= TRACE_STAGES )
+		return;
+	h = &t->stage[stage];
+	b = bucket( ns );
+
+	// one writer, the stores are atomic only for trace_dump to read them whole
+	__atomic_store_n( &h->bucket[b], h->bucket[b] + 1, __ATOMIC_RELAXED );
+	__atomic_store_n( &h->sum, h->sum + ns, __ATOMIC_RELAXED );
+	if( ns > h->max )
+		__atomic_store_n( &h->max, ns, __ATOMIC_RELAXED );
+	__atomic_store_n( &h->count, h->count + 1, __ATOMIC_RELEASE );
+}
+
+/*
+ * Value below which the fraction p of the counts of h is, in us
+ */
+static double percentile( trace_hist_t *h, double p )
+{
+	uint64_t n = 0, total = 0, rank;
+	int b;
+
+	for( b = 0; b < TRACE_BUCKETS; b++ )
+		total += h->bucket[b];
+	rank = p * total + 0.5;
+	if( rank < 1 )
+		rank = 1;
+	for( b = 0; b < TRACE_BUCKETS; b++ )
+	{
+		n += h->bucket[b];
+		if( n >= rank )
+			break;
+	}
+	// the maximum is exact, a bucket's middle may be beyond it
+	return (bucket_ns( b ) < h->max ? bucket_ns( b ) : h->max) / 1000.0;
+}
+
+/*
+ * Statistics of stage over all threads, in us
+ * returns the count
+ */
+uint64_t trace_get( int stage, trace_stats_t *st )
+{
+	trace_thread_t *t;
+	trace_hist_t h;
+	int b;
+
+	memset( st, 0, sizeof(*st) );
+	if( stage < 0 || stage >= TRACE_STAGES )
+		return 0;
+	memset( &h, 0, sizeof(h) );
+	for( t = __atomic_load_n( &threads, __ATOMIC_ACQUIRE ); t; t = t->next )
+	{
+		if( !__atomic_load_n( &t->stage[stage].count, __ATOMIC_ACQUIRE ) )
+			continue;
+		h.count += __atomic_load_n( &t->stage[stage].count, __ATOMIC_RELAXED );
+		h.sum += __atomic_load_n( &t->stage[stage].sum, __ATOMIC_RELAXED );
+		if( __atomic_load_n( &t->stage[stage].max, __ATOMIC_RELAXED ) > h.max )
+			h.max = __atomic_load_n( &t->stage[stage].max, __ATOMIC_RELAXED );
+		for( b = 0; b < TRACE_BUCKETS; b++ )
+			h.bucket[b] += __atomic_load_n( &t->stage[stage].bucket[b], __ATOMIC_RELAXED );
+	}
+	if( !h.count )
+		return 0;
+	st->count = h.count;
+	st->sum_us = h.sum / 1000.0;
+	st->p50_us = percentile( &h, 0.5 );
+	st->p90_us = percentile( &h, 0.9 );
+	st->p99_us = percentile( &h, 0.99 );
+	st->max_us = h.max / 1000.0;
+	return h.count;
+}
+
+const char *trace_stage_name( int stage )
+{
+	return stage >= 0 && stage < TRACE_STAGES ? stage_name[stage] : "?";
+}
+
+/*
+ * Log the latency of each stage recorded so far, over all threads
+ */
+void trace_dump( void )
+{
+	trace_thread_t *t;
+	trace_stats_t st;
+	int s, n = 0;
+
+	for( t = __atomic_load_n( &threads, __ATOMIC_ACQUIRE ); t; t = t->next )
+		n++;
+	MSG( "latency per stage, %d threads: count, mean, p50, p90, p99, max in us", n );
+
+	for( s = 0; s < TRACE_STAGES; s++ )
+	{
+		if( !trace_get( s, &st ) )
+			continue;
+		MSG( "%-16s %8llu %10.1f %10.1f %10.1f %10.1f %10.1f", stage_name[s], (unsigned long long)st.count,
+			 st.sum_us / st.count, st.p50_us, st.p90_us, st.p99_us, st.max_us );
+	}
+}
@@ -0,0 +1,97 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+#include "mmalyuv.h"
+
+/*
+ * Latency of the stages of the hot path, cheap enough to stay on.
+ *
+ * A stage is timed from trace_begin() to trace_end(), or over a block with
+ * TRACE_SCOPE(). Each thread counts into histograms of its own, so nothing
+ * is locked or shared while recording: 8 buckets per power of two of the
+ * nanoseconds, about 6% resolution, plus the exact maximum. trace_dump()
+ * merges the threads and logs count, mean, p50, p90, p99 and max per stage,
+ * on SIGUSR2 and at exit in mmalyuv.
+ *
+ * Times are CLOCK_MONOTONIC_RAW, not slewed by NTP.
+ */
+
+#define TRACE_CAPTURE   0   // next frame from the camera or the replay
+#define TRACE_BIN       1   // binning of a frame
+#define TRACE_LOOP      2   // processing loop, frame to frame
+#define TRACE_JOB_CPU   3   // phase correlation job in the scheduler
+#define TRACE_JOB_GPU   4
+#define TRACE_FFTW      5   // + PC_STAGE_*, fft.c
+#define TRACE_GPU       (TRACE_FFTW + PC_STAGES)   // + PC_STAGE_*, fft_gpu.c
+#define TRACE_LAT       (TRACE_GPU + PC_STAGES)    // + LAT_*: from the point before,
+                                                   // + LAT_ARRIVED: arrival to output
+#define TRACE_STAGES    (TRACE_LAT + LAT_POINTS)
+
+// 8 buckets per power of two of 64 bit nanoseconds
+#define TRACE_BUCKETS 512
+
+static inline uint64_t trace_now( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC_RAW, &ts );
+	return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Microseconds of CLOCK_MONOTONIC, for frame stamps, loop timings and the
+ * replay's clock_nanosleep() deadlines
+ */
+static inline int64_t now_us( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec*1000000LL + ts.tv_nsec/1000;
+}
+
+typedef struct {
+	uint64_t count;
+	double sum_us;
+	double p50_us, p90_us, p99_us;
+	double max_us;
+} trace_stats_t;
+
+void trace_add( int stage, uint64_t ns );
+uint64_t trace_get( int stage, trace_stats_t *st );
+const char *trace_stage_name( int stage );
+void trace_dump( void );
+
+static inline uint64_t trace_begin( void )
+{
+	return trace_now();
+}
+
+/*
+ * Record stage as begun at start, returns its nanoseconds
+ */
+static inline uint64_t trace_end( int stage, uint64_t start )
+{
+	uint64_t ns = trace_now() - start;
+
+	trace_add( stage, ns );
+	return ns;
+}
+
+typedef struct {
+	int stage;
+	uint64_t start;
+} trace_scope_t;
+
+static inline void trace_scope_end( trace_scope_t *s )
+{
+	trace_end( s->stage, s->start );
+}
+
+// times stage up to the end of the enclosing block, once per block
+#define TRACE_SCOPE(stage) \
+	trace_scope_t trace_scope_ __attribute__((cleanup(trace_scope_end))) = { (stage), trace_now() }
+
+#endif /* TRACE_H */
@@ -0,0 +1,347 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "mmalyuv.h"
+#include "image.h"
+#include "fft.h"
+#include "fft_gpu.h"
+#include "bin.h"
+#include "scheduler.h"
+#include "synth.h"
+#include "tune.h"
+#include "trace.h"
+
+#define TUNE_LINE 256
+
+// FFTW variants tried in SCHED_MODE_CPU, the fastest goes on to the GPU modes
+static const struct {
+	unsigned flags;
+	int all_cores;
+	int lowmem;
+} cpu_variants[] = {
+	{ FFTW_ESTIMATE, 0, 0 },
+	{ FFTW_MEASURE,  0, 0 },
+	{ FFTW_MEASURE,  1, 0 },
+	{ FFTW_MEASURE,  0, 1 },
+};
+
+static const int gpu_modes[] = { SCHED_MODE_GPU, SCHED_MODE_ALTERNATE, SCHED_MODE_WEIGHTED };
+
+// by SCHED_MODE_*
+static const char *mode_name[] = { "gpu", "cpu", "alternate", "weighted" };
+
+static const char *plan_name( unsigned flags )
+{
+	return flags == FFTW_PATIENT ? "patient" : flags == FFTW_MEASURE ? "measure" : "estimate";
+}
+
+/*
+ * Board model and GPU memory split, e.g. "Raspberry Pi 3 Model B Rev 1.2,
+ * gpu 128 MB"
+ * returns -1 if the model is not known, key is filled anyway
+ */
+int tune_key( char *key, size_t n )
+{
+	char model[TUNE_KEY] = "", line[TUNE_LINE];
+	unsigned gpu_mb = 0;
+	size_t len;
+	FILE *f;
+	int mb;
+
+	// device tree on the Pi, /proc/cpuinfo elsewhere
+	f = fopen( "/proc/device-tree/model", "r" );
+	if( f )
+	{
+		len = fread( model, 1, sizeof(model) - 1, f );
+		model[len] = 0;
+		fclose( f );
+	}
+	f = model[0] ? NULL : fopen( "/proc/cpuinfo", "r" );
+	while( f && fgets( line, sizeof(line), f ) )
+		if( strncmp( line, "Model", 5 ) == 0 || strncmp( line, "Hardware", 8 ) == 0 ||
+			strncmp( line, "model name", 10 ) == 0 )
+		{
+			snprintf( model, sizeof(model), "%.*s", (int)sizeof(model) - 1,
+					  strchr( line, ':' ) ? strchr( line, ':' ) + 2 : line );
+			break;
+		}
+	if( f )
+		fclose( f );
+	model[strcspn( model, "\n:" )] = 0;
+
+	mb = mbox_open();
+	if( mb >= 0 )
+	{
+		gpu_mb = get_vc_memory( mb ) >> 20;
+		mbox_close( mb );
+	}
+	snprintf( key, n, "%s, gpu %u MB", model[0] ? model : "unknown", gpu_mb );
+	return model[0] ? 0 : -1;
+}
+
+void tune_log( const char *what, const tune_t *t )
+{
+	MSG( "%s: %s%s, %ux%u binned %dx%d, FFTW %s on %d thread%s, %.1f fps", what,
+		 mode_name[t->sched_mode], t->lowmem ? " lowmem" : "", t->width, t->height, t->bin, t->bin,
+		 plan_name( t->plan_flags ), t->fft_threads, t->fft_threads > 1 ? "s" : "", t->fps );
+}
+
+/*
+ * Parse the settings after "<key>: "
+ * returns -1 if they are not complete
+ */
+static int parse( const char *s, tune_t *t )
+{
+	char mode[16], plan[16];
+	int m;
+
+	if( sscanf( s, "mode=%15s lowmem=%d bin=%d size=%ux%u plan=%15s threads=%d fps=%f", mode, &t->lowmem,
+				&t->bin, &t->width, &t->height, plan, &t->fft_threads, &t->fps ) != 8 )
+		return (-1);
+	for( m = 0; m < 4 && strcmp( mode, mode_name[m] ); m++ )
+		;
+	t->sched_mode = m;
+	t->plan_flags = strcmp( plan, "patient" ) == 0 ? FFTW_PATIENT :
+					strcmp( plan, "measure" ) == 0 ? FFTW_MEASURE : FFTW_ESTIMATE;
+	if( m == 4 || (t->bin != 1 && t->bin != 2 && t->bin != 4) || !t->width || !t->height || t->fft_threads < 1 )
+		return (-1);
+	return (0);
+}
+
+/*
+ * Settings tuned before for key
+ * returns -1 if file has none
+ */
+int tune_load( const char *file, const char *key, tune_t *t )
+{
+	char line[TUNE_LINE];
+	size_t n = strlen( key );
+	FILE *f;
+	int ret = -1;
+
+	f = fopen( file, "r" );
+	if( !f )
+		return (-1);
+	while( ret && fgets( line, sizeof(line), f ) )
+		if( strncmp( line, key, n ) == 0 && strncmp( line + n, ": ", 2 ) == 0 )
+		{
+			ret = parse( line + n + 2, t );
+			if( ret )
+				WARN( "bad settings for %s in %s", key, file );
+		}
+	fclose( f );
+	return ret;
+}
+
+/*
+ * Keep t for key in file, replacing what was there for it. Written to
+ * <file>.tmp and renamed
+ * returns -1 on error
+ */
+int tune_save( const char *file, const char *key, const tune_t *t )
+{
+	char line[TUNE_LINE], tmp[TUNE_LINE];
+	size_t n = strlen( key );
+	FILE *in, *out;
+	int ret;
+
+	snprintf( tmp, sizeof(tmp), "%s.tmp", file );
+	out = fopen( tmp, "w" );
+	if( !out )
+	{
+		ERROR( "cannot write %s", tmp );
+		return (-1);
+	}
+	in = fopen( file, "r" );
+	while( in && fgets( line, sizeof(line), in ) )
+		if( strncmp( line, key, n ) || strncmp( line + n, ": ", 2 ) )
+			fputs( line, out );
+	if( in )
+		fclose( in );
+	fprintf( out, "%s: mode=%s lowmem=%d bin=%d size=%ux%u plan=%s threads=%d fps=%.1f\n", key,
+			 mode_name[t->sched_mode], t->lowmem, t->bin, t->width, t->height, plan_name( t->plan_flags ),
+			 t->fft_threads, t->fps );
+	ret = fclose( out );
+	if( ret || rename( tmp, file ) )
+	{
+		ERROR( "cannot write %s", file );
+		unlink( tmp );
+		return (-1);
+	}
+	return (0);
+}
+
+/* 1 if res is not the shift of its frame, to a binned pixel */
+static int wrong( const sched_result_t *res, int bin )
+{
+	const synth_shift_t *f = &synth_shifts[res->seq % SYNTH_SHIFTS];
+
+	return res->status || abs( res->x * bin + (int)f->dx ) > bin / 2 + (bin > 1) ||
+		   abs( res->y * bin + (int)f->dy ) > bin / 2 + (bin > 1);
+}
+
+/*
+ * Correlations per second of candidate c on ref and frames, of its size
+ * returns 0 if it failed or found wrong shifts
+ */
+static float measure( const tune_t *c, pix_y_t *ref, pix_y_t *frames )
+{
+	sched_t *sched = NULL;
+	bin_t *bin = NULL;
+	sched_result_t res;
+	sched_counters_t cnt;
+	pix_y_t *pix;
+	long start = 0;
+	float fps = 0;
+	int k, b, bad = 0;
+
+	if( fft_set_plan( c->plan_flags, c->fft_threads ) )
+		return 0;
+	if( c->bin > 1 && !(bin = bin_create( c->width, c->height, c->bin, BIN_THREADS )) )
+		goto out;
+	sched = sched_create( c->sched_mode );
+	if( !sched )
+		goto out;
+	sched_set_lowmem( sched, c->lowmem );
+	pix = bin ? bin_frame( bin, ref ) : ref;
+	if( !pix || sched_set_reference( sched, pix ) )
+		goto out;
+
+	for( k = 0; k < TUNE_WARMUP + TUNE_FRAMES; k++ )
+	{
+		// timed from an empty queue, the plans made
+		if( k == TUNE_WARMUP )
+		{
+			while( sched_get_result( sched, &res, 1 ) == 0 )
+				bad += wrong( &res, c->bin );
+			start = now_us();
+		}
+		pix = bin ? bin_frame( bin, &frames[k % SYNTH_SHIFTS] ) : &frames[k % SYNTH_SHIFTS];
+		if( !pix || sched_submit( sched, pix, k, NULL ) )
+			goto out;
+		while( sched_get_result( sched, &res, 0 ) == 0 )
+			bad += wrong( &res, c->bin );
+	}
+	while( sched_get_result( sched, &res, 1 ) == 0 )
+		bad += wrong( &res, c->bin );
+	fps = TUNE_FRAMES * 1e6f / (now_us() - start);
+
+	for( b = 0; b < SCHED_BACKENDS; b++ )
+	{
+		sched_get_counters( sched, b, &cnt );
+		bad += cnt.errors;
+	}
+	if( bad )
+	{
+		DEBUG( "%d frames failed or wrong", bad );
+		fps = 0;
+	}
+out:
+	sched_destroy( sched );
+	bin_destroy( bin );
+	return fps;
+}
+
+/*
+ * Fastest candidate of size w x h binned by bin into best
+ * returns its fps, 0 if none worked
+ */
+static float tune_size( uint32_t w, uint32_t h, int bin, tune_t *best )
+{
+	pix_y_t ref, frames[SYNTH_SHIFTS];
+	synth_params_t sp;
+	synth_t *field = NULL;
+	tune_t c;
+	int cores = sysconf( _SC_NPROCESSORS_ONLN ), v, m;
+
+	memset( best, 0, sizeof(*best) );
+	memset( &ref, 0, sizeof(ref) );
+	memset( frames, 0, sizeof(frames) );
+	// the same stars, noise of their own
+	synth_defaults( &sp );
+	field = synth_create( &sp, w, h, 16 );
+	if( !field || synth_frames( field, &ref, frames, synth_shifts, SYNTH_SHIFTS ) )
+		goto out;
+
+	memset( &c, 0, sizeof(c) );
+	c.width = w;
+	c.height = h;
+	c.bin = bin;
+	c.sched_mode = SCHED_MODE_CPU;
+	for( v = 0; v < (int)(sizeof(cpu_variants) / sizeof(cpu_variants[0])); v++ )
+	{
+		if( cpu_variants[v].all_cores && cores < 2 )
+			continue;
+		c.plan_flags = cpu_variants[v].flags;
+		c.fft_threads = cpu_variants[v].all_cores ? cores : 1;
+		c.lowmem = cpu_variants[v].lowmem;
+		c.fps = measure( &c, &ref, frames );
+		tune_log( "tried", &c );
+		if( c.fps > best->fps )
+			*best = c;
+	}
+	if( !best->fps )
+		goto out;
+
+	// with the best FFTW
+	c = *best;
+	for( m = 0; m < (int)(sizeof(gpu_modes) / sizeof(gpu_modes[0])); m++ )
+	{
+		c.sched_mode = gpu_modes[m];
+		c.fps = measure( &c, &ref, frames );
+		tune_log( "tried", &c );
+		if( c.fps > best->fps )
+			*best = c;
+	}
+out:
+	synth_destroy( field );
+	synth_frames_free( &ref, frames, SYNTH_SHIFTS );
+	return best->fps;
+}
+
+/*
+ * Measure the candidates up to max_width x max_height (halved down to
+ * TUNE_MIN after binning), from the finest binned resolution on. The
+ * first that reaches target_fps wins, the fastest of all if none does.
+ * FFTW is left planning as best says
+ * returns -1 if nothing worked
+ */
+int tune_run( uint32_t max_width, uint32_t max_height, float target_fps, tune_t *best )
+{
+	tune_t t, fastest;
+	int level, k, lb;
+
+	MSG( "autotuning for %.1f fps, this takes a while", target_fps );
+	memset( &fastest, 0, sizeof(fastest) );
+	// level: halvings of the resolution, by frame size k and binning lb
+	for( level = 0; (max_width >> level) >= TUNE_MIN && (max_height >> level) >= TUNE_MIN; level++ )
+	{
+		memset( best, 0, sizeof(*best) );
+		for( lb = 0; lb <= 2 && lb <= level; lb++ )
+		{
+			k = level - lb;
+			if( tune_size( max_width >> k, max_height >> k, 1 << lb, &t ) > best->fps )
+				*best = t;
+		}
+		if( best->fps > fastest.fps )
+			fastest = *best;
+		if( best->fps >= target_fps )
+			break;
+	}
+	if( best->fps < target_fps )
+		*best = fastest;
+	if( !best->fps )
+	{
+		ERROR( "no configuration worked" );
+		return (-1);
+	}
+	fft_set_plan( best->plan_flags, best->fft_threads );
+	tune_log( "tuned", best );
+	return (0);
+}
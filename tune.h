@@ -0,0 +1,46 @@
+#ifndef TUNE_H
+#define TUNE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Startup autotuning. Which backend, binning, frame size and FFTW planning
+ * correlate fastest differs between Pi models and GPU memory splits, so
+ * tune_run() measures the candidates on synthetic star frames through the
+ * scheduler, as the loop runs them: per frame size and binning, FFTW
+ * planned with FFTW_ESTIMATE or FFTW_MEASURE on one or all cores, in place
+ * or not, then gpu_fft, alternating and weighted scheduling with the
+ * fastest of those. The finest binned resolution whose fastest candidate
+ * keeps up with the camera wins, shifts found must be right.
+ *
+ * The winner is kept in a text file, one line per board: the key of
+ * tune_key(), the board model and the GPU memory split, then the settings.
+ * Next time tune_load() finds it without measuring. FFTW's wisdom goes
+ * next to it, <file>.wisdom, so measured plans are not measured again.
+ */
+
+#define TUNE_FILE    "mmalyuv.tune"  // default of -tunefile
+#define TUNE_KEY     128             // bytes of a key
+#define TUNE_MIN     128             // smallest binned frame tried
+#define TUNE_WARMUP  2               // frames per candidate before timing
+#define TUNE_FRAMES  8               // frames timed per candidate
+
+typedef struct {
+	int sched_mode;        // SCHED_MODE_*
+	int lowmem;            // FFTW in place, sched_set_lowmem
+	int bin;               // 1, 2 or 4
+	uint32_t width;        // frame size
+	uint32_t height;
+	unsigned plan_flags;   // FFTW_ESTIMATE or FFTW_MEASURE
+	int fft_threads;       // FFTW threads per plan
+	float fps;             // correlations per second measured
+} tune_t;
+
+int tune_key( char *key, size_t n );
+int tune_load( const char *file, const char *key, tune_t *t );
+int tune_save( const char *file, const char *key, const tune_t *t );
+int tune_run( uint32_t max_width, uint32_t max_height, float target_fps, tune_t *best );
+void tune_log( const char *what, const tune_t *t );
+
+#endif /* TUNE_H */